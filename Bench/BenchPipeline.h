@@ -0,0 +1,684 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <future>
+#include <thread>
+#include <atomic>
+#include <stdexcept>
+#include "../Utils/Logger.h"
+#include "../Utils/ColorSpaceCpu.h"
+#include "../Utils/PcmH264Encoder.h"
+#include "../Utils/Mp4Writer.h"
+#include "../Utils/PacketSinks.h"
+#include "../Utils/ReplayBuffer.h"
+#include "../Utils/RecorderService.h"
+#include "../Utils/DirtyRects.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+extern simplelogger::Logger *logger;
+
+/**
+*  Pluggable stages of the headless capture -> convert -> encode -> write pipeline
+*  used by recorder_bench. Sources produce BGRA frames like IDXGIOutputDuplication,
+*  converters turn them into NV12, encoders return Annex-B packets and sinks
+*  consume the packets.
+*/
+
+class BenchFrameSource {
+public:
+    virtual ~BenchFrameSource() {}
+    virtual void Read(uint8_t *pBgra, int nPitch) = 0;
+    /** What the last Read() changed, like the dirty and move rects of desktop duplication */
+    virtual FrameChanges GetChanges() { return FrameChanges(); }
+};
+
+/**
+*  @brief Synthetic desktop: a static background, a window that moves and a small
+*  region of changing "text". Pattern "static" only changes the text, "scroll"
+*  also scrolls the window, "burst" scrolls it for 30 frames out of every 150,
+*  "noise" rewrites the whole frame every time.
+*/
+class SyntheticFrameSource : public BenchFrameSource {
+public:
+    SyntheticFrameSource(int nWidth, int nHeight, const std::string &strPattern)
+        : nWidth(nWidth), nHeight(nHeight), strPattern(strPattern) {
+        if (strPattern != "static" && strPattern != "scroll" && strPattern != "burst" && strPattern != "noise") {
+            throw std::invalid_argument("Unknown synthetic pattern: " + strPattern);
+        }
+    }
+    void Read(uint8_t *pBgra, int nPitch) {
+        changes = FrameChanges();
+        changes.bFullFrame = vCanvas.empty() || strPattern == "noise";
+        vDirtyRect.clear();
+        vMoveRect.clear();
+        if (vCanvas.empty() || strPattern == "noise") {
+            vCanvas.resize(nWidth * nHeight);
+            for (int y = 0; y < nHeight; y++) {
+                uint32_t *p = &vCanvas[y * nWidth];
+                for (int x = 0; x < nWidth; x++) {
+                    p[x] = strPattern == "noise" ? Random() : 0xFF000000 | ((x * 255 / nWidth) << 16) | ((y * 255 / nHeight) << 8) | 0x40;
+                }
+            }
+        }
+        if (strPattern == "scroll" || (strPattern == "burst" && nFrame % 150 < 30)) {
+            int w = nWidth / 2, h = nHeight / 2, x0 = nWidth / 4, y0 = nHeight / 4;
+            for (int y = 0; y < h; y++) {
+                uint32_t *p = &vCanvas[(y0 + y) * nWidth + x0];
+                int nLine = (y + (int)nScroll * 4) / 16;
+                for (int x = 0; x < w; x++) {
+                    p[x] = ((x / 8 + nLine) % 3) ? 0xFFFFFFFF : 0xFF202020;
+                }
+            }
+            // the window content moved up by 4 lines and 4 new lines appeared at its bottom
+            vMoveRect.push_back({x0, y0 + 4, {x0, y0, x0 + w, y0 + h - 4}});
+            vDirtyRect.push_back({x0, y0 + h - 4, x0 + w, y0 + h});
+            nScroll++;
+        }
+        // blinking text cursor and a line of changing glyphs
+        int yText = nHeight * 3 / 4, nTextWidth = std::min(nWidth / 2, 256);
+        for (int y = yText; y < yText + 16 && y < nHeight; y++) {
+            uint32_t *p = &vCanvas[y * nWidth];
+            for (int x = 16; x < 16 + nTextWidth; x++) {
+                p[x] = ((x + (int)nFrame) % 7 < 2) ? 0xFF000000 : 0xFFFFFFFF;
+            }
+        }
+        vDirtyRect.push_back({16, yText, 16 + nTextWidth, std::min(yText + 16, nHeight)});
+        // the copy stands in for CopyResource() out of the duplication surface
+        for (int y = 0; y < nHeight; y++) {
+            memcpy(pBgra + y * nPitch, &vCanvas[y * nWidth], nWidth * 4);
+        }
+        nFrame++;
+    }
+    FrameChanges GetChanges() {
+        if (!changes.bFullFrame) {
+            changes.pDirtyRect = vDirtyRect.data();
+            changes.nDirtyRects = (uint32_t)vDirtyRect.size();
+            changes.pMoveRect = vMoveRect.data();
+            changes.nMoveRects = (uint32_t)vMoveRect.size();
+        }
+        return changes;
+    }
+private:
+    uint32_t Random() {
+        nSeed = nSeed * 1664525 + 1013904223;
+        return nSeed | 0xFF000000;
+    }
+    int nWidth, nHeight;
+    std::string strPattern;
+    std::vector<uint32_t> vCanvas;
+    uint64_t nFrame = 0, nScroll = 0;
+    uint32_t nSeed = 1;
+    FrameChanges changes;
+    std::vector<ScreenRect> vDirtyRect;
+    std::vector<ScreenMoveRect> vMoveRect;
+};
+
+/**
+*  @brief Replays raw BGRA frames from a file, looping at the end.
+*/
+class FileReplaySource : public BenchFrameSource {
+public:
+    FileReplaySource(const std::string &strPath, int nWidth, int nHeight) : nWidth(nWidth), nHeight(nHeight) {
+        fpIn.open(strPath, std::ios::in | std::ios::binary);
+        if (!fpIn) {
+            throw std::invalid_argument("Unable to open input file: " + strPath);
+        }
+    }
+    void Read(uint8_t *pBgra, int nPitch) {
+        for (int y = 0; y < nHeight; y++) {
+            if (!fpIn.read((char *)pBgra + y * nPitch, nWidth * 4)) {
+                if (y != 0 || bEmpty) {
+                    throw std::runtime_error("Replay file is shorter than one frame");
+                }
+                fpIn.clear();
+                fpIn.seekg(0);
+                bEmpty = true;
+                y--;
+                continue;
+            }
+            bEmpty = false;
+        }
+    }
+private:
+    std::ifstream fpIn;
+    int nWidth, nHeight;
+    bool bEmpty = false;
+};
+
+/**
+*  @brief BGRA to NV12 conversion split into horizontal bands across nThreads threads.
+*/
+class BenchConverter {
+public:
+    BenchConverter(const std::string &strName, int nThreads) : nThreads(nThreads < 1 ? 1 : nThreads) {
+        if (strName == "bt601") {
+            iMatrix = 0;
+        } else if (strName == "bt709") {
+            iMatrix = 1;
+        } else {
+            throw std::invalid_argument("Unknown converter: " + strName);
+        }
+    }
+    void Convert(const uint8_t *pBgra, int nBgraPitch, uint8_t *pNv12, int nWidth, int nHeight) {
+        // rounded up to cover every row, and to even rows for the 4:2:0 chroma
+        int nBand = ((nHeight + nThreads - 1) / nThreads + 1) & ~1;
+        std::vector<std::thread> vWorker;
+        for (int i = 1; i < nThreads; i++) {
+            int yBegin = i * nBand, yEnd = std::min(nHeight, yBegin + nBand);
+            if (yBegin < yEnd) {
+                vWorker.emplace_back(Bgra32ToNv12Rows, pBgra, nBgraPitch, pNv12, nWidth, nWidth, nHeight, yBegin, yEnd, iMatrix);
+            }
+        }
+        Bgra32ToNv12Rows(pBgra, nBgraPitch, pNv12, nWidth, nWidth, nHeight, 0, std::min(nBand, nHeight), iMatrix);
+        for (auto &t : vWorker) {
+            t.join();
+        }
+    }
+private:
+    int nThreads;
+    int iMatrix = 0;
+};
+
+class BenchEncoder {
+public:
+    virtual ~BenchEncoder() {}
+    virtual void EncodeFrame(const uint8_t *pNv12, std::vector<std::vector<uint8_t>> &vPacket) = 0;
+    virtual void ForceIdr() {}
+};
+
+/**
+*  @brief Returns a fixed size packet per frame; measures the pipeline without encode cost.
+*/
+class NullBenchEncoder : public BenchEncoder {
+public:
+    void EncodeFrame(const uint8_t *, std::vector<std::vector<uint8_t>> &vPacket) {
+        vPacket.resize(1);
+        vPacket[0].assign(1024, 0);
+    }
+};
+
+class SoftwareBenchEncoder : public BenchEncoder {
+public:
+    SoftwareBenchEncoder(int nWidth, int nHeight, int nGop) : enc(nWidth, nHeight, nGop) {}
+    void EncodeFrame(const uint8_t *pNv12, std::vector<std::vector<uint8_t>> &vPacket) {
+        enc.EncodeFrame(pNv12, 0, vPacket);
+    }
+    void ForceIdr() {
+        enc.ForceIdr();
+    }
+private:
+    PcmH264Encoder enc;
+};
+
+/**
+*  @brief RecordingPipeline on the CPU (synthetic source, converter, PcmH264Encoder), so the
+*  warm-start recorder service can be measured without a GPU. Capture, conversion and
+*  encoding run on the calling thread; the sinks get the packets through the distributor.
+*/
+class SoftwareRecordingPipeline : public RecordingPipeline {
+public:
+    SoftwareRecordingPipeline(int nWidth, int nHeight, int nFps, int nGop, int nFramesPerRecording, const std::string &strPattern)
+        : nWidth(nWidth), nHeight(nHeight), nFps(nFps), nGop(nGop), nFramesPerRecording(nFramesPerRecording), strPattern(strPattern), converter("bt601", 1) {}
+
+    void Init(StartupTimer &timer) {
+        vBgra.resize(nWidth * nHeight * 4);
+        vNv12.resize(nWidth * nHeight * 3 / 2);
+        timer.Mark("buffers");
+        // the source renders its first frame while the encoder is created
+        std::future<void> sourceReady = std::async(std::launch::async, [this, &timer]() {
+            StartupTimer::Scope scope(timer, "source");
+            pSource.reset(new SyntheticFrameSource(nWidth, nHeight, strPattern));
+            pSource->Read(vBgra.data(), nWidth * 4);
+        });
+        pEncoder.reset(new PcmH264Encoder(nWidth, nHeight, nGop));
+        // the first frame touches every encoder buffer once
+        pEncoder->EncodeFrame(vNv12.data(), 0, vPacket);
+        timer.Mark("encoder");
+        sourceReady.get();
+    }
+
+    void GetSequenceParams(std::vector<uint8_t> &vSeqParams) {
+        pEncoder->GetSequenceParams(vSeqParams);
+    }
+
+    void Run(PacketDistributor *pDistributor, RecorderControl *pControl, StartupTimer &timer) {
+        std::chrono::nanoseconds period(nFps > 0 ? 1000000000LL / nFps : 0);
+        auto tStart = std::chrono::steady_clock::now(), tNext = tStart;
+        int64_t nPausedUs = 0, nWaitUs = 0;
+        bool bResumed = true;
+        for (int i = 0; pControl->WaitWhilePaused(&nWaitUs); i++) {
+            if (nWaitUs > 0) {
+                nPausedUs += nWaitUs;
+                bResumed = true;
+                tNext = std::chrono::steady_clock::now();
+            }
+            if (nFps > 0) {
+                std::this_thread::sleep_until(tNext);
+                tNext += period;
+            }
+            pSource->Read(vBgra.data(), nWidth * 4);
+            int64_t nTimestampUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - tStart).count() - nPausedUs;
+            converter.Convert(vBgra.data(), nWidth * 4, vNv12.data(), nWidth, nHeight);
+            if (bResumed || pDistributor->IsKeyFrameWanted()) {
+                pEncoder->ForceIdr();
+            }
+            bResumed = false;
+            bool bKeyFrame = false;
+            pEncoder->EncodeFrame(vNv12.data(), 0, vPacket, &bKeyFrame);
+            Deliver(pDistributor, nTimestampUs, bKeyFrame);
+            if (i == 0) {
+                timer.Mark("first frame");
+            }
+            if (i + 1 >= nFramesPerRecording) {
+                pControl->Stop();
+            }
+        }
+        pEncoder->EndEncode(vPacket);
+        Deliver(pDistributor, 0, false);
+    }
+
+private:
+    void Deliver(PacketDistributor *pDistributor, int64_t nTimestampUs, bool bKeyFrame) {
+        for (auto &v : vPacket) {
+            std::shared_ptr<EncodedPacket> pPacket = std::make_shared<EncodedPacket>();
+            pPacket->vData = std::move(v);
+            pPacket->nTimestampUs = nTimestampUs;
+            pPacket->bKeyFrame = bKeyFrame;
+            pDistributor->Deliver(pPacket);
+        }
+    }
+
+    int nWidth, nHeight, nFps, nGop, nFramesPerRecording;
+    std::string strPattern;
+    BenchConverter converter;
+    std::unique_ptr<BenchFrameSource> pSource;
+    std::unique_ptr<PcmH264Encoder> pEncoder;
+    std::vector<uint8_t> vBgra, vNv12;
+    std::vector<std::vector<uint8_t>> vPacket;
+};
+
+class BenchSink {
+public:
+    virtual ~BenchSink() {}
+    virtual void Write(std::vector<uint8_t> &&vPacket, int64_t nTimestampUs) = 0;
+    virtual void Close() {}
+    /** Polled by the encoding thread; true asks for an IDR on the next frame */
+    virtual bool IsKeyFrameWanted() { return false; }
+    /** Called right before the first frame is captured; timestamps passed to Write() are relative to tStart */
+    virtual void Start(std::chrono::steady_clock::time_point tStart) {}
+    /** Extra JSON members for the result line, each starting with a comma */
+    virtual std::string GetStatsJson() { return std::string(); }
+};
+
+class NullBenchSink : public BenchSink {
+public:
+    void Write(std::vector<uint8_t> &&, int64_t) {}
+};
+
+class FileBenchSink : public BenchSink {
+public:
+    FileBenchSink(const std::string &strPath) {
+        fpOut.open(strPath, std::ios::out | std::ios::binary);
+        if (!fpOut) {
+            throw std::invalid_argument("Unable to open output file: " + strPath);
+        }
+    }
+    void Write(std::vector<uint8_t> &&vPacket, int64_t) {
+        fpOut.write((const char *)vPacket.data(), vPacket.size());
+    }
+    void Close() {
+        fpOut.close();
+    }
+private:
+    std::ofstream fpOut;
+};
+
+/**
+*  @brief Muxes the packets into a plain or fragmented MP4 file with the capture time as timestamp.
+*/
+class Mp4BenchSink : public BenchSink {
+public:
+    Mp4BenchSink(const std::string &strPath, int nWidth, int nHeight, const Mp4WriterOptions &options = Mp4WriterOptions())
+        : writer(strPath, nWidth, nHeight, std::vector<uint8_t>(), options) {}
+    void Write(std::vector<uint8_t> &&vPacket, int64_t nTimestampUs) {
+        writer.WritePacket(vPacket, nTimestampUs);
+    }
+    void Close() {
+        writer.Close();
+    }
+private:
+    Mp4Writer writer;
+};
+
+/**
+*  @brief Writes numbered segments of about nDurationSec seconds through SegmentWriter,
+*  asking the encoder for an IDR once a segment is due.
+*/
+class SegmentBenchSink : public BenchSink {
+public:
+    SegmentBenchSink(const std::string &strPath, int nWidth, int nHeight, int nDurationSec) : writer(strPath, nWidth, nHeight, std::vector<uint8_t>(), MakeOptions(nDurationSec)) {}
+    void Write(std::vector<uint8_t> &&vPacket, int64_t nTimestampUs) {
+        writer.WritePacket(vPacket, nTimestampUs, IsH264KeyFrame(vPacket.data(), vPacket.size()));
+        bKeyFrameWanted = writer.IsRolloverDue();
+    }
+    void Close() {
+        writer.Close();
+    }
+    bool IsKeyFrameWanted() {
+        return bKeyFrameWanted;
+    }
+private:
+    static SegmentOptions MakeOptions(int nDurationSec) {
+        SegmentOptions options;
+        options.nDurationSec = nDurationSec;
+        return options;
+    }
+
+    SegmentWriter writer;
+    std::atomic<bool> bKeyFrameWanted{false};
+};
+
+/**
+*  @brief Sends the packets as RTP to a receiver on the loopback interface and reports
+*  the capture-to-reassembly latency the receiver measured.
+*/
+class RtpBenchSink : public BenchSink {
+public:
+    RtpBenchSink(unsigned short uPort, int nPaceMbps) : receiver(uPort), pSender(new RtpSender("127.0.0.1", uPort, MakeOptions(nPaceMbps))) {}
+    void Start(std::chrono::steady_clock::time_point tStart) {
+        nWallStartUs = RtpWallClockUs() - std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - tStart).count();
+    }
+    void Write(std::vector<uint8_t> &&vPacket, int64_t nTimestampUs) {
+        pSender->Send(vPacket.data(), vPacket.size(), nTimestampUs, nWallStartUs + nTimestampUs);
+        nFrames++;
+    }
+    void Close() {
+        if (!pSender) {
+            return;
+        }
+        pSender.reset();
+        // give the receiver a moment to drain its socket
+        for (int i = 0; i < 100 && receiver.GetFrames() + receiver.GetLostPackets() < nFrames; i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+    std::string GetStatsJson() {
+        return RtpStatsJson(receiver);
+    }
+    static std::string RtpStatsJson(const RtpReceiver &receiver) {
+        const LatencyHistogram &latency = receiver.GetLatency();
+        std::ostringstream oss;
+        oss << ",\"rtp\":{\"frames_received\":" << receiver.GetFrames() << ",\"packets_lost\":" << receiver.GetLostPackets()
+            << ",\"latency_ms\":{\"p50\":" << latency.GetQuantileUs(0.5) / 1000.0 << ",\"p99\":" << latency.GetQuantileUs(0.99) / 1000.0 << "}}";
+        return oss.str();
+    }
+private:
+    static RtpSenderOptions MakeOptions(int nPaceMbps) {
+        RtpSenderOptions options;
+        options.nPaceMbps = nPaceMbps;
+        return options;
+    }
+
+    RtpReceiver receiver;
+    std::unique_ptr<RtpSender> pSender;
+    int64_t nWallStartUs = 0;
+    uint64_t nFrames = 0;
+};
+
+/**
+*  @brief Records to a file and previews over loopback RTP through one PacketDistributor,
+*  like the recorder does with -rtp; the packets are shared by both sinks.
+*/
+class FanoutBenchSink : public BenchSink {
+public:
+    FanoutBenchSink(const std::string &strPath, unsigned short uPort, int nPaceMbps) : receiver(uPort) {
+        RtpSenderOptions options;
+        options.nPaceMbps = nPaceMbps;
+        distributor.AddSink(new FilePacketSink(strPath), "file", 256, PACKET_DROP_NEVER);
+        distributor.AddSink(new RtpPacketSink("127.0.0.1", uPort, options), "rtp", options.nQueueFrames, PACKET_DROP_TO_KEYFRAME);
+    }
+    void Start(std::chrono::steady_clock::time_point tStart) {
+        nWallStartUs = RtpWallClockUs() - std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - tStart).count();
+    }
+    void Write(std::vector<uint8_t> &&vPacket, int64_t nTimestampUs) {
+        std::shared_ptr<EncodedPacket> pPacket = std::make_shared<EncodedPacket>();
+        pPacket->bKeyFrame = IsH264KeyFrame(vPacket.data(), vPacket.size());
+        pPacket->vData = std::move(vPacket);
+        pPacket->nTimestampUs = nTimestampUs;
+        pPacket->nCaptureTimeUs = nWallStartUs + nTimestampUs;
+        distributor.Deliver(pPacket);
+        nFrames++;
+    }
+    void Close() {
+        distributor.Close();
+        for (int i = 0; i < 100 && receiver.GetFrames() + receiver.GetLostPackets() < nFrames; i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+    bool IsKeyFrameWanted() {
+        return distributor.IsKeyFrameWanted();
+    }
+    std::string GetStatsJson() {
+        return RtpBenchSink::RtpStatsJson(receiver);
+    }
+private:
+    RtpReceiver receiver;
+    PacketDistributor distributor;
+    int64_t nWallStartUs = 0;
+    uint64_t nFrames = 0;
+};
+
+/**
+*  @brief Flight recorder: keeps the last nSeconds in a ReplayBuffer and dumps them when closed
+*  (and on SIGUSR1 or a request to uPort while running). Reports how long Dump() held the caller.
+*/
+class ReplayBenchSink : public BenchSink {
+public:
+    ReplayBenchSink(const std::string &strPath, int nWidth, int nHeight, int nSeconds, unsigned short uPort) {
+        ReplayOptions options;
+        options.nSeconds = nSeconds;
+        pReplayBuffer = new ReplayBuffer(strPath, nWidth, nHeight, std::vector<uint8_t>(), options);
+        distributor.AddSink(pReplayBuffer, "replay", 256, PACKET_DROP_NEVER);
+        ReplayBuffer *p = pReplayBuffer;
+        pTrigger.reset(new ReplayTrigger([p](int n) { return p->Dump(n); }, uPort));
+    }
+    void Write(std::vector<uint8_t> &&vPacket, int64_t nTimestampUs) {
+        std::shared_ptr<EncodedPacket> pPacket = std::make_shared<EncodedPacket>();
+        pPacket->bKeyFrame = IsH264KeyFrame(vPacket.data(), vPacket.size());
+        pPacket->vData = std::move(vPacket);
+        pPacket->nTimestampUs = nTimestampUs;
+        distributor.Deliver(pPacket);
+    }
+    void Close() {
+        pTrigger.reset();
+        nWindowBytes = pReplayBuffer->GetBytes();
+        auto t0 = std::chrono::steady_clock::now();
+        pReplayBuffer->Dump();
+        nDumpCallUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count();
+        distributor.Close();
+    }
+    bool IsKeyFrameWanted() {
+        return distributor.IsKeyFrameWanted();
+    }
+    std::string GetStatsJson() {
+        std::ostringstream oss;
+        oss << ",\"replay\":{\"window_bytes\":" << nWindowBytes << ",\"dump_call_us\":" << nDumpCallUs << "}";
+        return oss.str();
+    }
+private:
+    PacketDistributor distributor;
+    ReplayBuffer *pReplayBuffer;
+    std::unique_ptr<ReplayTrigger> pTrigger;
+    uint64_t nWindowBytes = 0;
+    int64_t nDumpCallUs = 0;
+};
+
+#ifdef __linux__
+/**
+*  @brief Appends packets with io_uring writes, keeping up to nDepth writes in flight.
+*  Uses the raw system calls so no liburing is needed; falls back to write() when
+*  the kernel (or a seccomp policy) refuses io_uring_setup.
+*/
+class UringBenchSink : public BenchSink {
+public:
+    UringBenchSink(const std::string &strPath, unsigned nDepth = 32) {
+        fd = open(strPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw std::invalid_argument("Unable to open output file: " + strPath);
+        }
+        struct io_uring_params p = {};
+        ringFd = (int)syscall(__NR_io_uring_setup, nDepth, &p);
+        if (ringFd < 0) {
+            LOG(WARNING) << "io_uring is not available, falling back to write()";
+            return;
+        }
+        nSqSize = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+        nCqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        pSq = (uint8_t *)mmap(NULL, nSqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        pCq = (uint8_t *)mmap(NULL, nCqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        pSqe = (struct io_uring_sqe *)mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (pSq == MAP_FAILED || pCq == MAP_FAILED || pSqe == MAP_FAILED) {
+            throw std::runtime_error("Unable to map io_uring rings");
+        }
+        sqOff = p.sq_off;
+        cqOff = p.cq_off;
+        nEntries = p.sq_entries;
+        nSqeSize = p.sq_entries * sizeof(struct io_uring_sqe);
+        vInFlight.resize(nEntries);
+    }
+    // Close() reports failures; here they can only be logged, as this may run during unwinding
+    ~UringBenchSink() {
+        try {
+            Close();
+        } catch (const std::exception &ex) {
+            LOG(ERROR) << "Closing the io_uring output failed: " << ex.what();
+        }
+    }
+    void Write(std::vector<uint8_t> &&vPacket, int64_t) {
+        if (vPacket.empty()) {
+            return;
+        }
+        if (ringFd < 0) {
+            WriteAll(vPacket);
+            return;
+        }
+        while (nInFlight >= nEntries) {
+            Reap(1);
+        }
+        uint32_t *pTail = (uint32_t *)(pSq + sqOff.tail), nMask = *(uint32_t *)(pSq + sqOff.ring_mask);
+        uint32_t nTail = __atomic_load_n(pTail, __ATOMIC_RELAXED), i = nTail & nMask;
+        // slot i of vInFlight keeps the buffer alive until its completion arrives
+        uint32_t iSlot = FreeSlot();
+        vInFlight[iSlot] = std::move(vPacket);
+        struct io_uring_sqe &sqe = pSqe[i];
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_WRITE;
+        sqe.fd = fd;
+        sqe.addr = (uint64_t)(uintptr_t)vInFlight[iSlot].data();
+        sqe.len = (uint32_t)vInFlight[iSlot].size();
+        sqe.off = nOffset;
+        sqe.user_data = iSlot;
+        nOffset += sqe.len;
+        ((uint32_t *)(pSq + sqOff.array))[i] = i;
+        __atomic_store_n(pTail, nTail + 1, __ATOMIC_RELEASE);
+        nInFlight++;
+        if (syscall(__NR_io_uring_enter, ringFd, 1, 0, 0, NULL, 0) < 0) {
+            throw std::runtime_error("io_uring_enter failed");
+        }
+        Reap(0);
+    }
+    /**
+    *  @brief Waits for the writes in flight and closes the file. The file and the rings are
+    *  released even if a write failed; the first error is thrown afterwards.
+    */
+    void Close() {
+        if (fd < 0) {
+            return;
+        }
+        std::string strError;
+        try {
+            while (ringFd >= 0 && nInFlight) {
+                Reap(1);
+            }
+        } catch (const std::exception &ex) {
+            strError = ex.what();
+        }
+        if (ringFd >= 0) {
+            munmap(pSq, nSqSize);
+            munmap(pCq, nCqSize);
+            munmap(pSqe, nSqeSize);
+            close(ringFd);
+            ringFd = -1;
+        }
+        if (close(fd) != 0 && strError.empty()) {
+            strError = "close failed";
+        }
+        fd = -1;
+        if (!strError.empty()) {
+            throw std::runtime_error(strError);
+        }
+    }
+private:
+    void WriteAll(const std::vector<uint8_t> &v) {
+        size_t n = 0;
+        while (n < v.size()) {
+            ssize_t r = ::write(fd, v.data() + n, v.size() - n);
+            if (r <= 0) {
+                throw std::runtime_error("write failed");
+            }
+            n += r;
+        }
+    }
+    uint32_t FreeSlot() {
+        for (uint32_t i = 0; i < nEntries; i++) {
+            if (vInFlight[i].empty()) {
+                return i;
+            }
+        }
+        throw std::runtime_error("io_uring slot accounting error");
+    }
+    void Reap(unsigned nMinComplete) {
+        if (nMinComplete && syscall(__NR_io_uring_enter, ringFd, 0, nMinComplete, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+            throw std::runtime_error("io_uring_enter failed");
+        }
+        uint32_t *pHead = (uint32_t *)(pCq + cqOff.head), nMask = *(uint32_t *)(pCq + cqOff.ring_mask);
+        uint32_t nHead = __atomic_load_n(pHead, __ATOMIC_RELAXED);
+        uint32_t nTail = __atomic_load_n((uint32_t *)(pCq + cqOff.tail), __ATOMIC_ACQUIRE);
+        struct io_uring_cqe *pCqe = (struct io_uring_cqe *)(pCq + cqOff.cqes);
+        for (; nHead != nTail; nHead++) {
+            struct io_uring_cqe &cqe = pCqe[nHead & nMask];
+            std::vector<uint8_t> &v = vInFlight[cqe.user_data];
+            if (cqe.res != (int)v.size()) {
+                throw std::runtime_error("io_uring write failed or was short");
+            }
+            v.clear();
+            v.shrink_to_fit();
+            nInFlight--;
+        }
+        __atomic_store_n(pHead, nHead, __ATOMIC_RELEASE);
+    }
+
+    int fd = -1, ringFd = -1;
+    uint8_t *pSq = NULL, *pCq = NULL;
+    struct io_uring_sqe *pSqe = NULL;
+    size_t nSqSize = 0, nCqSize = 0, nSqeSize = 0;
+    struct io_sqring_offsets sqOff;
+    struct io_cqring_offsets cqOff;
+    uint32_t nEntries = 0, nInFlight = 0;
+    uint64_t nOffset = 0;
+    std::vector<std::vector<uint8_t>> vInFlight;
+};
+#endif
@@ -0,0 +1,684 @@
+/**
+*  libnvenc_fake.so: an in-process stand-in for the NVENC driver library. It exports the
+*  same two entry points and fills NV_ENCODE_API_FUNCTION_LIST with an implementation that
+*  keeps the bookkeeping of a real session (registered, mapped and bitstream buffers, B frame
+*  reordering, output order) and models its timing: every frame occupies one of nEngines
+*  engines for nEncodeUs, and locking its bitstream waits until it is done. The payloads are
+*  start codes and filler of the modelled size, preceded by a real SPS/PPS; they do not decode.
+*  Misuse that a driver would reject (encoding an unmapped input, unmapping twice, locking an
+*  empty buffer) fails the same way, so NvEncoder's ring logic can be checked without a GPU.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../NvCodec/NvEncoder/nvEncodeAPI.h"
+#include "../Utils/PcmH264Encoder.h"
+#include "FakeNvEncodeAPI.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#define FAKE_NVENC_EXPORT extern "C" __declspec(dllexport)
+#else
+#define FAKE_NVENC_EXPORT extern "C" __attribute__((visibility("default")))
+static inline bool operator==(const GUID &guid1, const GUID &guid2) {
+    return !memcmp(&guid1, &guid2, sizeof(GUID));
+}
+#endif
+
+typedef std::chrono::steady_clock::time_point TimePoint;
+
+struct FakeBuffer {
+    std::vector<uint8_t> vData;
+    uint32_t nSize = 0;
+    uint64_t nTimestamp = 0;
+    uint32_t iFrame = 0;
+    NV_ENC_PIC_TYPE ePicType = NV_ENC_PIC_TYPE_UNKNOWN;
+    TimePoint tDone;
+    /** Submitted and not unlocked yet; bEncoded once the engine got it (B frames wait for their anchor) */
+    bool bPending = false, bEncoded = false, bLocked = false;
+};
+
+struct FakeInput {
+    void *pResource = nullptr;
+    int nMapped = 0;
+};
+
+struct FakeSession {
+    std::mutex mtx;
+    FakeNvEncConfig config;
+    uint32_t nWidth = 0, nHeight = 0;
+    uint32_t nFrameIntervalP = 1, nGop = NVENC_INFINITE_GOPLENGTH, nBitrate = 0;
+    NV_ENC_QP_MAP_MODE eQpMapMode = NV_ENC_QP_MAP_DISABLED;
+    /** Candidates per 16x16 block the session accepts as external ME hints */
+    uint32_t nMaxMeHints16x16 = 0;
+    double dFps = 30;
+    bool bInitialized = false, bMotionEstimationOnly = false, bRepeatSpsPps = false, bForceIdr = false;
+    std::vector<uint8_t> vSeqParams;
+    std::set<FakeBuffer *> sBuffer;
+    std::set<FakeInput *> sInput;
+    /** B frames in display order, waiting for the next anchor */
+    std::vector<FakeBuffer *> vWaiting;
+    std::vector<TimePoint> vEngineFree;
+    uint32_t iGopFrame = 0, iFrame = 0, nInFlight = 0, nMapped = 0;
+    uint32_t nRandom = 12345;
+};
+
+static std::mutex mtxGlobal;
+static FakeNvEncConfig gConfig;
+static FakeNvEncStats gStats;
+static std::map<std::string, uint64_t> mCalls;
+
+static struct EnvironmentReader {
+    EnvironmentReader() {
+        ReadFakeNvEncEnvironment(&gConfig);
+    }
+} environmentReader;
+
+FAKE_NVENC_EXPORT void FakeNvEncConfigure(const FakeNvEncConfig *pConfig) {
+    std::lock_guard<std::mutex> lock(mtxGlobal);
+    gConfig = *pConfig;
+}
+
+FAKE_NVENC_EXPORT void FakeNvEncGetStats(FakeNvEncStats *pStats) {
+    std::lock_guard<std::mutex> lock(mtxGlobal);
+    *pStats = gStats;
+}
+
+FAKE_NVENC_EXPORT void FakeNvEncResetStats() {
+    std::lock_guard<std::mutex> lock(mtxGlobal);
+    gStats = FakeNvEncStats();
+    mCalls.clear();
+}
+
+/**
+*  @brief Accounts for one API call: returns the injected error if this call is due to fail,
+*  and spends the modelled CPU time of the call.
+*/
+static NVENCSTATUS Enter(const char *szCall) {
+    NVENCSTATUS eStatus = NV_ENC_SUCCESS;
+    int nCallUs;
+    {
+        std::lock_guard<std::mutex> lock(mtxGlobal);
+        gStats.nCalls++;
+        uint64_t n = ++mCalls[szCall];
+        if (gConfig.nFailAt && !strcmp(gConfig.szFailCall, szCall) && n >= gConfig.nFailAt && n < gConfig.nFailAt + gConfig.nFailCount) {
+            gStats.nInjectedErrors++;
+            eStatus = (NVENCSTATUS)gConfig.eFailStatus;
+        }
+        nCallUs = gConfig.nCallUs;
+    }
+    if (nCallUs > 0) {
+        std::this_thread::sleep_for(std::chrono::microseconds(nCallUs));
+    }
+    return eStatus;
+}
+
+static void UpdateMax(uint32_t &nMax, size_t n) {
+    std::lock_guard<std::mutex> lock(mtxGlobal);
+    if (n > nMax) {
+        nMax = (uint32_t)n;
+    }
+}
+
+static uint32_t Random(FakeSession *pSession) {
+    pSession->nRandom = pSession->nRandom * 1664525 + 1013904223;
+    return pSession->nRandom >> 8;
+}
+
+static int Vary(FakeSession *pSession, int n, int nRange) {
+    return nRange > 0 ? n + (int)(Random(pSession) % (2 * nRange + 1)) - nRange : n;
+}
+
+static uint32_t FrameBytes(FakeSession *pSession, NV_ENC_PIC_TYPE ePicType) {
+    const FakeNvEncConfig &config = pSession->config;
+    int nFrame = config.nFrameBytes, nIdr = config.nIdrBytes;
+    if (!nFrame) {
+        nFrame = pSession->nBitrate ? (int)(pSession->nBitrate / 8 / pSession->dFps) : (int)(pSession->nWidth * pSession->nHeight / 16);
+    }
+    if (!nIdr) {
+        nIdr = 4 * nFrame;
+    }
+    int n = ePicType == NV_ENC_PIC_TYPE_IDR ? nIdr : (ePicType == NV_ENC_PIC_TYPE_B ? nFrame / 2 : nFrame);
+    n = Vary(pSession, n, n * config.nSizeJitterPercent / 100);
+    return n < 16 ? 16 : n;
+}
+
+/**
+*  @brief Hands one frame to the first free engine and writes its payload into pBuffer;
+*  the payload may only be read once tDone has passed.
+*/
+static void Schedule(FakeSession *pSession, FakeBuffer *pBuffer, uint64_t nTimestamp, uint32_t iFrame, NV_ENC_PIC_TYPE ePicType, bool bSpsPps) {
+    TimePoint tNow = std::chrono::steady_clock::now();
+    size_t iEngine = 0;
+    for (size_t i = 1; i < pSession->vEngineFree.size(); i++) {
+        if (pSession->vEngineFree[i] < pSession->vEngineFree[iEngine]) {
+            iEngine = i;
+        }
+    }
+    TimePoint tStart = pSession->vEngineFree[iEngine] > tNow ? pSession->vEngineFree[iEngine] : tNow;
+    int nEncodeUs = Vary(pSession, pSession->config.nEncodeUs, pSession->config.nJitterUs);
+    pBuffer->tDone = pSession->vEngineFree[iEngine] = tStart + std::chrono::microseconds(nEncodeUs > 0 ? nEncodeUs : 0);
+
+    std::vector<uint8_t> &v = pBuffer->vData;
+    v.clear();
+    if (bSpsPps) {
+        v = pSession->vSeqParams;
+    }
+    uint32_t nSize = FrameBytes(pSession, ePicType);
+    static const uint8_t aStartCode[] = {0, 0, 0, 1};
+    v.insert(v.end(), aStartCode, aStartCode + 4);
+    v.push_back(ePicType == NV_ENC_PIC_TYPE_IDR ? 0x65 : (ePicType == NV_ENC_PIC_TYPE_B ? 0x01 : 0x41));
+    // filler without zero bytes, so no start code emulation
+    while (v.size() < nSize) {
+        v.push_back((uint8_t)(0x80 | (v.size() & 0x7F)));
+    }
+    pBuffer->nSize = (uint32_t)v.size();
+    pBuffer->nTimestamp = nTimestamp;
+    pBuffer->iFrame = iFrame;
+    pBuffer->ePicType = ePicType;
+    pBuffer->bEncoded = true;
+}
+
+/** The waiting B frames lose their anchor (end of stream or IDR) and are encoded as P frames */
+static void FlushWaiting(FakeSession *pSession) {
+    for (FakeBuffer *pBuffer : pSession->vWaiting) {
+        Schedule(pSession, pBuffer, pBuffer->nTimestamp, pBuffer->iFrame, NV_ENC_PIC_TYPE_P, false);
+    }
+    pSession->vWaiting.clear();
+}
+
+static NVENCSTATUS NVENCAPI FakeOpenEncodeSessionEx(NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS *pParams, void **pEncoder) {
+    NVENCSTATUS eStatus = Enter("open");
+    if (eStatus != NV_ENC_SUCCESS) {
+        return eStatus;
+    }
+    if (!pParams || !pEncoder) {
+        return NV_ENC_ERR_INVALID_PTR;
+    }
+    if (pParams->apiVersion != NVENCAPI_VERSION) {
+        return NV_ENC_ERR_INVALID_VERSION;
+    }
+    FakeSession *pSession = new FakeSession();
+    {
+        std::lock_guard<std::mutex> lock(mtxGlobal);
+        pSession->config = gConfig;
+    }
+    pSession->vEngineFree.resize(pSession->config.nEngines > 0 ? pSession->config.nEngines : 1);
+    *pEncoder = pSession;
+    return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI FakeOpenEncodeSession(void *, uint32_t, void **) {
+    return NV_ENC_ERR_UNIMPLEMENTED;
+}
+
+static NVENCSTATUS NVENCAPI FakeGetEncodeGUIDCount(void *, uint32_t *pCount) {
+    *pCount = 2;
+    return Enter("caps");
+}
+
+static NVENCSTATUS NVENCAPI FakeGetEncodeGUIDs(void *, GUID *pGuids, uint32_t nSize, uint32_t *pCount) {
+    const GUID aGuid[] = {NV_ENC_CODEC_H264_GUID, NV_ENC_CODEC_HEVC_GUID};
+    *pCount = nSize < 2 ? nSize : 2;
+    memcpy(pGuids, aGuid, *pCount * sizeof(GUID));
+    return Enter("caps");
+}
+
+static NVENCSTATUS NVENCAPI FakeGetEncodeCaps(void *, GUID, NV_ENC_CAPS_PARAM *pCapsParam, int *pValue) {
+    switch (pCapsParam->capsToQuery) {
+    case NV_ENC_CAPS_WIDTH_MAX:
+    case NV_ENC_CAPS_HEIGHT_MAX:
+        *pValue = 4096;
+        break;
+    case NV_ENC_CAPS_NUM_MAX_BFRAMES:
+        *pValue = 4;
+        break;
+    default:
+        *pValue = 0;
+    }
+    return Enter("caps");
+}
+
+static NVENCSTATUS NVENCAPI FakeGetEncodePresetConfig(void *, GUID encodeGuid, GUID, NV_ENC_PRESET_CONFIG *pPresetConfig) {
+    NV_ENC_CONFIG &config = pPresetConfig->presetCfg;
+    memset(&config, 0, sizeof(config));
+    config.version = NV_ENC_CONFIG_VER;
+    config.gopLength = 30;
+    config.frameIntervalP = 1;
+    config.rcParams.rateControlMode = NV_ENC_PARAMS_RC_VBR;
+    config.rcParams.averageBitRate = 5000000;
+    if (encodeGuid == NV_ENC_CODEC_H264_GUID) {
+        config.encodeCodecConfig.h264Config.idrPeriod = config.gopLength;
+    } else {
+        config.encodeCodecConfig.hevcConfig.idrPeriod = config.gopLength;
+    }
+    return Enter("caps");
+}
+
+static void ApplyParams(FakeSession *pSession, const NV_ENC_INITIALIZE_PARAMS *pParams) {
+    pSession->nWidth = pParams->encodeWidth;
+    pSession->nHeight = pParams->encodeHeight;
+    pSession->dFps = pParams->frameRateNum && pParams->frameRateDen ? (double)pParams->frameRateNum / pParams->frameRateDen : 30;
+    pSession->bMotionEstimationOnly = pParams->enableMEOnlyMode != 0;
+    pSession->nMaxMeHints16x16 = pParams->enableExternalMEHints ? pParams->maxMEHintCountsPerBlock[0].numCandsPerBlk16x16 : 0;
+    if (pParams->encodeConfig) {
+        const NV_ENC_CONFIG &config = *pParams->encodeConfig;
+        pSession->nFrameIntervalP = config.frameIntervalP > 0 ? config.frameIntervalP : 1;
+        pSession->nGop = config.gopLength ? config.gopLength : NVENC_INFINITE_GOPLENGTH;
+        pSession->nBitrate = config.rcParams.rateControlMode == NV_ENC_PARAMS_RC_CONSTQP ? 0 : config.rcParams.averageBitRate;
+        pSession->eQpMapMode = config.rcParams.qpMapMode;
+        pSession->bRepeatSpsPps = pParams->encodeGUID == NV_ENC_CODEC_H264_GUID ? config.encodeCodecConfig.h264Config.repeatSPSPPS != 0
+            : config.encodeCodecConfig.hevcConfig.repeatSPSPPS != 0;
+    }
+}
+
+static NVENCSTATUS NVENCAPI FakeInitializeEncoder(void *pEncoder, NV_ENC_INITIALIZE_PARAMS *pParams) {
+    NVENCSTATUS eStatus = Enter("init");
+    if (eStatus != NV_ENC_SUCCESS) {
+        return eStatus;
+    }
+    FakeSession *pSession = (FakeSession *)pEncoder;
+    if (!pParams || !pParams->encodeWidth || !pParams->encodeHeight) {
+        return NV_ENC_ERR_INVALID_PARAM;
+    }
+#if !defined(_WIN32)
+    if (pParams->enableEncodeAsync) {
+        return NV_ENC_ERR_UNSUPPORTED_PARAM;
+    }
+#endif
+    std::lock_guard<std::mutex> lock(pSession->mtx);
+    ApplyParams(pSession, pParams);
+    // the parameter sets of the software encoder: right size and profile for parsers, muxers and players
+    PcmH264Encoder(pSession->nWidth, pSession->nHeight).GetSequenceParams(pSession->vSeqParams);
+    pSession->bInitialized = true;
+    return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI FakeReconfigureEncoder(void *pEncoder, NV_ENC_RECONFIGURE_PARAMS *pParams) {
+    NVENCSTATUS eStatus = Enter("reconfigure");
+    if (eStatus != NV_ENC_SUCCESS) {
+        return eStatus;
+    }
+    FakeSession *pSession = (FakeSession *)pEncoder;
+    std::lock_guard<std::mutex> lock(pSession->mtx);
+    ApplyParams(pSession, &pParams->reInitEncodeParams);
+    if (pParams->forceIDR || pParams->resetEncoder) {
+        pSession->bForceIdr = true;
+    }
+    return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS CreateBuffer(void *pEncoder, const char *szCall, NV_ENC_OUTPUT_PTR *pBufferOut) {
+    NVENCSTATUS eStatus = Enter(szCall);
+    if (eStatus != NV_ENC_SUCCESS) {
+        return eStatus;
+    }
+    FakeSession *pSession = (FakeSession *)pEncoder;
+    std::lock_guard<std::mutex> lock(pSession->mtx);
+    if (!pSession->bInitialized) {
+        return NV_ENC_ERR_ENCODER_NOT_INITIALIZED;
+    }
+    FakeBuffer *pBuffer = new FakeBuffer();
+    pSession->sBuffer.insert(pBuffer);
+    UpdateMax(gStats.nMaxBitstreamBuffers, pSession->sBuffer.size());
+    *pBufferOut = pBuffer;
+    return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS DestroyBuffer(void *pEncoder, const char *szCall, NV_ENC_OUTPUT_PTR pBufferIn) {
+    Enter(szCall);
+    FakeSession *pSession = (FakeSession *)pEncoder;
+    std::lock_guard<std::mutex> lock(pSession->mtx);
+    FakeBuffer *pBuffer = (FakeBuffer *)pBufferIn;
+    if (!pSession->sBuffer.erase(pBuffer)) {
+        return NV_ENC_ERR_INVALID_PARAM;
+    }
+    delete pBuffer;
+    return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI FakeCreateBitstreamBuffer(void *pEncoder, NV_ENC_CREATE_BITSTREAM_BUFFER *pParams) {
+    return CreateBuffer(pEncoder, "bitstream", &pParams->bitstreamBuffer);
+}
+
+static NVENCSTATUS NVENCAPI FakeDestroyBitstreamBuffer(void *pEncoder, NV_ENC_OUTPUT_PTR pBuffer) {
+    return DestroyBuffer(pEncoder, "bitstream", pBuffer);
+}
+
+static NVENCSTATUS NVENCAPI FakeCreateMVBuffer(void *pEncoder, NV_ENC_CREATE_MV_BUFFER *pParams) {
+    return CreateBuffer(pEncoder, "bitstream", &pParams->mvBuffer);
+}
+
+static NVENCSTATUS NVENCAPI FakeDestroyMVBuffer(void *pEncoder, NV_ENC_OUTPUT_PTR pBuffer) {
+    return DestroyBuffer(pEncoder, "bitstream", pBuffer);
+}
+
+static NVENCSTATUS NVENCAPI FakeRegisterResource(void *pEncoder, NV_ENC_REGISTER_RESOURCE *pParams) {
+    NVENCSTATUS eStatus = Enter("register");
+    if (eStatus != NV_ENC_SUCCESS) {
+        return eStatus;
+    }
+    if (!pParams->resourceToRegister) {
+        return NV_ENC_ERR_INVALID_PTR;
+    }
+    FakeSession *pSession = (FakeSession *)pEncoder;
+    std::lock_guard<std::mutex> lock(pSession->mtx);
+    FakeInput *pInput = new FakeInput();
+    pInput->pResource = pParams->resourceToRegister;
+    pSession->sInput.insert(pInput);
+    UpdateMax(gStats.nMaxRegistered, pSession->sInput.size());
+    pParams->registeredResource = pInput;
+    return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI FakeUnregisterResource(void *pEncoder, NV_ENC_REGISTERED_PTR pRegistered) {
+    Enter("register");
+    FakeSession *pSession = (FakeSession *)pEncoder;
+    std::lock_guard<std::mutex> lock(pSession->mtx);
+    FakeInput *pInput = (FakeInput *)pRegistered;
+    if (!pSession->sInput.count(pInput)) {
+        return NV_ENC_ERR_INVALID_PARAM;
+    }
+    if (pInput->nMapped) {
+        return NV_ENC_ERR_INVALID_CALL;
+    }
+    pSession->sInput.erase(pInput);
+    delete pInput;
+    return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI FakeMapInputResource(void *pEncoder, NV_ENC_MAP_INPUT_RESOURCE *pParams) {
+    NVENCSTATUS eStatus = Enter("map");
+    if (eStatus != NV_ENC_SUCCESS) {
+        return eStatus;
+    }
+    FakeSession *pSession = (FakeSession *)pEncoder;
+    std::lock_guard<std::mutex> lock(pSession->mtx);
+    FakeInput *pInput = (FakeInput *)pParams->registeredResource;
+    if (!pSession->sInput.count(pInput)) {
+        return NV_ENC_ERR_RESOURCE_NOT_REGISTERED;
+    }
+    pInput->nMapped++;
+    UpdateMax(gStats.nMaxMapped, ++pSession->nMapped);
+    pParams->mappedResource = pInput;
+    return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI FakeUnmapInputResource(void *pEncoder, NV_ENC_INPUT_PTR pMapped) {
+    NVENCSTATUS eStatus = Enter("unmap");
+    if (eStatus != NV_ENC_SUCCESS) {
+        return eStatus;
+    }
+    FakeSession *pSession = (FakeSession *)pEncoder;
+    std::lock_guard<std::mutex> lock(pSession->mtx);
+    FakeInput *pInput = (FakeInput *)pMapped;
+    if (!pSession->sInput.count(pInput) || !pInput->nMapped) {
+        return NV_ENC_ERR_RESOURCE_NOT_MAPPED;
+    }
+    pInput->nMapped--;
+    pSession->nMapped--;
+    return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI FakeEncodePicture(void *pEncoder, NV_ENC_PIC_PARAMS *pParams) {
+    NVENCSTATUS eStatus = Enter("encode");
+    if (eStatus != NV_ENC_SUCCESS) {
+        return eStatus;
+    }
+    FakeSession *pSession = (FakeSession *)pEncoder;
+    std::lock_guard<std::mutex> lock(pSession->mtx);
+    if (!pSession->bInitialized) {
+        return NV_ENC_ERR_ENCODER_NOT_INITIALIZED;
+    }
+#if defined(_WIN32)
+    // the latency is modelled in the lock, so the completion can be signalled right away
+    if (pParams->completionEvent) {
+        SetEvent((HANDLE)pParams->completionEvent);
+    }
+#endif
+    if (pParams->encodePicFlags & NV_ENC_PIC_FLAG_EOS) {
+        FlushWaiting(pSession);
+        return NV_ENC_SUCCESS;
+    }
+
+    FakeInput *pInput = (FakeInput *)pParams->inputBuffer;
+    FakeBuffer *pBuffer = (FakeBuffer *)pParams->outputBitstream;
+    if (!pSession->sInput.count(pInput) || !pInput->nMapped) {
+        return NV_ENC_ERR_RESOURCE_NOT_MAPPED;
+    }
+    if (!pSession->sBuffer.count(pBuffer)) {
+        return NV_ENC_ERR_INVALID_PARAM;
+    }
+    if (pBuffer->bPending) {
+        // the previous frame in this buffer was never locked: the ring wrapped too early
+        return NV_ENC_ERR_ENCODER_BUSY;
+    }
+    if (pParams->qpDeltaMap) {
+        // one value per macroblock, and only for a session initialized with a QP map mode
+        uint32_t nMbs = ((pSession->nWidth + 15) / 16) * ((pSession->nHeight + 15) / 16);
+        if (pSession->eQpMapMode == NV_ENC_QP_MAP_DISABLED || pParams->qpDeltaMapSize < nMbs) {
+            return NV_ENC_ERR_INVALID_PARAM;
+        }
+        std::lock_guard<std::mutex> lockGlobal(mtxGlobal);
+        gStats.nQpMapFrames++;
+    }
+    if (pParams->meExternalHints) {
+        // more candidates than declared at initialization, or hints the session did not enable
+        uint32_t nCands = pParams->meHintCountsPerBlock[0].numCandsPerBlk16x16;
+        if (!nCands || nCands > pSession->nMaxMeHints16x16) {
+            return NV_ENC_ERR_INVALID_PARAM;
+        }
+        std::lock_guard<std::mutex> lockGlobal(mtxGlobal);
+        gStats.nMeHintFrames++;
+    }
+    pBuffer->bPending = true;
+    pBuffer->bEncoded = false;
+    UpdateMax(gStats.nMaxInFlight, ++pSession->nInFlight);
+    {
+        std::lock_guard<std::mutex> lockGlobal(mtxGlobal);
+        gStats.nFrames++;
+    }
+
+    uint32_t iFrame = pSession->iFrame++;
+    bool bIdr = pSession->iGopFrame == 0 || pSession->bForceIdr || (pParams->encodePicFlags & NV_ENC_PIC_FLAG_FORCEIDR)
+        || (pSession->nGop != NVENC_INFINITE_GOPLENGTH && pSession->iGopFrame >= pSession->nGop);
+    if (!bIdr && pSession->nFrameIntervalP > 1 && pSession->iGopFrame % pSession->nFrameIntervalP != 0) {
+        pBuffer->nTimestamp = pParams->inputTimeStamp;
+        pBuffer->iFrame = iFrame;
+        pSession->vWaiting.push_back(pBuffer);
+        pSession->iGopFrame++;
+        std::lock_guard<std::mutex> lockGlobal(mtxGlobal);
+        gStats.nNeedMoreInput++;
+        return NV_ENC_ERR_NEED_MORE_INPUT;
+    }
+
+    if (bIdr) {
+        FlushWaiting(pSession);
+        pSession->iGopFrame = 0;
+        pSession->bForceIdr = false;
+        bool bSpsPps = iFrame == 0 || pSession->bRepeatSpsPps || (pParams->encodePicFlags & NV_ENC_PIC_FLAG_OUTPUT_SPSPPS);
+        Schedule(pSession, pBuffer, pParams->inputTimeStamp, iFrame, NV_ENC_PIC_TYPE_IDR, bSpsPps);
+    } else {
+        // decode order is the anchor, then its B frames; the outputs fill the buffers in submission order
+        std::vector<FakeBuffer *> vBuffer = pSession->vWaiting;
+        vBuffer.push_back(pBuffer);
+        std::vector<FakeBuffer> vDecodeOrder(vBuffer.size());
+        Schedule(pSession, &vDecodeOrder[0], pParams->inputTimeStamp, iFrame, NV_ENC_PIC_TYPE_P, false);
+        for (size_t i = 0; i < pSession->vWaiting.size(); i++) {
+            Schedule(pSession, &vDecodeOrder[i + 1], pSession->vWaiting[i]->nTimestamp, pSession->vWaiting[i]->iFrame, NV_ENC_PIC_TYPE_B, false);
+        }
+        for (size_t i = 0; i < vBuffer.size(); i++) {
+            vDecodeOrder[i].bPending = true;
+            *vBuffer[i] = std::move(vDecodeOrder[i]);
+        }
+        pSession->vWaiting.clear();
+    }
+    pSession->iGopFrame++;
+    return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI FakeRunMotionEstimationOnly(void *pEncoder, NV_ENC_MEONLY_PARAMS *pParams) {
+    NVENCSTATUS eStatus = Enter("encode");
+    if (eStatus != NV_ENC_SUCCESS) {
+        return eStatus;
+    }
+    FakeSession *pSession = (FakeSession *)pEncoder;
+    std::lock_guard<std::mutex> lock(pSession->mtx);
+    FakeInput *pInput = (FakeInput *)pParams->inputBuffer, *pReference = (FakeInput *)pParams->referenceFrame;
+    FakeBuffer *pBuffer = (FakeBuffer *)pParams->mvBuffer;
+    if (!pSession->sInput.count(pInput) || !pInput->nMapped || !pSession->sInput.count(pReference) || !pReference->nMapped) {
+        return NV_ENC_ERR_RESOURCE_NOT_MAPPED;
+    }
+    if (!pSession->sBuffer.count(pBuffer) || pBuffer->bPending) {
+        return NV_ENC_ERR_INVALID_PARAM;
+    }
+#if defined(_WIN32)
+    if (pParams->completionEvent) {
+        SetEvent((HANDLE)pParams->completionEvent);
+    }
+#endif
+    pBuffer->bPending = true;
+    UpdateMax(gStats.nMaxInFlight, ++pSession->nInFlight);
+    Schedule(pSession, pBuffer, 0, pSession->iFrame++, NV_ENC_PIC_TYPE_P, false);
+    // zero motion for every macroblock
+    pBuffer->vData.assign(((pSession->nWidth + 15) / 16) * ((pSession->nHeight + 15) / 16) * sizeof(NV_ENC_H264_MV_DATA), 0);
+    pBuffer->nSize = (uint32_t)pBuffer->vData.size();
+    return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI FakeLockBitstream(void *pEncoder, NV_ENC_LOCK_BITSTREAM *pParams) {
+    NVENCSTATUS eStatus = Enter("lock");
+    if (eStatus != NV_ENC_SUCCESS) {
+        return eStatus;
+    }
+    FakeSession *pSession = (FakeSession *)pEncoder;
+    std::unique_lock<std::mutex> lock(pSession->mtx);
+    FakeBuffer *pBuffer = (FakeBuffer *)pParams->outputBitstream;
+    if (!pSession->sBuffer.count(pBuffer) || pBuffer->bLocked) {
+        return NV_ENC_ERR_INVALID_PARAM;
+    }
+    if (!pBuffer->bPending || !pBuffer->bEncoded) {
+        // nothing was encoded into it, or it is a B frame still waiting for its anchor
+        return NV_ENC_ERR_GENERIC;
+    }
+    TimePoint tNow = std::chrono::steady_clock::now(), tDone = pBuffer->tDone;
+    if (tNow < tDone) {
+        if (pParams->doNotWait) {
+            return NV_ENC_ERR_LOCK_BUSY;
+        }
+        lock.unlock();
+        std::this_thread::sleep_until(tDone);
+        lock.lock();
+        std::lock_guard<std::mutex> lockGlobal(mtxGlobal);
+        gStats.nLockWaits++;
+        gStats.nLockWaitUs += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - tNow).count();
+    }
+    pBuffer->bLocked = true;
+    pParams->bitstreamBufferPtr = pBuffer->vData.data();
+    pParams->bitstreamSizeInBytes = pBuffer->nSize;
+    pParams->outputTimeStamp = pBuffer->nTimestamp;
+    pParams->frameIdx = pBuffer->iFrame;
+    pParams->pictureType = pBuffer->ePicType;
+    pParams->pictureStruct = NV_ENC_PIC_STRUCT_FRAME;
+    pParams->frameAvgQP = 28;
+    pParams->hwEncodeStatus = 0;
+    pParams->numSlices = 1;
+    std::lock_guard<std::mutex> lockGlobal(mtxGlobal);
+    gStats.nLocks++;
+    return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI FakeUnlockBitstream(void *pEncoder, NV_ENC_OUTPUT_PTR pBufferIn) {
+    NVENCSTATUS eStatus = Enter("unlock");
+    if (eStatus != NV_ENC_SUCCESS) {
+        return eStatus;
+    }
+    FakeSession *pSession = (FakeSession *)pEncoder;
+    std::lock_guard<std::mutex> lock(pSession->mtx);
+    FakeBuffer *pBuffer = (FakeBuffer *)pBufferIn;
+    if (!pSession->sBuffer.count(pBuffer) || !pBuffer->bLocked) {
+        return NV_ENC_ERR_INVALID_PARAM;
+    }
+    pBuffer->bLocked = pBuffer->bPending = pBuffer->bEncoded = false;
+    pSession->nInFlight--;
+    return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI FakeGetSequenceParams(void *pEncoder, NV_ENC_SEQUENCE_PARAM_PAYLOAD *pPayload) {
+    NVENCSTATUS eStatus = Enter("caps");
+    if (eStatus != NV_ENC_SUCCESS) {
+        return eStatus;
+    }
+    FakeSession *pSession = (FakeSession *)pEncoder;
+    std::lock_guard<std::mutex> lock(pSession->mtx);
+    if (pPayload->inBufferSize < pSession->vSeqParams.size()) {
+        return NV_ENC_ERR_INVALID_PARAM;
+    }
+    memcpy(pPayload->spsppsBuffer, pSession->vSeqParams.data(), pSession->vSeqParams.size());
+    *pPayload->outSPSPPSPayloadSize = (uint32_t)pSession->vSeqParams.size();
+    return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI FakeAsyncEvent(void *, NV_ENC_EVENT_PARAMS *) {
+    return Enter("event");
+}
+
+static NVENCSTATUS NVENCAPI FakeDestroyEncoder(void *pEncoder) {
+    Enter("destroy");
+    FakeSession *pSession = (FakeSession *)pEncoder;
+    for (FakeBuffer *pBuffer : pSession->sBuffer) {
+        delete pBuffer;
+    }
+    for (FakeInput *pInput : pSession->sInput) {
+        delete pInput;
+    }
+    delete pSession;
+    return NV_ENC_SUCCESS;
+}
+
+FAKE_NVENC_EXPORT NVENCSTATUS NVENCAPI NvEncodeAPIGetMaxSupportedVersion(uint32_t *pVersion) {
+    *pVersion = (NVENCAPI_MAJOR_VERSION << 4) | NVENCAPI_MINOR_VERSION;
+    return NV_ENC_SUCCESS;
+}
+
+FAKE_NVENC_EXPORT NVENCSTATUS NVENCAPI NvEncodeAPICreateInstance(NV_ENCODE_API_FUNCTION_LIST *pFunctionList) {
+    if (!pFunctionList) {
+        return NV_ENC_ERR_INVALID_PTR;
+    }
+    if (pFunctionList->version != NV_ENCODE_API_FUNCTION_LIST_VER) {
+        return NV_ENC_ERR_INVALID_VERSION;
+    }
+    // the rest stays NULL: NvEncoder does not call it
+    pFunctionList->nvEncOpenEncodeSession = FakeOpenEncodeSession;
+    pFunctionList->nvEncOpenEncodeSessionEx = FakeOpenEncodeSessionEx;
+    pFunctionList->nvEncGetEncodeGUIDCount = FakeGetEncodeGUIDCount;
+    pFunctionList->nvEncGetEncodeGUIDs = FakeGetEncodeGUIDs;
+    pFunctionList->nvEncGetEncodeCaps = FakeGetEncodeCaps;
+    pFunctionList->nvEncGetEncodePresetConfig = FakeGetEncodePresetConfig;
+    pFunctionList->nvEncInitializeEncoder = FakeInitializeEncoder;
+    pFunctionList->nvEncReconfigureEncoder = FakeReconfigureEncoder;
+    pFunctionList->nvEncCreateBitstreamBuffer = FakeCreateBitstreamBuffer;
+    pFunctionList->nvEncDestroyBitstreamBuffer = FakeDestroyBitstreamBuffer;
+    pFunctionList->nvEncCreateMVBuffer = FakeCreateMVBuffer;
+    pFunctionList->nvEncDestroyMVBuffer = FakeDestroyMVBuffer;
+    pFunctionList->nvEncRegisterResource = FakeRegisterResource;
+    pFunctionList->nvEncUnregisterResource = FakeUnregisterResource;
+    pFunctionList->nvEncMapInputResource = FakeMapInputResource;
+    pFunctionList->nvEncUnmapInputResource = FakeUnmapInputResource;
+    pFunctionList->nvEncEncodePicture = FakeEncodePicture;
+    pFunctionList->nvEncRunMotionEstimationOnly = FakeRunMotionEstimationOnly;
+    pFunctionList->nvEncLockBitstream = FakeLockBitstream;
+    pFunctionList->nvEncUnlockBitstream = FakeUnlockBitstream;
+    pFunctionList->nvEncGetSequenceParams = FakeGetSequenceParams;
+    pFunctionList->nvEncRegisterAsyncEvent = FakeAsyncEvent;
+    pFunctionList->nvEncUnregisterAsyncEvent = FakeAsyncEvent;
+    pFunctionList->nvEncDestroyEncoder = FakeDestroyEncoder;
+    return NV_ENC_SUCCESS;
+}
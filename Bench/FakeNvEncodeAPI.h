@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+*  @brief Timing, output and error model of the fake NVENC driver (libnvenc_fake.so).
+*  NvEncoder loads it instead of the real library when NVENC_LIBRARY_PATH points to it.
+*  Every field can also be set through the environment variable named next to it; the
+*  environment is read when the library is loaded, and ReadFakeNvEncEnvironment() lets a
+*  caller of FakeNvEncConfigure() start from it too.
+*/
+struct FakeNvEncConfig {
+    /** Time the engine spends on one frame, in microseconds (FAKE_NVENC_ENCODE_US) */
+    int nEncodeUs = 2000;
+    /** Random +/- variation of nEncodeUs (FAKE_NVENC_JITTER_US) */
+    int nJitterUs = 0;
+    /** Frames encoded at the same time, like the several NVENC engines of some GPUs (FAKE_NVENC_ENGINES) */
+    int nEngines = 1;
+    /** CPU time every API call takes before it returns, in microseconds (FAKE_NVENC_CALL_US) */
+    int nCallUs = 0;
+    /** Sizes of IDR and P frames in bytes (B frames get half); 0 derives them from the bitrate (FAKE_NVENC_IDR_BYTES, FAKE_NVENC_FRAME_BYTES) */
+    int nIdrBytes = 0;
+    int nFrameBytes = 0;
+    /** Random +/- variation of the frame sizes in percent (FAKE_NVENC_SIZE_JITTER) */
+    int nSizeJitterPercent = 0;
+    /**
+    *  @brief Error injection: the nFailAt-th call (1-based) of szFailCall and the nFailCount - 1
+    *  calls after it return eFailStatus. Call names: open, init, register, map, unmap, encode,
+    *  lock, unlock, bitstream, reconfigure (FAKE_NVENC_FAIL=call:at[:count[:status]]).
+    */
+    char szFailCall[32] = {};
+    uint64_t nFailAt = 0;
+    uint64_t nFailCount = 1;
+    int eFailStatus = 8;    // NV_ENC_ERR_INVALID_PARAM
+};
+
+struct FakeNvEncStats {
+    uint64_t nCalls = 0;
+    uint64_t nFrames = 0;
+    /** B frames held back until their anchor frame */
+    uint64_t nNeedMoreInput = 0;
+    uint64_t nLocks = 0;
+    /** Locks that had to wait for the engine, and how long in total */
+    uint64_t nLockWaits = 0;
+    uint64_t nLockWaitUs = 0;
+    uint64_t nInjectedErrors = 0;
+    /** Frames encoded with a QP delta map */
+    uint64_t nQpMapFrames = 0;
+    /** Frames encoded with external ME hints */
+    uint64_t nMeHintFrames = 0;
+    /** Largest number of frames submitted but not yet locked, and of mapped inputs */
+    uint32_t nMaxInFlight = 0;
+    uint32_t nMaxMapped = 0;
+    /** Buffers alive at their peak */
+    uint32_t nMaxBitstreamBuffers = 0;
+    uint32_t nMaxRegistered = 0;
+};
+
+/** Overrides the fields of *pConfig whose environment variable is set */
+inline void ReadFakeNvEncEnvironment(FakeNvEncConfig *pConfig) {
+    const char *sz;
+    if ((sz = getenv("FAKE_NVENC_ENCODE_US"))) pConfig->nEncodeUs = atoi(sz);
+    if ((sz = getenv("FAKE_NVENC_JITTER_US"))) pConfig->nJitterUs = atoi(sz);
+    if ((sz = getenv("FAKE_NVENC_ENGINES"))) pConfig->nEngines = atoi(sz);
+    if ((sz = getenv("FAKE_NVENC_CALL_US"))) pConfig->nCallUs = atoi(sz);
+    if ((sz = getenv("FAKE_NVENC_IDR_BYTES"))) pConfig->nIdrBytes = atoi(sz);
+    if ((sz = getenv("FAKE_NVENC_FRAME_BYTES"))) pConfig->nFrameBytes = atoi(sz);
+    if ((sz = getenv("FAKE_NVENC_SIZE_JITTER"))) pConfig->nSizeJitterPercent = atoi(sz);
+    if ((sz = getenv("FAKE_NVENC_FAIL"))) {
+        // call:at[:count[:status]]
+        char szCall[32] = {};
+        unsigned long long nAt = 0, nCount = 1;
+        int eStatus = pConfig->eFailStatus;
+        if (sscanf(sz, "%31[^:]:%llu:%llu:%d", szCall, &nAt, &nCount, &eStatus) >= 2) {
+            strcpy(pConfig->szFailCall, szCall);
+            pConfig->nFailAt = nAt;
+            pConfig->nFailCount = nCount;
+            pConfig->eFailStatus = eStatus;
+        }
+    }
+}
+
+extern "C" {
+/** Replaces the model for the sessions opened from now on; fill pConfig with ReadFakeNvEncEnvironment() first to keep the environment */
+void FakeNvEncConfigure(const FakeNvEncConfig *pConfig);
+void FakeNvEncGetStats(FakeNvEncStats *pStats);
+/** Clears the statistics and the call counters of the error injection */
+void FakeNvEncResetStats();
+}
+
+typedef void (*FakeNvEncConfigure_Type)(const FakeNvEncConfig *);
+typedef void (*FakeNvEncGetStats_Type)(FakeNvEncStats *);
+typedef void (*FakeNvEncResetStats_Type)();
@@ -0,0 +1,486 @@
+/**
+*  micro_bench: Google Benchmark microbenchmarks of the header-only primitives the
+*  recorder relies on. Run with "make bench"; every case reports ns per operation
+*  and, where a frame or buffer is processed, bytes per second.
+*/
+
+#include <benchmark/benchmark.h>
+#include <fstream>
+#include <map>
+#include <vector>
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+#include "../Queue.h"
+#include "../NvCodec/NvEncoder/nvEncodeAPI.h"
+#include "../Utils/Logger.h"
+#include "../Utils/NvCodecUtils.h"
+#include "../Utils/NvEncoderCLIOptions.h"
+#include "../Utils/ColorSpaceCpu.h"
+#include "../Utils/QpMapBuilder.h"
+#include "../Utils/MotionHintBuilder.h"
+#include "../Utils/MotionEstimatorCpu.h"
+#include "../Utils/NalScanner.h"
+#include "../Utils/SeekIndex.h"
+#include "../Utils/QualityMetrics.h"
+
+simplelogger::Logger *logger = NULL;
+
+static const int aaResolution[][2] = { { 1280, 720 }, { 1920, 1080 }, { 3840, 2160 } };
+
+static void FrameSizes(benchmark::internal::Benchmark *b) {
+    for (auto &r : aaResolution) {
+        b->Args({ r[0], r[1] });
+    }
+}
+
+// Every thread pushes and then pops, so all of them contend on the same lock
+static void BM_QueuePushPop(benchmark::State &state) {
+    static Queue<int> *pQueue;
+    if (state.thread_index() == 0) {
+        pQueue = new Queue<int>();
+    }
+    int n = 0;
+    for (auto _ : state) {
+        pQueue->push(n++);
+        benchmark::DoNotOptimize(pQueue->pop());
+    }
+    state.SetItemsProcessed(state.iterations());
+    if (state.thread_index() == 0) {
+        delete pQueue;
+    }
+}
+BENCHMARK(BM_QueuePushPop)->ThreadRange(1, 8)->UseRealTime();
+
+static void BM_BoundedQueuePushPop(benchmark::State &state) {
+    static BoundedQueue<int> *pQueue;
+    if (state.thread_index() == 0) {
+        pQueue = new BoundedQueue<int>(16);
+    }
+    int n = 0, v = 0;
+    for (auto _ : state) {
+        pQueue->push(n++);
+        pQueue->pop(v);
+        benchmark::DoNotOptimize(v);
+    }
+    state.SetItemsProcessed(state.iterations());
+    if (state.thread_index() == 0) {
+        delete pQueue;
+    }
+}
+BENCHMARK(BM_BoundedQueuePushPop)->ThreadRange(1, 8)->UseRealTime();
+
+// One producer and one consumer handing over a frame pointer, as between the capture and encode threads
+static void BM_QueueHandoff(benchmark::State &state) {
+    Queue<int> q;
+    std::thread consumer([&q]() {
+        while (q.pop() >= 0) {
+        }
+    });
+    int n = 0;
+    for (auto _ : state) {
+        q.push(n++);
+    }
+    q.push(-1);
+    consumer.join();
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_QueueHandoff)->UseRealTime();
+
+static void BM_YuvConverterPlanarToUVInterleaved(benchmark::State &state) {
+    int nWidth = (int)state.range(0), nHeight = (int)state.range(1);
+    std::vector<uint8_t> vFrame(nWidth * nHeight * 3 / 2, 128);
+    YuvConverter<uint8_t> converter(nWidth, nHeight);
+    for (auto _ : state) {
+        converter.PlanarToUVInterleaved(vFrame.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * nWidth * nHeight / 2);
+}
+BENCHMARK(BM_YuvConverterPlanarToUVInterleaved)->Apply(FrameSizes);
+
+static void BM_YuvConverterUVInterleavedToPlanar(benchmark::State &state) {
+    int nWidth = (int)state.range(0), nHeight = (int)state.range(1);
+    std::vector<uint8_t> vFrame(nWidth * nHeight * 3 / 2, 128);
+    YuvConverter<uint8_t> converter(nWidth, nHeight);
+    for (auto _ : state) {
+        converter.UVInterleavedToPlanar(vFrame.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * nWidth * nHeight / 2);
+}
+BENCHMARK(BM_YuvConverterUVInterleavedToPlanar)->Apply(FrameSizes);
+
+static void BM_BufferedFileReader(benchmark::State &state) {
+    const char *szPath = "micro_bench.tmp";
+    size_t nSize = (size_t)state.range(0) << 20;
+    {
+        std::vector<char> v(nSize, 'x');
+        std::ofstream fpOut(szPath, std::ios::out | std::ios::binary);
+        fpOut.write(v.data(), v.size());
+    }
+    for (auto _ : state) {
+        BufferedFileReader reader(szPath);
+        uint8_t *pBuf;
+        uint32_t n;
+        if (!reader.GetBuffer(&pBuf, &n)) {
+            state.SkipWithError("BufferedFileReader failed");
+            break;
+        }
+        benchmark::DoNotOptimize(pBuf);
+    }
+    state.SetBytesProcessed(state.iterations() * nSize);
+    remove(szPath);
+}
+BENCHMARK(BM_BufferedFileReader)->Arg(1)->Arg(16)->Arg(64)->Unit(benchmark::kMicrosecond);
+
+// Enabled records go through the asynchronous logger into a file sink on /dev/null
+static void BM_LogEnabled(benchmark::State &state) {
+    logger = simplelogger::LoggerFactory::CreateAsyncLogger(
+        simplelogger::LoggerFactory::CreateFileLogger("/dev/null"), INFO);
+    int n = 0;
+    for (auto _ : state) {
+        LOG(INFO) << "Frame " << n++ << " encoded";
+    }
+    delete logger;
+    logger = NULL;
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_LogEnabled);
+
+// Records below the logger level are rejected at run time
+static void BM_LogFiltered(benchmark::State &state) {
+    logger = simplelogger::LoggerFactory::CreateFileLogger("/dev/null", ERROR);
+    int n = 0;
+    for (auto _ : state) {
+        LOG(TRACE) << "Frame " << n++ << " encoded";
+    }
+    delete logger;
+    logger = NULL;
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_LogFiltered);
+
+// SetInitParams() dumps the resulting config at INFO, so the logger is raised to keep that out of the timing
+static void BM_NvEncoderInitParam(benchmark::State &state) {
+    logger = simplelogger::LoggerFactory::CreateConsoleLogger(ERROR);
+    const char *szParam = "-codec h264 -preset ll_hq -profile high -rc cbr_ll_hq -fps 30 -bitrate 8M -vbvbufsize 300k -gop 60 -qmin 10 -qmax 40 -aq 8";
+    for (auto _ : state) {
+        NvEncoderInitParam param(szParam);
+        NV_ENC_CONFIG config = { NV_ENC_CONFIG_VER };
+        NV_ENC_INITIALIZE_PARAMS params = { NV_ENC_INITIALIZE_PARAMS_VER };
+        params.encodeConfig = &config;
+        params.encodeGUID = param.GetEncodeGUID();
+        params.presetGUID = param.GetPresetGUID();
+        config.encodeCodecConfig.h264Config.chromaFormatIDC = 1;
+        param.SetInitParams(&params, NV_ENC_BUFFER_FORMAT_NV12);
+        benchmark::DoNotOptimize(config.rcParams.averageBitRate);
+    }
+    delete logger;
+    logger = NULL;
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_NvEncoderInitParam);
+
+static void BM_Bgra32ToNv12(benchmark::State &state) {
+    int nWidth = (int)state.range(0), nHeight = (int)state.range(1);
+    std::vector<uint8_t> vBgra(nWidth * nHeight * 4, 0x5A), vNv12(nWidth * nHeight * 3 / 2);
+    for (auto _ : state) {
+        Bgra32ToNv12(vBgra.data(), nWidth * 4, vNv12.data(), nWidth, nWidth, nHeight);
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * vBgra.size());
+}
+BENCHMARK(BM_Bgra32ToNv12)->Apply(FrameSizes)->Unit(benchmark::kMicrosecond);
+
+// Downscale to half size in each direction, e.g. for a preview stream
+static void BM_ResizeNv12(benchmark::State &state) {
+    int nWidth = (int)state.range(0), nHeight = (int)state.range(1);
+    std::vector<uint8_t> vSrc(nWidth * nHeight * 3 / 2, 0x80), vDst(nWidth * nHeight * 3 / 8);
+    for (auto _ : state) {
+        ResizeNv12Cpu(vDst.data(), nWidth / 2, nWidth / 2, nHeight / 2, vSrc.data(), nWidth, nWidth, nHeight);
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * vSrc.size());
+}
+BENCHMARK(BM_ResizeNv12)->Apply(FrameSizes)->Unit(benchmark::kMicrosecond);
+
+static void FrameSizesScalarSimd(benchmark::internal::Benchmark *b) {
+    for (auto &r : aaResolution) {
+        b->Args({ r[0], r[1], 0 });
+        b->Args({ r[0], r[1], 1 });
+    }
+}
+
+// A typing-sized change plus a scrolled window; the last argument selects the SSE2 path
+static void BM_QpMapBuild(benchmark::State &state) {
+    int nWidth = (int)state.range(0), nHeight = (int)state.range(1);
+    QpMapOptions options;
+    options.bSimd = state.range(2) != 0;
+    QpMapBuilder builder(nWidth, nHeight, options);
+    ScreenRect aDirty[] = { { 100, 200, 180, 220 }, { nWidth / 2, 0, nWidth, nHeight / 16 } };
+    ScreenMoveRect move = { 0, 16, { 0, nHeight / 4, nWidth / 2, nHeight } };
+    FrameChanges changes;
+    changes.pDirtyRect = aDirty;
+    changes.nDirtyRects = 2;
+    changes.pMoveRect = &move;
+    changes.nMoveRects = 1;
+    changes.bFullFrame = false;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(builder.Build(changes));
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * builder.GetMapSize());
+}
+BENCHMARK(BM_QpMapBuild)->Apply(FrameSizesScalarSimd)->Unit(benchmark::kMicrosecond);
+
+// A scrolled window over most of the screen with the newly exposed strip redrawn
+static void BM_MotionHintBuild(benchmark::State &state) {
+    int nWidth = (int)state.range(0), nHeight = (int)state.range(1);
+    MotionHintBuilder builder(nWidth, nHeight);
+    ScreenMoveRect move = { 0, 32, { 0, 0, nWidth * 3 / 4, nHeight - 32 } };
+    ScreenRect dirty = { 0, nHeight - 32, nWidth * 3 / 4, nHeight };
+    FrameChanges changes;
+    changes.pDirtyRect = &dirty;
+    changes.nDirtyRects = 1;
+    changes.pMoveRect = &move;
+    changes.nMoveRects = 1;
+    changes.bFullFrame = false;
+    NV_ENC_PIC_PARAMS picParams = { NV_ENC_PIC_PARAMS_VER };
+    for (auto _ : state) {
+        builder.Build(changes, &picParams);
+        benchmark::DoNotOptimize(picParams.meExternalHints);
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * builder.GetHintCount());
+}
+BENCHMARK(BM_MotionHintBuild)->Apply(FrameSizes)->Unit(benchmark::kMicrosecond);
+
+// Textured luma moved by (5, -3) pels; "correct" is the share of macroblocks that find it
+static void BM_MotionEstimateCpu(benchmark::State &state) {
+    int nWidth = (int)state.range(0), nHeight = (int)state.range(1);
+    MotionEstimatorOptions options;
+    options.nSimd = (int)state.range(2);
+    options.nThreads = (int)state.range(3);
+    std::vector<uint8_t> vRef((size_t)nWidth * nHeight), vCur(vRef.size());
+    uint32_t nRandom = 1;
+    for (int y = 0; y < nHeight; y++) {
+        for (int x = 0; x < nWidth; x++) {
+            nRandom = nRandom * 1664525 + 1013904223;
+            vRef[(size_t)y * nWidth + x] = (uint8_t)(128 + 60 * sin(x * 0.05) * cos(y * 0.07) + (nRandom >> 26));
+        }
+    }
+    for (int y = 0; y < nHeight; y++) {
+        for (int x = 0; x < nWidth; x++) {
+            int xRef = std::min(std::max(x + 5, 0), nWidth - 1), yRef = std::min(std::max(y - 3, 0), nHeight - 1);
+            vCur[(size_t)y * nWidth + x] = vRef[(size_t)yRef * nWidth + xRef];
+        }
+    }
+    MotionEstimatorCpu estimator(nWidth, nHeight, options);
+    std::vector<NV_ENC_H264_MV_DATA> vMvData(estimator.GetMbCount());
+    for (auto _ : state) {
+        estimator.Estimate(vCur.data(), nWidth, vRef.data(), nWidth, vMvData.data());
+        benchmark::ClobberMemory();
+    }
+    size_t nCorrect = 0;
+    for (auto &mvData : vMvData) {
+        nCorrect += mvData.mv[0].mvx == 20 && mvData.mv[0].mvy == -12;
+    }
+    state.counters["correct"] = (double)nCorrect / vMvData.size();
+    state.SetItemsProcessed(state.iterations() * vMvData.size());
+}
+static void MotionEstimateArgs(benchmark::internal::Benchmark *b) {
+    for (auto &r : aaResolution) {
+        for (int nSimd = 0; nSimd <= 2; nSimd++) {
+            b->Args({ r[0], r[1], nSimd, 1 });
+        }
+        b->Args({ r[0], r[1], 2, 4 });
+    }
+}
+BENCHMARK(BM_MotionEstimateCpu)->Apply(MotionEstimateArgs)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Annex-B stream of slices with random (CABAC-like) payloads and emulation prevention,
+// a start code every nNalBytes; larger than the caches, so the scan runs from memory
+static const std::vector<uint8_t> &GetAnnexBStream(size_t nNalBytes) {
+    static std::map<size_t, std::vector<uint8_t>> mStream;
+    std::vector<uint8_t> &v = mStream[nNalBytes];
+    if (v.empty()) {
+        size_t nSize = (size_t)256 << 20;
+        v.reserve(nSize + nNalBytes + 16);
+        uint32_t nRandom = 1;
+        while (v.size() < nSize) {
+            v.insert(v.end(), { 0, 0, 0, 1, 0x41 });
+            int nZeros = 0;
+            for (size_t i = 0; i < nNalBytes; i++) {
+                nRandom = nRandom * 1664525 + 1013904223;
+                uint8_t b = (uint8_t)(nRandom >> 24);
+                if (nZeros >= 2 && b <= 3) {
+                    v.push_back(3);
+                    nZeros = 0;
+                }
+                nZeros = b ? 0 : nZeros + 1;
+                v.push_back(b);
+            }
+            if (!v.back()) {
+                v.push_back(0x80);
+            }
+        }
+    }
+    return v;
+}
+
+// Finds every start code of the stream; range(0) selects scalar, SSE2 or AVX2
+static void BM_FindStartCode(benchmark::State &state) {
+    const std::vector<uint8_t> &v = GetAnnexBStream((size_t)state.range(1));
+    const uint8_t *pEnd = v.data() + v.size();
+    if (state.range(0) == 2 && !CpuHasAvx2()) {
+        state.SkipWithError("no AVX2");
+        return;
+    }
+    size_t nStartCodes = 0;
+    for (auto _ : state) {
+        nStartCodes = 0;
+        for (const uint8_t *p = v.data(); ; p += 3, nStartCodes++) {
+            switch (state.range(0)) {
+            case 0: p = FindStartCodeScalar(p, pEnd); break;
+            case 1: p = FindStartCodeSse2(p, pEnd); break;
+            default: p = FindStartCodeAvx2(p, pEnd); break;
+            }
+            if (p == pEnd) {
+                break;
+            }
+        }
+        benchmark::DoNotOptimize(nStartCodes);
+    }
+    state.counters["start_codes"] = (double)nStartCodes;
+    state.SetBytesProcessed(state.iterations() * v.size());
+}
+BENCHMARK(BM_FindStartCode)->ArgsProduct({ { 0, 1, 2 }, { 1000, 100000 } })->Unit(benchmark::kMillisecond);
+
+// Key frame, parameter sets and slice type of every 100 KB access unit of the stream
+static void BM_DescribePacket(benchmark::State &state) {
+    const std::vector<uint8_t> &v = GetAnnexBStream(100000);
+    size_t nPacketBytes = 100000;
+    size_t nKeyFrames = 0;
+    for (auto _ : state) {
+        for (size_t i = 0; i + nPacketBytes <= v.size(); i += nPacketBytes) {
+            NalPacketInfo info;
+            DescribePacket(v.data() + i, nPacketBytes, NAL_CODEC_H264, &info);
+            nKeyFrames += info.bKeyFrame;
+        }
+        benchmark::DoNotOptimize(nKeyFrames);
+    }
+    state.SetBytesProcessed(state.iterations() * v.size());
+}
+BENCHMARK(BM_DescribePacket)->Unit(benchmark::kMillisecond);
+
+// One hour at 30 fps with an IDR every 2 seconds, written with its seek index once
+static const char *GetIndexedRecording() {
+    static const char *szPath = NULL;
+    if (szPath) {
+        return szPath;
+    }
+    szPath = "micro_bench.h264";
+    std::ofstream fpOut(szPath, std::ios::out | std::ios::binary);
+    SeekIndexWriter index(GetSeekIndexPath(szPath));
+    std::vector<uint8_t> vIdr = { 0, 0, 0, 1, 0x67, 0x42, 0, 0, 0, 1, 0x68, 0xce, 0, 0, 0, 1, 0x65 }, vP = { 0, 0, 0, 1, 0x41 };
+    vIdr.resize(4000, 0x55);
+    vP.resize(400, 0x55);
+    for (int i = 0; i < 3600 * 30; i++) {
+        const std::vector<uint8_t> &v = i % 60 ? vP : vIdr;
+        fpOut.write((const char *)v.data(), v.size());
+        index.Append(v.data(), v.size(), (int64_t)i * 1000000 / 30);
+    }
+    atexit([]() {
+        remove("micro_bench.h264");
+        remove(GetSeekIndexPath("micro_bench.h264").c_str());
+    });
+    return szPath;
+}
+
+class NullStreamBuf : public std::streambuf {
+protected:
+    std::streamsize xsputn(const char *, std::streamsize n) { return n; }
+    int overflow(int c) { return c; }
+};
+
+// A 10 second clip at range(0) percent of the recording: with the index, or by scanning
+// the recording from its start as a tool without one has to
+static void BM_SeekIndexExtract(benchmark::State &state) {
+    const char *szPath = GetIndexedRecording();
+    int64_t nStartUs = (int64_t)state.range(0) * 3590 * 10000, nEndUs = nStartUs + 10000000;
+    NullStreamBuf buf;
+    std::ostream out(&buf);
+    uint64_t nBytes = 0;
+    for (auto _ : state) {
+        RecordingReader reader(szPath);
+        if (state.range(1)) {
+            nBytes += reader.ExtractRange(nStartUs, nEndUs, out);
+            continue;
+        }
+        uint64_t iBegin = 0, iEnd = 0;
+        if (!reader.FindRange(nStartUs, nEndUs, &iBegin, &iEnd)) {
+            state.SkipWithError("Range not found");
+            break;
+        }
+        SeekIndexEntry last = reader.GetEntry(iEnd - 1);
+        std::ifstream fpIn(szPath, std::ios::in | std::ios::binary);
+        std::vector<uint8_t> vBuf(1 << 20);
+        int nStartCodes = 0;
+        for (uint64_t nLeft = last.nOffset + last.nSize; nLeft; ) {
+            size_t n = (size_t)std::min<uint64_t>(nLeft, vBuf.size());
+            fpIn.read((char *)vBuf.data(), n);
+            for (const uint8_t *p = FindStartCode(vBuf.data(), vBuf.data() + n); p < vBuf.data() + n; p = FindStartCode(p + 3, vBuf.data() + n)) {
+                nStartCodes++;
+            }
+            nLeft -= n;
+            nBytes += n;
+        }
+        benchmark::DoNotOptimize(nStartCodes);
+    }
+    state.SetBytesProcessed(nBytes);
+}
+BENCHMARK(BM_SeekIndexExtract)->ArgsProduct({ { 0, 50, 100 }, { 0, 1 } })->Unit(benchmark::kMicrosecond);
+
+// NV12 source against a noisy I420 decode of it, as Verify -ref compares them; items are frames
+static void BM_QualityMetrics(benchmark::State &state) {
+    int nWidth = (int)state.range(0), nHeight = (int)state.range(1);
+    QualityOptions options;
+    options.nSimd = (int)state.range(2);
+    options.nThreads = (int)state.range(3);
+    int nChromaWidth = (nWidth + 1) / 2, nChromaHeight = (nHeight + 1) / 2;
+    size_t nLuma = (size_t)nWidth * nHeight, nChroma = (size_t)nChromaWidth * nChromaHeight;
+    std::vector<uint8_t> vNv12(nLuma + 2 * nChroma), vI420(vNv12.size());
+    uint32_t nRandom = 1;
+    for (int y = 0; y < nHeight; y++) {
+        for (int x = 0; x < nWidth; x++) {
+            nRandom = nRandom * 1664525 + 1013904223;
+            vNv12[(size_t)y * nWidth + x] = (uint8_t)(128 + 60 * sin(x * 0.05) * cos(y * 0.07));
+            vI420[(size_t)y * nWidth + x] = (uint8_t)(vNv12[(size_t)y * nWidth + x] + (nRandom >> 29) - 4);
+        }
+    }
+    for (size_t i = 0; i < nChroma; i++) {
+        vNv12[nLuma + 2 * i] = vI420[nLuma + i] = (uint8_t)(i * 7);
+        vNv12[nLuma + 2 * i + 1] = vI420[nLuma + nChroma + i] = (uint8_t)(i * 13 + 1);
+    }
+    YuvFrame ref = YuvFrame::FromNv12(vNv12.data(), nWidth, nWidth, nHeight), test = YuvFrame::FromI420(vI420.data(), nWidth, nHeight);
+    QualityEvaluator evaluator(options);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(evaluator.Add(ref, test));
+    }
+    state.counters["psnr"] = evaluator.GetStats().GetGlobalPsnr();
+    state.counters["ssim"] = evaluator.GetStats().GetAverageSsim();
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * vNv12.size() * 2);
+}
+static void QualityMetricsArgs(benchmark::internal::Benchmark *b) {
+    for (auto &r : aaResolution) {
+        for (int nSimd = 0; nSimd <= 2; nSimd++) {
+            b->Args({ r[0], r[1], nSimd, 1 });
+        }
+        b->Args({ r[0], r[1], 2, 4 });
+    }
+}
+BENCHMARK(BM_QualityMetrics)->Apply(QualityMetricsArgs)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,444 @@
+/**
+*  nvenc_bench: drives NvEncoder against the fake NVENC driver (libnvenc_fake.so) over a
+*  matrix of output delays, B frame counts and modelled encode times, and prints one JSON
+*  object per configuration: throughput, EncodeFrame() call times, submit-to-packet latency
+*  and what the fake driver saw (frames in flight, lock waits, buffers). With -fail an API
+*  call is made to fail, to check that the error surfaces as an NVENCException and the
+*  session is torn down cleanly. The FAKE_NVENC_* environment of the fake driver is kept
+*  (FAKE_NVENC_FAIL injects errors as well); -encodeus, -engines, -callus and -fail replace it.
+*
+*  With -adapt the frames come from the synthetic desktop of recorder_bench and RateController
+*  adapts the bitrate to its dirty rects and to a sink draining -sinkmbps. Time is simulated
+*  (frame i is captured at i / fps), so the sink backlog does not depend on the machine.
+*  -roi 1 also attaches the QP delta map QpMapBuilder makes of the same rects to every frame,
+*  -mehints 1 the external ME hints MotionHintBuilder makes of the move rects.
+*/
+
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include "NvEncoderHost.h"
+#include "FakeNvEncodeAPI.h"
+#include "BenchPipeline.h"
+#include "../Utils/Logger.h"
+#include "../Utils/RateController.h"
+#include "../Utils/QpMapBuilder.h"
+#include "../Utils/MotionHintBuilder.h"
+
+simplelogger::Logger *logger = simplelogger::LoggerFactory::CreateConsoleLogger();
+
+struct BenchOptions {
+    std::string strLibrary = "./libnvenc_fake.so";
+    std::vector<std::pair<int, int>> vResolution = {{1920, 1080}};
+    std::vector<int> vDelay = {3};
+    std::vector<int> vBFrames = {0};
+    std::vector<int> vEncodeUs = {2000};
+    int nFrames = 300;
+    int nEngines = 1;
+    int nCallUs = 0;
+    int nFps = 60;
+    int nGop = 60;
+    bool bCopy = false;
+    std::string strFail;
+    std::vector<int> vAdapt;
+    std::vector<int> vRoi = {0};
+    std::vector<int> vMeHints = {0};
+    std::vector<std::string> vPattern = {"static"};
+    int nBitrateKbps = 8000;
+    int nMinBitrateKbps = 500;
+    int nAdaptMs = 1000;
+    double dSinkMbps = 0;
+};
+
+struct FakeDriver {
+    FakeNvEncConfigure_Type Configure;
+    FakeNvEncGetStats_Type GetStats;
+    FakeNvEncResetStats_Type ResetStats;
+};
+
+static void ShowHelpAndExit(const char *szBadOption = NULL) {
+    std::ostringstream oss;
+    if (szBadOption) {
+        oss << "Error parsing \"" << szBadOption << "\"" << std::endl;
+    }
+    oss << "Options:" << std::endl
+        << "-lib         Fake driver library (default ./libnvenc_fake.so)" << std::endl
+        << "-res         Comma separated resolutions, e.g. 1280x720,1920x1080" << std::endl
+        << "-frames      Frames per configuration" << std::endl
+        << "-delay       Comma separated extra output delays of NvEncoder" << std::endl
+        << "-bframes     Comma separated B frame counts" << std::endl
+        << "-encodeus    Comma separated engine times per frame in microseconds" << std::endl
+        << "-engines     Frames the fake encodes at the same time" << std::endl
+        << "-callus      CPU time of every API call in microseconds" << std::endl
+        << "-fps         Frame rate of the session (sizes the frames with the bitrate)" << std::endl
+        << "-gop         GOP length" << std::endl
+        << "-fail        call:at[:count[:status]], e.g. lock:100 or map:50:3:8" << std::endl
+        << "-copy        (No value) Write every input frame, like a capture would" << std::endl
+        << "-adapt       Comma separated 0 (fixed bitrate) | 1 (RateController): runs the rate adaptation benchmark" << std::endl
+        << "-pattern     Comma separated synthetic content for -adapt: static | scroll | burst | noise" << std::endl
+        << "-bitrate     Initial and maximum bitrate in kbps for -adapt" << std::endl
+        << "-minbitrate  Minimum bitrate in kbps for -adapt" << std::endl
+        << "-adaptms     Least time between two bitrate changes for -adapt" << std::endl
+        << "-sinkmbps    Rate the simulated sink drains for -adapt; 0 keeps up with anything" << std::endl
+        << "-roi         Comma separated 0 | 1 (QP delta map from the dirty rects) for -adapt" << std::endl
+        << "-mehints     Comma separated 0 | 1 (external ME hints from the move rects) for -adapt" << std::endl;
+    if (szBadOption) {
+        throw std::invalid_argument(oss.str());
+    }
+    std::cout << oss.str();
+    exit(0);
+}
+
+template<typename T>
+static std::vector<T> ParseList(const char *sz, T (*parse)(const std::string &)) {
+    std::vector<T> v;
+    std::istringstream iss(sz);
+    std::string strItem;
+    while (std::getline(iss, strItem, ',')) {
+        v.push_back(parse(strItem));
+    }
+    return v;
+}
+
+static int ParseInt(const std::string &str) {
+    return std::stoi(str);
+}
+
+static std::string ParseString(const std::string &str) {
+    return str;
+}
+
+static std::pair<int, int> ParseResolution(const std::string &str) {
+    int w = 0, h = 0;
+    if (sscanf(str.c_str(), "%dx%d", &w, &h) != 2) {
+        ShowHelpAndExit("-res");
+    }
+    return std::make_pair(w, h);
+}
+
+static void ParseCommandLine(int argc, char **argv, BenchOptions &opt) {
+    for (int i = 1; i < argc; i++) {
+        std::string strArg = argv[i];
+        if (strArg == "-h") {
+            ShowHelpAndExit();
+        }
+        if (strArg == "-copy") {
+            opt.bCopy = true;
+            continue;
+        }
+        if (i + 1 == argc) {
+            ShowHelpAndExit(argv[i]);
+        }
+        const char *szValue = argv[++i];
+        if (strArg == "-lib") opt.strLibrary = szValue;
+        else if (strArg == "-res") opt.vResolution = ParseList(szValue, ParseResolution);
+        else if (strArg == "-frames") opt.nFrames = atoi(szValue);
+        else if (strArg == "-delay") opt.vDelay = ParseList(szValue, ParseInt);
+        else if (strArg == "-bframes") opt.vBFrames = ParseList(szValue, ParseInt);
+        else if (strArg == "-encodeus") opt.vEncodeUs = ParseList(szValue, ParseInt);
+        else if (strArg == "-engines") opt.nEngines = atoi(szValue);
+        else if (strArg == "-callus") opt.nCallUs = atoi(szValue);
+        else if (strArg == "-fps") opt.nFps = atoi(szValue);
+        else if (strArg == "-gop") opt.nGop = atoi(szValue);
+        else if (strArg == "-fail") opt.strFail = szValue;
+        else if (strArg == "-adapt") opt.vAdapt = ParseList(szValue, ParseInt);
+        else if (strArg == "-pattern") opt.vPattern = ParseList(szValue, ParseString);
+        else if (strArg == "-bitrate") opt.nBitrateKbps = atoi(szValue);
+        else if (strArg == "-minbitrate") opt.nMinBitrateKbps = atoi(szValue);
+        else if (strArg == "-adaptms") opt.nAdaptMs = atoi(szValue);
+        else if (strArg == "-sinkmbps") opt.dSinkMbps = atof(szValue);
+        else if (strArg == "-roi") opt.vRoi = ParseList(szValue, ParseInt);
+        else if (strArg == "-mehints") opt.vMeHints = ParseList(szValue, ParseInt);
+        else ShowHelpAndExit(argv[i - 1]);
+    }
+}
+
+static double Percentile(const std::vector<double> &vSorted, double q) {
+    if (vSorted.empty()) {
+        return 0;
+    }
+    return vSorted[(size_t)(q * (vSorted.size() - 1) + 0.5)];
+}
+
+static FakeDriver LoadFakeDriver(const std::string &strLibrary) {
+    // NvEncoder loads the same file through NVENC_LIBRARY_PATH, so both share one instance
+    setenv("NVENC_LIBRARY_PATH", strLibrary.c_str(), 1);
+    void *hModule = dlopen(strLibrary.c_str(), RTLD_NOW);
+    if (!hModule) {
+        throw std::runtime_error("Unable to load " + strLibrary + ": " + dlerror());
+    }
+    FakeDriver driver;
+    driver.Configure = (FakeNvEncConfigure_Type)dlsym(hModule, "FakeNvEncConfigure");
+    driver.GetStats = (FakeNvEncGetStats_Type)dlsym(hModule, "FakeNvEncGetStats");
+    driver.ResetStats = (FakeNvEncResetStats_Type)dlsym(hModule, "FakeNvEncResetStats");
+    if (!driver.Configure || !driver.GetStats || !driver.ResetStats) {
+        throw std::runtime_error(strLibrary + " is not the fake driver");
+    }
+    return driver;
+}
+
+static std::string RunConfig(const BenchOptions &opt, const FakeDriver &driver, int nWidth, int nHeight, int nDelay, int nBFrames, int nEncodeUs) {
+    FakeNvEncConfig config;
+    ReadFakeNvEncEnvironment(&config);
+    config.nEncodeUs = nEncodeUs;
+    config.nEngines = opt.nEngines;
+    config.nCallUs = opt.nCallUs;
+    if (!opt.strFail.empty()) {
+        unsigned long long nAt = 0, nCount = 1;
+        int eStatus = config.eFailStatus;
+        if (sscanf(opt.strFail.c_str(), "%31[^:]:%llu:%llu:%d", config.szFailCall, &nAt, &nCount, &eStatus) < 2) {
+            ShowHelpAndExit("-fail");
+        }
+        config.nFailAt = nAt;
+        config.nFailCount = nCount;
+        config.eFailStatus = eStatus;
+    }
+    driver.Configure(&config);
+    driver.ResetStats();
+
+    std::vector<double> vCallUs, vLatencyMs;
+    std::map<uint64_t, std::chrono::steady_clock::time_point> mSubmitted;
+    uint64_t nPackets = 0, nBytes = 0;
+    int nSubmitted = 0;
+    std::string strError;
+    auto tStart = std::chrono::steady_clock::now();
+    auto Collect = [&](const std::vector<std::vector<uint8_t>> &vPacket, const std::vector<NvEncOutputPacketInfo> &vPacketInfo) {
+        auto tNow = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < vPacket.size(); i++) {
+            nPackets++;
+            nBytes += vPacket[i].size();
+            auto it = mSubmitted.find(vPacketInfo[i].timestamp);
+            if (it != mSubmitted.end()) {
+                vLatencyMs.push_back(std::chrono::duration<double, std::milli>(tNow - it->second).count());
+                mSubmitted.erase(it);
+            }
+        }
+    };
+    try {
+        NvEncoderHost enc(nWidth, nHeight, NV_ENC_BUFFER_FORMAT_NV12, nDelay);
+        NV_ENC_INITIALIZE_PARAMS initializeParams = { NV_ENC_INITIALIZE_PARAMS_VER };
+        NV_ENC_CONFIG encodeConfig = { NV_ENC_CONFIG_VER };
+        initializeParams.encodeConfig = &encodeConfig;
+        enc.CreateDefaultEncoderParams(&initializeParams, NV_ENC_CODEC_H264_GUID, NV_ENC_PRESET_LOW_LATENCY_HQ_GUID);
+        initializeParams.frameRateNum = opt.nFps;
+        initializeParams.frameRateDen = 1;
+        encodeConfig.gopLength = opt.nGop;
+        encodeConfig.frameIntervalP = nBFrames + 1;
+        encodeConfig.encodeCodecConfig.h264Config.idrPeriod = opt.nGop;
+        enc.CreateEncoder(&initializeParams);
+
+        std::vector<std::vector<uint8_t>> vPacket;
+        std::vector<NvEncOutputPacketInfo> vPacketInfo;
+        for (int i = 0; i < opt.nFrames; i++) {
+            const NvEncInputFrame *pInput = enc.GetNextInputFrame();
+            if (opt.bCopy) {
+                memset(pInput->inputPtr, i & 0xFF, (size_t)pInput->pitch * nHeight * 3 / 2);
+            }
+            NV_ENC_PIC_PARAMS picParams = {};
+            picParams.inputTimeStamp = i;
+            auto tCall = std::chrono::steady_clock::now();
+            mSubmitted[i] = tCall;
+            enc.EncodeFrame(vPacket, vPacketInfo, &picParams);
+            nSubmitted++;
+            vCallUs.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - tCall).count());
+            Collect(vPacket, vPacketInfo);
+        }
+        enc.EndEncode(vPacket, vPacketInfo);
+        Collect(vPacket, vPacketInfo);
+        enc.DestroyEncoder();
+    } catch (const NVENCException &ex) {
+        strError = ex.getErrorString();
+        strError.erase(std::remove(strError.begin(), strError.end(), '\n'), strError.end());
+        strError += " (status " + std::to_string(ex.getErrorCode()) + ")";
+    }
+    double tWall = std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+    FakeNvEncStats stats;
+    driver.GetStats(&stats);
+    std::sort(vCallUs.begin(), vCallUs.end());
+    std::sort(vLatencyMs.begin(), vLatencyMs.end());
+
+    std::ostringstream oss;
+    oss << "{\"width\":" << nWidth << ",\"height\":" << nHeight << ",\"extra_delay\":" << nDelay << ",\"bframes\":" << nBFrames
+        << ",\"encode_us\":" << nEncodeUs << ",\"engines\":" << opt.nEngines << ",\"call_us\":" << opt.nCallUs
+        << ",\"frames\":" << nSubmitted << ",\"frames_requested\":" << opt.nFrames << ",\"packets\":" << nPackets
+        << ",\"throughput_fps\":" << nPackets / tWall
+        << ",\"output_mbps\":" << nBytes * 8 / tWall / 1.0e6
+        << ",\"encode_call_us\":{\"p50\":" << Percentile(vCallUs, 0.5) << ",\"p99\":" << Percentile(vCallUs, 0.99)
+        << ",\"max\":" << (vCallUs.empty() ? 0 : vCallUs.back()) << "}"
+        << ",\"latency_ms\":{\"p50\":" << Percentile(vLatencyMs, 0.5) << ",\"p90\":" << Percentile(vLatencyMs, 0.9)
+        << ",\"p99\":" << Percentile(vLatencyMs, 0.99) << ",\"max\":" << (vLatencyMs.empty() ? 0 : vLatencyMs.back()) << "}"
+        << ",\"driver\":{\"calls\":" << stats.nCalls << ",\"frames\":" << stats.nFrames << ",\"need_more_input\":" << stats.nNeedMoreInput
+        << ",\"locks\":" << stats.nLocks << ",\"lock_waits\":" << stats.nLockWaits << ",\"lock_wait_ms\":" << stats.nLockWaitUs / 1000.0
+        << ",\"max_in_flight\":" << stats.nMaxInFlight << ",\"max_mapped\":" << stats.nMaxMapped
+        << ",\"bitstream_buffers\":" << stats.nMaxBitstreamBuffers << ",\"registered\":" << stats.nMaxRegistered
+        << ",\"injected_errors\":" << stats.nInjectedErrors << "}"
+        << ",\"error\":" << (strError.empty() ? "null" : "\"" + strError + "\"")
+        << ",\"wall_seconds\":" << tWall << "}";
+    return oss.str();
+}
+
+/**
+*  @brief Encodes opt.nFrames frames of a synthetic desktop at a fixed bitrate or with
+*  RateController, into a sink that drains opt.dSinkMbps, and reports the output bitrate,
+*  the frame (burst) sizes and the sink backlog.
+*/
+static std::string RunAdaptive(const BenchOptions &opt, const FakeDriver &driver, int nWidth, int nHeight, const std::string &strPattern, bool bAdapt, bool bRoi, bool bMeHints) {
+    FakeNvEncConfig config;
+    ReadFakeNvEncEnvironment(&config);
+    config.nEncodeUs = opt.vEncodeUs[0];
+    config.nEngines = opt.nEngines;
+    config.nSizeJitterPercent = 10;
+    driver.Configure(&config);
+    driver.ResetStats();
+
+    SyntheticFrameSource source(nWidth, nHeight, strPattern);
+    std::vector<uint8_t> vBgra((size_t)nWidth * nHeight * 4);
+    std::vector<double> vFrameKB, vBitrateKbps;
+    double dBacklogBytes = 0, dMaxBacklogBytes = 0;
+    uint64_t nBytes = 0, nReconfigures = 0;
+    double dActivity = 0;
+
+    NvEncoderHost enc(nWidth, nHeight, NV_ENC_BUFFER_FORMAT_NV12, opt.vDelay[0]);
+    NV_ENC_INITIALIZE_PARAMS initializeParams = { NV_ENC_INITIALIZE_PARAMS_VER };
+    NV_ENC_CONFIG encodeConfig = { NV_ENC_CONFIG_VER };
+    initializeParams.encodeConfig = &encodeConfig;
+    enc.CreateDefaultEncoderParams(&initializeParams, NV_ENC_CODEC_H264_GUID, NV_ENC_PRESET_LOW_LATENCY_HQ_GUID);
+    initializeParams.frameRateNum = opt.nFps;
+    initializeParams.frameRateDen = 1;
+    encodeConfig.gopLength = opt.nGop;
+    encodeConfig.frameIntervalP = opt.vBFrames[0] + 1;
+    encodeConfig.encodeCodecConfig.h264Config.idrPeriod = opt.nGop;
+    encodeConfig.rcParams.rateControlMode = NV_ENC_PARAMS_RC_VBR;
+    encodeConfig.rcParams.averageBitRate = opt.nBitrateKbps * 1000;
+    encodeConfig.rcParams.maxBitRate = opt.nBitrateKbps * 2000;
+    encodeConfig.rcParams.vbvBufferSize = opt.nBitrateKbps * 1000 / opt.nFps;
+    if (bRoi) {
+        encodeConfig.rcParams.qpMapMode = NV_ENC_QP_MAP_DELTA;
+    }
+    if (bMeHints) {
+        MotionHintBuilder::SetInitParams(&initializeParams);
+    }
+    enc.CreateEncoder(&initializeParams);
+    QpMapOptions qpMapOptions;
+    qpMapOptions.nPoolSize = enc.GetEncoderBufferCount() + 1;
+    QpMapBuilder qpMapBuilder(nWidth, nHeight, qpMapOptions);
+    MotionHintBuilder motionHintBuilder(nWidth, nHeight, enc.GetEncoderBufferCount() + 1);
+
+    RateControlOptions rateOptions;
+    rateOptions.nMinBitrate = opt.nMinBitrateKbps * 1000;
+    rateOptions.nIntervalMs = opt.nAdaptMs;
+    RateController rateController(rateOptions, encodeConfig.rcParams.averageBitRate);
+
+    std::vector<std::vector<uint8_t>> vPacket;
+    std::vector<NvEncOutputPacketInfo> vPacketInfo;
+    for (int i = 0; i <= opt.nFrames; i++) {
+        int64_t nNowUs = (int64_t)i * 1000000 / opt.nFps;
+        if (i < opt.nFrames) {
+            source.Read(vBgra.data(), nWidth * 4);
+            rateController.OnFrame(GetChangedArea(source.GetChanges(), nWidth, nHeight), (int64_t)nWidth * nHeight);
+            if (bAdapt) {
+                if (rateController.Update(nNowUs, (int64_t)dBacklogBytes)) {
+                    rateController.Reconfigure(&enc);
+                }
+            }
+            enc.GetNextInputFrame();
+            NV_ENC_PIC_PARAMS picParams = {};
+            picParams.inputTimeStamp = i;
+            if (bRoi) {
+                picParams.qpDeltaMap = qpMapBuilder.Build(source.GetChanges());
+                picParams.qpDeltaMapSize = qpMapBuilder.GetMapSize();
+            }
+            if (bMeHints) {
+                motionHintBuilder.Build(source.GetChanges(), &picParams);
+            }
+            enc.EncodeFrame(vPacket, vPacketInfo, &picParams);
+        } else {
+            enc.EndEncode(vPacket, vPacketInfo);
+        }
+        for (auto &v : vPacket) {
+            nBytes += v.size();
+            dBacklogBytes += v.size();
+            vFrameKB.push_back(v.size() / 1024.0);
+            rateController.OnPacket(v.size());
+        }
+        // the sink writes at its rate for one frame interval
+        if (opt.dSinkMbps > 0) {
+            dBacklogBytes = std::max(0.0, dBacklogBytes - opt.dSinkMbps * 1.0e6 / 8 / opt.nFps);
+        } else {
+            dBacklogBytes = 0;
+        }
+        dMaxBacklogBytes = std::max(dMaxBacklogBytes, dBacklogBytes);
+        vBitrateKbps.push_back(rateController.GetBitrate() / 1000.0);
+    }
+    nReconfigures = rateController.GetReconfigureCount();
+    dActivity = rateController.GetActivity();
+    enc.DestroyEncoder();
+    FakeNvEncStats stats;
+    driver.GetStats(&stats);
+
+    double dSeconds = (double)opt.nFrames / opt.nFps;
+    std::sort(vFrameKB.begin(), vFrameKB.end());
+    std::ostringstream oss;
+    oss << "{\"width\":" << nWidth << ",\"height\":" << nHeight << ",\"pattern\":\"" << strPattern << "\",\"adapt\":" << (bAdapt ? "true" : "false")
+        << ",\"roi\":" << (bRoi ? "true" : "false") << ",\"qp_map_frames\":" << stats.nQpMapFrames
+        << ",\"mehints\":" << (bMeHints ? "true" : "false") << ",\"me_hint_frames\":" << stats.nMeHintFrames
+        << ",\"frames\":" << opt.nFrames << ",\"fps\":" << opt.nFps << ",\"sink_mbps\":" << opt.dSinkMbps
+        << ",\"output_mbps\":" << nBytes * 8 / dSeconds / 1.0e6
+        << ",\"frame_kb\":{\"p50\":" << Percentile(vFrameKB, 0.5) << ",\"p99\":" << Percentile(vFrameKB, 0.99)
+        << ",\"max\":" << (vFrameKB.empty() ? 0 : vFrameKB.back()) << "}"
+        << ",\"bitrate_kbps\":{\"min\":" << *std::min_element(vBitrateKbps.begin(), vBitrateKbps.end())
+        << ",\"final\":" << vBitrateKbps.back() << "}"
+        << ",\"reconfigures\":" << nReconfigures << ",\"activity\":" << dActivity
+        << ",\"backlog_kb\":{\"max\":" << dMaxBacklogBytes / 1024 << ",\"final\":" << dBacklogBytes / 1024 << "}}";
+    return oss.str();
+}
+
+int main(int argc, char **argv) {
+    try {
+        BenchOptions opt;
+        ParseCommandLine(argc, argv, opt);
+        FakeDriver driver = LoadFakeDriver(opt.strLibrary);
+        std::cout << "[" << std::endl;
+        bool bFirst = true;
+        if (!opt.vAdapt.empty()) {
+            for (auto &res : opt.vResolution) {
+                for (auto &strPattern : opt.vPattern) {
+                    for (int nAdapt : opt.vAdapt) {
+                        for (int nRoi : opt.vRoi) {
+                            for (int nMeHints : opt.vMeHints) {
+                                std::cout << (bFirst ? "  " : ", ") << RunAdaptive(opt, driver, res.first, res.second, strPattern, nAdapt != 0, nRoi != 0, nMeHints != 0) << std::endl;
+                                bFirst = false;
+                            }
+                        }
+                    }
+                }
+            }
+            std::cout << "]" << std::endl;
+            return 0;
+        }
+        for (auto &res : opt.vResolution) {
+            for (int nDelay : opt.vDelay) {
+                for (int nBFrames : opt.vBFrames) {
+                    for (int nEncodeUs : opt.vEncodeUs) {
+                        std::string strResult = RunConfig(opt, driver, res.first, res.second, nDelay, nBFrames, nEncodeUs);
+                        std::cout << (bFirst ? "  " : ", ") << strResult << std::endl;
+                        bFirst = false;
+                    }
+                }
+            }
+        }
+        std::cout << "]" << std::endl;
+    } catch (const std::exception &ex) {
+        std::cout << ex.what();
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdlib.h>
+#include <vector>
+#include "NvEncoder/NvEncoder.h"
+
+/**
+*  @brief Encoder whose input frames are plain host memory, to drive NvEncoder against the
+*  fake driver (FakeNvEncodeAPI.cpp): the buffers are registered as CUDA device pointers, which
+*  the fake accepts without looking at them. A real driver rejects them.
+*/
+class NvEncoderHost : public NvEncoder
+{
+public:
+    NvEncoderHost(uint32_t nWidth, uint32_t nHeight, NV_ENC_BUFFER_FORMAT eBufferFormat,
+        uint32_t nExtraOutputDelay = 3, bool bMotionEstimationOnly = false)
+        : NvEncoder(NV_ENC_DEVICE_TYPE_CUDA, &nDummyDevice, nWidth, nHeight, eBufferFormat, nExtraOutputDelay, bMotionEstimationOnly)
+    {
+    }
+
+    virtual ~NvEncoderHost()
+    {
+        ReleaseHostBuffers();
+    }
+
+private:
+    virtual void AllocateInputBuffers(int32_t numInputBuffers) override
+    {
+        if (!IsHWEncoderInitialized())
+        {
+            NVENC_THROW_ERROR("Encoder intialization failed", NV_ENC_ERR_ENCODER_NOT_INITIALIZED);
+        }
+
+        uint32_t nPitch = GetWidthInBytes(GetPixelFormat(), GetMaxEncodeWidth());
+        uint32_t nChromaHeight = GetNumChromaPlanes(GetPixelFormat()) * GetChromaHeight(GetPixelFormat(), GetMaxEncodeHeight());
+        int numCount = m_bMotionEstimationOnly ? 2 : 1;
+        for (int count = 0; count < numCount; count++)
+        {
+            std::vector<void*> inputFrames;
+            for (int i = 0; i < numInputBuffers; i++)
+            {
+                inputFrames.push_back(calloc(1, (size_t)nPitch * (GetMaxEncodeHeight() + nChromaHeight)));
+            }
+            RegisterResources(inputFrames, NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR,
+                GetMaxEncodeWidth(), GetMaxEncodeHeight(), (int)nPitch, GetPixelFormat(), count == 1);
+        }
+    }
+
+    virtual void ReleaseInputBuffers() override
+    {
+        ReleaseHostBuffers();
+    }
+
+    void ReleaseHostBuffers()
+    {
+        if (!m_hEncoder)
+        {
+            return;
+        }
+
+        UnregisterResources();
+        for (uint32_t i = 0; i < m_vInputFrames.size(); ++i)
+        {
+            free(m_vInputFrames[i].inputPtr);
+        }
+        m_vInputFrames.clear();
+        for (uint32_t i = 0; i < m_vReferenceFrames.size(); ++i)
+        {
+            free(m_vReferenceFrames[i].inputPtr);
+        }
+        m_vReferenceFrames.clear();
+    }
+
+    int nDummyDevice = 0;
+};
@@ -0,0 +1,417 @@
+/**
+*  recorder_bench: runs the capture -> convert -> encode -> write pipeline headless
+*  over a matrix of resolutions, frame rates, queue depths and converter thread
+*  counts and prints one JSON object per configuration, so runs of different
+*  releases can be diffed for regressions.
+*/
+
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <new>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include "BenchPipeline.h"
+#include "../Queue.h"
+
+simplelogger::Logger *logger = simplelogger::LoggerFactory::CreateConsoleLogger();
+
+// Every heap allocation of the process is counted to report allocations per frame
+static std::atomic<uint64_t> nAllocations(0);
+
+void *operator new(size_t n) {
+    nAllocations.fetch_add(1, std::memory_order_relaxed);
+    void *p = malloc(n ? n : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+void operator delete(void *p) noexcept {
+    free(p);
+}
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+struct BenchOptions {
+    std::vector<std::pair<int, int>> vResolution = {{1920, 1080}};
+    std::vector<int> vFps = {30};
+    std::vector<int> vQueueDepth = {4};
+    std::vector<int> vThreads = {1};
+    int nFrames = 300;
+    int nGop = 60;
+    int nSegmentSec = 2;
+    int nRtpPort = 5004;
+    int nRtpPaceMbps = 100;
+    int nReplaySec = 5;
+    int nReplayPort = 0;
+    int nRecordings = 0;
+    bool bCold = false;
+    std::string strSource = "synthetic";
+    std::string strPattern = "static";
+    std::string strInput;
+    std::string strConverter = "bt601";
+    std::string strEncoder = "sw";
+    std::string strSink = "null";
+    std::string strOutput = "recorder_bench.h264";
+};
+
+struct BenchConfig {
+    int nWidth, nHeight, nFps, nQueueDepth, nThreads;
+};
+
+struct BenchFrame {
+    std::vector<uint8_t> vBgra;
+    std::chrono::steady_clock::time_point tCapture;
+};
+
+struct BenchPacket {
+    std::vector<uint8_t> vData;
+    std::chrono::steady_clock::time_point tCapture;
+};
+
+static void ShowHelpAndExit(const char *szBadOption = NULL) {
+    std::ostringstream oss;
+    if (szBadOption) {
+        oss << "Error parsing \"" << szBadOption << "\"" << std::endl;
+    }
+    oss << "Options:" << std::endl
+        << "-res         Comma separated resolutions, e.g. 1280x720,1920x1080" << std::endl
+        << "-fps         Comma separated capture rates; 0 runs unpaced" << std::endl
+        << "-queue       Comma separated capture queue depths" << std::endl
+        << "-threads     Comma separated converter thread counts" << std::endl
+        << "-frames      Frames per configuration" << std::endl
+        << "-gop         IDR interval of the software encoder" << std::endl
+        << "-source      synthetic | replay" << std::endl
+        << "-pattern     Synthetic content: static | scroll | burst | noise" << std::endl
+        << "-i           Raw BGRA input file for -source replay" << std::endl
+        << "-converter   bt601 | bt709" << std::endl
+        << "-encoder     sw | null" << std::endl
+        << "-sink        null | file | uring | mp4 | fmp4 | seg | rtp | fanout (file + rtp) | replay" << std::endl
+        << "-segdur      Segment length in seconds for -sink seg" << std::endl
+        << "-rtpport     Loopback UDP port for -sink rtp and fanout" << std::endl
+        << "-rtppace     RTP pacing rate in Mbps for -sink rtp and fanout; 0 disables pacing" << std::endl
+        << "-replay      Seconds kept by -sink replay, which dumps them to <output>_replay_NNNN at the end" << std::endl
+        << "-replayport  Also accept \"dump [seconds]\" requests on 127.0.0.1:<port> for -sink replay" << std::endl
+        << "-recordings  Run N recordings of -frames frames through the recorder service (sink null | file | mp4)" << std::endl
+        << "-cold        (No value) With -recordings, initialize a new pipeline for every recording" << std::endl
+        << "-o           Output file for the file, uring, (f)mp4, seg, fanout and replay sinks" << std::endl;
+    if (szBadOption) {
+        throw std::invalid_argument(oss.str());
+    }
+    std::cout << oss.str();
+    exit(0);
+}
+
+template<typename T>
+static std::vector<T> ParseList(const char *sz, T (*parse)(const std::string &)) {
+    std::vector<T> v;
+    std::istringstream iss(sz);
+    std::string strItem;
+    while (std::getline(iss, strItem, ',')) {
+        v.push_back(parse(strItem));
+    }
+    return v;
+}
+
+static int ParseInt(const std::string &str) {
+    return std::stoi(str);
+}
+
+static std::pair<int, int> ParseResolution(const std::string &str) {
+    int w = 0, h = 0;
+    if (sscanf(str.c_str(), "%dx%d", &w, &h) != 2) {
+        ShowHelpAndExit("-res");
+    }
+    return std::make_pair(w, h);
+}
+
+static void ParseCommandLine(int argc, char **argv, BenchOptions &opt) {
+    for (int i = 1; i < argc; i++) {
+        std::string strArg = argv[i];
+        if (strArg == "-h") {
+            ShowHelpAndExit();
+        }
+        if (strArg == "-cold") {
+            opt.bCold = true;
+            continue;
+        }
+        if (i + 1 == argc) {
+            ShowHelpAndExit(argv[i]);
+        }
+        const char *szValue = argv[++i];
+        if (strArg == "-res") opt.vResolution = ParseList(szValue, ParseResolution);
+        else if (strArg == "-fps") opt.vFps = ParseList(szValue, ParseInt);
+        else if (strArg == "-queue") opt.vQueueDepth = ParseList(szValue, ParseInt);
+        else if (strArg == "-threads") opt.vThreads = ParseList(szValue, ParseInt);
+        else if (strArg == "-frames") opt.nFrames = atoi(szValue);
+        else if (strArg == "-gop") opt.nGop = atoi(szValue);
+        else if (strArg == "-segdur") opt.nSegmentSec = atoi(szValue);
+        else if (strArg == "-rtpport") opt.nRtpPort = atoi(szValue);
+        else if (strArg == "-rtppace") opt.nRtpPaceMbps = atoi(szValue);
+        else if (strArg == "-replay") opt.nReplaySec = atoi(szValue);
+        else if (strArg == "-replayport") opt.nReplayPort = atoi(szValue);
+        else if (strArg == "-recordings") opt.nRecordings = atoi(szValue);
+        else if (strArg == "-source") opt.strSource = szValue;
+        else if (strArg == "-pattern") opt.strPattern = szValue;
+        else if (strArg == "-i") opt.strInput = szValue;
+        else if (strArg == "-converter") opt.strConverter = szValue;
+        else if (strArg == "-encoder") opt.strEncoder = szValue;
+        else if (strArg == "-sink") opt.strSink = szValue;
+        else if (strArg == "-o") opt.strOutput = szValue;
+        else ShowHelpAndExit(argv[i - 1]);
+    }
+}
+
+static double CpuSeconds() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1.0e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1.0e6;
+}
+
+static double Percentile(const std::vector<double> &vSorted, double q) {
+    if (vSorted.empty()) {
+        return 0;
+    }
+    return vSorted[(size_t)(q * (vSorted.size() - 1) + 0.5)];
+}
+
+static std::string RunConfig(const BenchOptions &opt, const BenchConfig &cfg) {
+    std::unique_ptr<BenchFrameSource> pSource;
+    if (opt.strSource == "synthetic") {
+        pSource.reset(new SyntheticFrameSource(cfg.nWidth, cfg.nHeight, opt.strPattern));
+    } else if (opt.strSource == "replay") {
+        pSource.reset(new FileReplaySource(opt.strInput, cfg.nWidth, cfg.nHeight));
+    } else {
+        throw std::invalid_argument("Unknown source: " + opt.strSource);
+    }
+    BenchConverter converter(opt.strConverter, cfg.nThreads);
+    std::unique_ptr<BenchEncoder> pEncoder;
+    if (opt.strEncoder == "sw") {
+        pEncoder.reset(new SoftwareBenchEncoder(cfg.nWidth, cfg.nHeight, opt.nGop));
+    } else if (opt.strEncoder == "null") {
+        pEncoder.reset(new NullBenchEncoder());
+    } else {
+        throw std::invalid_argument("Unknown encoder: " + opt.strEncoder);
+    }
+    std::unique_ptr<BenchSink> pSink;
+    if (opt.strSink == "null") {
+        pSink.reset(new NullBenchSink());
+    } else if (opt.strSink == "file") {
+        pSink.reset(new FileBenchSink(opt.strOutput));
+    } else if (opt.strSink == "mp4") {
+        pSink.reset(new Mp4BenchSink(opt.strOutput, cfg.nWidth, cfg.nHeight));
+    } else if (opt.strSink == "fmp4") {
+        Mp4WriterOptions mp4Options;
+        mp4Options.bFragmented = true;
+        pSink.reset(new Mp4BenchSink(opt.strOutput, cfg.nWidth, cfg.nHeight, mp4Options));
+    } else if (opt.strSink == "rtp") {
+        pSink.reset(new RtpBenchSink((unsigned short)opt.nRtpPort, opt.nRtpPaceMbps));
+    } else if (opt.strSink == "fanout") {
+        pSink.reset(new FanoutBenchSink(opt.strOutput, (unsigned short)opt.nRtpPort, opt.nRtpPaceMbps));
+    } else if (opt.strSink == "replay") {
+        pSink.reset(new ReplayBenchSink(opt.strOutput, cfg.nWidth, cfg.nHeight, opt.nReplaySec, (unsigned short)opt.nReplayPort));
+    } else if (opt.strSink == "seg") {
+        pSink.reset(new SegmentBenchSink(opt.strOutput, cfg.nWidth, cfg.nHeight, opt.nSegmentSec));
+#ifdef __linux__
+    } else if (opt.strSink == "uring") {
+        pSink.reset(new UringBenchSink(opt.strOutput));
+#endif
+    } else {
+        throw std::invalid_argument("Unknown sink: " + opt.strSink);
+    }
+
+    // Frames are recycled through a free list so steady state capture does not allocate
+    int nPool = cfg.nQueueDepth + 2;
+    std::vector<BenchFrame> vFrame(nPool);
+    BoundedQueue<BenchFrame *> qFree(nPool), qCapture(cfg.nQueueDepth);
+    BoundedQueue<BenchPacket> qWrite(cfg.nQueueDepth);
+    for (BenchFrame &f : vFrame) {
+        f.vBgra.resize(cfg.nWidth * cfg.nHeight * 4);
+        qFree.push(&f);
+    }
+    std::vector<uint8_t> vNv12(cfg.nWidth * cfg.nHeight * 3 / 2);
+    std::vector<double> vLatencyMs;
+    vLatencyMs.reserve(opt.nFrames);
+    uint64_t nDropped = 0, nBytes = 0;
+
+    uint64_t nAllocStart = nAllocations.load();
+    double tCpuStart = CpuSeconds();
+    auto tStart = std::chrono::steady_clock::now();
+    pSink->Start(tStart);
+
+    std::thread thEncode([&] {
+        BenchFrame *pFrame = NULL;
+        std::vector<std::vector<uint8_t>> vPacket;
+        while (qCapture.pop(pFrame)) {
+            converter.Convert(pFrame->vBgra.data(), cfg.nWidth * 4, vNv12.data(), cfg.nWidth, cfg.nHeight);
+            auto tCapture = pFrame->tCapture;
+            qFree.push(pFrame);
+            if (pSink->IsKeyFrameWanted()) {
+                pEncoder->ForceIdr();
+            }
+            pEncoder->EncodeFrame(vNv12.data(), vPacket);
+            for (auto &v : vPacket) {
+                qWrite.push(BenchPacket{std::move(v), tCapture});
+            }
+        }
+        qWrite.close();
+    });
+    // a failed sink is reported once the run is over; the packets are still drained so the encoder never blocks
+    std::exception_ptr pSinkError;
+    std::thread thWrite([&] {
+        BenchPacket pkt;
+        try {
+            while (qWrite.pop(pkt)) {
+                nBytes += pkt.vData.size();
+                pSink->Write(std::move(pkt.vData), std::chrono::duration_cast<std::chrono::microseconds>(pkt.tCapture - tStart).count());
+                vLatencyMs.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - pkt.tCapture).count());
+            }
+            pSink->Close();
+        } catch (...) {
+            pSinkError = std::current_exception();
+            while (qWrite.pop(pkt)) {
+            }
+        }
+    });
+
+    std::chrono::nanoseconds period(cfg.nFps > 0 ? 1000000000LL / cfg.nFps : 0);
+    auto tNext = tStart;
+    for (int i = 0; i < opt.nFrames; i++) {
+        if (cfg.nFps > 0) {
+            std::this_thread::sleep_until(tNext);
+            tNext += period;
+        }
+        BenchFrame *pFrame = NULL;
+        qFree.pop(pFrame);
+        pSource->Read(pFrame->vBgra.data(), cfg.nWidth * 4);
+        pFrame->tCapture = std::chrono::steady_clock::now();
+        // A paced capture behaves like desktop duplication: a frame the encoder cannot take is lost
+        bool bQueued = cfg.nFps > 0 ? qCapture.try_push(pFrame) : qCapture.push(pFrame);
+        if (!bQueued) {
+            nDropped++;
+            qFree.push(pFrame);
+        }
+    }
+    qCapture.close();
+    thEncode.join();
+    thWrite.join();
+    if (pSinkError) {
+        std::rethrow_exception(pSinkError);
+    }
+
+    double tWall = std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+    double tCpu = CpuSeconds() - tCpuStart;
+    uint64_t nAlloc = nAllocations.load() - nAllocStart;
+    uint64_t nEncoded = opt.nFrames - nDropped;
+    std::sort(vLatencyMs.begin(), vLatencyMs.end());
+
+    std::ostringstream oss;
+    oss << "{\"width\":" << cfg.nWidth << ",\"height\":" << cfg.nHeight << ",\"fps_target\":" << cfg.nFps
+        << ",\"queue_depth\":" << cfg.nQueueDepth << ",\"threads\":" << cfg.nThreads
+        << ",\"source\":\"" << opt.strSource << "\",\"pattern\":\"" << opt.strPattern << "\",\"converter\":\"" << opt.strConverter
+        << "\",\"encoder\":\"" << opt.strEncoder << "\",\"sink\":\"" << opt.strSink << "\""
+        << ",\"frames\":" << opt.nFrames << ",\"frames_dropped\":" << nDropped
+        << ",\"throughput_fps\":" << nEncoded / tWall
+        << ",\"output_mbps\":" << nBytes * 8 / tWall / 1.0e6
+        << ",\"latency_ms\":{\"p50\":" << Percentile(vLatencyMs, 0.5) << ",\"p90\":" << Percentile(vLatencyMs, 0.9)
+        << ",\"p99\":" << Percentile(vLatencyMs, 0.99) << ",\"max\":" << (vLatencyMs.empty() ? 0 : vLatencyMs.back()) << "}"
+        << ",\"cpu_utilisation\":" << tCpu / tWall
+        << ",\"allocations_per_frame\":" << (double)nAlloc / opt.nFrames
+        << ",\"wall_seconds\":" << tWall << pSink->GetStatsJson() << "}";
+    return oss.str();
+}
+
+class NullPacketSink : public PacketSink {
+public:
+    void Write(const EncodedPacketPtr &) {}
+};
+
+/**
+*  @brief Runs opt.nRecordings recordings back to back through RecorderService and reports,
+*  per recording, the one-time initialization it paid (every time with -cold) and the
+*  phases from the record command to its first frame.
+*/
+static std::string RunService(const BenchOptions &opt, const BenchConfig &cfg, bool &bFirst) {
+    AddSinksFunc funcAddSinks = [&](PacketDistributor &distributor, const std::string &strPath) {
+        if (opt.strSink == "null") {
+            distributor.AddSink(new NullPacketSink(), "null", 256, PACKET_DROP_NEVER);
+        } else if (opt.strSink == "file") {
+            distributor.AddSink(new FilePacketSink(strPath), "file", 256, PACKET_DROP_NEVER);
+        } else if (opt.strSink == "mp4") {
+            PcmH264Encoder enc(cfg.nWidth, cfg.nHeight);
+            std::vector<uint8_t> vSeqParams;
+            enc.GetSequenceParams(vSeqParams);
+            distributor.AddSink(new Mp4PacketSink(strPath, cfg.nWidth, cfg.nHeight, vSeqParams, Mp4WriterOptions()), "mp4", 256, PACKET_DROP_NEVER);
+        } else {
+            throw std::invalid_argument("Unsupported sink for -recordings: " + opt.strSink);
+        }
+        return std::shared_ptr<void>();
+    };
+    std::ostringstream oss;
+    std::unique_ptr<SoftwareRecordingPipeline> pPipeline;
+    std::unique_ptr<RecorderService> pService;
+    for (int i = 0; i < opt.nRecordings; i++) {
+        // a cold start pays for the pipeline as part of the recording
+        auto tBegin = std::chrono::steady_clock::now();
+        bool bInit = !pService || opt.bCold;
+        if (bInit) {
+            pService.reset();
+            pPipeline.reset(new SoftwareRecordingPipeline(cfg.nWidth, cfg.nHeight, cfg.nFps, opt.nGop, opt.nFrames, opt.strPattern));
+            pService.reset(new RecorderService(pPipeline.get(), funcAddSinks));
+        }
+        RecorderControl control;
+        pService->Record(RecorderService::NumberedPath(opt.strOutput, i), &control);
+        double dStartMs = (bInit ? pService->GetInitTimer().GetTotalMs() : 0) + pService->GetRecordTimer().GetTotalMs();
+        oss << (bFirst ? "  " : ", ") << "{\"width\":" << cfg.nWidth << ",\"height\":" << cfg.nHeight << ",\"fps_target\":" << cfg.nFps
+            << ",\"mode\":\"" << (opt.bCold ? "cold" : "warm") << "\",\"recording\":" << i << ",\"sink\":\"" << opt.strSink << "\""
+            << ",\"init_ms\":" << (bInit ? pService->GetInitTimer().ToJson() : "{}")
+            << ",\"start_ms\":" << pService->GetRecordTimer().ToJson()
+            << ",\"time_to_first_frame_ms\":" << dStartMs
+            << ",\"wall_seconds\":" << std::chrono::duration<double>(std::chrono::steady_clock::now() - tBegin).count() << "}" << std::endl;
+        bFirst = false;
+    }
+    return oss.str();
+}
+
+int main(int argc, char **argv) {
+    try {
+        BenchOptions opt;
+        ParseCommandLine(argc, argv, opt);
+        if (opt.nRecordings > 0) {
+            std::cout << "[" << std::endl;
+            bool bFirst = true;
+            for (auto &res : opt.vResolution) {
+                for (int nFps : opt.vFps) {
+                    BenchConfig cfg = {res.first, res.second, nFps, 0, 1};
+                    std::cout << RunService(opt, cfg, bFirst);
+                }
+            }
+            std::cout << "]" << std::endl;
+            return 0;
+        }
+        std::cout << "[" << std::endl;
+        bool bFirst = true;
+        for (auto &res : opt.vResolution) {
+            for (int nFps : opt.vFps) {
+                for (int nQueueDepth : opt.vQueueDepth) {
+                    for (int nThreads : opt.vThreads) {
+                        BenchConfig cfg = {res.first, res.second, nFps, nQueueDepth, nThreads};
+                        std::string strResult = RunConfig(opt, cfg);
+                        std::cout << (bFirst ? "  " : ", ") << strResult << std::endl;
+                        bFirst = false;
+                    }
+                }
+            }
+        }
+        std::cout << "]" << std::endl;
+    } catch (const std::exception &ex) {
+        std::cout << ex.what();
+        return 1;
+    }
+    return 0;
+}
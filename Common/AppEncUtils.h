@@ -11,8 +11,37 @@
 
 #pragma once
 #include <iostream>
+#include <string>
 #include "NvEncoder/NvEncoder.h"
 #include "../Utils/NvEncoderCLIOptions.h"
+#include "../Utils/SegmentWriter.h"
+
+/**
+*  @brief Recorder specific options that are not forwarded to NvEncoderInitParam.
+*/
+struct RecorderOptions
+{
+    int nDuration = 0;          // 0: until stopped through the control channel
+    std::string strBinLogPath;
+    int nMetricsPort = 0;
+    int nFragmentFrames = -1;   // < 0 writes a plain MP4
+    int nSegmentSeconds = 0;    // 0: no time based segmentation
+    int nSegmentMB = 0;         // 0: no size based segmentation
+    std::string strRtpHost;     // empty: no RTP preview
+    int nRtpPort = 5004;
+    int nRtpPaceMbps = 100;
+    int nReplaySeconds = 0;     // 0: record to the output file as usual
+    int nReplayMB = 512;
+    int nReplayPort = 0;
+    bool bStartPaused = false;  // wait for a start command with the encoder ready
+    int nControlPort = 0;       // 0: control through stdin and Ctrl+C only
+    bool bDaemon = false;       // keep the encoder warm and record on command
+    int nAdaptMinKbps = 0;      // 0: the bitrate set at initialization is kept
+    int nAdaptMaxKbps = 0;      // 0: the initial bitrate is the maximum
+    bool bRoi = false;          // QP delta map from the dirty rects
+    bool bMeHints = false;      // external ME hints from the move rects
+    bool bIndex = true;         // seek index (<output>.idx) next to raw outputs
+};
 
 inline void ShowHelpAndExit_AppEncD3D(const char *szBadOption = NULL)
 {
@@ -25,10 +54,28 @@ inline void ShowHelpAndExit_AppEncD3D(const char *szBadOption = NULL)
     }
     oss << "Options:" << std::endl
         << "-i           Input file (must be in BGRA format) path" << std::endl
-        << "-o           Output file path" << std::endl
+        << "-o           Output file path; a .mp4 extension writes an MP4 file instead of raw H.264 (H.264 without B frames only)" << std::endl
         << "-s           Input resolution in this form: WxH" << std::endl
         << "-gpu         Ordinal of GPU to use" << std::endl
         << "-nv12        (No value) Convert to NV12 before encoding. Don't use it with -444" << std::endl
+        << "-dur         Stop automatically after N seconds of recording, pauses excluded (default: record until stopped)" << std::endl
+        << "-binlog      Base path of the binary per-frame event log (decode with BinLogDecode)" << std::endl
+        << "-metrics     Serve Prometheus metrics on http://127.0.0.1:<port>/metrics" << std::endl
+        << "-fmp4        Write .mp4 output as fragmented MP4 with a fragment every N frames (0: every IDR)" << std::endl
+        << "-segdur      Split the output into files of about N seconds (name_0000.ext, name_0001.ext, ...)" << std::endl
+        << "-segsize     Split the output into files of about N MB" << std::endl
+        << "-rtp         Also send the stream as RTP/H.264 to host:port for a live preview (H.264 only)" << std::endl
+        << "-rtppace     Pacing rate of the RTP preview in Mbps (default 100, 0: unpaced)" << std::endl
+        << "-replay      Keep only the last N seconds in memory and write them to <output>_replay_NNNN on Ctrl+Break" << std::endl
+        << "-replaymb    Memory budget of -replay in MB (default 512)" << std::endl
+        << "-replayport  Also accept \"dump [seconds]\" requests on 127.0.0.1:<port>" << std::endl
+        << "-paused      (No value) Prepare the encoder and wait for a start command before recording" << std::endl
+        << "-controlport Also accept start/pause/resume/stop/status commands on 127.0.0.1:<port>" << std::endl
+        << "-daemon      (No value) Initialize once, then record on \"record [path]\" commands until \"quit\"" << std::endl
+        << "-adapt       min[:max] Adapt the bitrate (QP with -rc constqp) between min and max kbps to the screen activity and the output backlog" << std::endl
+        << "-roi         (No value) Lower the QP where the screen changed recently and raise it on static content" << std::endl
+        << "-mehints     (No value) Pass scrolled and dragged windows to the encoder as motion vector hints (H.264, no B frames)" << std::endl
+        << "-noindex     (No value) Don't write the seek index <output>.idx next to raw H.264 outputs" << std::endl
         ;
     oss << NvEncoderInitParam().GetHelpMessage();
     if (bThrowError)
@@ -43,7 +90,7 @@ inline void ShowHelpAndExit_AppEncD3D(const char *szBadOption = NULL)
 }
 
 inline void ParseCommandLine_AppEncD3D(int argc, char *argv[], int &nWidth, int &nHeight, char *szOutputFileName,
-	NvEncoderInitParam &initParam, int &iGpu, int &dur)
+	NvEncoderInitParam &initParam, int &iGpu, RecorderOptions &recOptions)
 {
     std::ostringstream oss;
     int i;
@@ -77,9 +124,113 @@ inline void ParseCommandLine_AppEncD3D(int argc, char *argv[], int &nWidth, int
 			if (++i == argc) {
 				ShowHelpAndExit_AppEncD3D("-dur");
 			}
-			dur = atoi(argv[i]);
+			recOptions.nDuration = atoi(argv[i]);
 			continue;
 		}
+        if (!_stricmp(argv[i], "-binlog")) {
+            if (++i == argc) {
+                ShowHelpAndExit_AppEncD3D("-binlog");
+            }
+            recOptions.strBinLogPath = argv[i];
+            continue;
+        }
+        if (!_stricmp(argv[i], "-metrics")) {
+            if (++i == argc) {
+                ShowHelpAndExit_AppEncD3D("-metrics");
+            }
+            recOptions.nMetricsPort = atoi(argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-fmp4")) {
+            if (++i == argc) {
+                ShowHelpAndExit_AppEncD3D("-fmp4");
+            }
+            recOptions.nFragmentFrames = atoi(argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-segdur")) {
+            if (++i == argc) {
+                ShowHelpAndExit_AppEncD3D("-segdur");
+            }
+            recOptions.nSegmentSeconds = atoi(argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-segsize")) {
+            if (++i == argc) {
+                ShowHelpAndExit_AppEncD3D("-segsize");
+            }
+            recOptions.nSegmentMB = atoi(argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-rtp")) {
+            char szHost[256];
+            if (++i == argc || 2 != sscanf(argv[i], "%255[^:]:%d", szHost, &recOptions.nRtpPort)) {
+                ShowHelpAndExit_AppEncD3D("-rtp");
+            }
+            recOptions.strRtpHost = szHost;
+            continue;
+        }
+        if (!_stricmp(argv[i], "-replay")) {
+            if (++i == argc) {
+                ShowHelpAndExit_AppEncD3D("-replay");
+            }
+            recOptions.nReplaySeconds = atoi(argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-replaymb")) {
+            if (++i == argc) {
+                ShowHelpAndExit_AppEncD3D("-replaymb");
+            }
+            recOptions.nReplayMB = atoi(argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-replayport")) {
+            if (++i == argc) {
+                ShowHelpAndExit_AppEncD3D("-replayport");
+            }
+            recOptions.nReplayPort = atoi(argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-daemon")) {
+            recOptions.bDaemon = true;
+            continue;
+        }
+        if (!_stricmp(argv[i], "-roi")) {
+            recOptions.bRoi = true;
+            continue;
+        }
+        if (!_stricmp(argv[i], "-mehints")) {
+            recOptions.bMeHints = true;
+            continue;
+        }
+        if (!_stricmp(argv[i], "-noindex")) {
+            recOptions.bIndex = false;
+            continue;
+        }
+        if (!_stricmp(argv[i], "-paused")) {
+            recOptions.bStartPaused = true;
+            continue;
+        }
+        if (!_stricmp(argv[i], "-controlport")) {
+            if (++i == argc) {
+                ShowHelpAndExit_AppEncD3D("-controlport");
+            }
+            recOptions.nControlPort = atoi(argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-adapt")) {
+            if (++i == argc || sscanf(argv[i], "%d:%d", &recOptions.nAdaptMinKbps, &recOptions.nAdaptMaxKbps) < 1 || recOptions.nAdaptMinKbps <= 0) {
+                ShowHelpAndExit_AppEncD3D("-adapt");
+            }
+            continue;
+        }
+        if (!_stricmp(argv[i], "-rtppace")) {
+            if (++i == argc) {
+                ShowHelpAndExit_AppEncD3D("-rtppace");
+            }
+            recOptions.nRtpPaceMbps = atoi(argv[i]);
+            continue;
+        }
         // Regard as encoder parameter
         if (argv[i][0] != '-') {
             ShowHelpAndExit_AppEncD3D(argv[i]);
@@ -90,4 +241,12 @@ inline void ParseCommandLine_AppEncD3D(int argc, char *argv[], int &nWidth, int
         }
     }
     initParam = NvEncoderInitParam(oss.str().c_str());
+    // the MP4 writers only know the H.264 sample entry
+    if (initParam.IsCodecHEVC() && SegmentFile::IsMp4Path(szOutputFileName)) {
+        throw std::invalid_argument("MP4 output is only supported for H.264; write HEVC to a raw file such as .h265");
+    }
+    // the preview is packetized as RTP/H.264 (RFC 6184)
+    if (initParam.IsCodecHEVC() && !recOptions.strRtpHost.empty()) {
+        throw std::invalid_argument("-rtp is only supported for H.264");
+    }
 }
@@ -12,6 +12,7 @@
 #ifndef WIN32
 #include <dlfcn.h>
 #endif
+#include <stdlib.h>
 #include "NvEncoder/NvEncoder.h"
 
 #ifndef _WIN32
@@ -55,16 +56,48 @@ NvEncoder::NvEncoder(NV_ENC_DEVICE_TYPE eDeviceType, void *pDevice, uint32_t nWi
     m_hEncoder = hEncoder;
 }
 
-void NvEncoder::LoadNvEncApi()
+static void *LoadNvEncLibrary()
 {
+    // e.g. a fake driver to test or benchmark the encoder without a GPU
+    const char *szPath = getenv("NVENC_LIBRARY_PATH");
 #if defined(_WIN32)
+    if (szPath && *szPath)
+    {
+        return LoadLibraryA(szPath);
+    }
 #if defined(_WIN64)
-    HMODULE hModule = LoadLibrary(TEXT("nvEncodeAPI64.dll"));
+    return LoadLibrary(TEXT("nvEncodeAPI64.dll"));
 #else
-    HMODULE hModule = LoadLibrary(TEXT("nvEncodeAPI.dll"));
+    return LoadLibrary(TEXT("nvEncodeAPI.dll"));
 #endif
 #else
-    void *hModule = dlopen("libnvidia-encode.so.1", RTLD_LAZY);
+    if (szPath && *szPath)
+    {
+        return dlopen(szPath, RTLD_LAZY);
+    }
+    return dlopen("libnvidia-encode.so.1", RTLD_LAZY);
+#endif
+}
+
+bool NvEncoder::PreloadNvEncApi()
+{
+    // the first load maps the driver and its dependencies; this reference is never released
+    static std::mutex mtxPreload;
+    static void *hPreloaded = nullptr;
+    std::lock_guard<std::mutex> lock(mtxPreload);
+    if (!hPreloaded)
+    {
+        hPreloaded = LoadNvEncLibrary();
+    }
+    return hPreloaded != nullptr;
+}
+
+void NvEncoder::LoadNvEncApi()
+{
+#if defined(_WIN32)
+    HMODULE hModule = (HMODULE)LoadNvEncLibrary();
+#else
+    void *hModule = LoadNvEncLibrary();
 #endif
 
     if (hModule == NULL)
@@ -271,6 +304,10 @@ void NvEncoder::CreateEncoder(const NV_ENC_INITIALIZE_PARAMS* pEncoderParams)
     m_initializeParams.encodeConfig = &m_encodeConfig;
 
     NVENC_API_CALL(m_nvenc.nvEncInitializeEncoder(m_hEncoder, &m_initializeParams));
+    if (m_funcInitPhase)
+    {
+        m_funcInitPhase("encoder init");
+    }
 
     m_bEncoderInitialized = true;
     m_nWidth = m_initializeParams.encodeWidth;
@@ -296,15 +333,48 @@ void NvEncoder::CreateEncoder(const NV_ENC_INITIALIZE_PARAMS* pEncoderParams)
     if (m_bMotionEstimationOnly)
     {
         m_vMappedRefBuffers.resize(m_nEncoderBuffer, nullptr);
-        InitializeMVOutputBuffer();
+        m_vMVDataOutputBuffer.resize(m_nEncoderBuffer, nullptr);
     }
     else
     {
         m_vBitstreamOutputBuffer.resize(m_nEncoderBuffer, nullptr);
-        InitializeBitstreamBuffer();
     }
 
-    AllocateInputBuffers(m_nEncoderBuffer);
+    // only the first frame's buffers are needed to start encoding
+    m_nAllocatedBuffers = 0;
+    AllocateBuffers(1);
+    if (m_funcInitPhase)
+    {
+        m_funcInitPhase("encoder buffers");
+    }
+}
+
+void NvEncoder::AllocateBuffers(int32_t nBuffers)
+{
+    if (nBuffers > m_nEncoderBuffer)
+    {
+        nBuffers = m_nEncoderBuffer;
+    }
+    if (nBuffers <= m_nAllocatedBuffers)
+    {
+        return;
+    }
+
+    for (int i = m_nAllocatedBuffers; i < nBuffers; i++)
+    {
+        if (m_bMotionEstimationOnly)
+        {
+            InitializeMVOutputBuffer(i);
+        }
+        else
+        {
+            InitializeBitstreamBuffer(i);
+        }
+    }
+
+    // input buffers are appended, so slot i is always m_vInputFrames[i]
+    AllocateInputBuffers(nBuffers - m_nAllocatedBuffers);
+    m_nAllocatedBuffers = nBuffers;
 }
 
 void NvEncoder::DestroyEncoder()
@@ -352,6 +422,7 @@ void NvEncoder::DestroyHWEncoder()
     m_nvenc.nvEncDestroyEncoder(m_hEncoder);
 
     m_hEncoder = nullptr;
+    m_nAllocatedBuffers = 0;
 
     m_bEncoderInitialized = false;
 }
@@ -359,28 +430,38 @@ void NvEncoder::DestroyHWEncoder()
 const NvEncInputFrame* NvEncoder::GetNextInputFrame()
 {
     int i = m_iToSend % m_nEncoderBuffer;
+    AllocateBuffers(i + 1);
     return &m_vInputFrames[i];
 }
 
 const NvEncInputFrame* NvEncoder::GetNextReferenceFrame()
 {
     int i = m_iToSend % m_nEncoderBuffer;
+    AllocateBuffers(i + 1);
     return &m_vReferenceFrames[i];
 }
 
 void NvEncoder::EncodeFrame(std::vector<std::vector<uint8_t>> &vPacket, NV_ENC_PIC_PARAMS *pPicParams)
+{
+    std::vector<NvEncOutputPacketInfo> vPacketInfo;
+    EncodeFrame(vPacket, vPacketInfo, pPicParams);
+}
+
+void NvEncoder::EncodeFrame(std::vector<std::vector<uint8_t>> &vPacket, std::vector<NvEncOutputPacketInfo> &vPacketInfo, NV_ENC_PIC_PARAMS *pPicParams)
 {
     vPacket.clear();
+    vPacketInfo.clear();
     if (!IsHWEncoderInitialized())
     {
         NVENC_THROW_ERROR("Encoder device not found", NV_ENC_ERR_NO_ENCODE_DEVICE);
     }
     int i = m_iToSend % m_nEncoderBuffer;
+    AllocateBuffers(i + 1);
     NV_ENC_MAP_INPUT_RESOURCE mapInputResource = { NV_ENC_MAP_INPUT_RESOURCE_VER };
     mapInputResource.registeredResource = m_vRegisteredResources[i];
     NVENC_API_CALL(m_nvenc.nvEncMapInputResource(m_hEncoder, &mapInputResource));
     m_vMappedInputBuffers[i] = mapInputResource.mappedResource;
-    DoEncode(m_vMappedInputBuffers[i], vPacket, pPicParams);
+    DoEncode(m_vMappedInputBuffers[i], vPacket, pPicParams, &vPacketInfo);
 }
 
 void NvEncoder::RunMotionEstimation(std::vector<uint8_t> &mvData)
@@ -392,6 +473,7 @@ void NvEncoder::RunMotionEstimation(std::vector<uint8_t> &mvData)
     }
 
     const uint32_t i = m_iToSend % m_nEncoderBuffer;
+    AllocateBuffers(i + 1);
 
     NV_ENC_MAP_INPUT_RESOURCE mapInputResource = { NV_ENC_MAP_INPUT_RESOURCE_VER };
     mapInputResource.registeredResource = m_vRegisteredResources[i];
@@ -424,7 +506,8 @@ void NvEncoder::GetSequenceParams(std::vector<uint8_t> &seqParams)
     seqParams.insert(seqParams.end(), &spsppsData[0], &spsppsData[spsppsSize]);
 }
 
-void NvEncoder::DoEncode(NV_ENC_INPUT_PTR inputBuffer, std::vector<std::vector<uint8_t>> &vPacket, NV_ENC_PIC_PARAMS *pPicParams)
+void NvEncoder::DoEncode(NV_ENC_INPUT_PTR inputBuffer, std::vector<std::vector<uint8_t>> &vPacket, NV_ENC_PIC_PARAMS *pPicParams,
+    std::vector<NvEncOutputPacketInfo> *pvPacketInfo)
 {
     NV_ENC_PIC_PARAMS picParams = {};
     if (pPicParams)
@@ -439,11 +522,22 @@ void NvEncoder::DoEncode(NV_ENC_INPUT_PTR inputBuffer, std::vector<std::vector<u
     picParams.inputHeight = GetEncodeHeight();
     picParams.outputBitstream = m_vBitstreamOutputBuffer[m_iToSend % m_nEncoderBuffer];
     picParams.completionEvent = m_vpCompletionEvent[m_iToSend % m_nEncoderBuffer];
+    if (m_encodeConfig.rcParams.qpMapMode == NV_ENC_QP_MAP_DISABLED)
+    {
+        // a map is only valid for an encoder initialized with a QP map mode
+        picParams.qpDeltaMap = NULL;
+        picParams.qpDeltaMapSize = 0;
+    }
+    if (!m_initializeParams.enableExternalMEHints)
+    {
+        picParams.meExternalHints = NULL;
+        memset(picParams.meHintCountsPerBlock, 0, sizeof(picParams.meHintCountsPerBlock));
+    }
     NVENCSTATUS nvStatus = m_nvenc.nvEncEncodePicture(m_hEncoder, &picParams);
     if (nvStatus == NV_ENC_SUCCESS || nvStatus == NV_ENC_ERR_NEED_MORE_INPUT)
     {
         m_iToSend++;
-        GetEncodedPacket(m_vBitstreamOutputBuffer, vPacket, true);
+        GetEncodedPacket(m_vBitstreamOutputBuffer, vPacket, true, pvPacketInfo);
     }
     else
     {
@@ -452,8 +546,15 @@ void NvEncoder::DoEncode(NV_ENC_INPUT_PTR inputBuffer, std::vector<std::vector<u
 }
 
 void NvEncoder::EndEncode(std::vector<std::vector<uint8_t>> &vPacket)
+{
+    std::vector<NvEncOutputPacketInfo> vPacketInfo;
+    EndEncode(vPacket, vPacketInfo);
+}
+
+void NvEncoder::EndEncode(std::vector<std::vector<uint8_t>> &vPacket, std::vector<NvEncOutputPacketInfo> &vPacketInfo)
 {
     vPacket.clear();
+    vPacketInfo.clear();
     if (!IsHWEncoderInitialized())
     {
         NVENC_THROW_ERROR("Encoder device not initialized", NV_ENC_ERR_ENCODER_NOT_INITIALIZED);
@@ -463,10 +564,11 @@ void NvEncoder::EndEncode(std::vector<std::vector<uint8_t>> &vPacket)
     picParams.encodePicFlags = NV_ENC_PIC_FLAG_EOS;
     picParams.completionEvent = m_vpCompletionEvent[m_iToSend % m_nEncoderBuffer];
     NVENC_API_CALL(m_nvenc.nvEncEncodePicture(m_hEncoder, &picParams));
-    GetEncodedPacket(m_vBitstreamOutputBuffer, vPacket, false);
+    GetEncodedPacket(m_vBitstreamOutputBuffer, vPacket, false, &vPacketInfo);
 }
 
-void NvEncoder::GetEncodedPacket(std::vector<NV_ENC_OUTPUT_PTR> &vOutputBuffer, std::vector<std::vector<uint8_t>> &vPacket, bool bOutputDelay)
+void NvEncoder::GetEncodedPacket(std::vector<NV_ENC_OUTPUT_PTR> &vOutputBuffer, std::vector<std::vector<uint8_t>> &vPacket, bool bOutputDelay,
+    std::vector<NvEncOutputPacketInfo> *pvPacketInfo)
 {
     unsigned i = 0;
     int iEnd = bOutputDelay ? m_iToSend - m_nOutputDelay : m_iToSend;
@@ -485,6 +587,13 @@ void NvEncoder::GetEncodedPacket(std::vector<NV_ENC_OUTPUT_PTR> &vOutputBuffer,
         }
         vPacket[i].clear();
         vPacket[i].insert(vPacket[i].end(), &pData[0], &pData[lockBitstreamData.bitstreamSizeInBytes]);
+        if (pvPacketInfo)
+        {
+            NvEncOutputPacketInfo info;
+            info.timestamp = lockBitstreamData.outputTimeStamp;
+            info.pictureType = lockBitstreamData.pictureType;
+            pvPacketInfo->push_back(info);
+        }
         i++;
 
         NVENC_API_CALL(m_nvenc.nvEncUnlockBitstream(m_hEncoder, lockBitstreamData.outputBitstream));
@@ -843,14 +952,11 @@ void NvEncoder::GetInitializeParams(NV_ENC_INITIALIZE_PARAMS *pInitializeParams)
     pInitializeParams->encodeConfig = pEncodeConfig;
 }
 
-void NvEncoder::InitializeBitstreamBuffer()
+void NvEncoder::InitializeBitstreamBuffer(int32_t iBuffer)
 {
-    for (int i = 0; i < m_nEncoderBuffer; i++)
-    {
-        NV_ENC_CREATE_BITSTREAM_BUFFER createBitstreamBuffer = { NV_ENC_CREATE_BITSTREAM_BUFFER_VER };
-        NVENC_API_CALL(m_nvenc.nvEncCreateBitstreamBuffer(m_hEncoder, &createBitstreamBuffer));
-        m_vBitstreamOutputBuffer[i] = createBitstreamBuffer.bitstreamBuffer;
-    }
+    NV_ENC_CREATE_BITSTREAM_BUFFER createBitstreamBuffer = { NV_ENC_CREATE_BITSTREAM_BUFFER_VER };
+    NVENC_API_CALL(m_nvenc.nvEncCreateBitstreamBuffer(m_hEncoder, &createBitstreamBuffer));
+    m_vBitstreamOutputBuffer[iBuffer] = createBitstreamBuffer.bitstreamBuffer;
 }
 
 void NvEncoder::DestroyBitstreamBuffer()
@@ -866,14 +972,11 @@ void NvEncoder::DestroyBitstreamBuffer()
     m_vBitstreamOutputBuffer.clear();
 }
 
-void NvEncoder::InitializeMVOutputBuffer()
+void NvEncoder::InitializeMVOutputBuffer(int32_t iBuffer)
 {
-    for (int i = 0; i < m_nEncoderBuffer; i++)
-    {
-        NV_ENC_CREATE_MV_BUFFER createMVBuffer = { NV_ENC_CREATE_MV_BUFFER_VER };
-        NVENC_API_CALL(m_nvenc.nvEncCreateMVBuffer(m_hEncoder, &createMVBuffer));
-        m_vMVDataOutputBuffer.push_back(createMVBuffer.mvBuffer);
-    }
+    NV_ENC_CREATE_MV_BUFFER createMVBuffer = { NV_ENC_CREATE_MV_BUFFER_VER };
+    NVENC_API_CALL(m_nvenc.nvEncCreateMVBuffer(m_hEncoder, &createMVBuffer));
+    m_vMVDataOutputBuffer[iBuffer] = createMVBuffer.mvBuffer;
 }
 
 void NvEncoder::DestroyMVOutputBuffer()
@@ -12,6 +12,7 @@
 #pragma once
 
 #include <vector>
+#include <functional>
 #include "nvEncodeAPI.h"
 #include <stdint.h>
 #include <mutex>
@@ -79,6 +80,15 @@ struct NvEncInputFrame
     NV_ENC_INPUT_RESOURCE_TYPE resourceType;
 };
 
+/**
+* @brief Per packet information returned alongside the encoded bitstream.
+*/
+struct NvEncOutputPacketInfo
+{
+    uint64_t timestamp = 0;                             /**< NV_ENC_PIC_PARAMS::inputTimeStamp of the encoded picture */
+    NV_ENC_PIC_TYPE pictureType = NV_ENC_PIC_TYPE_UNKNOWN;
+};
+
 /**
 * @brief Shared base class for different encoder interfaces.
 */
@@ -125,6 +135,15 @@ public:
     */
     void EncodeFrame(std::vector<std::vector<uint8_t>> &vPacket, NV_ENC_PIC_PARAMS *pPicParams = nullptr);
 
+    /**
+    *  @brief  This function is used to encode a frame and to get the timestamp
+    *  and picture type of every returned packet.
+    *  vPacketInfo[i] describes vPacket[i]. Timestamps are the inputTimeStamp
+    *  values passed in pPicParams; packets come in decode order, so with B frames
+    *  the timestamps are not monotonic.
+    */
+    void EncodeFrame(std::vector<std::vector<uint8_t>> &vPacket, std::vector<NvEncOutputPacketInfo> &vPacketInfo, NV_ENC_PIC_PARAMS *pPicParams = nullptr);
+
     /**
     *  @brief  This function to flush the encoder queue.
     *  The encoder might be queuing frames for B picture encoding or lookahead;
@@ -134,6 +153,12 @@ public:
     */
     void EndEncode(std::vector<std::vector<uint8_t>> &vPacket);
 
+    /**
+    *  @brief  This function flushes the encoder queue and returns the information
+    *  of every flushed packet, see EncodeFrame().
+    */
+    void EndEncode(std::vector<std::vector<uint8_t>> &vPacket, std::vector<NvEncOutputPacketInfo> &vPacketInfo);
+
     /**
     *  @brief  This function is used to query hardware encoder capabilities.
     *  Applications can call this function to query capabilities like maximum encode
@@ -163,6 +188,13 @@ public:
     */
     int GetEncodeHeight() const { return m_nHeight; }
 
+    /**
+    *  @brief  This function is used to get the number of frames the encoder can hold
+    *  between EncodeFrame() and the output of their packets. Per-frame data referenced
+    *  from NV_ENC_PIC_PARAMS, such as qpDeltaMap, must stay valid that long.
+    */
+    int GetEncoderBufferCount() const { return m_nEncoderBuffer; }
+
     /**
     *   @brief  This function is used to get the current frame size based on pixel format.
     */
@@ -211,11 +243,25 @@ public:
     */
     void GetSequenceParams(std::vector<uint8_t> &seqParams);
 
+    /**
+    *  @brief  This function is used to get notified of each step of CreateEncoder()
+    *          ("encoder init", "encoder buffers") as it completes, e.g. to time them.
+    */
+    void SetInitPhaseCallback(std::function<void(const char *szPhase)> funcInitPhase) { m_funcInitPhase = funcInitPhase; }
+
     /**
     *  @brief  NvEncoder class virtual destructor.
     */
     virtual ~NvEncoder();
 
+    /**
+    *  @brief This a static function to load the encode api shared library ahead of time,
+    *  e.g. on another thread while the device is being created. The library then stays
+    *  loaded, so the constructor only takes a reference on it. Returns false if the
+    *  library is not found; the constructor reports the error.
+    */
+    static bool PreloadNvEncApi();
+
 public:
     /**
     *  @brief This a static function to get chroma offsets for YUV planar formats.
@@ -309,6 +355,8 @@ private:
 
     /**
     *  @brief This is a private function which is used to load the encode api shared library.
+    *  The environment variable NVENC_LIBRARY_PATH, if set, names the library to load instead
+    *  of the driver's.
     */
     void LoadNvEncApi();
 
@@ -316,7 +364,8 @@ private:
     *  @brief This is a private function which is used to submit the encode
     *         commands to the NVENC hardware.
     */
-    void DoEncode(NV_ENC_INPUT_PTR inputBuffer, std::vector<std::vector<uint8_t>> &vPacket, NV_ENC_PIC_PARAMS *pPicParams);
+    void DoEncode(NV_ENC_INPUT_PTR inputBuffer, std::vector<std::vector<uint8_t>> &vPacket, NV_ENC_PIC_PARAMS *pPicParams,
+        std::vector<NvEncOutputPacketInfo> *pvPacketInfo = nullptr);
 
     /**
     *  @brief This is a private function which is used to submit the encode
@@ -330,13 +379,22 @@ private:
     *  This is called by DoEncode() function. If there is buffering enabled,
     *  this may return without any output data.
     */
-    void GetEncodedPacket(std::vector<NV_ENC_OUTPUT_PTR> &vOutputBuffer, std::vector<std::vector<uint8_t>> &vPacket, bool bOutputDelay);
+    void GetEncodedPacket(std::vector<NV_ENC_OUTPUT_PTR> &vOutputBuffer, std::vector<std::vector<uint8_t>> &vPacket, bool bOutputDelay,
+        std::vector<NvEncOutputPacketInfo> *pvPacketInfo = nullptr);
+
+    /**
+    *  @brief This is a private function which is used to allocate the output and input
+    *  buffers of the first nBuffers slots, if not done yet.
+    *  CreateEncoder() only allocates the first slot; the others only serve the output delay,
+    *  so each is allocated when the first frames reach it.
+    */
+    void AllocateBuffers(int32_t nBuffers);
 
     /**
-    *  @brief This is a private function which is used to initialize the bitstream buffers.
+    *  @brief This is a private function which is used to initialize the bitstream buffer of a slot.
     *  This is only used in the encoding mode.
     */
-    void InitializeBitstreamBuffer();
+    void InitializeBitstreamBuffer(int32_t iBuffer);
 
     /**
     *  @brief This is a private function which is used to destroy the bitstream buffers.
@@ -345,10 +403,10 @@ private:
     void DestroyBitstreamBuffer();
 
     /**
-    *  @brief This is a private function which is used to initialize MV output buffers.
+    *  @brief This is a private function which is used to initialize the MV output buffer of a slot.
     *  This is only used in ME-only Mode.
     */
-    void InitializeMVOutputBuffer();
+    void InitializeMVOutputBuffer(int32_t iBuffer);
 
     /**
     *  @brief This is a private function which is used to destroy MV output buffers.
@@ -403,5 +461,7 @@ private:
     int32_t m_iToSend = 0;
     int32_t m_iGot = 0;
     int32_t m_nEncoderBuffer = 0;
+    int32_t m_nAllocatedBuffers = 0;
     int32_t m_nOutputDelay = 0;
+    std::function<void(const char *)> m_funcInitPhase;
 };
@@ -13,6 +13,7 @@
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <chrono>
 
 template <typename T>
 class Queue
@@ -65,4 +66,131 @@ private:
 	std::condition_variable cond_;
 };
 
+// Queue with a fixed capacity: push() blocks while full, try_push() fails instead.
+// close() wakes every waiter; pop() then drains what is left and returns false when empty.
+// pop_for() also returns false when nothing arrived in time; closed() tells the two apart.
+template <typename T>
+class BoundedQueue
+{
+public:
+
+	explicit BoundedQueue(size_t capacity) : capacity_(capacity ? capacity : 1) {}
+
+	bool pop(T& item)
+	{
+		std::unique_lock<std::mutex> mlock(mutex_);
+		while (queue_.empty() && !closed_)
+		{
+			not_empty_.wait(mlock);
+		}
+		if (queue_.empty())
+		{
+			return false;
+		}
+		item = std::move(queue_.front());
+		queue_.pop();
+		mlock.unlock();
+		not_full_.notify_one();
+		return true;
+	}
+
+	template <typename Rep, typename Period>
+	bool pop_for(T& item, const std::chrono::duration<Rep, Period>& timeout)
+	{
+		std::unique_lock<std::mutex> mlock(mutex_);
+		if (!not_empty_.wait_for(mlock, timeout, [this] { return !queue_.empty() || closed_; }) || queue_.empty())
+		{
+			return false;
+		}
+		item = std::move(queue_.front());
+		queue_.pop();
+		mlock.unlock();
+		not_full_.notify_one();
+		return true;
+	}
+
+	bool push(T item)
+	{
+		std::unique_lock<std::mutex> mlock(mutex_);
+		while (queue_.size() >= capacity_ && !closed_)
+		{
+			not_full_.wait(mlock);
+		}
+		if (closed_)
+		{
+			return false;
+		}
+		queue_.push(std::move(item));
+		mlock.unlock();
+		not_empty_.notify_one();
+		return true;
+	}
+
+	bool try_push(T item)
+	{
+		std::unique_lock<std::mutex> mlock(mutex_);
+		if (queue_.size() >= capacity_ || closed_)
+		{
+			return false;
+		}
+		queue_.push(std::move(item));
+		mlock.unlock();
+		not_empty_.notify_one();
+		return true;
+	}
+
+	// Removes the oldest element if the queue is full, then pushes; returns false if one was discarded.
+	bool push_drop_oldest(T item)
+	{
+		std::unique_lock<std::mutex> mlock(mutex_);
+		bool kept = true;
+		if (queue_.size() >= capacity_)
+		{
+			queue_.pop();
+			kept = false;
+		}
+		queue_.push(std::move(item));
+		mlock.unlock();
+		not_empty_.notify_one();
+		return kept;
+	}
+
+	void close()
+	{
+		std::unique_lock<std::mutex> mlock(mutex_);
+		closed_ = true;
+		mlock.unlock();
+		not_empty_.notify_all();
+		not_full_.notify_all();
+	}
+
+	size_t size()
+	{
+		std::unique_lock<std::mutex> mlock(mutex_);
+		return queue_.size();
+	}
+
+	size_t capacity() const
+	{
+		return capacity_;
+	}
+
+	bool closed()
+	{
+		std::unique_lock<std::mutex> mlock(mutex_);
+		return closed_;
+	}
+
+	BoundedQueue(const BoundedQueue&) = delete;
+	BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+private:
+	std::queue<T> queue_;
+	size_t capacity_;
+	bool closed_ = false;
+	std::mutex mutex_;
+	std::condition_variable not_empty_;
+	std::condition_variable not_full_;
+};
+
 #endif
\ No newline at end of file
@@ -13,26 +13,39 @@
 #include <iostream>
 #include <unordered_map>
 #include <memory>
+#include <climits>
 #include <wrl.h>
 #include "NvEncoder/NvEncoderD3D11.h"
 #include "./Utils/Logger.h"
+#include "./Utils/BinaryLogger.h"
+#include "./Utils/RecorderMetrics.h"
+#include "./Utils/PacketSinks.h"
+#include "./Utils/ReplayBuffer.h"
+#include "./Utils/RecorderService.h"
+#include "./Utils/RateController.h"
+#include "./Utils/DirtyRects.h"
+#include "./Utils/QpMapBuilder.h"
+#include "./Utils/MotionHintBuilder.h"
 #include "./Utils/NvCodecUtils.h"
 #include "./Common/AppEncUtils.h"
 #include <DXGI.h>
 #include <DXGI1_2.h> /* For IDXGIOutput1 */
 
 #include "Queue.h"
+#include <future>
 #include <thread>
 
 #define FPS_CAPTURE_INTERVAL 33
 #define FPS_DEFAULT 30
+#define DISK_QUEUE_PACKETS 256	// about 8 s of packets the file sinks may fall behind before the encoder waits
 
 #pragma comment(lib, "dxgi.lib")
 
 using Microsoft::WRL::ComPtr;
 
 
-simplelogger::Logger *logger = simplelogger::LoggerFactory::CreateConsoleLogger();
+simplelogger::Logger *logger = simplelogger::LoggerFactory::CreateAsyncLogger(simplelogger::LoggerFactory::CreateConsoleLogger());
+simplelogger::BinaryLogger *binlogger = NULL;
 
 class RGBToNV12ConverterD3D11 
 {
@@ -113,7 +126,7 @@ public:
         return;
     }
 
-	ComPtr<IDXGIOutputDuplication> init_duplication(ID3D11Device *pDevice)
+	static ComPtr<IDXGIOutputDuplication> init_duplication(ID3D11Device *pDevice)
 	{
 		ComPtr<IDXGIFactory1> factory;
 		ComPtr<IDXGIAdapter> adapter;
@@ -125,7 +138,7 @@ public:
 		ck(CreateDXGIFactory1(__uuidof(IDXGIFactory1), (void **)factory.GetAddressOf()));
 		ck(factory->EnumAdapters(0, adapter.GetAddressOf()));
 
-		std::cout << "Initialized duplication stream\n";
+		LOG(INFO) << "Initialized duplication stream";
 
 		ck(adapter->EnumOutputs(0, output.GetAddressOf()));
 		ck(output->QueryInterface(__uuidof(IDXGIOutput1), (void **)output1.GetAddressOf()));
@@ -152,14 +165,60 @@ private:
 };
 
 
+// the encoder input itself stays in the NvEncoderD3D11 buffer; the queue carries the capture time and the packets
+struct CapturedFrame
+{
+	std::vector<std::vector<uint8_t>> vPacket;
+	int64_t nCaptureTimeUs;	// recording time, pauses excluded
+	int64_t nPausedUs;		// total time paused so far, to map nCaptureTimeUs back to the wall clock
+	bool bResumed;			// first frame of the recording or after a pause
+	FrameChanges changes;	// regions that changed since the previous frame
+};
+
+static_assert(sizeof(ScreenRect) == sizeof(RECT) && sizeof(ScreenMoveRect) == sizeof(DXGI_OUTDUPL_MOVE_RECT), "duplication metadata layout");
+
+// the move and dirty rects of an acquired frame, stored in vMetadata; without them the whole frame counts as changed
+static void GetFrameChanges(IDXGIOutputDuplication *pDuplication, const DXGI_OUTDUPL_FRAME_INFO &frameInfo, std::vector<uint8_t> &vMetadata, FrameChanges *pChanges)
+{
+	*pChanges = FrameChanges();
+	if (frameInfo.LastPresentTime.QuadPart == 0)
+	{
+		// only the mouse pointer moved; the desktop image is the same
+		pChanges->bFullFrame = false;
+		return;
+	}
+	if (frameInfo.TotalMetadataBufferSize == 0)
+		return;
+	if (vMetadata.size() < frameInfo.TotalMetadataBufferSize)
+		vMetadata.resize(frameInfo.TotalMetadataBufferSize);
+
+	UINT nMoveBytes = 0, nDirtyBytes = 0;
+	if (FAILED(pDuplication->GetFrameMoveRects((UINT)vMetadata.size(), (DXGI_OUTDUPL_MOVE_RECT *)vMetadata.data(), &nMoveBytes)))
+		return;
+	if (FAILED(pDuplication->GetFrameDirtyRects((UINT)vMetadata.size() - nMoveBytes, (RECT *)(vMetadata.data() + nMoveBytes), &nDirtyBytes)))
+		return;
+	pChanges->pMoveRect = (const ScreenMoveRect *)vMetadata.data();
+	pChanges->nMoveRects = nMoveBytes / sizeof(DXGI_OUTDUPL_MOVE_RECT);
+	pChanges->pDirtyRect = (const ScreenRect *)(vMetadata.data() + nMoveBytes);
+	pChanges->nDirtyRects = nDirtyBytes / sizeof(RECT);
+	pChanges->bFullFrame = false;
+}
+
 struct producerThreadParams
 {
-	Queue<std::vector<std::vector<uint8_t>>*> *frameQueue;
+	Queue<CapturedFrame*> *frameQueue;
 	ComPtr<IDXGIOutputDuplication> duplication;
 	ComPtr<ID3D11DeviceContext> pContext;
 	Queue<UINT8> *waitQueue;
 	NvEncoderD3D11 *enc;
 	int totalFrames;
+	RecorderControl *pControl;
+	RecorderMetrics *pMetrics;
+	StartupTimer *pTimer;
+	std::chrono::steady_clock::time_point tStart;
+	// service mode: a copy of the last desktop image, so that a recording can start before the desktop changes
+	ID3D11Texture2D *pTexLast;
+	bool *pbHasLastFrame;
 };
 
 
@@ -167,11 +226,14 @@ DWORD WINAPI frameProducer(LPVOID threadParam)
 {
 	producerThreadParams *prodStruct = (producerThreadParams *)threadParam;
 
-	Queue<std::vector<std::vector<uint8_t>>*> *frameQueue = prodStruct->frameQueue;
+	Queue<CapturedFrame*> *frameQueue = prodStruct->frameQueue;
 	Queue<UINT8> *waitQueue = prodStruct->waitQueue;
 	ComPtr<IDXGIOutputDuplication> duplication = prodStruct->duplication;
 	NvEncoderD3D11 *enc = prodStruct->enc;
 	ComPtr<ID3D11DeviceContext> pContext = prodStruct->pContext;
+	RecorderControl *pControl = prodStruct->pControl;
+	RecorderMetrics *pMetrics = prodStruct->pMetrics;
+	pMetrics->RegisterCurrentThread("producer");
 
 	DXGI_OUTDUPL_FRAME_INFO frame_info;
 	DXGI_MAPPED_RECT mapped_rect;
@@ -180,27 +242,65 @@ DWORD WINAPI frameProducer(LPVOID threadParam)
 	std::chrono::microseconds period{ 1000000 / FPS_DEFAULT };
 
 	UINT32 frames = 0;
+	int64_t nPausedUs = 0, nWaitUs = 0;
+	bool bResumed = true;
+	// dirty/move rects of the frame in flight; the consumer reads them before the next frame is acquired
+	std::vector<uint8_t> vMetadata;
 
-	while (frames < prodStruct->totalFrames)
+	// a pause parks the thread here between frames; the encoder and the duplication stay warm
+	while (pControl->WaitWhilePaused(&nWaitUs))
 	{
-		std::cout << frameQueue->size() << " frame captured" << std::endl;
+		nPausedUs += nWaitUs;
+		bResumed = bResumed || nWaitUs > 0;
+		LOG(TRACE) << frameQueue->size() << " frame captured";
+		BINLOG("frame %u captured, queue depth %u", frames, (uint32_t)frameQueue->size());
 		ComPtr<IDXGIResource> desktop_resource;
 		ComPtr<ID3D11Texture2D> screenTex;
-		std::vector<std::vector<uint8_t>> vPacket;
+		CapturedFrame capturedFrame;
+		bool bAcquired;
 
 		sclock::time_point currentTime = sclock::now();
 
-		duplication->AcquireNextFrame(1000, &frame_info, desktop_resource.GetAddressOf());
-		ck(desktop_resource->QueryInterface(__uuidof(ID3D11Texture2D), (void**)screenTex.GetAddressOf()));
-		duplication->MapDesktopSurface(&mapped_rect);
-
-		// now the NvEncoderD3D11 is in a state that waits for the next gpu frame to be processed
-		const NvEncInputFrame* encoderInputFrame = enc->GetNextInputFrame();
-		// the encoderInputFrame->inputPtr needs firstly to reinterpret_cast its empty pointer and the gpu D3D11 texture will be copied into it
-		ID3D11Texture2D *pTexBgra = reinterpret_cast<ID3D11Texture2D*>(encoderInputFrame->inputPtr);
-		pContext->CopyResource(pTexBgra, screenTex.Get());
+		{
+			StageTimer captureTimer(pMetrics, RecorderMetrics::STAGE_CAPTURE);
+			// duplication only returns a frame once the desktop changes; a warm recorder starts with the last one it saw instead of waiting
+			bool bReuseLast = frames == 0 && prodStruct->pTexLast && *prodStruct->pbHasLastFrame;
+			bAcquired = duplication->AcquireNextFrame(bReuseLast ? 0 : 1000, &frame_info, desktop_resource.GetAddressOf()) != DXGI_ERROR_WAIT_TIMEOUT;
+			if (!bAcquired && !bReuseLast)
+			{
+				pMetrics->nFramesDropped++;
+				continue;
+			}
+			capturedFrame.nCaptureTimeUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - prodStruct->tStart).count() - nPausedUs;
+			capturedFrame.nPausedUs = nPausedUs;
+			capturedFrame.bResumed = bResumed;
+			bResumed = false;
+			if (bAcquired)
+			{
+				ck(desktop_resource->QueryInterface(__uuidof(ID3D11Texture2D), (void**)screenTex.GetAddressOf()));
+				duplication->MapDesktopSurface(&mapped_rect);
+			}
+			// the first frame of a recording is an IDR, whatever changed
+			if (bAcquired && frames > 0)
+				GetFrameChanges(duplication.Get(), frame_info, vMetadata, &capturedFrame.changes);
+
+			// now the NvEncoderD3D11 is in a state that waits for the next gpu frame to be processed
+			const NvEncInputFrame* encoderInputFrame = enc->GetNextInputFrame();
+			// the encoderInputFrame->inputPtr needs firstly to reinterpret_cast its empty pointer and the gpu D3D11 texture will be copied into it
+			ID3D11Texture2D *pTexBgra = reinterpret_cast<ID3D11Texture2D*>(encoderInputFrame->inputPtr);
+			pContext->CopyResource(pTexBgra, bAcquired ? screenTex.Get() : prodStruct->pTexLast);
+			if (bAcquired && prodStruct->pTexLast)
+			{
+				pContext->CopyResource(prodStruct->pTexLast, screenTex.Get());
+				*prodStruct->pbHasLastFrame = true;
+			}
+		}
+		if (frames == 0)
+			prodStruct->pTimer->Mark("first capture");
 
-		frameQueue->push(&vPacket);
+		frameQueue->push(&capturedFrame);
+		pMetrics->nFramesCaptured++;
+		pMetrics->nCaptureQueueDepth = frameQueue->size();
 
 		sclock::time_point nextTime = currentTime + period;
 
@@ -210,180 +310,456 @@ DWORD WINAPI frameProducer(LPVOID threadParam)
 
 		waitQueue->pop();
 
-		duplication->ReleaseFrame();
+		if (bAcquired)
+			duplication->ReleaseFrame();
 
+		// -dur counts recorded frames, pauses excluded
+		if (frames >= (UINT32)prodStruct->totalFrames)
+			pControl->Stop();
 	}
 
-	std::cout << "There are " << frameQueue->size() << " frames remaining in queue" << std::endl;
+	// NULL tells the consumer to flush the encoder
+	frameQueue->push(NULL);
+	LOG(INFO) << "There are " << frameQueue->size() << " frames remaining in queue";
 	return 0;
 }
 
 struct consumerThreadParams
 {
-	Queue<std::vector<std::vector<uint8_t>>*> *frameQueue;
+	Queue<CapturedFrame*> *frameQueue;
 	NvEncoderD3D11 *enc;
-	std::ofstream *fpOutWriter;
+	PacketDistributor *pDistributor;
+	int64_t nWallClockStartUs;
 	Queue<UINT8> *waitQueue;
-	int totalFrames;
+	RecorderMetrics *pMetrics;
+	StartupTimer *pTimer;
+	RateController *pRateController;	// NULL: the rate control set at initialization is kept
+	QpMapBuilder *pQpMapBuilder;		// NULL: no QP delta map
+	MotionHintBuilder *pMotionHintBuilder;	// NULL: no external ME hints
+	int nWidth, nHeight;
 };
 
 DWORD WINAPI frameConsumer(LPVOID threadParam)
 {
 	consumerThreadParams *consStruct = (consumerThreadParams *)threadParam;
 
-	Queue<std::vector<std::vector<uint8_t>>*> *frameQueue = consStruct->frameQueue;
+	Queue<CapturedFrame*> *frameQueue = consStruct->frameQueue;
 	NvEncoderD3D11 *enc = consStruct->enc;
-	std::ofstream *fpOut = consStruct->fpOutWriter;
+	PacketDistributor *pDistributor = consStruct->pDistributor;
+	std::vector<NvEncOutputPacketInfo> vPacketInfo;
 	Queue<UINT8> *waitQueue = consStruct->waitQueue;
+	RecorderMetrics *pMetrics = consStruct->pMetrics;
+	RateController *pRateController = consStruct->pRateController;
+	QpMapBuilder *pQpMapBuilder = consStruct->pQpMapBuilder;
+	MotionHintBuilder *pMotionHintBuilder = consStruct->pMotionHintBuilder;
+	pMetrics->RegisterCurrentThread("consumer");
 
 	UINT32 frames = 0;
 	UINT8 done = 1;
+	CapturedFrame endFrame = {};
 
-	while (frames < consStruct->totalFrames)
+	while (true)
 	{
 		// queue's "frame" is actually an empty frame, that signals the consumer that the NvEncoderD3D11 has a gpu frame ready for encoding
 		auto frame = frameQueue->pop();
-
-		if(frames < consStruct->totalFrames-1)
-			enc->EncodeFrame(*frame);
+		pMetrics->nCaptureQueueDepth = frameQueue->size();
+		// NULL: the recording was stopped, only the frames still inside the encoder are left
+		bool bEnd = frame == NULL;
+		if (bEnd)
+			frame = &endFrame;
 		else
-			enc->EndEncode(*frame);
-
-		std::cout << frames << " frame encoded" << std::endl;
+			endFrame.nPausedUs = frame->nPausedUs;
+
+		int64_t nBacklogBytes = pDistributor->GetBacklogBytes();
+		pMetrics->nWriterBacklogBytes = nBacklogBytes;
+		if (pRateController && !bEnd)
+		{
+			pRateController->OnFrame(GetChangedArea(frame->changes, consStruct->nWidth, consStruct->nHeight), (int64_t)consStruct->nWidth * consStruct->nHeight);
+			if (pRateController->Update(frame->nCaptureTimeUs, nBacklogBytes))
+			{
+				pRateController->Reconfigure(enc);
+				pMetrics->nTargetBitrate = pRateController->GetBitrate();
+				LOG(INFO) << "Rate adapted to " << pRateController->GetBitrate() / 1000 << " kbps (QP " << pRateController->GetQp() << " in constant QP mode), screen activity "
+					<< (int)(pRateController->GetActivity() * 100) << "%, backlog " << nBacklogBytes / 1024 << " KB";
+			}
+		}
 
-		// the frame-to-disk writing part of code will be highly more efficient to get out of this loop
-		for (std::vector<uint8_t> &packet : *frame){
-			fpOut->write(reinterpret_cast<char*>(packet.data()), packet.size());
+		{
+			StageTimer encodeTimer(pMetrics, RecorderMetrics::STAGE_ENCODE);
+			NV_ENC_PIC_PARAMS picParams = { NV_ENC_PIC_PARAMS_VER };
+			picParams.inputTimeStamp = frame->nCaptureTimeUs;
+			// a sink starting a new segment or resyncing after drops needs a self-contained IDR,
+			// and so does a resumed recording, so that it can be cut at the pause
+			if (frame->bResumed || pDistributor->IsKeyFrameWanted())
+				picParams.encodePicFlags |= NV_ENC_PIC_FLAG_FORCEIDR | NV_ENC_PIC_FLAG_OUTPUT_SPSPPS;
+			if (pQpMapBuilder && !bEnd)
+			{
+				picParams.qpDeltaMap = pQpMapBuilder->Build(frame->changes);
+				picParams.qpDeltaMapSize = pQpMapBuilder->GetMapSize();
+			}
+			if (pMotionHintBuilder && !bEnd)
+				pMotionHintBuilder->Build(frame->changes, &picParams);
+			if (!bEnd)
+				enc->EncodeFrame(frame->vPacket, vPacketInfo, &picParams);
+			else
+				enc->EndEncode(frame->vPacket, vPacketInfo);
 		}
+		if (!bEnd)
+			pMetrics->nFramesEncoded++;
+
+		LOG(TRACE) << frames << " frame encoded";
+		BINLOG("frame %u encoded, %u packets", frames, (uint32_t)frame->vPacket.size());
+
+		// writing happens on the sink threads; here the packets are only handed over
+		{
+			StageTimer writeTimer(pMetrics, RecorderMetrics::STAGE_WRITE);
+			for (size_t i = 0; i < frame->vPacket.size(); i++){
+				std::shared_ptr<EncodedPacket> pPacket = std::make_shared<EncodedPacket>();
+				pPacket->vData = std::move(frame->vPacket[i]);
+				pPacket->nTimestampUs = (int64_t)vPacketInfo[i].timestamp;
+				pPacket->nCaptureTimeUs = consStruct->nWallClockStartUs + frame->nPausedUs + pPacket->nTimestampUs;
+				pPacket->bKeyFrame = vPacketInfo[i].pictureType == NV_ENC_PIC_TYPE_IDR;
+				pMetrics->nBytesEncoded += pPacket->vData.size();
+				if (pRateController)
+					pRateController->OnPacket(pPacket->vData.size());
+				pDistributor->Deliver(pPacket);
+				pMetrics->nBytesWritten += pPacket->vData.size();
+				BINLOG("packet delivered, %u bytes", (uint32_t)pPacket->vData.size());
+			}
+		}
+		if (frames == 0 && !bEnd)
+			consStruct->pTimer->Mark("first frame");
 
+		if (bEnd)
+			break;
 		frames++;
 		
 		std::this_thread::sleep_for(std::chrono::microseconds(1000));
 		waitQueue->push(done); // inform the producer thread that the frame is processed
 	}
 
-	std::cout << "Finished encoding/writing of video!" << std::endl;
+	LOG(INFO) << "Finished encoding/writing of video!";
 	return 0;
 }
 
-void Screens2Video(int nWidth, int nHeight, char *szOutFilePath, NvEncoderInitParam *pEncodeCLIOptions, int iGpu, int duration)
+/**
+*  @brief Desktop duplication feeding NvEncoderD3D11 through the producer/consumer threads.
+*  The device, the encoder session with its input/output buffers and the duplication are
+*  created once, so the same pipeline can run any number of recordings.
+*/
+class D3D11RecordingPipeline : public RecordingPipeline
 {
-	Queue<std::vector<std::vector<uint8_t>>*> frameQueue;
-	Queue<UINT8> waitQueue;
-
-    ComPtr<ID3D11Device> pDevice;
-    ComPtr<ID3D11DeviceContext> pContext;
-    ComPtr<IDXGIFactory1> pFactory;
-    ComPtr<IDXGIAdapter> pAdapter;
-    ComPtr<ID3D11Texture2D> pTexSysMem;
-
-	// D3D11 adapter GPU resource allocation - this will feed the NvEncoderD3D11 encoder
-    ck(CreateDXGIFactory1(__uuidof(IDXGIFactory1), (void **)pFactory.GetAddressOf()));
-    ck(pFactory->EnumAdapters(iGpu, pAdapter.GetAddressOf()));
-    ck(D3D11CreateDevice(pAdapter.Get(), D3D_DRIVER_TYPE_UNKNOWN, NULL, D3D11_CREATE_DEVICE_BGRA_SUPPORT,
-        NULL, 0, D3D11_SDK_VERSION, pDevice.GetAddressOf(), NULL, pContext.GetAddressOf()));
-    DXGI_ADAPTER_DESC adapterDesc;
-    pAdapter->GetDesc(&adapterDesc);
-    char szDesc[80];
-    wcstombs(szDesc, adapterDesc.Description, sizeof(szDesc));
-    std::cout << "GPU in use: " << szDesc << std::endl;
-
-	// Following parameters determine the D3D11 texture grabbing
-    D3D11_TEXTURE2D_DESC desc;
-    ZeroMemory(&desc, sizeof(D3D11_TEXTURE2D_DESC));
-    desc.Width = nWidth;
-    desc.Height = nHeight;
-    desc.MipLevels = 1;
-    desc.ArraySize = 1;
-    desc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
-    desc.SampleDesc.Count = 1;
-    desc.Usage = D3D11_USAGE_STAGING;
-    desc.BindFlags = 0;
-    desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
-    ck(pDevice->CreateTexture2D(&desc, NULL, pTexSysMem.GetAddressOf()));
-
-    std::unique_ptr<RGBToNV12ConverterD3D11> pConverter;
-
-    NvEncoderD3D11 enc(pDevice.Get(), nWidth, nHeight, NV_ENC_BUFFER_FORMAT_ARGB);
-
-    NV_ENC_INITIALIZE_PARAMS initializeParams = { NV_ENC_INITIALIZE_PARAMS_VER };
-    NV_ENC_CONFIG encodeConfig = { NV_ENC_CONFIG_VER };
-    initializeParams.encodeConfig = &encodeConfig;
-    enc.CreateDefaultEncoderParams(&initializeParams, pEncodeCLIOptions->GetEncodeGUID(), pEncodeCLIOptions->GetPresetGUID());
-
-    pEncodeCLIOptions->SetInitParams(&initializeParams, NV_ENC_BUFFER_FORMAT_ARGB);
-
-    enc.CreateEncoder(&initializeParams);
-
-	// **** DUPLICATION
-	ComPtr<IDXGIOutputDuplication> duplication = pConverter->init_duplication(pDevice.Get());
-	DXGI_MAPPED_RECT mapped_rect;
-	// ****
-
-
-    std::ofstream fpOut(szOutFilePath, std::ios::out | std::ios::binary);
-    if (!fpOut){
-        std::ostringstream err;
-        err << "Unable to open output file: " << szOutFilePath << std::endl;
-        throw std::invalid_argument(err.str());
-    }
+public:
+	D3D11RecordingPipeline(int nWidth, int nHeight, NvEncoderInitParam *pEncodeCLIOptions, int iGpu, const RecorderOptions &recOptions)
+		: nWidth(nWidth), nHeight(nHeight), pEncodeCLIOptions(pEncodeCLIOptions), iGpu(iGpu), recOptions(recOptions) {}
 
-	HANDLE producerThread, consumerThread;
-	DWORD producerThreadID, consumerThreadID;
+	~D3D11RecordingPipeline()
+	{
+		if (pEnc)
+			pEnc->DestroyEncoder();
+	}
 
-	LARGE_INTEGER frequency;
-	LARGE_INTEGER start;
-	LARGE_INTEGER end;
-	double elapsedSeconds;
+	void Init(StartupTimer &timer)
+	{
+		// loading the driver's encode library does not need the device, so it overlaps with its creation
+		std::future<bool> apiLoaded = std::async(std::launch::async, [&timer]() {
+			StartupTimer::Scope scope(timer, "encode api");
+			return NvEncoder::PreloadNvEncApi();
+		});
+
+		// D3D11 adapter GPU resource allocation - this will feed the NvEncoderD3D11 encoder
+		ComPtr<IDXGIFactory1> pFactory;
+		ComPtr<IDXGIAdapter> pAdapter;
+		ck(CreateDXGIFactory1(__uuidof(IDXGIFactory1), (void **)pFactory.GetAddressOf()));
+		ck(pFactory->EnumAdapters(iGpu, pAdapter.GetAddressOf()));
+		ck(D3D11CreateDevice(pAdapter.Get(), D3D_DRIVER_TYPE_UNKNOWN, NULL, D3D11_CREATE_DEVICE_BGRA_SUPPORT,
+			NULL, 0, D3D11_SDK_VERSION, pDevice.GetAddressOf(), NULL, pContext.GetAddressOf()));
+		DXGI_ADAPTER_DESC adapterDesc;
+		pAdapter->GetDesc(&adapterDesc);
+		char szDesc[80];
+		wcstombs(szDesc, adapterDesc.Description, sizeof(szDesc));
+		LOG(INFO) << "GPU in use: " << szDesc;
+		timer.Mark("device");
+
+		// the capture side only needs the (free-threaded) device: it is set up while the encoder session opens
+		std::future<void> captureReady = std::async(std::launch::async, [this, &timer]() {
+			StartupTimer::Scope scope(timer, "capture");
+			// Following parameters determine the D3D11 texture grabbing
+			D3D11_TEXTURE2D_DESC desc;
+			ZeroMemory(&desc, sizeof(D3D11_TEXTURE2D_DESC));
+			desc.Width = nWidth;
+			desc.Height = nHeight;
+			desc.MipLevels = 1;
+			desc.ArraySize = 1;
+			desc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+			desc.SampleDesc.Count = 1;
+			desc.Usage = D3D11_USAGE_STAGING;
+			desc.BindFlags = 0;
+			desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+			ck(pDevice->CreateTexture2D(&desc, NULL, pTexSysMem.GetAddressOf()));
+			if (recOptions.bDaemon)
+			{
+				desc.Usage = D3D11_USAGE_DEFAULT;
+				desc.CPUAccessFlags = 0;
+				ck(pDevice->CreateTexture2D(&desc, NULL, pTexLast.GetAddressOf()));
+			}
+
+			// **** DUPLICATION
+			duplication = RGBToNV12ConverterD3D11::init_duplication(pDevice.Get());
+			// ****
+		});
+
+		// a missing library is reported by the encoder constructor
+		apiLoaded.wait();
+		pEnc.reset(new NvEncoderD3D11(pDevice.Get(), nWidth, nHeight, NV_ENC_BUFFER_FORMAT_ARGB));
+		timer.Mark("encoder session");
+
+		NV_ENC_INITIALIZE_PARAMS initializeParams = { NV_ENC_INITIALIZE_PARAMS_VER };
+		NV_ENC_CONFIG encodeConfig = { NV_ENC_CONFIG_VER };
+		initializeParams.encodeConfig = &encodeConfig;
+		pEnc->CreateDefaultEncoderParams(&initializeParams, pEncodeCLIOptions->GetEncodeGUID(), pEncodeCLIOptions->GetPresetGUID());
+
+		pEncodeCLIOptions->SetInitParams(&initializeParams, NV_ENC_BUFFER_FORMAT_ARGB);
+		bool bHevc = pEncodeCLIOptions->IsCodecHEVC();
+		if (recOptions.bRoi)
+		{
+			encodeConfig.rcParams.qpMapMode = NV_ENC_QP_MAP_DELTA;
+			// the HEVC map has one delta per CTB; pin the CTB size the map is built for
+			if (bHevc)
+				encodeConfig.encodeCodecConfig.hevcConfig.maxCUSize = NV_ENC_HEVC_CUSIZE_32x32;
+		}
+		// the hints describe the motion from the previous captured frame, which only a P frame references
+		bool bMeHints = recOptions.bMeHints && encodeConfig.frameIntervalP <= 1 && !bHevc;
+		if (recOptions.bMeHints && !bMeHints)
+			LOG(WARNING) << "-mehints is ignored " << (bHevc ? "with HEVC (the hints are per H.264 macroblock)" : "with B frames");
+		if (bMeHints)
+			MotionHintBuilder::SetInitParams(&initializeParams);
+
+		// marks "encoder init" and "encoder buffers"; the buffers of the other slots are created by the first frames
+		pEnc->SetInitPhaseCallback([&timer](const char *szPhase) { timer.Mark(szPhase); });
+		pEnc->CreateEncoder(&initializeParams);
+		pEnc->SetInitPhaseCallback(nullptr);
+		bBFrames = encodeConfig.frameIntervalP > 1;
+		metrics.nTargetBitrate = encodeConfig.rcParams.averageBitRate;
+		if (recOptions.nAdaptMinKbps > 0)
+		{
+			RateControlOptions rateOptions;
+			rateOptions.nMinBitrate = recOptions.nAdaptMinKbps * 1000;
+			rateOptions.nMaxBitrate = recOptions.nAdaptMaxKbps * 1000;
+			pRateController.reset(new RateController(rateOptions, encodeConfig.rcParams.averageBitRate));
+		}
+		if (recOptions.bRoi)
+		{
+			// a map has to outlive every frame the encoder still holds
+			QpMapOptions qpMapOptions;
+			qpMapOptions.nPoolSize = pEnc->GetEncoderBufferCount() + 1;
+			qpMapOptions.nBlockSize = bHevc ? 32 : 16;
+			pQpMapBuilder.reset(new QpMapBuilder(nWidth, nHeight, qpMapOptions));
+		}
+		if (bMeHints)
+			pMotionHintBuilder.reset(new MotionHintBuilder(nWidth, nHeight, pEnc->GetEncoderBufferCount() + 1));
 
-    int nSize = nWidth * nHeight * 4;
-    std::unique_ptr<uint8_t[]> pHostFrame(new uint8_t[nSize]);
-	int totalFrames = FPS_DEFAULT * duration;
-    int nFrame = 0;
-	int idx = 0;
+		captureReady.get();
+	}
 
-	// prepare the consumer's (video-writer) thread parameters
-	consumerThreadParams consStruct;
-	consStruct.frameQueue = &frameQueue;
-	consStruct.fpOutWriter = &fpOut;
-	consStruct.totalFrames = totalFrames;
-	consStruct.enc = &enc;
-	consStruct.waitQueue = &waitQueue;
+	void GetSequenceParams(std::vector<uint8_t> &vSeqParams)
+	{
+		pEnc->GetSequenceParams(vSeqParams);
+	}
 
-	consumerThread = CreateThread(0, 0, frameConsumer, (LPVOID)&consStruct, 0, &consumerThreadID);
-	SetThreadPriority(consumerThread, THREAD_PRIORITY_HIGHEST);
+	bool HasBFrames() const { return bBFrames; }
 
-	// prepare the producer's (video-writer) thread parameters
-	producerThreadParams prodStruct;
-	prodStruct.frameQueue = &frameQueue;
-	prodStruct.duplication = duplication;
-	prodStruct.enc = &enc;
-	prodStruct.totalFrames = totalFrames;
-	prodStruct.pContext = pContext;
-	prodStruct.waitQueue = &waitQueue;
+	void Run(PacketDistributor *pDistributor, RecorderControl *pControl, StartupTimer &timer)
+	{
+		HANDLE producerThread, consumerThread;
+		DWORD producerThreadID, consumerThreadID;
+
+		LARGE_INTEGER frequency;
+		LARGE_INTEGER start;
+		LARGE_INTEGER end;
+		double elapsedSeconds;
+
+		// without -dur the recording runs until it is stopped through the control channel
+		int totalFrames = recOptions.nDuration > 0 ? FPS_DEFAULT * recOptions.nDuration : INT_MAX;
+
+		// prepare the consumer's (video-writer) thread parameters
+		consumerThreadParams consStruct;
+		consStruct.frameQueue = &frameQueue;
+		consStruct.pDistributor = pDistributor;
+		consStruct.enc = pEnc.get();
+		consStruct.waitQueue = &waitQueue;
+		consStruct.pMetrics = &metrics;
+		consStruct.pTimer = &timer;
+		consStruct.pRateController = pRateController.get();
+		// the capture timestamps of every recording start at 0
+		if (pRateController)
+			pRateController->Reset();
+		consStruct.pQpMapBuilder = pQpMapBuilder.get();
+		consStruct.pMotionHintBuilder = pMotionHintBuilder.get();
+		consStruct.nWidth = nWidth;
+		consStruct.nHeight = nHeight;
+
+		// capture timestamps are relative to tStart; the RTP preview carries them as wall clock time
+		std::chrono::steady_clock::time_point tStart = std::chrono::steady_clock::now();
+		consStruct.nWallClockStartUs = RtpWallClockUs();
+
+		consumerThread = CreateThread(0, 0, frameConsumer, (LPVOID)&consStruct, 0, &consumerThreadID);
+		SetThreadPriority(consumerThread, THREAD_PRIORITY_HIGHEST);
+
+		// prepare the producer's (video-writer) thread parameters
+		producerThreadParams prodStruct;
+		prodStruct.frameQueue = &frameQueue;
+		prodStruct.duplication = duplication;
+		prodStruct.enc = pEnc.get();
+		prodStruct.totalFrames = totalFrames;
+		prodStruct.pControl = pControl;
+		prodStruct.pContext = pContext;
+		prodStruct.waitQueue = &waitQueue;
+		prodStruct.pMetrics = &metrics;
+		prodStruct.pTimer = &timer;
+		prodStruct.tStart = tStart;
+		prodStruct.pTexLast = pTexLast.Get();
+		prodStruct.pbHasLastFrame = &bHasLastFrame;
+
+		// producer thread is of "critical" priority because of desired FPS
+		producerThread = CreateThread(0, 0, frameProducer, (LPVOID)&prodStruct, 0, &producerThreadID);
+		SetThreadPriority(producerThread, THREAD_PRIORITY_HIGHEST);
+
+		QueryPerformanceFrequency(&frequency);
+		QueryPerformanceCounter(&start);
+
+		// Firstly wait for frameProducer to return and then for frameConsumer
+		WaitForSingleObject(producerThread, INFINITE);
+
+		QueryPerformanceCounter(&end);
+		elapsedSeconds = (end.QuadPart - start.QuadPart) / (double)frequency.QuadPart;
+		LOG(INFO) << "Elapsed recording time: " << elapsedSeconds << " seconds";
+
+		WaitForSingleObject(consumerThread, INFINITE);
+		CloseHandle(producerThread);
+		CloseHandle(consumerThread);
+	}
 
-	// producer thread is of "critical" priority because of desired FPS
-	producerThread = CreateThread(0, 0, frameProducer, (LPVOID)&prodStruct, 0, &producerThreadID);
-	SetThreadPriority(producerThread, THREAD_PRIORITY_HIGHEST);
+	RecorderMetrics &GetMetrics() { return metrics; }
 
-	QueryPerformanceFrequency(&frequency);
-	QueryPerformanceCounter(&start);
+private:
+	int nWidth, nHeight;
+	NvEncoderInitParam *pEncodeCLIOptions;
+	int iGpu;
+	RecorderOptions recOptions;
 
-	// Firstly wait for frameProducer to return and then for frameConsumer
-	WaitForSingleObject(producerThread, INFINITE);
+	ComPtr<ID3D11Device> pDevice;
+	ComPtr<ID3D11DeviceContext> pContext;
+	ComPtr<ID3D11Texture2D> pTexSysMem;
+	ComPtr<ID3D11Texture2D> pTexLast;
+	bool bHasLastFrame = false;
+	bool bBFrames = false;
+	std::unique_ptr<NvEncoderD3D11> pEnc;
+	std::unique_ptr<RateController> pRateController;
+	std::unique_ptr<QpMapBuilder> pQpMapBuilder;
+	std::unique_ptr<MotionHintBuilder> pMotionHintBuilder;
+	ComPtr<IDXGIOutputDuplication> duplication;
 
-	QueryPerformanceCounter(&end);
-	elapsedSeconds = (end.QuadPart - start.QuadPart) / (double)frequency.QuadPart;
-	std::cout << "Elapsed recording time: " << elapsedSeconds << " seconds" << std::endl;
+	Queue<CapturedFrame*> frameQueue;
+	Queue<UINT8> waitQueue;
+	RecorderMetrics metrics;
+};
 
-	WaitForSingleObject(consumerThread, INFINITE);
+/**
+*  @brief Adds the outputs of one recording to distributor; eCodec is the codec of the encoder
+*  session, for the seek indexes. The returned object (the replay trigger, if any) must be
+*  released before the distributor is closed. Throws std::invalid_argument for an .mp4 path
+*  with an HEVC session or B frames.
+*/
+std::shared_ptr<void> AddRecorderSinks(PacketDistributor &distributor, const std::string &strOutFilePath, int nWidth, int nHeight, const std::vector<uint8_t> &vSeqParams, NalCodec eCodec, bool bBFrames, const RecorderOptions &recOptions)
+{
+	// -o is checked at parse time, but a daemon "record" command can name any path
+	if (eCodec != NAL_CODEC_H264 && SegmentFile::IsMp4Path(strOutFilePath))
+	{
+		throw std::invalid_argument("MP4 output is only supported for H.264: " + strOutFilePath);
+	}
+	// the MP4 writers take the presentation time as the decode time, which runs backwards with B frames
+	if (bBFrames && SegmentFile::IsMp4Path(strOutFilePath))
+	{
+		throw std::invalid_argument("MP4 output is not supported with B frames, use -bf 0: " + strOutFilePath);
+	}
+	// every output is a sink of the distributor; an .mp4 output is muxed on the fly, anything else gets the raw Annex-B stream
+	Mp4WriterOptions mp4Options;
+	mp4Options.bFragmented = recOptions.nFragmentFrames >= 0;
+	mp4Options.nFragmentFrames = recOptions.nFragmentFrames;
+	// in replay mode nothing is written until a dump is triggered
+	std::shared_ptr<ReplayTrigger> pReplayTrigger;
+	if (recOptions.nReplaySeconds > 0)
+	{
+		ReplayOptions replayOptions;
+		replayOptions.nSeconds = recOptions.nReplaySeconds;
+		replayOptions.nMaxBytes = (uint64_t)recOptions.nReplayMB << 20;
+		replayOptions.mp4Options = mp4Options;
+		replayOptions.bIndex = recOptions.bIndex;
+		ReplayBuffer *pReplayBuffer = new ReplayBuffer(strOutFilePath, nWidth, nHeight, vSeqParams, replayOptions, eCodec);
+		distributor.AddSink(pReplayBuffer, "replay", DISK_QUEUE_PACKETS, PACKET_DROP_NEVER);
+		pReplayTrigger.reset(new ReplayTrigger([pReplayBuffer](int nSeconds) { return pReplayBuffer->Dump(nSeconds); }, (unsigned short)recOptions.nReplayPort));
+		LOG(INFO) << "Replay mode: keeping the last " << recOptions.nReplaySeconds << " seconds, dump with Ctrl+Break" << (recOptions.nReplayPort ? " or the trigger port" : "");
+	}
+	else if (recOptions.nSegmentSeconds > 0 || recOptions.nSegmentMB > 0)
+	{
+		SegmentOptions segOptions;
+		segOptions.nDurationSec = recOptions.nSegmentSeconds;
+		segOptions.nMaxBytes = (uint64_t)recOptions.nSegmentMB << 20;
+		segOptions.mp4Options = mp4Options;
+		segOptions.bIndex = recOptions.bIndex;
+		segOptions.funcSegmentClosed = [](const std::string &strPath) { LOG(INFO) << "Segment saved in file " << strPath; };
+		distributor.AddSink(new SegmentPacketSink(strOutFilePath, nWidth, nHeight, vSeqParams, segOptions, eCodec), "segments", DISK_QUEUE_PACKETS, PACKET_DROP_NEVER);
+	}
+	else if (SegmentFile::IsMp4Path(strOutFilePath))
+	{
+		distributor.AddSink(new Mp4PacketSink(strOutFilePath, nWidth, nHeight, vSeqParams, mp4Options), "mp4", DISK_QUEUE_PACKETS, PACKET_DROP_NEVER);
+	}
+	else
+	{
+		distributor.AddSink(new FilePacketSink(strOutFilePath, recOptions.bIndex, eCodec), "file", DISK_QUEUE_PACKETS, PACKET_DROP_NEVER);
+	}
 
-	enc.DestroyEncoder();
+	// a slow network only costs preview frames, never recorded ones
+	if (!recOptions.strRtpHost.empty())
+	{
+		RtpSenderOptions rtpOptions;
+		rtpOptions.nPaceMbps = recOptions.nRtpPaceMbps;
+		distributor.AddSink(new RtpPacketSink(recOptions.strRtpHost, (unsigned short)recOptions.nRtpPort, rtpOptions), "rtp", rtpOptions.nQueueFrames, PACKET_DROP_TO_KEYFRAME);
+	}
+	return pReplayTrigger;
+}
 
-	// close the recording file
-    fpOut.close();
+void Screens2Video(int nWidth, int nHeight, char *szOutFilePath, NvEncoderInitParam *pEncodeCLIOptions, int iGpu, const RecorderOptions &recOptions)
+{
+	D3D11RecordingPipeline pipeline(nWidth, nHeight, pEncodeCLIOptions, iGpu, recOptions);
+	NalCodec eCodec = pEncodeCLIOptions->IsCodecHEVC() ? NAL_CODEC_HEVC : NAL_CODEC_H264;
+	RecorderService service(&pipeline, [&](PacketDistributor &distributor, const std::string &strPath) {
+		std::vector<uint8_t> vSeqParams;
+		pipeline.GetSequenceParams(vSeqParams);
+		return AddRecorderSinks(distributor, strPath, nWidth, nHeight, vSeqParams, eCodec, pipeline.HasBFrames(), recOptions);
+	});
+
+	std::unique_ptr<MetricsServer> pMetricsServer;
+	if (recOptions.nMetricsPort > 0)
+	{
+		pMetricsServer.reset(new MetricsServer(&pipeline.GetMetrics(), (unsigned short)recOptions.nMetricsPort));
+	}
 
-    std::cout << "Recording has finished " << std::endl << "Saved in file " << szOutFilePath << std::endl;
+	// stdin commands, Ctrl+C and the optional control port drive the recording(s)
+	RecorderControl control(recOptions.bDaemon ? RECORDER_IDLE : (recOptions.bStartPaused ? RECORDER_PAUSED : RECORDER_RECORDING), &pipeline.GetMetrics());
+	std::unique_ptr<RecorderControlChannel> pControlChannel(new RecorderControlChannel(&control, (unsigned short)recOptions.nControlPort));
+	if (recOptions.bDaemon)
+	{
+		// the encoder session stays warm between recordings
+		service.Serve(&control, szOutFilePath);
+	}
+	else
+	{
+		LOG(INFO) << (recOptions.bStartPaused ? "Ready, type start to begin recording" : "Recording") << "; type pause, resume or stop (or press Ctrl+C) to control it";
+		service.Record(szOutFilePath, &control);
+	}
+	pControlChannel.reset();
 }
 
 
@@ -402,20 +778,31 @@ int main(int argc, char **argv)
 
     char szOutFilePath[256] = "screenRecording.h264";
     int nWidth = 1920, nHeight = 1080;
-	int duration = 20;
+	RecorderOptions recOptions;
 
     try
     {
         NvEncoderInitParam encodeCLIOptions;
         int iGpu = 0;
-        ParseCommandLine_AppEncD3D(argc, argv, nWidth, nHeight, szOutFilePath, encodeCLIOptions, iGpu, duration);
+        ParseCommandLine_AppEncD3D(argc, argv, nWidth, nHeight, szOutFilePath, encodeCLIOptions, iGpu, recOptions);
+        if (!recOptions.strBinLogPath.empty())
+        {
+            binlogger = new simplelogger::BinaryLogger(recOptions.strBinLogPath);
+        }
 
-        Screens2Video( nWidth, nHeight, szOutFilePath, &encodeCLIOptions, iGpu, duration);
+        Screens2Video( nWidth, nHeight, szOutFilePath, &encodeCLIOptions, iGpu, recOptions);
     }
     catch (const std::exception &ex)
     {
+        delete binlogger;
+        delete logger;
+        logger = NULL;
         std::cout << ex.what();
         exit(1);
     }
+    // drains the asynchronous logger before the process exits
+    delete binlogger;
+    delete logger;
+    logger = NULL;
     return 0;
 }
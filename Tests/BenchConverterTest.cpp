@@ -0,0 +1,25 @@
+#include <gtest/gtest.h>
+#include <vector>
+#include "../Bench/BenchPipeline.h"
+
+simplelogger::Logger *logger = NULL;
+
+// Every thread count has to convert every row, exactly as one thread does
+TEST(BenchConverter, BandsCoverTheFrame) {
+    const int aaSize[][2] = { { 1920, 1080 }, { 1280, 720 }, { 64, 6 }, { 32, 2 } };
+    for (auto &size : aaSize) {
+        int nWidth = size[0], nHeight = size[1];
+        std::vector<uint8_t> vBgra((size_t)nWidth * nHeight * 4);
+        for (size_t i = 0; i < vBgra.size(); i++) {
+            vBgra[i] = (uint8_t)(i * 31 + i / 4096);
+        }
+        size_t nNv12 = (size_t)nWidth * nHeight * 3 / 2;
+        std::vector<uint8_t> vExpected(nNv12, 0xCD);
+        Bgra32ToNv12(vBgra.data(), nWidth * 4, vExpected.data(), nWidth, nWidth, nHeight);
+        for (int nThreads = 1; nThreads <= 16; nThreads++) {
+            std::vector<uint8_t> vNv12(nNv12, 0xCD);
+            BenchConverter("bt601", nThreads).Convert(vBgra.data(), nWidth * 4, vNv12.data(), nWidth, nHeight);
+            ASSERT_TRUE(vNv12 == vExpected) << nWidth << "x" << nHeight << " with " << nThreads << " threads";
+        }
+    }
+}
@@ -0,0 +1,90 @@
+#include <gtest/gtest.h>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include "../Utils/BinaryLogger.h"
+
+simplelogger::Logger *logger = NULL;
+simplelogger::BinaryLogger *binlogger = NULL;
+
+using namespace simplelogger;
+
+struct BinLogFile {
+    BinLogFileHeader header;
+    std::vector<BinLogRecordHeader> vEvent;
+};
+
+static bool ReadBinLog(const std::string &strPath, BinLogFile *pFile) {
+    std::ifstream fpIn(strPath, std::ios::in | std::ios::binary);
+    std::vector<uint8_t> vBuf((std::istreambuf_iterator<char>(fpIn)), std::istreambuf_iterator<char>());
+    if (vBuf.size() < sizeof(BinLogFileHeader)) {
+        return false;
+    }
+    memcpy(&pFile->header, vBuf.data(), sizeof(BinLogFileHeader));
+    size_t k = sizeof(BinLogFileHeader);
+    while (k + sizeof(BinLogRecordHeader) <= vBuf.size()) {
+        BinLogRecordHeader h;
+        memcpy(&h, vBuf.data() + k, sizeof(h));
+        if (!h.nFormatId) {
+            break;
+        }
+        if (h.nFormatId != BINLOG_FORMAT_DEFINITION) {
+            pFile->vEvent.push_back(h);
+        }
+        k += sizeof(h) + h.nPayloadSize;
+    }
+    return true;
+}
+
+TEST(BinaryLogger, RotatedFilesKeepTimestampsInRange) {
+    const std::string strBase = "binlog_test";
+    const uint32_t nEvents = 2000, nMaxFiles = 1000;
+    uint16_t nFormatId = BinLogFormats::Register("frame %u: %u bytes");
+    int64_t tStart = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    {
+        // about 40 events per file
+        BinaryLogger binlog(strBase, 1024, nMaxFiles);
+        for (uint32_t i = 0; i < nEvents; i++) {
+            binlog.Write(nFormatId, i, i * 100);
+        }
+    }
+    int64_t tEnd = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+    uint32_t nRead = 0, iFile = 0;
+    BinLogFile file;
+    for (; ReadBinLog(BinaryLogger::GetFilePath(strBase, iFile), &file); iFile++) {
+        EXPECT_EQ(file.header.nMagic, BINLOG_MAGIC);
+        EXPECT_EQ(file.header.nFileIndex, iFile);
+        EXPECT_GE(file.header.nBaseTimeUs, tStart);
+        for (const BinLogRecordHeader &h : file.vEvent) {
+            EXPECT_LE(file.header.nBaseTimeUs + h.nDeltaUs, tEnd) << "file " << iFile << " event " << nRead;
+            nRead++;
+        }
+        remove(BinaryLogger::GetFilePath(strBase, iFile).c_str());
+        file = BinLogFile();
+    }
+    EXPECT_GT(iFile, 10u);
+    EXPECT_EQ(nRead, nEvents);
+}
+
+TEST(BinaryLogger, KeepsAtMostMaxFiles) {
+    const std::string strBase = "binlog_test_max";
+    uint16_t nFormatId = BinLogFormats::Register("event %d");
+    {
+        BinaryLogger binlog(strBase, 512, 3);
+        for (int i = 0; i < 500; i++) {
+            binlog.Write(nFormatId, i);
+        }
+    }
+    uint32_t nFiles = 0, iFile = 0;
+    BinLogFile file;
+    for (; iFile < 1000; iFile++) {
+        if (ReadBinLog(BinaryLogger::GetFilePath(strBase, iFile), &file)) {
+            nFiles++;
+            remove(BinaryLogger::GetFilePath(strBase, iFile).c_str());
+        }
+    }
+    EXPECT_EQ(nFiles, 3u);
+}
@@ -0,0 +1,90 @@
+#include <gtest/gtest.h>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include "../Utils/Logger.h"
+
+simplelogger::Logger *logger = NULL;
+
+static size_t CountLines(const char *szPath) {
+    std::ifstream fpIn(szPath);
+    std::string strLine;
+    size_t n = 0;
+    while (std::getline(fpIn, strLine)) {
+        n++;
+    }
+    return n;
+}
+
+TEST(Logger, FilteredCallsDoNotFormat) {
+    logger = simplelogger::LoggerFactory::CreateFileLogger("/dev/null", ERROR);
+    int n = 0;
+    LOG(TRACE) << n++;
+    LOG(INFO) << n++;
+    EXPECT_EQ(n, 0);
+    LOG(ERROR) << n++;
+    EXPECT_EQ(n, 1);
+    delete logger;
+    logger = NULL;
+}
+
+TEST(AsyncLogger, FreesRingsOfExitedThreads) {
+    const char *szPath = "logger_test.log";
+    simplelogger::AsyncLogger *pAsync = new simplelogger::AsyncLogger(
+        simplelogger::LoggerFactory::CreateFileLogger(szPath, TRACE, false), TRACE, false);
+    logger = pAsync;
+    for (int i = 0; i < 64; i++) {
+        std::thread([i] { LOG(INFO) << "thread " << i; }).join();
+    }
+    // the first flush drains the rings of the exited threads, the second frees them
+    pAsync->Flush();
+    pAsync->Flush();
+    EXPECT_EQ(pAsync->GetRingCount(), 0u);
+    LOG(INFO) << "main";
+    pAsync->Flush();
+    EXPECT_EQ(pAsync->GetRingCount(), 1u);
+    delete pAsync;
+    logger = NULL;
+    EXPECT_EQ(CountLines(szPath), 65u);
+    remove(szPath);
+}
+
+TEST(AsyncLogger, MarksTruncatedRecords) {
+    const char *szPath = "logger_test.log";
+    simplelogger::AsyncLogger *pAsync = new simplelogger::AsyncLogger(
+        simplelogger::LoggerFactory::CreateFileLogger(szPath, TRACE, false), TRACE, false);
+    logger = pAsync;
+    std::string strLong(2 * simplelogger::AsyncLogger::RECORD_TEXT_SIZE, 'x');
+    LOG(INFO) << strLong << " tail";
+    LOG(INFO) << "short";
+    LOG(INFO) << std::string(simplelogger::AsyncLogger::RECORD_TEXT_SIZE, 'y');
+    EXPECT_EQ(pAsync->GetTruncatedCount(), 1u);
+    delete pAsync;
+    logger = NULL;
+
+    std::ifstream fpIn(szPath);
+    std::vector<std::string> vLine;
+    std::string strLine;
+    while (std::getline(fpIn, strLine)) {
+        vLine.push_back(strLine);
+    }
+    ASSERT_EQ(vLine.size(), 3u);
+    const std::string strLead = "[INFO ] ";
+    EXPECT_EQ(vLine[0], strLead + strLong.substr(0, simplelogger::AsyncLogger::RECORD_TEXT_SIZE - 3) + "...");
+    EXPECT_EQ(vLine[1], strLead + "short");
+    // a message that just fits is not marked
+    EXPECT_EQ(vLine[2], strLead + std::string(simplelogger::AsyncLogger::RECORD_TEXT_SIZE, 'y'));
+    remove(szPath);
+}
+
+// A thread that outlives its logger and then logs to a new one
+TEST(AsyncLogger, ThreadMovesToAnotherLogger) {
+    for (int i = 0; i < 3; i++) {
+        logger = new simplelogger::AsyncLogger(simplelogger::LoggerFactory::CreateFileLogger("/dev/null"), INFO, true);
+        LOG(INFO) << "logger " << i;
+        delete logger;
+    }
+    logger = NULL;
+}
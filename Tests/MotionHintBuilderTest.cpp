@@ -0,0 +1,68 @@
+#include <gtest/gtest.h>
+#include <vector>
+#include "../Utils/MotionHintBuilder.h"
+
+// 100x70 is 7x5 macroblocks; the last column is 4 pixels wide and the last row 6 pixels high
+static const int WIDTH = 100, HEIGHT = 70, WIDTH_IN_MBS = 7, HEIGHT_IN_MBS = 5;
+
+TEST(MotionHintBuilder, NoMoveRectsNoHints) {
+    MotionHintBuilder builder(WIDTH, HEIGHT);
+    ScreenRect dirty = { 0, 0, 16, 16 };
+    FrameChanges changes;
+    changes.bFullFrame = false;
+    changes.pDirtyRect = &dirty;
+    changes.nDirtyRects = 1;
+    NV_ENC_PIC_PARAMS picParams = {};
+    EXPECT_FALSE(builder.Build(changes, &picParams));
+    EXPECT_EQ(NULL, picParams.meExternalHints);
+    EXPECT_EQ(0u, picParams.meHintCountsPerBlock[0].numCandsPerBlk16x16);
+}
+
+TEST(MotionHintBuilder, RasterizesMoveIntoMacroblockGrid) {
+    MotionHintBuilder builder(WIDTH, HEIGHT);
+    ASSERT_EQ((size_t)WIDTH_IN_MBS * HEIGHT_IN_MBS, builder.GetHintCount());
+    // a window dragged by (+10, +10) into the bottom right corner, running off both partial edges
+    ScreenMoveRect move = {};
+    move.xSource = 30;
+    move.ySource = 10;
+    move.destination = { 40, 20, WIDTH, HEIGHT };
+    // redrawn in place after the move
+    ScreenRect dirty = { 48, 32, 64, 48 };
+    FrameChanges changes;
+    changes.bFullFrame = false;
+    changes.pMoveRect = &move;
+    changes.nMoveRects = 1;
+    changes.pDirtyRect = &dirty;
+    changes.nDirtyRects = 1;
+    NV_ENC_PIC_PARAMS picParams = {};
+    ASSERT_TRUE(builder.Build(changes, &picParams));
+    ASSERT_NE(nullptr, picParams.meExternalHints);
+    EXPECT_EQ(1u, picParams.meHintCountsPerBlock[0].numCandsPerBlk16x16);
+
+    for (int y = 0; y < HEIGHT_IN_MBS; y++) {
+        for (int x = 0; x < WIDTH_IN_MBS; x++) {
+            const NVENC_EXTERNAL_ME_HINT &hint = picParams.meExternalHints[y * WIDTH_IN_MBS + x];
+            // macroblocks whose center (x * 16 + 8) lies in the destination: columns 2..6, rows 1..4
+            bool bMoved = x >= 2 && y >= 1 && !(x == 3 && y == 2);
+            EXPECT_EQ(bMoved ? -10 : 0, (int)hint.mvx) << "macroblock " << x << "," << y;
+            EXPECT_EQ(bMoved ? -10 : 0, (int)hint.mvy) << "macroblock " << x << "," << y;
+            EXPECT_NE(0, (int)hint.lastofPart);
+            EXPECT_NE(0, (int)hint.lastOfMB);
+        }
+    }
+}
+
+TEST(MotionHintBuilder, SkipsVectorsOutOfRange) {
+    MotionHintBuilder builder(4096, 2160);
+    ScreenMoveRect move = {};
+    move.xSource = 0;
+    move.ySource = 1000;
+    move.destination = { 0, 0, 64, 64 };
+    FrameChanges changes;
+    changes.bFullFrame = false;
+    changes.pMoveRect = &move;
+    changes.nMoveRects = 1;
+    NV_ENC_PIC_PARAMS picParams = {};
+    ASSERT_TRUE(builder.Build(changes, &picParams));
+    EXPECT_EQ(0, (int)picParams.meExternalHints[0].mvy);
+}
@@ -0,0 +1,112 @@
+#include <gtest/gtest.h>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include "../Utils/Mp4Writer.h"
+#include "../Utils/PcmH264Encoder.h"
+
+struct Mp4Box {
+    std::string strType;
+    size_t iOffset, nSize;
+};
+
+static uint32_t Be32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+// The top level boxes; false if their sizes do not add up to the file
+static bool ReadTopLevelBoxes(const std::vector<uint8_t> &vFile, std::vector<Mp4Box> &vBox) {
+    size_t i = 0;
+    while (i + 8 <= vFile.size()) {
+        uint64_t nSize = Be32(&vFile[i]);
+        if (nSize == 1) {
+            nSize = (uint64_t)Be32(&vFile[i + 8]) << 32 | Be32(&vFile[i + 12]);
+        }
+        if (nSize < 8 || i + nSize > vFile.size()) {
+            return false;
+        }
+        vBox.push_back(Mp4Box{ std::string((const char *)&vFile[i + 4], 4), i, (size_t)nSize });
+        i += (size_t)nSize;
+    }
+    return i == vFile.size();
+}
+
+// The 32-bit field nFieldOffset bytes after the type of the first box szType inside box
+static uint32_t FindField(const std::vector<uint8_t> &vFile, const Mp4Box &box, const char *szType, size_t nFieldOffset) {
+    for (size_t i = box.iOffset + 8; i + 8 + nFieldOffset <= box.iOffset + box.nSize; i++) {
+        if (!memcmp(&vFile[i], szType, 4)) {
+            return Be32(&vFile[i + 4 + nFieldOffset]);
+        }
+    }
+    return UINT32_MAX;
+}
+
+static std::vector<uint8_t> WriteRecording(const char *szPath, int nFrames, const Mp4WriterOptions &options, uint32_t *pnTableSamples) {
+    PcmH264Encoder enc(64, 48, 10);
+    std::vector<uint8_t> vFrame(enc.GetFrameSize(), 128), vSeqParams;
+    enc.GetSequenceParams(vSeqParams);
+    {
+        Mp4Writer writer(szPath, 64, 48, vSeqParams, options);
+        std::vector<std::vector<uint8_t>> vPacket;
+        for (int i = 0; i < nFrames; i++) {
+            vFrame[i % vFrame.size()] = (uint8_t)i;
+            enc.EncodeFrame(vFrame.data(), 0, vPacket);
+            writer.WritePacket(vPacket[0], i * 20000LL);
+        }
+        writer.Close();
+        *pnTableSamples = writer.GetTableSampleCount();
+    }
+    std::ifstream fpIn(szPath, std::ios::in | std::ios::binary);
+    std::vector<uint8_t> vFile((std::istreambuf_iterator<char>(fpIn)), std::istreambuf_iterator<char>());
+    remove(szPath);
+    return vFile;
+}
+
+TEST(Mp4Writer, ProgressiveFileHasOneTable) {
+    uint32_t nTableSamples;
+    std::vector<uint8_t> vFile = WriteRecording("mp4_test.mp4", 100, Mp4WriterOptions(), &nTableSamples);
+    std::vector<Mp4Box> vBox;
+    ASSERT_TRUE(ReadTopLevelBoxes(vFile, vBox));
+    ASSERT_EQ(vBox.size(), 3u);
+    EXPECT_EQ(vBox[0].strType, "ftyp");
+    EXPECT_EQ(vBox[1].strType, "mdat");
+    EXPECT_EQ(vBox[2].strType, "moov");
+    EXPECT_EQ(FindField(vFile, vBox[2], "stsz", 8), 100u);
+    EXPECT_EQ(FindField(vFile, vBox[2], "mvex", 0), UINT32_MAX);
+    EXPECT_EQ(nTableSamples, 0u);
+}
+
+// Past nMaxTableSamples the file goes on in fragments, which describe the remaining samples
+TEST(Mp4Writer, BoundedTableContinuesInFragments) {
+    Mp4WriterOptions options;
+    options.nMaxTableSamples = 45;
+    uint32_t nTableSamples;
+    std::vector<uint8_t> vFile = WriteRecording("mp4_test.mp4", 100, options, &nTableSamples);
+    std::vector<Mp4Box> vBox;
+    ASSERT_TRUE(ReadTopLevelBoxes(vFile, vBox));
+    ASSERT_GE(vBox.size(), 5u);
+    EXPECT_EQ(vBox[0].strType, "ftyp");
+    EXPECT_EQ(vBox[1].strType, "mdat");
+    EXPECT_EQ(vBox[2].strType, "moov");
+    EXPECT_EQ(nTableSamples, 45u);
+    EXPECT_EQ(FindField(vFile, vBox[2], "stsz", 8), 45u);
+    EXPECT_NE(FindField(vFile, vBox[2], "trex", 0), UINT32_MAX);
+    // the table covers 45 frames of 1/50 s in the 90 kHz timescale
+    EXPECT_EQ(FindField(vFile, vBox[2], "mdhd", 24), 0u);
+    EXPECT_EQ(FindField(vFile, vBox[2], "mdhd", 28), 45u * 1800);
+
+    uint32_t nFragmentSamples = 0, nFragments = 0;
+    for (size_t i = 3; i < vBox.size(); i += 2) {
+        ASSERT_EQ(vBox[i].strType, "moof");
+        ASSERT_LT(i + 1, vBox.size());
+        EXPECT_EQ(vBox[i + 1].strType, "mdat");
+        uint32_t nBaseDts = FindField(vFile, vBox[i], "tfdt", 8);
+        EXPECT_EQ(nBaseDts, (45u + nFragmentSamples) * 1800);
+        nFragmentSamples += FindField(vFile, vBox[i], "trun", 4);
+        nFragments++;
+    }
+    EXPECT_EQ(nTableSamples + nFragmentSamples, 100u);
+    EXPECT_GE(nFragments, 5u);
+}
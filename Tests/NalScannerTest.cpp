@@ -0,0 +1,90 @@
+#include <gtest/gtest.h>
+#include <random>
+#include <vector>
+#include "../Utils/NalScanner.h"
+#include "../Utils/PcmH264Encoder.h"
+
+// The SIMD search has to find the same start codes as the scalar one, wherever they sit relative to its 16/32-byte blocks
+TEST(NalScanner, FindStartCodeMatchesScalar) {
+    std::mt19937 rng(7);
+    std::vector<uint8_t> vBuf(1000);
+    for (uint8_t &b : vBuf) {
+        b = (uint8_t)(rng() % 4 ? rng() | 1 : 0);
+    }
+    for (size_t i = 5; i + 3 < vBuf.size(); i += 37) {
+        vBuf[i] = 0;
+        vBuf[i + 1] = 0;
+        vBuf[i + 2] = 1;
+    }
+    for (size_t iBegin = 0; iBegin < 64; iBegin++) {
+        const uint8_t *pEnd = vBuf.data() + vBuf.size();
+        const uint8_t *p = vBuf.data() + iBegin, *pScalar = p;
+        do {
+            p = FindStartCode(p, pEnd);
+            pScalar = FindStartCodeScalar(pScalar, pEnd);
+            ASSERT_EQ(pScalar - vBuf.data(), p - vBuf.data()) << "searching from " << iBegin;
+            p += p < pEnd ? 3 : 0;
+            pScalar += pScalar < pEnd ? 3 : 0;
+        } while (p < pEnd);
+    }
+}
+
+TEST(NalScanner, SplitAnnexBTrimsStartCodesAndTrailingZeros) {
+    const std::vector<uint8_t> vStream = {
+        0, 0, 0, 1, 0x67, 0xaa, 0xbb,
+        0, 0, 1, 0x68, 0xcc, 0, 0,
+        0, 0, 0, 1, 0x65, 0x00, 0x00, 0x03, 0x01,
+    };
+    std::vector<NalUnit> vNal;
+    SplitAnnexB(vStream.data(), vStream.size(), vNal);
+    ASSERT_EQ(3u, vNal.size());
+    EXPECT_EQ(vStream.data() + 4, vNal[0].pData);
+    EXPECT_EQ(3u, vNal[0].nSize);
+    EXPECT_EQ(H264_NAL_SPS, GetH264NalType(vNal[0]));
+    EXPECT_EQ(2u, vNal[1].nSize);
+    EXPECT_EQ(H264_NAL_PPS, GetH264NalType(vNal[1]));
+    EXPECT_EQ(5u, vNal[2].nSize);
+    EXPECT_EQ(H264_NAL_IDR, GetH264NalType(vNal[2]));
+
+    std::vector<uint8_t> vRbsp;
+    NalToRbsp(vNal[2].pData, vNal[2].nSize, vRbsp);
+    EXPECT_EQ(std::vector<uint8_t>({ 0x65, 0x00, 0x00, 0x01 }), vRbsp);
+}
+
+TEST(NalScanner, DescribesEncodedFrames) {
+    PcmH264Encoder enc(64, 48);
+    std::vector<uint8_t> vFrame(enc.GetFrameSize(), 128);
+    std::vector<std::vector<uint8_t>> vPacket;
+
+    enc.EncodeFrame(vFrame.data(), 0, vPacket);
+    NalPacketInfo info;
+    DescribePacket(vPacket[0].data(), vPacket[0].size(), NAL_CODEC_H264, &info);
+    EXPECT_TRUE(info.bKeyFrame);
+    EXPECT_TRUE(info.bParameterSets);
+    EXPECT_EQ(3, info.nNalUnits);
+    EXPECT_EQ(1, info.nSlices);
+    EXPECT_EQ(NAL_SLICE_I, info.eSliceType);
+    EXPECT_TRUE(IsH264KeyFrame(vPacket[0].data(), vPacket[0].size()));
+
+    vFrame[0] = 0;
+    enc.EncodeFrame(vFrame.data(), 0, vPacket);
+    DescribePacket(vPacket[0].data(), vPacket[0].size(), NAL_CODEC_H264, &info);
+    EXPECT_FALSE(info.bKeyFrame);
+    EXPECT_FALSE(info.bParameterSets);
+    EXPECT_EQ(1, info.nSlices);
+    EXPECT_EQ(NAL_SLICE_P, info.eSliceType);
+}
+
+TEST(NalScanner, ReadsSpsSize) {
+    PcmH264Encoder enc(100, 70);
+    std::vector<uint8_t> vSeqParams;
+    enc.GetSequenceParams(vSeqParams);
+    std::vector<NalUnit> vNal;
+    SplitAnnexB(vSeqParams.data(), vSeqParams.size(), vNal);
+    ASSERT_EQ(2u, vNal.size());
+    int nWidth = 0, nHeight = 0;
+    ASSERT_TRUE(GetH264SpsSize(vNal[0], &nWidth, &nHeight));
+    // coded as 112x80 and cropped
+    EXPECT_EQ(100, nWidth);
+    EXPECT_EQ(70, nHeight);
+}
@@ -0,0 +1,113 @@
+#include <gtest/gtest.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "../Utils/PacketDistributor.h"
+
+simplelogger::Logger *logger = NULL;
+
+static EncodedPacketPtr MakePacket(int64_t nTimestampUs, bool bKeyFrame) {
+    EncodedPacket *pPacket = new EncodedPacket;
+    pPacket->vData.assign(100, 0);
+    pPacket->nTimestampUs = nTimestampUs;
+    pPacket->bKeyFrame = bKeyFrame;
+    return EncodedPacketPtr(pPacket);
+}
+
+static void WaitForBacklog(PacketDistributor &distributor, int64_t nBytes) {
+    for (int i = 0; i < 500 && distributor.GetBacklogBytes() != nBytes; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    ASSERT_EQ(nBytes, distributor.GetBacklogBytes());
+}
+
+// Records the timestamps it is given; can be stopped in Write() until released
+class RecordingSink : public PacketSink {
+public:
+    RecordingSink(std::vector<int64_t> *pvTimestamp, bool bBlock = false, int nFailAt = -1)
+        : pvTimestamp(pvTimestamp), bBlock(bBlock), nFailAt(nFailAt) {}
+    void Write(const EncodedPacketPtr &pPacket) {
+        if ((int)pvTimestamp->size() == nFailAt) {
+            throw std::runtime_error("disk full");
+        }
+        std::unique_lock<std::mutex> lock(mtx);
+        bInWrite = true;
+        cv.notify_all();
+        cv.wait(lock, [this] { return !bBlock; });
+        pvTimestamp->push_back(pPacket->nTimestampUs);
+    }
+    void Close() {
+        bClosed = true;
+    }
+    void WaitInWrite() {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [this] { return bInWrite; });
+    }
+    void Release() {
+        std::lock_guard<std::mutex> lock(mtx);
+        bBlock = false;
+        cv.notify_all();
+    }
+    bool bClosed = false;
+
+private:
+    std::vector<int64_t> *pvTimestamp;
+    bool bBlock;
+    int nFailAt;
+    bool bInWrite = false;
+    std::mutex mtx;
+    std::condition_variable cv;
+};
+
+TEST(PacketDistributor, DropsToTheNextKeyFrame) {
+    std::vector<int64_t> vLive, vRecorded;
+    RecordingSink *pLive = new RecordingSink(&vLive, true);
+    PacketDistributor distributor;
+    distributor.AddSink(pLive, "live", 2, PACKET_DROP_TO_KEYFRAME);
+    distributor.AddSink(new RecordingSink(&vRecorded), "file", 16, PACKET_DROP_NEVER);
+
+    distributor.Deliver(MakePacket(0, true));
+    pLive->WaitInWrite();
+    // packets 1 and 2 fill the queue of the stalled sink; 3 is dropped and so is 4, which depends on it
+    for (int i = 1; i <= 4; i++) {
+        distributor.Deliver(MakePacket(i, false));
+    }
+    EXPECT_TRUE(distributor.IsKeyFrameWanted());
+
+    pLive->Release();
+    WaitForBacklog(distributor, 0);
+    EXPECT_TRUE(distributor.IsKeyFrameWanted());
+    distributor.Deliver(MakePacket(5, false));
+    distributor.Deliver(MakePacket(6, true));
+    EXPECT_FALSE(distributor.IsKeyFrameWanted());
+    distributor.Deliver(MakePacket(7, false));
+    distributor.Close();
+
+    EXPECT_EQ((std::vector<int64_t>{0, 1, 2, 6, 7}), vLive);
+    EXPECT_EQ((std::vector<int64_t>{0, 1, 2, 3, 4, 5, 6, 7}), vRecorded);
+}
+
+// A sink that throws must not block Deliver() on its full queue, nor hold back the other sinks
+TEST(PacketDistributor, DrainsAFailedSink) {
+    std::vector<int64_t> vFailed, vRecorded;
+    RecordingSink *pFailed = new RecordingSink(&vFailed, false, 3);
+    RecordingSink *pRecorded = new RecordingSink(&vRecorded);
+    PacketDistributor distributor;
+    distributor.AddSink(pFailed, "failed", 2, PACKET_DROP_NEVER);
+    distributor.AddSink(pRecorded, "file", 2, PACKET_DROP_NEVER);
+
+    for (int i = 0; i < 100; i++) {
+        distributor.Deliver(MakePacket(i, i % 10 == 0));
+    }
+    WaitForBacklog(distributor, 0);
+    EXPECT_FALSE(distributor.IsKeyFrameWanted());
+    EXPECT_FALSE(pFailed->bClosed);
+    distributor.Close();
+
+    EXPECT_EQ((std::vector<int64_t>{0, 1, 2}), vFailed);
+    ASSERT_EQ(100u, vRecorded.size());
+    EXPECT_EQ(99, vRecorded.back());
+}
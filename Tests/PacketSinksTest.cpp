@@ -0,0 +1,43 @@
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include "../Utils/PacketSinks.h"
+
+simplelogger::Logger *logger = NULL;
+
+static EncodedPacketPtr MakePacket(const std::vector<uint8_t> &vData, int64_t nTimestampUs) {
+    std::shared_ptr<EncodedPacket> pPacket(new EncodedPacket());
+    pPacket->vData = vData;
+    pPacket->nTimestampUs = nTimestampUs;
+    return pPacket;
+}
+
+// VPS, SPS, PPS and an IDR_W_RADL slice; as H.264 the first NAL (type 0x40 & 0x1f = 0) would be unknown
+static const std::vector<uint8_t> HEVC_IDR = {
+    0, 0, 0, 1, 0x40, 0x01, 0x0c,
+    0, 0, 0, 1, 0x42, 0x01, 0x01,
+    0, 0, 0, 1, 0x44, 0x01, 0xc0,
+    0, 0, 0, 1, 0x26, 0x01, 0xaf, 0x10,
+};
+static const std::vector<uint8_t> HEVC_TRAIL = { 0, 0, 0, 1, 0x02, 0x01, 0xd0, 0x10 };
+
+TEST(FilePacketSink, IndexesTheStreamCodec) {
+    const char *szPath = "file_sink_test.h265";
+    {
+        FilePacketSink sink(szPath, true, NAL_CODEC_HEVC);
+        sink.Write(MakePacket(HEVC_IDR, 0));
+        sink.Write(MakePacket(HEVC_TRAIL, 16667));
+        sink.Close();
+    }
+    {
+        RecordingReader reader(szPath);
+        EXPECT_EQ(NAL_CODEC_HEVC, reader.GetCodec());
+        ASSERT_EQ(2u, reader.GetFrameCount());
+        EXPECT_EQ((uint32_t)(SEEK_INDEX_KEY_FRAME | SEEK_INDEX_PARAMETER_SETS), reader.GetEntry(0).nFlags);
+        EXPECT_EQ(0u, reader.GetEntry(1).nFlags);
+        EXPECT_EQ(HEVC_IDR.size(), reader.GetEntry(1).nOffset);
+    }
+    remove(szPath);
+    remove(GetSeekIndexPath(szPath).c_str());
+}
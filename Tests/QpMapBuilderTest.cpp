@@ -0,0 +1,48 @@
+#include <gtest/gtest.h>
+#include <vector>
+#include "../Utils/QpMapBuilder.h"
+
+static void ExpectBlocks(const int8_t *pMap, int nWidthInBlocks, int nHeightInBlocks, int x0, int y0, int x1, int y1, int nInside, int nOutside) {
+    for (int y = 0; y < nHeightInBlocks; y++) {
+        for (int x = 0; x < nWidthInBlocks; x++) {
+            bool bInside = x >= x0 && x < x1 && y >= y0 && y < y1;
+            ASSERT_EQ(bInside ? nInside : nOutside, pMap[y * nWidthInBlocks + x]) << "block " << x << "," << y;
+        }
+    }
+}
+
+TEST(QpMapBuilder, MacroblockMapForH264) {
+    QpMapBuilder builder(1920, 1080);
+    EXPECT_EQ(120, builder.GetWidthInMbs());
+    EXPECT_EQ(68, builder.GetHeightInMbs());
+    EXPECT_EQ(120u * 68, builder.GetMapSize());
+    ScreenRect rect = { 40, 40, 50, 50 };
+    FrameChanges changes;
+    changes.bFullFrame = false;
+    changes.pDirtyRect = &rect;
+    changes.nDirtyRects = 1;
+    ExpectBlocks(builder.Build(changes), 120, 68, 2, 2, 4, 4, -4, 2);
+}
+
+TEST(QpMapBuilder, CtbMapForHevc) {
+    QpMapOptions options;
+    options.nBlockSize = 32;
+    QpMapBuilder builder(1920, 1080, options);
+    EXPECT_EQ(60, builder.GetWidthInMbs());
+    EXPECT_EQ(34, builder.GetHeightInMbs());
+    EXPECT_EQ(60u * 34, builder.GetMapSize());
+    // touches CTB 1,1 only; the second rect runs off the partial bottom right CTB
+    ScreenRect aRect[2] = { { 40, 40, 50, 50 }, { 1900, 1070, 2000, 1200 } };
+    FrameChanges changes;
+    changes.bFullFrame = false;
+    changes.pDirtyRect = aRect;
+    changes.nDirtyRects = 1;
+    ExpectBlocks(builder.Build(changes), 60, 34, 1, 1, 2, 2, -4, 2);
+    changes.pDirtyRect = aRect + 1;
+    const int8_t *pMap = builder.Build(changes);
+    // the first rect is still within the hold time
+    EXPECT_EQ(-4, pMap[1 * 60 + 1]);
+    EXPECT_EQ(-4, pMap[33 * 60 + 59]);
+    EXPECT_EQ(2, pMap[33 * 60 + 58]);
+    EXPECT_EQ(2, pMap[32 * 60 + 59]);
+}
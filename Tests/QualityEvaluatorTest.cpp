@@ -0,0 +1,128 @@
+#include <gtest/gtest.h>
+#include <stdlib.h>
+#include <vector>
+#include "../Utils/QualityMetrics.h"
+
+// A random I420 frame, and a copy of it with noise of up to +-nNoise
+static void MakeFrames(int nWidth, int nHeight, int nNoise, std::vector<uint8_t> &vRef, std::vector<uint8_t> &vTest) {
+    int nChromaWidth = (nWidth + 1) / 2, nChromaHeight = (nHeight + 1) / 2;
+    vRef.resize((size_t)nWidth * nHeight + 2 * (size_t)nChromaWidth * nChromaHeight);
+    vTest.resize(vRef.size());
+    srand(nWidth * 7919 + nHeight);
+    for (size_t i = 0; i < vRef.size(); i++) {
+        vRef[i] = (uint8_t)(rand() & 0xFF);
+        int n = vRef[i] + rand() % (2 * nNoise + 1) - nNoise;
+        vTest[i] = (uint8_t)(n < 0 ? 0 : (n > 255 ? 255 : n));
+    }
+}
+
+// The NV12 layout of an I420 frame, with a pitch wider than the frame
+static std::vector<uint8_t> ToNv12(const std::vector<uint8_t> &vI420, int nWidth, int nHeight, int nPitch) {
+    YuvFrame frame = YuvFrame::FromI420(vI420.data(), nWidth, nHeight);
+    int nChromaWidth = frame.aPlane[1].nWidth, nChromaHeight = frame.aPlane[1].nHeight;
+    std::vector<uint8_t> vNv12((size_t)nPitch * (nHeight + nChromaHeight));
+    for (int y = 0; y < nHeight; y++) {
+        std::copy(vI420.begin() + (size_t)y * nWidth, vI420.begin() + (size_t)(y + 1) * nWidth, vNv12.begin() + (size_t)y * nPitch);
+    }
+    for (int y = 0; y < nChromaHeight; y++) {
+        uint8_t *pUV = vNv12.data() + (size_t)(nHeight + y) * nPitch;
+        for (int x = 0; x < nChromaWidth; x++) {
+            pUV[2 * x] = frame.aPlane[1].pData[(size_t)y * nChromaWidth + x];
+            pUV[2 * x + 1] = frame.aPlane[2].pData[(size_t)y * nChromaWidth + x];
+        }
+    }
+    return vNv12;
+}
+
+struct FrameSize {
+    int nWidth, nHeight;
+};
+
+// Sizes that leave tails for every kernel width, and a frame too small for SSIM windows
+static const FrameSize aSize[] = { {1920, 1080}, {643, 361}, {100, 68}, {37, 29}, {7, 5} };
+
+TEST(QualityEvaluator, MatchesTheScalarReference) {
+    for (const FrameSize &size : aSize) {
+        for (int nNoise : {3, 255}) {
+            std::vector<uint8_t> vRef, vTest;
+            MakeFrames(size.nWidth, size.nHeight, nNoise, vRef, vTest);
+            YuvFrame ref = YuvFrame::FromI420(vRef.data(), size.nWidth, size.nHeight);
+            YuvFrame test = YuvFrame::FromI420(vTest.data(), size.nWidth, size.nHeight);
+            uint64_t aSse[3];
+            for (int i = 0; i < 3; i++) {
+                aSse[i] = PlaneSse(ref.aPlane[i], test.aPlane[i]);
+            }
+            double dSsim = PlaneSsim(ref.aPlane[0], test.aPlane[0]);
+
+            for (int nSimd = 0; nSimd <= 2; nSimd++) {
+                for (int nBandRows : {4, 64}) {
+                    FrameQuality first;
+                    for (int nThreads : {1, 3, 8}) {
+                        SCOPED_TRACE(::testing::Message() << size.nWidth << "x" << size.nHeight << " noise " << nNoise
+                            << " simd " << nSimd << " band rows " << nBandRows << " threads " << nThreads);
+                        QualityOptions options;
+                        options.nSimd = nSimd;
+                        options.nBandRows = nBandRows;
+                        options.nThreads = nThreads;
+                        FrameQuality q = QualityEvaluator(options).Compare(ref, test);
+                        for (int i = 0; i < 3; i++) {
+                            EXPECT_EQ(aSse[i], q.aSse[i]) << "plane " << i;
+                            EXPECT_EQ((uint64_t)ref.aPlane[i].nWidth * ref.aPlane[i].nHeight, q.aSamples[i]);
+                        }
+                        EXPECT_NEAR(dSsim, q.dSsimY, 1e-9);
+                        // the bands sum up in order, whichever thread computed them
+                        if (nThreads == 1) {
+                            first = q;
+                        } else {
+                            EXPECT_EQ(first.dSsimY, q.dSsimY);
+                            EXPECT_EQ(first.dPsnr, q.dPsnr);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+TEST(QualityEvaluator, ComparesNv12WithI420) {
+    const int nWidth = 643, nHeight = 361;
+    std::vector<uint8_t> vRef, vTest;
+    MakeFrames(nWidth, nHeight, 20, vRef, vTest);
+    std::vector<uint8_t> vTestNv12 = ToNv12(vTest, nWidth, nHeight, 704);
+    YuvFrame ref = YuvFrame::FromI420(vRef.data(), nWidth, nHeight);
+    YuvFrame test = YuvFrame::FromI420(vTest.data(), nWidth, nHeight);
+    YuvFrame testNv12 = YuvFrame::FromNv12(vTestNv12.data(), 704, nWidth, nHeight);
+    for (int nSimd = 0; nSimd <= 2; nSimd++) {
+        QualityOptions options;
+        options.nSimd = nSimd;
+        options.nThreads = 2;
+        QualityEvaluator evaluator(options);
+        FrameQuality q = evaluator.Compare(ref, test), qNv12 = evaluator.Compare(ref, testNv12);
+        for (int i = 0; i < 3; i++) {
+            EXPECT_EQ(q.aSse[i], qNv12.aSse[i]) << "simd " << nSimd << " plane " << i;
+        }
+        EXPECT_EQ(q.dSsimY, qNv12.dSsimY) << "simd " << nSimd;
+    }
+}
+
+TEST(QualityEvaluator, SumsUpTheSequence) {
+    const int nWidth = 100, nHeight = 68;
+    std::vector<uint8_t> vRef, vTest;
+    MakeFrames(nWidth, nHeight, 10, vRef, vTest);
+    YuvFrame ref = YuvFrame::FromI420(vRef.data(), nWidth, nHeight);
+    YuvFrame test = YuvFrame::FromI420(vTest.data(), nWidth, nHeight);
+    QualityEvaluator evaluator;
+    FrameQuality q = evaluator.Add(ref, test);
+    FrameQuality qSame = evaluator.Add(ref, ref);
+    EXPECT_EQ(100.0, qSame.dPsnr);
+    EXPECT_DOUBLE_EQ(1.0, qSame.dSsimY);
+
+    const QualityStats &stats = evaluator.GetStats();
+    EXPECT_EQ(2u, stats.nFrames);
+    EXPECT_DOUBLE_EQ((q.dPsnr + 100.0) / 2, stats.GetAveragePsnr());
+    EXPECT_EQ(q.dPsnr, stats.dPsnrMin);
+    // the global PSNR is that of the total error over both frames
+    EXPECT_DOUBLE_EQ(q.dPsnr + 10 * log10(2.0), stats.GetGlobalPsnr());
+    evaluator.Reset();
+    EXPECT_EQ(0u, evaluator.GetStats().nFrames);
+}
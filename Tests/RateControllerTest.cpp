@@ -0,0 +1,80 @@
+#include <gtest/gtest.h>
+#include "../Utils/RateController.h"
+
+static const int64_t SECOND_US = 1000000;
+
+// The activity is smoothed; feeding the same share long enough settles it there
+static void SettleActivity(RateController &controller, double dChanged) {
+    for (int i = 0; i < 2000; i++) {
+        controller.OnFrame((int64_t)(dChanged * 1000000), 1000000);
+    }
+}
+
+TEST(RateController, DecidesOncePerInterval) {
+    RateControlOptions options;
+    options.nMinBitrate = 1000000;
+    options.nMaxBitrate = 8000000;
+    RateController controller(options, 8000000);
+    SettleActivity(controller, 0);
+    EXPECT_FALSE(controller.Update(0, 0));
+    EXPECT_FALSE(controller.Update(SECOND_US / 2, 0));
+    EXPECT_TRUE(controller.Update(SECOND_US, 0));
+    EXPECT_EQ(1000000u, controller.GetBitrate());
+    EXPECT_EQ(options.nMinQp + 18, controller.GetQp());
+}
+
+TEST(RateController, CapsTheBitrateBelowTheDrainRate) {
+    RateControlOptions options;
+    options.nMinBitrate = 1000000;
+    options.nMaxBitrate = 8000000;
+    RateController controller(options, 8000000);
+    EXPECT_FALSE(controller.Update(0, 0));
+    // 8 Mbps produced, 3.2 Mbps drained: the backlog is 600 ms of output after a second
+    controller.OnPacket(1000000);
+    EXPECT_TRUE(controller.Update(SECOND_US, 600000));
+    EXPECT_NEAR(0.8 * 3200000, controller.GetBitrate(), 1);
+
+    // once the sinks have caught up, the cap is raised by a quarter per interval
+    controller.OnPacket(320000);
+    EXPECT_TRUE(controller.Update(2 * SECOND_US, 0));
+    EXPECT_NEAR(1.25 * 0.8 * 3200000, controller.GetBitrate(), 1);
+    for (int i = 3; i < 10; i++) {
+        controller.Update(i * SECOND_US, 0);
+    }
+    EXPECT_EQ(8000000u, controller.GetBitrate());
+}
+
+TEST(RateController, SkipsSmallChanges) {
+    RateControlOptions options;
+    options.nMinBitrate = 1000000;
+    options.nMaxBitrate = 8000000;
+    options.nBusyPercent = 100;
+    RateController controller(options, 4500000);
+    EXPECT_FALSE(controller.Update(0, 0));
+    // a target of 1 + 7 * sqrt(activity) Mbps: 4.7 Mbps is less than 10% away
+    SettleActivity(controller, 0.2794);
+    EXPECT_FALSE(controller.Update(SECOND_US, 0));
+    EXPECT_EQ(4500000u, controller.GetBitrate());
+    // 6 Mbps is not
+    SettleActivity(controller, 0.5102);
+    EXPECT_TRUE(controller.Update(2 * SECOND_US, 0));
+    EXPECT_NEAR(6000000, controller.GetBitrate(), 2000);
+}
+
+TEST(RateController, ResetStartsTheNextRecording) {
+    RateControlOptions options;
+    options.nMinBitrate = 1000000;
+    options.nMaxBitrate = 8000000;
+    RateController controller(options, 8000000);
+    for (int i = 0; i <= 10; i++) {
+        controller.Update(i * SECOND_US, 0);
+    }
+    controller.OnPacket(500000);
+
+    // the timestamps of the next recording restart at 0
+    controller.Reset();
+    SettleActivity(controller, 0);
+    EXPECT_FALSE(controller.Update(0, 0));
+    EXPECT_TRUE(controller.Update(SECOND_US, 0));
+    EXPECT_EQ(1000000u, controller.GetBitrate());
+}
@@ -0,0 +1,63 @@
+#include <gtest/gtest.h>
+#include <string>
+#include <thread>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "../Utils/RecorderControl.h"
+
+simplelogger::Logger *logger = NULL;
+
+static const unsigned short CONTROL_TEST_PORT = 19480;
+
+static SOCKET Connect(unsigned short uPort) {
+    SOCKET s = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(uPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        CloseSocket(s);
+        return INVALID_SOCKET;
+    }
+    return s;
+}
+
+static std::string Request(unsigned short uPort, const std::string &strCommand) {
+    SOCKET s = Connect(uPort);
+    if (s == INVALID_SOCKET) {
+        return "";
+    }
+    SendAll(s, strCommand.data(), strCommand.size());
+    std::string strReply;
+    char aBuf[256];
+    int n;
+    while ((n = (int)recv(s, aBuf, sizeof(aBuf), 0)) > 0) {
+        strReply.append(aBuf, n);
+    }
+    CloseSocket(s);
+    return strReply;
+}
+
+TEST(RecorderControlChannel, AnswersWithTheState) {
+    RecorderControl control;
+    RecorderControlChannel channel(&control, CONTROL_TEST_PORT, false);
+    EXPECT_EQ("paused\n", Request(CONTROL_TEST_PORT, "pause\n"));
+    EXPECT_EQ(RECORDER_PAUSED, control.GetState());
+    EXPECT_EQ(0, Request(CONTROL_TEST_PORT, "jump\n").compare(0, 6, "error:"));
+}
+
+// A client that resets the connection before the reply must not end the process with SIGPIPE
+TEST(RecorderControlChannel, SurvivesResetConnections) {
+    RecorderControl control;
+    RecorderControlChannel channel(&control, CONTROL_TEST_PORT, false);
+    for (int i = 0; i < 5; i++) {
+        SOCKET s = Connect(CONTROL_TEST_PORT);
+        ASSERT_NE(s, INVALID_SOCKET);
+        struct linger l = { 1, 0 };
+        setsockopt(s, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+        CloseSocket(s);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    EXPECT_EQ("recording\n", Request(CONTROL_TEST_PORT, "status\n"));
+}
@@ -0,0 +1,92 @@
+#include <gtest/gtest.h>
+#include <string>
+#include <sstream>
+#include <thread>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "../Utils/RecorderMetrics.h"
+
+simplelogger::Logger *logger = NULL;
+
+static const unsigned short METRICS_TEST_PORT = 19478;
+
+static SOCKET Connect(unsigned short uPort) {
+    SOCKET s = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(uPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        CloseSocket(s);
+        return INVALID_SOCKET;
+    }
+    return s;
+}
+
+static std::string Scrape(unsigned short uPort) {
+    SOCKET s = Connect(uPort);
+    if (s == INVALID_SOCKET) {
+        return "";
+    }
+    const char szRequest[] = "GET /metrics HTTP/1.0\r\n\r\n";
+    SendAll(s, szRequest, sizeof(szRequest) - 1);
+    std::string strResponse;
+    char aBuf[4096];
+    int n;
+    while ((n = (int)recv(s, aBuf, sizeof(aBuf), 0)) > 0) {
+        strResponse.append(aBuf, n);
+    }
+    CloseSocket(s);
+    return strResponse;
+}
+
+TEST(MetricsServer, ServesPrometheusText) {
+    RecorderMetrics metrics;
+    metrics.nFramesEncoded = 42;
+    MetricsServer server(&metrics, METRICS_TEST_PORT);
+    std::string strResponse = Scrape(METRICS_TEST_PORT);
+    EXPECT_EQ(strResponse.compare(0, 15, "HTTP/1.0 200 OK"), 0);
+    EXPECT_NE(strResponse.find("recorder_frames_encoded_total 42\n"), std::string::npos);
+}
+
+// A scraper that resets the connection before the response must not end the process with SIGPIPE
+TEST(MetricsServer, SurvivesResetConnections) {
+    RecorderMetrics metrics;
+    MetricsServer server(&metrics, METRICS_TEST_PORT);
+    for (int i = 0; i < 5; i++) {
+        SOCKET s = Connect(METRICS_TEST_PORT);
+        ASSERT_NE(s, INVALID_SOCKET);
+        struct linger l = { 1, 0 };
+        setsockopt(s, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+        CloseSocket(s);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    EXPECT_NE(Scrape(METRICS_TEST_PORT).find("recorder_frames_captured_total"), std::string::npos);
+}
+
+static int CountLines(const std::string &strText, const std::string &strPrefix) {
+    std::istringstream iss(strText);
+    std::string strLine;
+    int n = 0;
+    while (std::getline(iss, strLine)) {
+        n += strLine.compare(0, strPrefix.size(), strPrefix) == 0;
+    }
+    return n;
+}
+
+// Every recording of the service starts new pipeline threads under the same names
+TEST(RecorderMetrics, ReusesThreadSlotsByName) {
+    RecorderMetrics metrics;
+    for (int i = 0; i < 2 * RecorderMetrics::MAX_THREADS; i++) {
+        std::thread producer([&metrics]() { metrics.RegisterCurrentThread("producer"); });
+        std::thread consumer([&metrics]() { metrics.RegisterCurrentThread("consumer"); });
+        producer.join();
+        consumer.join();
+    }
+    metrics.RegisterCurrentThread("main");
+    std::string strText = metrics.ToPrometheusText();
+    EXPECT_EQ(CountLines(strText, "recorder_thread_cpu_seconds_total{thread=\"producer\"}"), 1);
+    EXPECT_EQ(CountLines(strText, "recorder_thread_cpu_seconds_total{thread=\"consumer\"}"), 1);
+    EXPECT_EQ(CountLines(strText, "recorder_thread_cpu_seconds_total{thread=\"main\"}"), 1);
+}
@@ -0,0 +1,64 @@
+#include <gtest/gtest.h>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../Utils/RecorderService.h"
+
+simplelogger::Logger *logger = NULL;
+
+// Records nothing; runs until the recording is stopped
+class IdlePipeline : public RecordingPipeline {
+public:
+    void Init(StartupTimer &) {}
+    void GetSequenceParams(std::vector<uint8_t> &vSeqParams) { vSeqParams.clear(); }
+    void Run(PacketDistributor *, RecorderControl *pControl, StartupTimer &) {
+        int64_t nPausedUs;
+        while (pControl->WaitWhilePaused(&nPausedUs)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+};
+
+static bool WaitForState(RecorderControl &control, RecorderState eState) {
+    for (int i = 0; i < 2000 && control.GetState() != eState; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return control.GetState() == eState;
+}
+
+TEST(RecorderService, KeepsServingAfterAFailedRecording) {
+    IdlePipeline pipeline;
+    std::vector<std::string> vOpened;
+    RecorderService service(&pipeline, [&vOpened](PacketDistributor &, const std::string &strPath) {
+        if (vOpened.empty()) {
+            vOpened.push_back("");
+            throw std::runtime_error("Unable to open output file: " + strPath);
+        }
+        vOpened.push_back(strPath);
+        return std::shared_ptr<void>();
+    });
+    RecorderMetrics metrics;
+    RecorderControl control(RECORDER_IDLE, &metrics);
+    std::thread thServe([&]() { service.Serve(&control, "service_test.mp4"); });
+
+    control.Execute("record");
+    ASSERT_TRUE(WaitForState(control, RECORDER_IDLE));
+    EXPECT_TRUE(control.HasLastRecordingFailed());
+    EXPECT_EQ("idle (last recording failed)\n", control.Execute("status"));
+    EXPECT_EQ(1u, metrics.nRecordingsFailed.load());
+
+    control.Execute("record");
+    ASSERT_TRUE(WaitForState(control, RECORDER_RECORDING));
+    control.Execute("stop");
+    ASSERT_TRUE(WaitForState(control, RECORDER_IDLE));
+    EXPECT_FALSE(control.HasLastRecordingFailed());
+    EXPECT_EQ("idle\n", control.Execute("status"));
+
+    control.Execute("quit");
+    thServe.join();
+    ASSERT_EQ(2u, vOpened.size());
+    // the failed recording did not use up its number
+    EXPECT_EQ("service_test_0000.mp4", vOpened[1]);
+}
@@ -0,0 +1,64 @@
+#include <gtest/gtest.h>
+#include <string>
+#include <thread>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "../Utils/ReplayBuffer.h"
+
+simplelogger::Logger *logger = NULL;
+
+static const unsigned short TRIGGER_TEST_PORT = 19479;
+
+static SOCKET Connect(unsigned short uPort) {
+    SOCKET s = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(uPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        CloseSocket(s);
+        return INVALID_SOCKET;
+    }
+    return s;
+}
+
+static std::string Request(unsigned short uPort, const std::string &strCommand) {
+    SOCKET s = Connect(uPort);
+    if (s == INVALID_SOCKET) {
+        return "";
+    }
+    SendAll(s, strCommand.data(), strCommand.size());
+    std::string strReply;
+    char aBuf[256];
+    int n;
+    while ((n = (int)recv(s, aBuf, sizeof(aBuf), 0)) > 0) {
+        strReply.append(aBuf, n);
+    }
+    CloseSocket(s);
+    return strReply;
+}
+
+TEST(ReplayTrigger, DumpsOnRequest) {
+    int nRequestedSeconds = -1;
+    ReplayTrigger trigger([&nRequestedSeconds](int nSeconds) {
+        nRequestedSeconds = nSeconds;
+        return std::string("replay_0000.mp4");
+    }, TRIGGER_TEST_PORT);
+    EXPECT_EQ("replay_0000.mp4\n", Request(TRIGGER_TEST_PORT, "dump 20\n"));
+    EXPECT_EQ(20, nRequestedSeconds);
+}
+
+// A client that resets the connection before the reply must not end the process with SIGPIPE
+TEST(ReplayTrigger, SurvivesResetConnections) {
+    ReplayTrigger trigger([](int) { return std::string(); }, TRIGGER_TEST_PORT);
+    for (int i = 0; i < 5; i++) {
+        SOCKET s = Connect(TRIGGER_TEST_PORT);
+        ASSERT_NE(s, INVALID_SOCKET);
+        struct linger l = { 1, 0 };
+        setsockopt(s, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+        CloseSocket(s);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    EXPECT_EQ("error: nothing recorded yet\n", Request(TRIGGER_TEST_PORT, "dump\n"));
+}
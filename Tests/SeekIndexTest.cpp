@@ -0,0 +1,132 @@
+#include <gtest/gtest.h>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include "../Utils/SeekIndex.h"
+#include "../Utils/PcmH264Encoder.h"
+
+static const char *RECORDING_PATH = "seek_index_test.h264";
+
+// 30 frames at 25 fps with an IDR (and SPS/PPS) every 10 frames, written as FilePacketSink does
+static std::vector<std::vector<uint8_t>> WriteRecording() {
+    PcmH264Encoder enc(64, 48, 10);
+    std::vector<uint8_t> vFrame(enc.GetFrameSize(), 128);
+    std::vector<std::vector<uint8_t>> vPacket, vFrames;
+    std::ofstream fpOut(RECORDING_PATH, std::ios::out | std::ios::binary);
+    SeekIndexWriter index(GetSeekIndexPath(RECORDING_PATH));
+    for (int i = 0; i < 30; i++) {
+        vFrame[i] = (uint8_t)i;
+        enc.EncodeFrame(vFrame.data(), 0, vPacket);
+        fpOut.write(reinterpret_cast<const char *>(vPacket[0].data()), vPacket[0].size());
+        index.Append(vPacket[0].data(), vPacket[0].size(), i * 40000LL);
+        vFrames.push_back(vPacket[0]);
+    }
+    EXPECT_EQ(30u, index.GetEntryCount());
+    return vFrames;
+}
+
+static void RemoveRecording() {
+    remove(RECORDING_PATH);
+    remove(GetSeekIndexPath(RECORDING_PATH).c_str());
+}
+
+TEST(SeekIndex, ReadsBackWhatWasWritten) {
+    std::vector<std::vector<uint8_t>> vFrames = WriteRecording();
+    {
+        RecordingReader reader(RECORDING_PATH);
+        EXPECT_EQ(NAL_CODEC_H264, reader.GetCodec());
+        ASSERT_EQ(30u, reader.GetFrameCount());
+        uint64_t nOffset = 0;
+        for (uint64_t i = 0; i < 30; i++) {
+            SeekIndexEntry entry = reader.GetEntry(i);
+            EXPECT_EQ(nOffset, entry.nOffset);
+            EXPECT_EQ(vFrames[i].size(), entry.nSize);
+            EXPECT_EQ((int64_t)i * 40000, entry.nPtsUs);
+            EXPECT_EQ(i % 10 == 0 ? (uint32_t)(SEEK_INDEX_KEY_FRAME | SEEK_INDEX_PARAMETER_SETS) : 0u, entry.nFlags);
+            nOffset += entry.nSize;
+        }
+        std::vector<uint8_t> vData;
+        ASSERT_TRUE(reader.ReadFrame(17, vData));
+        EXPECT_EQ(vFrames[17], vData);
+        EXPECT_FALSE(reader.ReadFrame(30, vData));
+    }
+    RemoveRecording();
+}
+
+TEST(SeekIndex, FindsFramesAndKeyFrames) {
+    WriteRecording();
+    {
+        RecordingReader reader(RECORDING_PATH);
+        EXPECT_EQ(0u, reader.FindFrame(-1));
+        EXPECT_EQ(13u, reader.FindFrame(13 * 40000));
+        EXPECT_EQ(14u, reader.FindFrame(13 * 40000 + 1));
+        EXPECT_EQ(30u, reader.FindFrame(30 * 40000));
+        EXPECT_EQ(10u, reader.FindKeyFrame(19));
+        EXPECT_EQ(20u, reader.FindKeyFrame(20));
+        EXPECT_EQ(20u, reader.FindKeyFrame(1000));
+
+        // 0.5 s to 0.9 s: frame 12 is on screen at the start, so the range starts at its key frame
+        uint64_t iBegin = 0, iEnd = 0;
+        ASSERT_TRUE(reader.FindRange(500000, 900000, &iBegin, &iEnd));
+        EXPECT_EQ(10u, iBegin);
+        EXPECT_EQ(23u, iEnd);
+        EXPECT_FALSE(reader.FindRange(30 * 40000, 40 * 40000, &iBegin, &iEnd));
+    }
+    RemoveRecording();
+}
+
+TEST(SeekIndex, ExtractedClipStartsWithParameterSets) {
+    std::vector<std::vector<uint8_t>> vFrames = WriteRecording();
+    {
+        RecordingReader reader(RECORDING_PATH);
+        std::vector<uint8_t> vSeqParams;
+        reader.GetSequenceParams(vSeqParams);
+        PcmH264Encoder enc(64, 48);
+        std::vector<uint8_t> vExpected;
+        enc.GetSequenceParams(vExpected);
+        EXPECT_EQ(vExpected, vSeqParams);
+
+        // from a key frame the bytes are copied as they are
+        std::ostringstream oss;
+        uint64_t nWritten = reader.ExtractFrames(10, 12, oss);
+        EXPECT_EQ(vFrames[10].size() + vFrames[11].size(), nWritten);
+        EXPECT_EQ(nWritten, oss.str().size());
+        // from any other frame the sequence parameters go in front
+        std::ostringstream ossP;
+        nWritten = reader.ExtractFrames(11, 12, ossP);
+        EXPECT_EQ(vSeqParams.size() + vFrames[11].size(), nWritten);
+        EXPECT_EQ(0, ossP.str().compare(0, vSeqParams.size(), std::string(vSeqParams.begin(), vSeqParams.end())));
+    }
+    RemoveRecording();
+}
+
+TEST(SeekIndex, IgnoresRecordsPastTheRecording) {
+    std::vector<std::vector<uint8_t>> vFrames = WriteRecording();
+    // a crash lost the last frame and a half of the recording, but not their records
+    uint64_t nSize = 0;
+    for (int i = 0; i < 28; i++) {
+        nSize += vFrames[i].size();
+    }
+    nSize += vFrames[28].size() / 2;
+    std::ifstream fpIn(RECORDING_PATH, std::ios::in | std::ios::binary);
+    std::vector<char> vData((size_t)nSize);
+    fpIn.read(vData.data(), vData.size());
+    fpIn.close();
+    std::ofstream(RECORDING_PATH, std::ios::out | std::ios::binary).write(vData.data(), vData.size());
+    {
+        RecordingReader reader(RECORDING_PATH);
+        EXPECT_EQ(28u, reader.GetFrameCount());
+    }
+    RemoveRecording();
+}
+
+TEST(SeekIndex, RejectsOtherFiles) {
+    std::ofstream(RECORDING_PATH, std::ios::out | std::ios::binary) << "not a recording";
+    std::ofstream(GetSeekIndexPath(RECORDING_PATH), std::ios::out | std::ios::binary) << "NVSX and more than sixteen bytes";
+    EXPECT_THROW(RecordingReader reader(RECORDING_PATH), std::invalid_argument);
+    RemoveRecording();
+    EXPECT_THROW(RecordingReader reader(RECORDING_PATH), std::invalid_argument);
+}
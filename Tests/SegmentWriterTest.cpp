@@ -0,0 +1,89 @@
+#include <gtest/gtest.h>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include "../Utils/SegmentWriter.h"
+
+simplelogger::Logger *logger = NULL;
+
+static bool FileExists(const std::string &strPath) {
+    return std::ifstream(strPath).good();
+}
+
+static void RemoveSegments(const char *szStem, const char *szExtension, int nSegments) {
+    for (int i = 0; i < nSegments; i++) {
+        char szPath[64];
+        sprintf(szPath, "%s_%04d%s", szStem, i, szExtension);
+        remove(szPath);
+        remove(GetSeekIndexPath(szPath).c_str());
+    }
+}
+
+// An IDR slice with no SPS/PPS in front of it
+static std::vector<uint8_t> MakeH264Idr() {
+    return std::vector<uint8_t>{ 0, 0, 0, 1, 0x65, 0x88, 0x84, 0x00, 0x10 };
+}
+
+TEST(SegmentWriterTest, FailedFinalizeIsLoggedNotFatal) {
+    SegmentOptions options;
+    options.nMaxBytes = 1;
+    int nClosed = 0;
+    options.funcSegmentClosed = [&nClosed](const std::string &) { nClosed++; };
+    {
+        // without SPS/PPS every MP4 segment fails to write its moov
+        SegmentWriter writer("segment_fail_test.mp4", 64, 48, std::vector<uint8_t>(), options);
+        for (int i = 0; i < 3; i++) {
+            writer.WritePacket(MakeH264Idr(), i * 20000LL, true);
+        }
+        EXPECT_EQ(2, writer.GetSegmentIndex());
+        writer.Close();
+    }
+    EXPECT_EQ(0, nClosed);
+    RemoveSegments("segment_fail_test", ".mp4", 4);
+}
+
+TEST(SegmentWriterTest, ThrowingCallbackKeepsRecording) {
+    SegmentOptions options;
+    options.nMaxBytes = 1;
+    int nClosed = 0;
+    options.funcSegmentClosed = [&nClosed](const std::string &) {
+        nClosed++;
+        throw std::runtime_error("upload failed");
+    };
+    {
+        SegmentWriter writer("segment_callback_test.h264", 64, 48, std::vector<uint8_t>(), options);
+        for (int i = 0; i < 3; i++) {
+            writer.WritePacket(MakeH264Idr(), i * 20000LL, true);
+        }
+        writer.Close();
+    }
+    EXPECT_EQ(3, nClosed);
+    EXPECT_TRUE(FileExists("segment_callback_test_0002.h264"));
+    EXPECT_FALSE(FileExists("segment_callback_test_0003.h264"));
+    RemoveSegments("segment_callback_test", ".h264", 4);
+}
+
+TEST(SegmentWriterTest, RawSegmentIndexUsesStreamCodec) {
+    // HEVC IDR_W_RADL slice; as H.264 its first header byte would read as a non-IDR slice
+    const std::vector<uint8_t> vIdr = { 0, 0, 0, 1, 0x26, 0x01, 0xaf, 0x00, 0x10 };
+    const std::vector<uint8_t> vTrail = { 0, 0, 0, 1, 0x02, 0x01, 0xd0, 0x00, 0x10 };
+    SegmentOptions options;
+    {
+        SegmentWriter writer("segment_hevc_test.h265", 64, 48, std::vector<uint8_t>(), options, NAL_CODEC_HEVC);
+        writer.WritePacket(vIdr, 0, true);
+        writer.WritePacket(vTrail, 20000, false);
+        writer.Close();
+    }
+    RecordingReader reader("segment_hevc_test_0000.h265");
+    EXPECT_EQ(NAL_CODEC_HEVC, reader.GetCodec());
+    ASSERT_EQ(2u, reader.GetFrameCount());
+    SeekIndexEntry entry = reader.GetEntry(0);
+    EXPECT_EQ(0u, entry.nOffset);
+    EXPECT_EQ(vIdr.size(), entry.nSize);
+    // nothing was prepended, so the frame must not claim to carry parameter sets
+    EXPECT_EQ((uint32_t)SEEK_INDEX_KEY_FRAME, entry.nFlags);
+    EXPECT_EQ(0u, reader.GetEntry(1).nFlags);
+    RemoveSegments("segment_hevc_test", ".h265", 2);
+}
@@ -0,0 +1,204 @@
+/**
+*  Offline decoder for the binary logs written by simplelogger::BinaryLogger.
+*  Usage: BinLogDecode [-json] file.0.binlog [file.1.binlog ...]
+*/
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <map>
+#include "../Utils/BinaryLogger.h"
+
+simplelogger::Logger *logger = simplelogger::LoggerFactory::CreateConsoleLogger();
+simplelogger::BinaryLogger *binlogger = NULL;
+
+using namespace simplelogger;
+
+struct BinLogArg {
+    BinLogArgType eType;
+    int64_t i;
+    uint64_t u;
+    double d;
+    std::string s;
+};
+
+static bool ReadArgs(const uint8_t *p, size_t n, std::vector<BinLogArg> &vArg) {
+    size_t k = 0;
+    while (k < n) {
+        BinLogArg a = {(BinLogArgType)p[k++], 0, 0, 0.0, std::string()};
+        switch (a.eType) {
+        case BINLOG_ARG_I32: { int32_t x; if (k + 4 > n) return false; memcpy(&x, p + k, 4); k += 4; a.i = x; break; }
+        case BINLOG_ARG_U32: { uint32_t x; if (k + 4 > n) return false; memcpy(&x, p + k, 4); k += 4; a.u = x; break; }
+        case BINLOG_ARG_I64: { if (k + 8 > n) return false; memcpy(&a.i, p + k, 8); k += 8; break; }
+        case BINLOG_ARG_U64: { if (k + 8 > n) return false; memcpy(&a.u, p + k, 8); k += 8; break; }
+        case BINLOG_ARG_F64: { if (k + 8 > n) return false; memcpy(&a.d, p + k, 8); k += 8; break; }
+        case BINLOG_ARG_STR: {
+            if (k + 1 > n || k + 1 + p[k] > n) return false;
+            a.s.assign((const char *)p + k + 1, p[k]);
+            k += 1 + p[k];
+            break;
+        }
+        default:
+            return false;
+        }
+        vArg.push_back(a);
+    }
+    return true;
+}
+
+// Expands printf-style conversions using the recorded argument types rather than the specifiers.
+static std::string Expand(const std::string &strFormat, const std::vector<BinLogArg> &vArg) {
+    std::ostringstream oss;
+    size_t iArg = 0;
+    for (size_t i = 0; i < strFormat.size(); i++) {
+        if (strFormat[i] != '%') {
+            oss << strFormat[i];
+            continue;
+        }
+        if (i + 1 < strFormat.size() && strFormat[i + 1] == '%') {
+            oss << '%';
+            i++;
+            continue;
+        }
+        size_t j = i + 1;
+        while (j < strFormat.size() && !strchr("diuxXfFeEgGsScp", strFormat[j])) {
+            j++;
+        }
+        std::string strSpec = strFormat.substr(i, j - i);
+        char cConv = j < strFormat.size() ? strFormat[j] : 'd';
+        i = j;
+        // drop length modifiers, the recorded type decides the width
+        std::string strFlags;
+        for (char c : strSpec) {
+            if (!strchr("hlLqjzt", c)) strFlags += c;
+        }
+        if (iArg >= vArg.size()) {
+            oss << "<missing>";
+            continue;
+        }
+        const BinLogArg &a = vArg[iArg++];
+        char szBuf[128];
+        switch (a.eType) {
+        case BINLOG_ARG_I32:
+        case BINLOG_ARG_I64:
+            snprintf(szBuf, sizeof(szBuf), (strFlags + "lld").c_str(), (long long)a.i);
+            break;
+        case BINLOG_ARG_U32:
+        case BINLOG_ARG_U64:
+            snprintf(szBuf, sizeof(szBuf), (strFlags + (strchr("xX", cConv) ? std::string("ll") + cConv : "llu")).c_str(), (unsigned long long)a.u);
+            break;
+        case BINLOG_ARG_F64:
+            snprintf(szBuf, sizeof(szBuf), (strFlags + (strchr("fFeEgG", cConv) ? std::string(1, cConv) : "g")).c_str(), a.d);
+            break;
+        default:
+            snprintf(szBuf, sizeof(szBuf), "%s", a.s.c_str());
+            break;
+        }
+        oss << szBuf;
+    }
+    return oss.str();
+}
+
+static std::string JsonEscape(const std::string &str) {
+    std::ostringstream oss;
+    for (unsigned char c : str) {
+        if (c == '"' || c == '\\') oss << '\\' << c;
+        else if (c < 0x20) oss << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int)c << std::dec;
+        else oss << c;
+    }
+    return oss.str();
+}
+
+static bool DecodeFile(const char *szPath, bool bJson) {
+    std::ifstream fpIn(szPath, std::ios::in | std::ios::binary);
+    if (!fpIn) {
+        LOG(ERROR) << "Unable to open input file: " << szPath;
+        return false;
+    }
+    std::vector<uint8_t> vBuf((std::istreambuf_iterator<char>(fpIn)), std::istreambuf_iterator<char>());
+    BinLogFileHeader fh;
+    if (vBuf.size() < sizeof(fh) || (memcpy(&fh, vBuf.data(), sizeof(fh)), fh.nMagic != BINLOG_MAGIC)) {
+        LOG(ERROR) << szPath << " is not a binary log";
+        return false;
+    }
+    if (fh.nVersion != BINLOG_VERSION) {
+        LOG(ERROR) << szPath << ": unsupported binary log version " << fh.nVersion;
+        return false;
+    }
+
+    std::map<uint16_t, std::string> mFormat;
+    size_t k = sizeof(fh);
+    while (k + sizeof(BinLogRecordHeader) <= vBuf.size()) {
+        BinLogRecordHeader h;
+        memcpy(&h, vBuf.data() + k, sizeof(h));
+        if (h.nFormatId == 0) {
+            break;
+        }
+        k += sizeof(h);
+        if (k + h.nPayloadSize > vBuf.size()) {
+            LOG(WARNING) << szPath << ": truncated record at offset " << k;
+            break;
+        }
+        const uint8_t *pPayload = vBuf.data() + k;
+        k += h.nPayloadSize;
+        if (h.nFormatId == BINLOG_FORMAT_DEFINITION) {
+            uint16_t nId;
+            memcpy(&nId, pPayload, sizeof(nId));
+            mFormat[nId].assign((const char *)pPayload + sizeof(nId), h.nPayloadSize - sizeof(nId));
+            continue;
+        }
+
+        std::vector<BinLogArg> vArg;
+        if (!ReadArgs(pPayload, h.nPayloadSize, vArg)) {
+            LOG(WARNING) << szPath << ": malformed arguments at offset " << k - h.nPayloadSize;
+        }
+        auto it = mFormat.find(h.nFormatId);
+        std::string strMsg = it == mFormat.end() ? "<unknown format " + std::to_string(h.nFormatId) + ">" : Expand(it->second, vArg);
+        int64_t nTimeUs = fh.nBaseTimeUs + h.nDeltaUs;
+        if (bJson) {
+            std::cout << "{\"t_us\":" << nTimeUs << ",\"id\":" << h.nFormatId << ",\"msg\":\"" << JsonEscape(strMsg) << "\",\"args\":[";
+            for (size_t i = 0; i < vArg.size(); i++) {
+                const BinLogArg &a = vArg[i];
+                std::cout << (i ? "," : "");
+                switch (a.eType) {
+                case BINLOG_ARG_I32: case BINLOG_ARG_I64: std::cout << a.i; break;
+                case BINLOG_ARG_U32: case BINLOG_ARG_U64: std::cout << a.u; break;
+                case BINLOG_ARG_F64: std::cout << std::setprecision(17) << a.d; break;
+                default: std::cout << "\"" << JsonEscape(a.s) << "\""; break;
+                }
+            }
+            std::cout << "]}\n";
+        } else {
+            time_t t = (time_t)(nTimeUs / 1000000);
+            struct tm *ptm = localtime(&t);
+            char szTime[32];
+            sprintf(szTime, "%02d:%02d:%02d.%06d", ptm->tm_hour, ptm->tm_min, ptm->tm_sec, (int)(nTimeUs % 1000000));
+            std::cout << "[" << szTime << "] " << strMsg << "\n";
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    bool bJson = false;
+    int nFiles = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-json")) {
+            bJson = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "-h")) {
+            break;
+        }
+        if (!DecodeFile(argv[i], bJson)) {
+            return 1;
+        }
+        nFiles++;
+    }
+    if (!nFiles) {
+        std::cout << "Usage: " << argv[0] << " [-json] file.0.binlog [file.1.binlog ...]" << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,211 @@
+/**
+*  Cuts a time range out of a raw recording without decoding it, through the seek index the
+*  recorder writes next to it (<recording>.idx). The clip starts at the key frame at or before
+*  the start time, gets the SPS/PPS in front if that frame lacks them, and timestamps that start
+*  at 0. Only the index records of the lookup and the bytes of the clip are read.
+*  Usage: Clip [-ss start] [-to end | -t duration] [-fmp4 N] recording.h264 clip.{h264,mp4}
+*/
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#endif
+#include "../Utils/Logger.h"
+#include "../Utils/NalScanner.h"
+#include "../Utils/SeekIndex.h"
+#include "../Utils/Mp4Writer.h"
+#include "../Utils/SegmentWriter.h"
+
+simplelogger::Logger *logger = simplelogger::LoggerFactory::CreateConsoleLogger();
+
+// Seconds ("12.5") or [hh:]mm:ss[.fff]
+static bool ParseTime(const char *sz, int64_t *pnUs) {
+    double dSeconds = 0;
+    const char *p = sz;
+    for (int i = 0; i < 3; i++) {
+        char *pEnd;
+        double d = strtod(p, &pEnd);
+        if (pEnd == p || d < 0) {
+            return false;
+        }
+        dSeconds = dSeconds * 60 + d;
+        if (*pEnd == 0) {
+            *pnUs = (int64_t)(dSeconds * 1000000 + 0.5);
+            return true;
+        }
+        if (*pEnd != ':') {
+            return false;
+        }
+        p = pEnd + 1;
+    }
+    return false;
+}
+
+#ifdef __linux__
+/**
+*  Copies nSize bytes at nOffset of fdIn to the current position of fdOut inside the kernel:
+*  copy_file_range() (which can share the blocks on reflink capable file systems), sendfile()
+*  where that is not supported, e.g. across file systems on older kernels.
+*/
+static bool CopyRange(int fdIn, uint64_t nOffset, uint64_t nSize, int fdOut) {
+    loff_t nOffsetIn = (loff_t)nOffset;
+    while (nSize) {
+        ssize_t n = copy_file_range(fdIn, &nOffsetIn, fdOut, NULL, nSize, 0);
+        if (n <= 0) {
+            break;
+        }
+        nSize -= n;
+    }
+    off_t nSendOffset = (off_t)nOffsetIn;
+    while (nSize) {
+        ssize_t n = sendfile(fdOut, fdIn, &nSendOffset, nSize);
+        if (n <= 0) {
+            return false;
+        }
+        nSize -= n;
+    }
+    return true;
+}
+#endif
+
+static void WriteRaw(RecordingReader &reader, const char *szRecording, uint64_t iBegin, uint64_t iEnd, const char *szOut) {
+    std::vector<uint8_t> vPrefix;
+    SeekIndexEntry first = reader.GetEntry(iBegin), last = reader.GetEntry(iEnd - 1);
+    if (!(first.nFlags & SEEK_INDEX_PARAMETER_SETS)) {
+        reader.GetSequenceParams(vPrefix);
+    }
+    // the clip gets its own index, with the offsets and timestamps of the clip
+    SeekIndexWriter index(GetSeekIndexPath(szOut), reader.GetCodec());
+#ifdef __linux__
+    int fdIn = open(szRecording, O_RDONLY), fdOut = open(szOut, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool bOk = fdIn >= 0 && fdOut >= 0
+        && (vPrefix.empty() || write(fdOut, vPrefix.data(), vPrefix.size()) == (ssize_t)vPrefix.size())
+        && CopyRange(fdIn, first.nOffset, last.nOffset + last.nSize - first.nOffset, fdOut);
+    if (fdIn >= 0) {
+        close(fdIn);
+    }
+    if (fdOut >= 0 && close(fdOut)) {
+        bOk = false;
+    }
+    if (!bOk) {
+        throw std::runtime_error(std::string("Unable to write ") + szOut + ": " + strerror(errno));
+    }
+#else
+    std::ofstream fpOut(szOut, std::ios::out | std::ios::binary);
+    if (!fpOut) {
+        throw std::invalid_argument(std::string("Unable to open output file: ") + szOut);
+    }
+    reader.ExtractFrames(iBegin, iEnd, fpOut);
+#endif
+    for (uint64_t i = iBegin; i < iEnd; i++) {
+        SeekIndexEntry entry = i == iBegin ? first : reader.GetEntry(i);
+        uint32_t nFlags = entry.nFlags | (vPrefix.empty() || i != iBegin ? 0 : SEEK_INDEX_PARAMETER_SETS);
+        index.Append(entry.nSize + (i == iBegin ? vPrefix.size() : 0), entry.nPtsUs - first.nPtsUs, nFlags);
+    }
+    index.Close();
+}
+
+static void WriteMp4(RecordingReader &reader, uint64_t iBegin, uint64_t iEnd, const char *szOut, int nFragmentFrames) {
+    if (reader.GetCodec() != NAL_CODEC_H264) {
+        throw std::invalid_argument("MP4 output is only supported for H.264 recordings");
+    }
+    std::vector<uint8_t> vSeqParams;
+    reader.GetSequenceParams(vSeqParams);
+    std::vector<NalUnit> vNal;
+    SplitAnnexB(vSeqParams.data(), vSeqParams.size(), vNal);
+    int nWidth = 0, nHeight = 0;
+    for (const NalUnit &nal : vNal) {
+        if (GetH264NalType(nal) == H264_NAL_SPS && GetH264SpsSize(nal, &nWidth, &nHeight)) {
+            break;
+        }
+    }
+    if (!nWidth) {
+        throw std::invalid_argument("Unable to read the picture size from the SPS of the recording");
+    }
+    Mp4WriterOptions options;
+    options.bFragmented = nFragmentFrames >= 0;
+    options.nFragmentFrames = nFragmentFrames;
+    Mp4Writer writer(szOut, nWidth, nHeight, vSeqParams, options);
+    std::vector<uint8_t> vFrame;
+    SeekIndexEntry entry, first = reader.GetEntry(iBegin);
+    for (uint64_t i = iBegin; i < iEnd; i++) {
+        if (!reader.ReadFrame(i, vFrame, &entry)) {
+            throw std::runtime_error("Unable to read frame " + std::to_string(i) + " of the recording");
+        }
+        writer.WritePacket(vFrame, entry.nPtsUs - first.nPtsUs);
+    }
+    writer.Close();
+}
+
+static void ShowUsage(const char *szName) {
+    std::cout << "Usage: " << szName << " [-ss start] [-to end | -t duration] [-fmp4 N] recording.h264 clip.{h264,mp4}" << std::endl
+        << "Times are seconds (12.5) or [hh:]mm:ss[.fff] from the first frame of the recording." << std::endl
+        << "The clip starts at the key frame at or before -ss; an .mp4 path wraps it into MP4," << std::endl
+        << "fragmented with a fragment every N frames (0: every IDR) with -fmp4." << std::endl;
+}
+
+int main(int argc, char **argv) {
+    int64_t nStartUs = 0, nEndUs = INT64_MAX, nDurationUs = -1;
+    int nFragmentFrames = -1;
+    std::vector<const char *> vPath;
+    for (int i = 1; i < argc; i++) {
+        bool bValue = i + 1 < argc;
+        if (!strcmp(argv[i], "-ss") && bValue && ParseTime(argv[i + 1], &nStartUs)) {
+            i++;
+        } else if (!strcmp(argv[i], "-to") && bValue && ParseTime(argv[i + 1], &nEndUs)) {
+            i++;
+        } else if (!strcmp(argv[i], "-t") && bValue && ParseTime(argv[i + 1], &nDurationUs)) {
+            i++;
+        } else if (!strcmp(argv[i], "-fmp4") && bValue) {
+            nFragmentFrames = atoi(argv[++i]);
+        } else if (argv[i][0] != '-') {
+            vPath.push_back(argv[i]);
+        } else {
+            ShowUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (vPath.size() != 2) {
+        ShowUsage(argv[0]);
+        return 1;
+    }
+    if (nDurationUs >= 0) {
+        nEndUs = nStartUs + nDurationUs;
+    }
+
+    try {
+        RecordingReader reader(vPath[0]);
+        if (!reader.GetFrameCount()) {
+            LOG(ERROR) << vPath[0] << " has no indexed frames";
+            return 1;
+        }
+        // the timestamps of a recording continue across pauses and segments, so times count from its first frame
+        int64_t nBaseUs = reader.GetEntry(0).nPtsUs;
+        uint64_t iBegin, iEnd;
+        if (!reader.FindRange(nBaseUs + nStartUs, nEndUs == INT64_MAX ? INT64_MAX : nBaseUs + nEndUs, &iBegin, &iEnd)) {
+            LOG(ERROR) << "No frames in the requested range of " << vPath[0];
+            return 1;
+        }
+        if (SegmentFile::IsMp4Path(vPath[1])) {
+            WriteMp4(reader, iBegin, iEnd, vPath[1], nFragmentFrames);
+        } else {
+            WriteRaw(reader, vPath[0], iBegin, iEnd, vPath[1]);
+        }
+        SeekIndexEntry first = reader.GetEntry(iBegin), last = reader.GetEntry(iEnd - 1);
+        LOG(INFO) << "Clip of " << iEnd - iBegin << " frames from " << (first.nPtsUs - nBaseUs) / 1000 << " ms to "
+            << (last.nPtsUs - nBaseUs) / 1000 << " ms (" << last.nOffset + last.nSize - first.nOffset << " bytes) saved in file " << vPath[1];
+    } catch (const std::exception &ex) {
+        LOG(ERROR) << ex.what();
+        return 1;
+    }
+    return 0;
+}
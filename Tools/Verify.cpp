@@ -0,0 +1,479 @@
+/**
+*  Checks that a recording decodes: demuxes it, cuts it into GOPs at the key frames and decodes
+*  the GOPs in parallel on the CPU with libavcodec, each from its own IDR, then reports decode
+*  errors, frame counts and timestamp continuity and, against the source frames, PSNR and SSIM.
+*  No GPU is needed.
+*  Usage: Verify [-threads N] [-maxgap ms] [-ref source.yuv -reffmt i420|nv12|bgra] [-noindex] [-json] recording
+*/
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <memory>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include "../Utils/FFmpegDemuxer.h"
+extern "C" {
+#include <libavutil/frame.h>
+}
+#include "../Utils/Logger.h"
+#include "../Utils/NalScanner.h"
+#include "../Utils/SeekIndex.h"
+#include "../Utils/ColorSpaceCpu.h"
+#include "../Utils/QualityMetrics.h"
+#include "../Queue.h"
+
+simplelogger::Logger *logger = simplelogger::LoggerFactory::CreateConsoleLogger();
+
+struct VerifyOptions {
+    int nThreads = 0;
+    int nMaxGapMs = 1000;
+    std::string strRef;
+    std::string strRefFormat = "i420";
+    bool bIndex = true;
+    bool bJson = false;
+};
+
+/**
+*  Packets of the recording in stream order with their pts in microseconds. A raw recording with a
+*  seek index is read through the index, which has the capture timestamps; FFmpeg's raw H.264
+*  demuxer would make them up from a nominal frame rate.
+*/
+class PacketSource {
+public:
+    virtual ~PacketSource() {}
+    virtual bool Next(const uint8_t **ppData, int *pnSize, int64_t *pnPtsUs) = 0;
+    virtual NalCodec GetCodec() = 0;
+    virtual const char *GetName() = 0;
+};
+
+class IndexPacketSource : public PacketSource {
+public:
+    IndexPacketSource(const std::string &strPath) : reader(strPath) {}
+    bool Next(const uint8_t **ppData, int *pnSize, int64_t *pnPtsUs) {
+        SeekIndexEntry entry;
+        if (!reader.ReadFrame(iFrame++, vFrame, &entry)) {
+            return false;
+        }
+        *ppData = vFrame.data();
+        *pnSize = (int)vFrame.size();
+        *pnPtsUs = entry.nPtsUs;
+        return true;
+    }
+    NalCodec GetCodec() { return reader.GetCodec(); }
+    const char *GetName() { return "index"; }
+private:
+    RecordingReader reader;
+    std::vector<uint8_t> vFrame;
+    uint64_t iFrame = 0;
+};
+
+class DemuxerPacketSource : public PacketSource {
+public:
+    DemuxerPacketSource(const std::string &strPath) : demuxer(strPath.c_str()) {
+        if (!demuxer.Demux(&pFirst, &nFirst, &nFirstPtsUs)) {
+            throw std::invalid_argument("No video packets in " + strPath);
+        }
+        if (demuxer.GetVideoCodec() != AV_CODEC_ID_H264 && demuxer.GetVideoCodec() != AV_CODEC_ID_HEVC) {
+            throw std::invalid_argument("Only H.264 and HEVC recordings can be verified");
+        }
+    }
+    bool Next(const uint8_t **ppData, int *pnSize, int64_t *pnPtsUs) {
+        if (pFirst) {
+            *ppData = pFirst;
+            *pnSize = nFirst;
+            *pnPtsUs = nFirstPtsUs;
+            pFirst = NULL;
+            return true;
+        }
+        uint8_t *pData;
+        bool bOk = demuxer.Demux(&pData, pnSize, pnPtsUs);
+        *ppData = pData;
+        return bOk;
+    }
+    NalCodec GetCodec() { return demuxer.GetVideoCodec() == AV_CODEC_ID_HEVC ? NAL_CODEC_HEVC : NAL_CODEC_H264; }
+    const char *GetName() { return "ffmpeg"; }
+private:
+    FFmpegDemuxer demuxer;
+    uint8_t *pFirst = NULL;
+    int nFirst = 0;
+    int64_t nFirstPtsUs = 0;
+};
+
+struct Gop {
+    uint64_t iGop = 0, iFirstPacket = 0;
+    int64_t nFirstPtsUs = AV_NOPTS_VALUE;
+    bool bKeyFrame = false;
+    /** Each packet is followed by the zero padding libavcodec reads past the end */
+    std::vector<std::vector<uint8_t>> vPacket;
+    std::vector<int> vSize;
+};
+
+struct GopResult {
+    uint64_t iFirstPacket = 0;
+    int64_t nFirstPtsUs = AV_NOPTS_VALUE;
+    uint64_t nPackets = 0, nFrames = 0, nErrors = 0;
+    std::string strError;
+    QualityStats quality;
+};
+
+static std::string AvErrorString(int e) {
+    char sz[AV_ERROR_MAX_STRING_SIZE] = {};
+    av_strerror(e, sz, sizeof(sz));
+    return sz;
+}
+
+/**
+*  Reads the source frame of a decoded one from a raw file of fixed-size frames; BGRA is
+*  converted to NV12. Every decoding thread has its own.
+*/
+class ReferenceReader {
+public:
+    ReferenceReader(const std::string &strPath, const std::string &strFormat) : strFormat(strFormat) {
+        fpIn.open(strPath, std::ios::in | std::ios::binary);
+        if (!fpIn) {
+            throw std::invalid_argument("Unable to open reference file: " + strPath);
+        }
+    }
+    bool Read(uint64_t iFrame, int nWidth, int nHeight, YuvFrame *pFrame) {
+        int nChromaWidth = (nWidth + 1) / 2, nChromaHeight = (nHeight + 1) / 2;
+        size_t nLuma = (size_t)nWidth * nHeight, nChroma = (size_t)nChromaWidth * nChromaHeight;
+        size_t nFrameSize = strFormat == "bgra" ? nLuma * 4 : nLuma + 2 * nChroma;
+        vFile.resize(nFrameSize);
+        fpIn.clear();
+        fpIn.seekg(iFrame * nFrameSize);
+        if (!fpIn.read((char *)vFile.data(), nFrameSize)) {
+            return false;
+        }
+        if (strFormat == "i420") {
+            *pFrame = YuvFrame::FromI420(vFile.data(), nWidth, nHeight);
+        } else if (strFormat == "bgra") {
+            // the recorder's conversion: limited range BT.601, even sizes
+            vNv12.resize(nLuma + 2 * nChroma);
+            Bgra32ToNv12(vFile.data(), nWidth * 4, vNv12.data(), nWidth, nWidth, nHeight);
+            *pFrame = YuvFrame::FromNv12(vNv12.data(), nWidth, nWidth, nHeight);
+        } else {
+            *pFrame = YuvFrame::FromNv12(vFile.data(), nWidth, nWidth, nHeight);
+        }
+        return true;
+    }
+private:
+    std::ifstream fpIn;
+    std::string strFormat;
+    std::vector<uint8_t> vFile, vNv12;
+};
+
+/**
+*  One software decoder per thread, single-threaded itself: the parallelism is across GOPs. It is
+*  flushed at every GOP, so each GOP decodes from its own key frame as a player seeking there would.
+*/
+class GopDecoder {
+public:
+    GopDecoder(NalCodec eCodec, const VerifyOptions &options) {
+        const AVCodec *pCodec = avcodec_find_decoder(eCodec == NAL_CODEC_HEVC ? AV_CODEC_ID_HEVC : AV_CODEC_ID_H264);
+        if (!pCodec || !(ctx = avcodec_alloc_context3(pCodec))) {
+            throw std::runtime_error("No libavcodec decoder for the codec of the recording");
+        }
+        ctx->thread_count = 1;
+        // report damaged slices instead of concealing them
+        ctx->err_recognition |= AV_EF_EXPLODE;
+        int e = avcodec_open2(ctx, pCodec, NULL);
+        if (e < 0) {
+            avcodec_free_context(&ctx);
+            throw std::runtime_error("Unable to open the decoder: " + AvErrorString(e));
+        }
+        pkt = av_packet_alloc();
+        frame = av_frame_alloc();
+        if (!options.strRef.empty()) {
+            pRef.reset(new ReferenceReader(options.strRef, options.strRefFormat));
+        }
+    }
+    ~GopDecoder() {
+        av_frame_free(&frame);
+        av_packet_free(&pkt);
+        avcodec_free_context(&ctx);
+    }
+
+    GopResult Decode(const Gop &gop) {
+        GopResult r;
+        r.iFirstPacket = gop.iFirstPacket;
+        r.nFirstPtsUs = gop.nFirstPtsUs;
+        r.nPackets = gop.vPacket.size();
+        if (!gop.bKeyFrame) {
+            Fail(r, "does not start with a key frame");
+        }
+        for (size_t i = 0; i < gop.vPacket.size(); i++) {
+            pkt->data = const_cast<uint8_t *>(gop.vPacket[i].data());
+            pkt->size = gop.vSize[i];
+            int e = avcodec_send_packet(ctx, pkt);
+            if (e < 0) {
+                Fail(r, "packet " + std::to_string(gop.iFirstPacket + i) + ": " + AvErrorString(e));
+            }
+            ReceiveFrames(gop, r);
+        }
+        avcodec_send_packet(ctx, NULL);
+        ReceiveFrames(gop, r);
+        avcodec_flush_buffers(ctx);
+        return r;
+    }
+
+private:
+    void ReceiveFrames(const Gop &gop, GopResult &r) {
+        int e;
+        while ((e = avcodec_receive_frame(ctx, frame)) >= 0) {
+            if (frame->decode_error_flags || (frame->flags & AV_FRAME_FLAG_CORRUPT)) {
+                Fail(r, "frame " + std::to_string(gop.iFirstPacket + r.nFrames) + " is corrupt");
+            }
+            if (pRef) {
+                Compare(gop.iFirstPacket + r.nFrames, r);
+            }
+            r.nFrames++;
+            av_frame_unref(frame);
+        }
+        if (e != AVERROR(EAGAIN) && e != AVERROR_EOF) {
+            Fail(r, "frame " + std::to_string(gop.iFirstPacket + r.nFrames) + ": " + AvErrorString(e));
+        }
+    }
+
+    // without B frames the n-th decoded frame of the recording shows the n-th source frame
+    void Compare(uint64_t iFrame, GopResult &r) {
+        if (frame->format != AV_PIX_FMT_YUV420P && frame->format != AV_PIX_FMT_YUVJ420P) {
+            return;
+        }
+        YuvFrame ref, test;
+        if (!pRef->Read(iFrame, frame->width, frame->height, &ref)) {
+            return;
+        }
+        int nChromaWidth = (frame->width + 1) / 2, nChromaHeight = (frame->height + 1) / 2;
+        test.aPlane[0] = ImagePlane{ frame->data[0], frame->linesize[0], frame->width, frame->height };
+        test.aPlane[1] = ImagePlane{ frame->data[1], frame->linesize[1], nChromaWidth, nChromaHeight };
+        test.aPlane[2] = ImagePlane{ frame->data[2], frame->linesize[2], nChromaWidth, nChromaHeight };
+        r.quality.Add(evaluator.Compare(ref, test));
+    }
+
+    static void Fail(GopResult &r, const std::string &strError) {
+        if (!r.nErrors++) {
+            r.strError = strError;
+        }
+    }
+
+    AVCodecContext *ctx = NULL;
+    AVPacket *pkt = NULL;
+    AVFrame *frame = NULL;
+    std::unique_ptr<ReferenceReader> pRef;
+    // single-threaded as well, with the SIMD kernels
+    QualityEvaluator evaluator;
+};
+
+struct TimestampStats {
+    uint64_t nPackets = 0, nWithPts = 0, nNonMonotonic = 0, nGaps = 0;
+    int64_t nFirstUs = 0, nLastUs = 0, nMaxGapUs = 0;
+    uint64_t iMaxGap = 0, iFirstNonMonotonic = 0;
+
+    void Add(int64_t nPtsUs, uint64_t iPacket, int64_t nGapUs) {
+        nPackets++;
+        if (nPtsUs == AV_NOPTS_VALUE) {
+            return;
+        }
+        if (nWithPts++ == 0) {
+            nFirstUs = nLastUs = nPtsUs;
+            return;
+        }
+        int64_t nDelta = nPtsUs - nLastUs;
+        if (nDelta <= 0 && !nNonMonotonic++) {
+            iFirstNonMonotonic = iPacket;
+        }
+        if (nDelta > nGapUs) {
+            nGaps++;
+        }
+        if (nDelta > nMaxGapUs) {
+            nMaxGapUs = nDelta;
+            iMaxGap = iPacket;
+        }
+        nLastUs = (std::max)(nLastUs, nPtsUs);
+    }
+};
+
+static void ShowUsage(const char *szName) {
+    std::cout << "Usage: " << szName << " [-threads N] [-maxgap ms] [-ref source.yuv -reffmt i420|nv12|bgra] [-noindex] [-json] recording" << std::endl
+        << "-threads  Decoding threads (default: all cores)" << std::endl
+        << "-maxgap   Report timestamp gaps longer than this (default 1000 ms)" << std::endl
+        << "-ref      Raw source frames, at the size of the recording, to compute PSNR/SSIM against (no B frames)" << std::endl
+        << "-reffmt   Format of the -ref frames (default i420)" << std::endl
+        << "-noindex  Demux a raw recording with FFmpeg even if it has a seek index" << std::endl
+        << "-json     Print the report as one JSON object" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    VerifyOptions options;
+    std::string strPath;
+    for (int i = 1; i < argc; i++) {
+        bool bValue = i + 1 < argc;
+        if (!strcmp(argv[i], "-threads") && bValue) {
+            options.nThreads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-maxgap") && bValue) {
+            options.nMaxGapMs = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-ref") && bValue) {
+            options.strRef = argv[++i];
+        } else if (!strcmp(argv[i], "-reffmt") && bValue) {
+            options.strRefFormat = argv[++i];
+        } else if (!strcmp(argv[i], "-noindex")) {
+            options.bIndex = false;
+        } else if (!strcmp(argv[i], "-json")) {
+            options.bJson = true;
+        } else if (argv[i][0] != '-' && strPath.empty()) {
+            strPath = argv[i];
+        } else {
+            ShowUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (strPath.empty() || (options.strRefFormat != "i420" && options.strRefFormat != "nv12" && options.strRefFormat != "bgra")) {
+        ShowUsage(argv[0]);
+        return 1;
+    }
+    if (options.nThreads <= 0) {
+        options.nThreads = (std::max)(1, (int)std::thread::hardware_concurrency());
+    }
+
+    auto tStart = std::chrono::steady_clock::now();
+    std::unique_ptr<PacketSource> pSource;
+    std::vector<std::unique_ptr<GopDecoder>> vDecoder;
+    try {
+        std::ifstream fpIndex(GetSeekIndexPath(strPath));
+        if (options.bIndex && fpIndex) {
+            pSource.reset(new IndexPacketSource(strPath));
+        } else {
+            pSource.reset(new DemuxerPacketSource(strPath));
+        }
+        for (int i = 0; i < options.nThreads; i++) {
+            vDecoder.emplace_back(new GopDecoder(pSource->GetCodec(), options));
+        }
+    } catch (const std::exception &ex) {
+        LOG(ERROR) << ex.what();
+        return 1;
+    }
+
+    // a couple of GOPs per thread in flight bounds the memory whatever the recording length
+    BoundedQueue<Gop> qGop(options.nThreads * 2);
+    std::mutex mtxResult;
+    std::map<uint64_t, GopResult> mResult;
+    std::vector<std::thread> vThread;
+    for (int i = 0; i < options.nThreads; i++) {
+        vThread.push_back(std::thread([&, i]() {
+            Gop gop;
+            while (qGop.pop(gop)) {
+                GopResult r = vDecoder[i]->Decode(gop);
+                std::lock_guard<std::mutex> lock(mtxResult);
+                mResult[gop.iGop] = std::move(r);
+            }
+        }));
+    }
+
+    TimestampStats ts;
+    uint64_t nKeyFrames = 0, nBytes = 0;
+    Gop gop;
+    const uint8_t *pData;
+    int nSize;
+    int64_t nPtsUs;
+    for (uint64_t iPacket = 0; pSource->Next(&pData, &nSize, &nPtsUs); iPacket++) {
+        ts.Add(nPtsUs, iPacket, (int64_t)options.nMaxGapMs * 1000);
+        NalPacketInfo info;
+        DescribePacket(pData, nSize, pSource->GetCodec(), &info);
+        nKeyFrames += info.bKeyFrame;
+        nBytes += nSize;
+        if (info.bKeyFrame && !gop.vPacket.empty()) {
+            uint64_t iGop = gop.iGop;
+            qGop.push(std::move(gop));
+            gop = Gop();
+            gop.iGop = iGop + 1;
+        }
+        if (gop.vPacket.empty()) {
+            gop.iFirstPacket = iPacket;
+            gop.nFirstPtsUs = nPtsUs;
+            gop.bKeyFrame = info.bKeyFrame;
+        }
+        std::vector<uint8_t> vPacket(nSize + AV_INPUT_BUFFER_PADDING_SIZE, 0);
+        memcpy(vPacket.data(), pData, nSize);
+        gop.vPacket.push_back(std::move(vPacket));
+        gop.vSize.push_back(nSize);
+    }
+    if (!gop.vPacket.empty()) {
+        qGop.push(std::move(gop));
+    }
+    qGop.close();
+    for (std::thread &th : vThread) {
+        th.join();
+    }
+    double dSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+
+    uint64_t nFrames = 0, nErrors = 0, nBadGops = 0;
+    QualityStats quality;
+    std::vector<const GopResult *> vBad;
+    for (auto &it : mResult) {
+        nFrames += it.second.nFrames;
+        nErrors += it.second.nErrors;
+        quality.Merge(it.second.quality);
+        if (it.second.nErrors) {
+            nBadGops++;
+            vBad.push_back(&it.second);
+        }
+    }
+    double dDurationS = (ts.nLastUs - ts.nFirstUs) / 1e6;
+    bool bOk = nErrors == 0 && nFrames == ts.nPackets && ts.nNonMonotonic == 0 && ts.nPackets > 0;
+
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(3);
+    if (options.bJson) {
+        oss << "{\"file\":\"" << strPath << "\",\"demuxer\":\"" << pSource->GetName() << "\",\"ok\":" << (bOk ? "true" : "false")
+            << ",\"packets\":" << ts.nPackets << ",\"frames\":" << nFrames << ",\"key_frames\":" << nKeyFrames << ",\"gops\":" << mResult.size()
+            << ",\"bytes\":" << nBytes << ",\"errors\":" << nErrors << ",\"bad_gops\":" << nBadGops
+            << ",\"duration_s\":" << dDurationS << ",\"non_monotonic\":" << ts.nNonMonotonic << ",\"gaps\":" << ts.nGaps
+            << ",\"max_gap_ms\":" << ts.nMaxGapUs / 1000.0 << ",\"wall_s\":" << dSeconds << ",\"threads\":" << options.nThreads;
+        if (quality.nFrames) {
+            oss << ",\"compared\":" << quality.nFrames << ",\"psnr_y\":" << quality.GetPlanePsnr(0) << ",\"psnr_u\":" << quality.GetPlanePsnr(1)
+                << ",\"psnr_v\":" << quality.GetPlanePsnr(2) << ",\"psnr\":" << quality.GetGlobalPsnr() << ",\"psnr_avg\":" << quality.GetAveragePsnr()
+                << ",\"psnr_min\":" << quality.dPsnrMin << ",\"ssim\":" << quality.GetAverageSsim() << ",\"ssim_min\":" << quality.dSsimMin;
+        }
+        oss << "}";
+        std::cout << oss.str() << std::endl;
+        return bOk ? 0 : 1;
+    }
+
+    oss << strPath << " (" << pSource->GetName() << "): " << (bOk ? "OK" : "FAILED") << "\n"
+        << "  frames:     " << nFrames << " decoded of " << ts.nPackets << " packets, " << nKeyFrames << " key frames, " << mResult.size() << " GOPs, " << nBytes << " bytes\n"
+        << "  errors:     " << nErrors << " in " << nBadGops << " GOPs\n";
+    for (size_t i = 0; i < vBad.size() && i < 10; i++) {
+        oss << "    GOP at packet " << vBad[i]->iFirstPacket;
+        if (vBad[i]->nFirstPtsUs != AV_NOPTS_VALUE) {
+            oss << " (" << (vBad[i]->nFirstPtsUs - ts.nFirstUs) / 1e6 << " s)";
+        }
+        oss << ": " << vBad[i]->strError << (vBad[i]->nErrors > 1 ? " and " + std::to_string(vBad[i]->nErrors - 1) + " more" : "") << "\n";
+    }
+    if (ts.nWithPts) {
+        oss << "  timestamps: " << dDurationS << " s, " << (dDurationS > 0 ? (ts.nWithPts - 1) / dDurationS : 0) << " fps on average, "
+            << ts.nNonMonotonic << " not increasing" << (ts.nNonMonotonic ? " (first at packet " + std::to_string(ts.iFirstNonMonotonic) + ")" : "") << ", "
+            << ts.nGaps << " gaps over " << options.nMaxGapMs << " ms, longest " << ts.nMaxGapUs / 1000.0 << " ms at packet " << ts.iMaxGap << "\n";
+    } else {
+        oss << "  timestamps: none in the stream\n";
+    }
+    if (quality.nFrames) {
+        oss << "  quality:    " << quality.nFrames << " frames, PSNR Y " << quality.GetPlanePsnr(0) << " U " << quality.GetPlanePsnr(1) << " V " << quality.GetPlanePsnr(2)
+            << " dB, global " << quality.GetGlobalPsnr() << ", average " << quality.GetAveragePsnr() << ", min " << quality.dPsnrMin
+            << "; SSIM " << std::setprecision(5) << quality.GetAverageSsim() << ", min " << quality.dSsimMin << std::setprecision(3) << "\n";
+    }
+    oss << "  speed:      " << dSeconds << " s with " << options.nThreads << " threads, " << nFrames / dSeconds << " fps";
+    if (dDurationS > 0) {
+        oss << ", " << dDurationS / dSeconds << "x real time";
+    }
+    std::cout << oss.str() << std::endl;
+    return bOk ? 0 : 1;
+}
@@ -0,0 +1,341 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <type_traits>
+#include "Logger.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+extern simplelogger::Logger *logger;
+
+namespace simplelogger {
+
+/**
+* @brief On-disk layout of the binary log.
+* A file starts with BinLogFileHeader and is followed by records. Every record
+* starts with BinLogRecordHeader; nFormatId == 0 marks the end of valid data
+* (the mapped file is zero-filled), BINLOG_FORMAT_DEFINITION carries the text of
+* a format string and any other id is an event whose arguments follow as
+* (BinLogArgType, raw value) pairs.
+*/
+static const uint32_t BINLOG_MAGIC = 0x4C42564E; // "NVBL"
+static const uint16_t BINLOG_VERSION = 1;
+static const uint16_t BINLOG_FORMAT_DEFINITION = 0xFFFF;
+
+enum BinLogArgType : uint8_t {
+    BINLOG_ARG_I32 = 1,
+    BINLOG_ARG_U32,
+    BINLOG_ARG_I64,
+    BINLOG_ARG_U64,
+    BINLOG_ARG_F64,
+    BINLOG_ARG_STR,
+};
+
+#pragma pack(push, 1)
+struct BinLogFileHeader {
+    uint32_t nMagic;
+    uint16_t nVersion;
+    uint16_t nReserved;
+    int64_t nBaseTimeUs;    // wall clock at file creation, microseconds since epoch
+    uint32_t nFileIndex;
+    uint32_t nReserved2;
+};
+
+struct BinLogRecordHeader {
+    uint16_t nFormatId;
+    uint16_t nPayloadSize;
+    uint32_t nDeltaUs;      // microseconds since nBaseTimeUs
+};
+#pragma pack(pop)
+
+/**
+* @brief Process-wide table of format strings, indexed by the id stored in each record.
+*/
+class BinLogFormats {
+public:
+    static uint16_t Register(const char *szFormat) {
+        std::lock_guard<std::mutex> lock(Mutex());
+        Table().push_back(szFormat);
+        return (uint16_t)Table().size();
+    }
+    static size_t Count() {
+        std::lock_guard<std::mutex> lock(Mutex());
+        return Table().size();
+    }
+    static const char *Get(uint16_t nId) {
+        std::lock_guard<std::mutex> lock(Mutex());
+        return Table()[nId - 1];
+    }
+private:
+    static std::vector<const char *> &Table() {
+        static std::vector<const char *> vFormat;
+        return vFormat;
+    }
+    static std::mutex &Mutex() {
+        static std::mutex mtx;
+        return mtx;
+    }
+};
+
+/**
+* @brief Binary event sink for per-frame diagnostics.
+* Events are written as a format id, a timestamp delta and the raw argument values
+* into a memory-mapped file of fixed size. When a file is full (or the delta would
+* overflow) it is trimmed to its used size and the next file of the rotation is
+* mapped; at most nMaxFiles files are kept. Use the BINLOG() macro to log events and
+* Tools/BinLogDecode to turn the files back into text or JSON.
+*/
+class BinaryLogger {
+public:
+    BinaryLogger(const std::string &strBasePath, uint32_t nFileSize = 64 << 20, uint32_t nMaxFiles = 4)
+        : strBasePath(strBasePath), nFileSize(nFileSize), nMaxFiles(nMaxFiles) {
+        OpenFile();
+    }
+    ~BinaryLogger() {
+        std::lock_guard<std::mutex> lock(mtx);
+        CloseFile();
+    }
+
+    template<typename... Args>
+    void Write(uint16_t nFormatId, const Args&... args) {
+        uint8_t aPayload[MAX_PAYLOAD];
+        size_t nPayload = 0;
+        EncodeArgs(aPayload, nPayload, args...);
+
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!pView) {
+            return;
+        }
+        // taken under the lock so that the records of a file are in time order
+        int64_t nNow = NowUs();
+        if (nFormatId > nFormatsWritten) {
+            WriteFormatDefinitions(nFormatId);
+        }
+        if (!Reserve(sizeof(BinLogRecordHeader) + nPayload, nNow)) {
+            return;
+        }
+        // a rotation in Reserve() sets the base time of the new file after nNow
+        BinLogRecordHeader h = {nFormatId, (uint16_t)nPayload, (uint32_t)(nNow > nBaseTimeUs ? nNow - nBaseTimeUs : 0)};
+        Append(&h, sizeof(h));
+        Append(aPayload, nPayload);
+    }
+
+    const std::string &GetBasePath() const {
+        return strBasePath;
+    }
+
+    static std::string GetFilePath(const std::string &strBasePath, uint32_t iFile) {
+        return strBasePath + "." + std::to_string(iFile) + ".binlog";
+    }
+
+private:
+    enum { MAX_PAYLOAD = 512, MAX_STRING = 255 };
+
+    static int64_t NowUs() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    static void Put(uint8_t *p, size_t &n, BinLogArgType eType, const void *pValue, size_t nSize) {
+        if (n + 1 + nSize > MAX_PAYLOAD) {
+            return;
+        }
+        p[n++] = eType;
+        memcpy(p + n, pValue, nSize);
+        n += nSize;
+    }
+    template<typename T>
+    static typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type
+    EncodeArg(uint8_t *p, size_t &n, const T &v) {
+        if (std::is_signed<T>::value) {
+            if (sizeof(T) <= 4) { int32_t x = (int32_t)v; Put(p, n, BINLOG_ARG_I32, &x, 4); }
+            else { int64_t x = (int64_t)v; Put(p, n, BINLOG_ARG_I64, &x, 8); }
+        } else {
+            if (sizeof(T) <= 4) { uint32_t x = (uint32_t)v; Put(p, n, BINLOG_ARG_U32, &x, 4); }
+            else { uint64_t x = (uint64_t)v; Put(p, n, BINLOG_ARG_U64, &x, 8); }
+        }
+    }
+    template<typename T>
+    static typename std::enable_if<std::is_floating_point<T>::value>::type
+    EncodeArg(uint8_t *p, size_t &n, const T &v) {
+        double x = v;
+        Put(p, n, BINLOG_ARG_F64, &x, 8);
+    }
+    static void EncodeArg(uint8_t *p, size_t &n, const char *sz) {
+        size_t nLen = sz ? strlen(sz) : 0;
+        if (nLen > MAX_STRING) {
+            nLen = MAX_STRING;
+        }
+        if (n + 2 + nLen > MAX_PAYLOAD) {
+            return;
+        }
+        p[n++] = BINLOG_ARG_STR;
+        p[n++] = (uint8_t)nLen;
+        memcpy(p + n, sz, nLen);
+        n += nLen;
+    }
+    static void EncodeArg(uint8_t *p, size_t &n, const std::string &str) {
+        EncodeArg(p, n, str.c_str());
+    }
+    static void EncodeArgs(uint8_t *, size_t &) {}
+    template<typename T, typename... Rest>
+    static void EncodeArgs(uint8_t *p, size_t &n, const T &v, const Rest&... rest) {
+        EncodeArg(p, n, v);
+        EncodeArgs(p, n, rest...);
+    }
+
+    void Append(const void *pData, size_t nSize) {
+        memcpy(pView + nOffset, pData, nSize);
+        nOffset += (uint32_t)nSize;
+    }
+
+    // Makes room for nSize bytes (plus a terminating zero header), rotating if needed.
+    bool Reserve(size_t nSize, int64_t nNow) {
+        if (nOffset + nSize + sizeof(BinLogRecordHeader) <= nFileSize && nNow - nBaseTimeUs < (int64_t)UINT32_MAX) {
+            return true;
+        }
+        CloseFile();
+        iFile++;
+        OpenFile();
+        if (!pView) {
+            return false;
+        }
+        WriteFormatDefinitions((uint16_t)nFormatsWritten);
+        return nOffset + nSize + sizeof(BinLogRecordHeader) <= nFileSize;
+    }
+
+    // Writes definitions for ids (nFormatsWritten, nLastId], or re-emits [1, nLastId] into a new file.
+    void WriteFormatDefinitions(uint16_t nLastId) {
+        uint16_t nFirst = nOffset == sizeof(BinLogFileHeader) ? 1 : (uint16_t)(nFormatsWritten + 1);
+        for (uint16_t nId = nFirst; nId <= nLastId; nId++) {
+            const char *szFormat = BinLogFormats::Get(nId);
+            uint16_t nLen = (uint16_t)strlen(szFormat);
+            size_t nSize = sizeof(BinLogRecordHeader) + sizeof(nId) + nLen;
+            if (nOffset + nSize + sizeof(BinLogRecordHeader) > nFileSize) {
+                break;
+            }
+            BinLogRecordHeader h = {BINLOG_FORMAT_DEFINITION, (uint16_t)(sizeof(nId) + nLen), 0};
+            Append(&h, sizeof(h));
+            Append(&nId, sizeof(nId));
+            Append(szFormat, nLen);
+        }
+        if (nLastId > nFormatsWritten) {
+            nFormatsWritten = nLastId;
+        }
+    }
+
+    void OpenFile() {
+        if (iFile >= nMaxFiles) {
+            remove(GetFilePath(strBasePath, iFile - nMaxFiles).c_str());
+        }
+        std::string strPath = GetFilePath(strBasePath, iFile);
+#ifdef _WIN32
+        hFile = CreateFileA(strPath.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hFile == INVALID_HANDLE_VALUE) {
+            LOG(ERROR) << "Unable to open binary log file: " << strPath;
+            return;
+        }
+        hMapping = CreateFileMappingA(hFile, NULL, PAGE_READWRITE, 0, nFileSize, NULL);
+        pView = hMapping ? (uint8_t *)MapViewOfFile(hMapping, FILE_MAP_WRITE, 0, 0, nFileSize) : NULL;
+#else
+        fd = open(strPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            LOG(ERROR) << "Unable to open binary log file: " << strPath;
+            return;
+        }
+        if (ftruncate(fd, nFileSize) == 0) {
+            void *p = mmap(NULL, nFileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            pView = p == MAP_FAILED ? NULL : (uint8_t *)p;
+        }
+#endif
+        if (!pView) {
+            LOG(ERROR) << "Unable to map binary log file: " << strPath;
+            CloseFile();
+            return;
+        }
+        nBaseTimeUs = NowUs();
+        BinLogFileHeader h = {BINLOG_MAGIC, BINLOG_VERSION, 0, nBaseTimeUs, iFile, 0};
+        nOffset = 0;
+        Append(&h, sizeof(h));
+    }
+
+    // Unmaps the current file and trims it to the bytes actually written.
+    void CloseFile() {
+#ifdef _WIN32
+        if (pView) {
+            FlushViewOfFile(pView, nOffset);
+            UnmapViewOfFile(pView);
+        }
+        if (hMapping) {
+            CloseHandle(hMapping);
+        }
+        if (hFile != INVALID_HANDLE_VALUE) {
+            LARGE_INTEGER li;
+            li.QuadPart = nOffset;
+            SetFilePointerEx(hFile, li, NULL, FILE_BEGIN);
+            SetEndOfFile(hFile);
+            CloseHandle(hFile);
+        }
+        hMapping = NULL;
+        hFile = INVALID_HANDLE_VALUE;
+#else
+        if (pView) {
+            munmap(pView, nFileSize);
+        }
+        if (fd >= 0) {
+            if (ftruncate(fd, nOffset) != 0) {
+                LOG(WARNING) << "Unable to trim binary log file";
+            }
+            close(fd);
+        }
+        fd = -1;
+#endif
+        pView = NULL;
+    }
+
+    std::string strBasePath;
+    uint32_t nFileSize;
+    uint32_t nMaxFiles;
+    uint32_t iFile = 0;
+    uint32_t nOffset = 0;
+    uint32_t nFormatsWritten = 0;
+    int64_t nBaseTimeUs = 0;
+    uint8_t *pView = NULL;
+#ifdef _WIN32
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+    HANDLE hMapping = NULL;
+#else
+    int fd = -1;
+#endif
+    std::mutex mtx;
+};
+
+}
+
+extern simplelogger::BinaryLogger *binlogger;
+
+/**
+* BINLOG("encoded frame %u: %u bytes", nFrame, nBytes) records an event in the binary log.
+* The format string is registered once per call site and is only expanded by the decoder.
+*/
+#define BINLOG(szFormat, ...)                                                                          \
+    do                                                                                                 \
+    {                                                                                                  \
+        static const uint16_t nBinLogFormatId = simplelogger::BinLogFormats::Register(szFormat);       \
+        if (binlogger)                                                                                 \
+        {                                                                                              \
+            binlogger->Write(nBinLogFormatId, ##__VA_ARGS__);                                          \
+        }                                                                                              \
+    } while (0)
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+*  CPU counterparts of the kernels in ColorSpace.cu for hosts without CUDA.
+*  The functions work on a band of rows [yBegin, yEnd) so callers can split a
+*  frame across threads; yBegin and yEnd must be even.
+*/
+
+/**
+*  @brief Converts BGRA (as captured by DXGI) to NV12 using limited range BT.601 (iMatrix 0) or BT.709 (iMatrix 1).
+*/
+inline void Bgra32ToNv12Rows(const uint8_t *pBgra, int nBgraPitch, uint8_t *pNv12, int nNv12Pitch,
+    int nWidth, int nHeight, int yBegin, int yEnd, int iMatrix = 0)
+{
+    // Fixed point coefficients scaled by 256
+    static const int aCoef[2][9] = {
+        { 66, 129, 25, -38, -74, 112, 112, -94, -18 },
+        { 47, 157, 16, -26, -87, 112, 112, -102, -10 },
+    };
+    const int *c = aCoef[iMatrix ? 1 : 0];
+    uint8_t *pUV = pNv12 + nNv12Pitch * nHeight;
+    for (int y = yBegin; y < yEnd; y += 2)
+    {
+        const uint8_t *s0 = pBgra + y * nBgraPitch, *s1 = s0 + nBgraPitch;
+        uint8_t *d0 = pNv12 + y * nNv12Pitch, *d1 = d0 + nNv12Pitch, *duv = pUV + y / 2 * nNv12Pitch;
+        for (int x = 0; x < nWidth; x += 2)
+        {
+            int b = 0, g = 0, r = 0;
+            const uint8_t *ap[4] = { s0 + x * 4, s0 + x * 4 + 4, s1 + x * 4, s1 + x * 4 + 4 };
+            uint8_t *ad[4] = { d0 + x, d0 + x + 1, d1 + x, d1 + x + 1 };
+            for (int k = 0; k < 4; k++)
+            {
+                const uint8_t *p = ap[k];
+                *ad[k] = (uint8_t)(((c[0] * p[2] + c[1] * p[1] + c[2] * p[0] + 128) >> 8) + 16);
+                b += p[0];
+                g += p[1];
+                r += p[2];
+            }
+            b = (b + 2) >> 2;
+            g = (g + 2) >> 2;
+            r = (r + 2) >> 2;
+            duv[x] = (uint8_t)(((c[3] * r + c[4] * g + c[5] * b + 128) >> 8) + 128);
+            duv[x + 1] = (uint8_t)(((c[6] * r + c[7] * g + c[8] * b + 128) >> 8) + 128);
+        }
+    }
+}
+
+inline void Bgra32ToNv12(const uint8_t *pBgra, int nBgraPitch, uint8_t *pNv12, int nNv12Pitch, int nWidth, int nHeight, int iMatrix = 0)
+{
+    Bgra32ToNv12Rows(pBgra, nBgraPitch, pNv12, nNv12Pitch, nWidth, nHeight, 0, nHeight, iMatrix);
+}
+
+/**
+*  @brief Bilinear NV12 resize, the CPU counterpart of ResizeNv12() in Resize.cu.
+*  Rows [yBegin, yEnd) of the destination luma plane (and the matching chroma rows) are produced.
+*/
+inline void ResizeNv12CpuRows(uint8_t *pDst, int nDstPitch, int nDstWidth, int nDstHeight,
+    const uint8_t *pSrc, int nSrcPitch, int nSrcWidth, int nSrcHeight, int yBegin, int yEnd)
+{
+    // 16.16 fixed point source positions, sampled at pixel centres like the texture fetch
+    const int64_t dx = ((int64_t)nSrcWidth << 16) / nDstWidth, dy = ((int64_t)nSrcHeight << 16) / nDstHeight;
+    auto Sample = [](const uint8_t *p, int nPitch, int nStride, int nWidth, int nHeight, int64_t fx, int64_t fy) {
+        int x0 = (int)(fx >> 16), y0 = (int)(fy >> 16);
+        int wx = (int)(fx & 0xFFFF) >> 8, wy = (int)(fy & 0xFFFF) >> 8;
+        int x1 = x0 + 1 < nWidth ? x0 + 1 : x0, y1 = y0 + 1 < nHeight ? y0 + 1 : y0;
+        const uint8_t *r0 = p + y0 * nPitch, *r1 = p + y1 * nPitch;
+        int a = r0[x0 * nStride] * (256 - wx) + r0[x1 * nStride] * wx;
+        int b = r1[x0 * nStride] * (256 - wx) + r1[x1 * nStride] * wx;
+        return (uint8_t)((a * (256 - wy) + b * wy + 32768) >> 16);
+    };
+    auto Position = [](int i, int64_t d) {
+        int64_t f = ((2 * (int64_t)i + 1) * d >> 1) - 32768;
+        return f < 0 ? 0 : f;
+    };
+    for (int y = yBegin; y < yEnd; y++)
+    {
+        uint8_t *d = pDst + y * nDstPitch;
+        int64_t fy = Position(y, dy);
+        for (int x = 0; x < nDstWidth; x++)
+        {
+            d[x] = Sample(pSrc, nSrcPitch, 1, nSrcWidth, nSrcHeight, Position(x, dx), fy);
+        }
+    }
+    const uint8_t *pSrcUV = pSrc + nSrcPitch * nSrcHeight;
+    uint8_t *pDstUV = pDst + nDstPitch * nDstHeight;
+    for (int y = yBegin / 2; y < (yEnd + 1) / 2; y++)
+    {
+        uint8_t *d = pDstUV + y * nDstPitch;
+        int64_t fy = Position(y, dy);
+        for (int x = 0; x < nDstWidth / 2; x++)
+        {
+            int64_t fx = Position(x, dx);
+            d[2 * x] = Sample(pSrcUV, nSrcPitch, 2, nSrcWidth / 2, nSrcHeight / 2, fx, fy);
+            d[2 * x + 1] = Sample(pSrcUV + 1, nSrcPitch, 2, nSrcWidth / 2, nSrcHeight / 2, fx, fy);
+        }
+    }
+}
+
+inline void ResizeNv12Cpu(uint8_t *pDst, int nDstPitch, int nDstWidth, int nDstHeight,
+    const uint8_t *pSrc, int nSrcPitch, int nSrcWidth, int nSrcHeight)
+{
+    ResizeNv12CpuRows(pDst, nDstPitch, nDstWidth, nDstHeight, pSrc, nSrcPitch, nSrcWidth, nSrcHeight, 0, nDstHeight);
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+/**
+*  SIMD paths of the CPU kernels. SSE2 is part of every x64 target and is used whenever the
+*  compiler targets it. AVX2 code is compiled into functions marked CPU_TARGET_AVX2 whatever the
+*  compiler flags, and is only called when CpuHasAvx2() says the CPU runs it.
+*/
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CPU_HAS_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_AMD64))
+#define CPU_HAS_AVX2_TARGET
+#define CPU_TARGET_AVX2
+#include <immintrin.h>
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define CPU_HAS_AVX2_TARGET
+#define CPU_TARGET_AVX2 __attribute__((target("avx2")))
+#include <immintrin.h>
+#endif
+
+/**
+*  @brief True if the CPU and the OS (which has to save the YMM registers) support AVX2.
+*/
+static inline bool CpuHasAvx2()
+{
+#if defined(_MSC_VER) && defined(CPU_HAS_AVX2_TARGET)
+    static const bool bAvx2 = []() {
+        int aInfo[4];
+        __cpuid(aInfo, 0);
+        if (aInfo[0] < 7)
+        {
+            return false;
+        }
+        __cpuid(aInfo, 1);
+        // OSXSAVE and AVX, then XMM and YMM state enabled in XCR0
+        if ((aInfo[2] & (1 << 27 | 1 << 28)) != (1 << 27 | 1 << 28) || (_xgetbv(0) & 6) != 6)
+        {
+            return false;
+        }
+        __cpuidex(aInfo, 7, 0);
+        return (aInfo[1] & (1 << 5)) != 0;
+    }();
+    return bAvx2;
+#elif defined(CPU_HAS_AVX2_TARGET)
+    return __builtin_cpu_supports("avx2") != 0;
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+*  @brief Region of the desktop that changed since the previous frame, in pixels, right and
+*  bottom exclusive. Same layout as RECT, so the buffer filled by
+*  IDXGIOutputDuplication::GetFrameDirtyRects() can be used as is.
+*/
+struct ScreenRect
+{
+    int32_t left, top, right, bottom;
+};
+
+/**
+*  @brief Content moved from (xSource, ySource) to destination, e.g. a scrolled or dragged
+*  window. Same layout as DXGI_OUTDUPL_MOVE_RECT.
+*/
+struct ScreenMoveRect
+{
+    int32_t xSource, ySource;
+    ScreenRect destination;
+};
+
+/**
+*  @brief Dirty and move rects of one captured frame. The arrays belong to the capture and
+*  stay valid until the frame is encoded.
+*/
+struct FrameChanges
+{
+    const ScreenRect *pDirtyRect = nullptr;
+    uint32_t nDirtyRects = 0;
+    const ScreenMoveRect *pMoveRect = nullptr;
+    uint32_t nMoveRects = 0;
+    /** Everything changed (first frame, or the capture did not report the regions) */
+    bool bFullFrame = true;
+};
+
+static inline int64_t ClippedArea(const ScreenRect &rect, int nWidth, int nHeight)
+{
+    int64_t w = (rect.right < nWidth ? rect.right : nWidth) - (rect.left > 0 ? rect.left : 0);
+    int64_t h = (rect.bottom < nHeight ? rect.bottom : nHeight) - (rect.top > 0 ? rect.top : 0);
+    return w > 0 && h > 0 ? w * h : 0;
+}
+
+/**
+*  @brief Pixels that changed in a frame: the dirty rects and the destinations of the move
+*  rects. Duplication does not report overlapping rects, so the areas are simply added.
+*/
+static inline int64_t GetChangedArea(const FrameChanges &changes, int nWidth, int nHeight)
+{
+    int64_t nFrameArea = (int64_t)nWidth * nHeight;
+    if (changes.bFullFrame)
+    {
+        return nFrameArea;
+    }
+    int64_t nArea = 0;
+    for (uint32_t i = 0; i < changes.nDirtyRects; i++)
+    {
+        nArea += ClippedArea(changes.pDirtyRect[i], nWidth, nHeight);
+    }
+    for (uint32_t i = 0; i < changes.nMoveRects; i++)
+    {
+        nArea += ClippedArea(changes.pMoveRect[i].destination, nWidth, nHeight);
+    }
+    return nArea < nFrameArea ? nArea : nFrameArea;
+}
@@ -156,7 +156,11 @@ public:
     int GetFrameSize() {
         return nBitDepth == 8 ? nWidth * nHeight * 3 / 2: nWidth * nHeight * 3;
     }
-    bool Demux(uint8_t **ppVideo, int *pnVideoBytes) {
+    /**
+    *  @brief Returns the next video packet in Annex-B format and, if pnPtsUs is given, its pts in
+    *  microseconds (AV_NOPTS_VALUE if the container has none).
+    */
+    bool Demux(uint8_t **ppVideo, int *pnVideoBytes, int64_t *pnPtsUs = NULL) {
         if (!fmtc) {
             return false;
         }
@@ -187,6 +191,9 @@ public:
             *ppVideo = pkt.data;
             *pnVideoBytes = pkt.size;
         }
+        if (pnPtsUs) {
+            *pnPtsUs = pkt.pts == AV_NOPTS_VALUE ? AV_NOPTS_VALUE : av_rescale_q(pkt.pts, fmtc->streams[iVideoStream]->time_base, AVRational{ 1, 1000000 });
+        }
 
         return true;
     }
@@ -196,6 +203,8 @@ public:
     }
 };
 
+// only with the NVDEC headers, so that the demuxer also serves CPU decoding
+#ifdef __CUDA_VIDEO_H__
 inline cudaVideoCodec FFmpeg2NvCodecId(AVCodecID id) {
     switch (id) {
     case AV_CODEC_ID_MPEG1VIDEO : return cudaVideoCodec_MPEG1;
@@ -210,3 +219,4 @@ inline cudaVideoCodec FFmpeg2NvCodecId(AVCodecID id) {
     default                     : return cudaVideoCodec_NumCodecs;
     }
 }
+#endif
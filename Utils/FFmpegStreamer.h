@@ -12,23 +12,77 @@
 
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <queue>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <algorithm>
 extern "C" {
 #include <libavformat/avformat.h>
 #include <libavutil/opt.h>
 #include <libswresample/swresample.h>
 };
 #include "Logger.h"
+#include "NalScanner.h"
+#include "../Queue.h"
 
 extern simplelogger::Logger *logger;
 
+struct FFmpegStreamerOptions {
+    /** Container short name ("mpegts", "mp4", "matroska", "flv", ...); NULL guesses it from the destination, falling back to mpegts */
+    const char *szFormat = NULL;
+    /** Packets buffered between Stream() and the muxing thread */
+    size_t nQueuePackets = 256;
+    /** The output is flushed after this many packets ... */
+    int nFlushPackets = 32;
+    /** ... or when this much time has passed since the last flush, whichever comes first */
+    int nFlushIntervalMs = 100;
+    /** Frames the encoder holds back for reordering (number of B-frames); 0 means dts = pts */
+    int nReorderDelay = 0;
+    /** Annex-B SPS/PPS (VPS for HEVC) from NvEncoder::GetSequenceParams(); needed by mp4 and matroska */
+    std::vector<uint8_t> vSeqParams;
+};
+
+/**
+*  @brief Muxes an encoded H.264/HEVC elementary stream into a file or network destination.
+*  Stream() copies the packet into a bounded queue and returns; a dedicated thread does
+*  the muxing and flushes the output in batches instead of after every packet.
+*  When the queue is full the packet is dropped, and so is everything up to the next key
+*  frame, so the encoding thread never blocks on the network.
+*/
 class FFmpegStreamer {
 private:
+    struct StreamerPacket {
+        std::vector<uint8_t> vData;
+        int64_t nPts, nDts;
+        bool bKeyFrame;
+    };
+
     AVFormatContext *oc = NULL;
     AVStream *vs = NULL;
+    AVCodecID eCodecId;
     int nFps = 0;
+    FFmpegStreamerOptions options;
+    bool bReady = false;
+
+    // dts derivation, only touched by the thread calling Stream()
+    std::priority_queue<int64_t, std::vector<int64_t>, std::greater<int64_t>> qPendingPts;
+    int64_t nFirstPts = 0;
+    int nPacket = 0;
+    bool bWaitKeyFrame = false;
+    // last dts written in vs->time_base, only touched by the muxing thread
+    int64_t nLastDts = INT64_MIN;
+
+    BoundedQueue<StreamerPacket> qPacket;
+    std::mutex mtxFree;
+    std::vector<std::vector<uint8_t>> vFreeBuffer;
+    std::thread thMux;
+    std::atomic<uint64_t> nDroppedPackets{0};
 
 public:
-    FFmpegStreamer(AVCodecID eCodecId, int nWidth, int nHeight, int nFps, const char *szInFilePath) : nFps(nFps) {
+    FFmpegStreamer(AVCodecID eCodecId, int nWidth, int nHeight, int nFps, const char *szInFilePath, const FFmpegStreamerOptions &options = FFmpegStreamerOptions())
+        : eCodecId(eCodecId), nFps(nFps), options(options), qPacket(options.nQueuePackets) {
         av_register_all();
         avformat_network_init();
         oc = avformat_alloc_context();
@@ -37,17 +91,21 @@ public:
             return;
         }
 
-        // Set format on oc
-        AVOutputFormat *fmt = av_guess_format("mpegts", NULL, NULL);
+        // Set format on oc, chosen at run time
+        AVOutputFormat *fmt = options.szFormat ? av_guess_format(options.szFormat, NULL, NULL) : av_guess_format(NULL, szInFilePath, NULL);
+        if (!fmt && !options.szFormat) {
+            fmt = av_guess_format("mpegts", NULL, NULL);
+        }
         if (!fmt) {
             LOG(ERROR) << "Invalid format";
             return;
         }
-        fmt->video_codec = eCodecId;
 
         oc->oformat = fmt;
         sprintf(oc->filename, "%s", szInFilePath);
-        LOG(INFO) << "Streaming destination: " << oc->filename;
+        // flushing is done in batches by the muxing thread
+        oc->flush_packets = 0;
+        LOG(INFO) << "Streaming destination: " << oc->filename << " (" << fmt->name << ")";
 
         // Add video stream to oc
         vs = avformat_new_stream(oc, NULL);
@@ -56,55 +114,193 @@ public:
             return;
         }
         vs->id = 0;
+        vs->time_base = AVRational {1, 90000};
+        vs->avg_frame_rate = AVRational {nFps, 1};
 
         // Set video parameters
         AVCodecParameters *vpar = vs->codecpar;
-        vpar->codec_id = fmt->video_codec;
+        vpar->codec_id = eCodecId;
         vpar->codec_type = AVMEDIA_TYPE_VIDEO;
         vpar->width = nWidth;
         vpar->height = nHeight;
+        vpar->video_delay = options.nReorderDelay;
+        if (!options.vSeqParams.empty()) {
+            vpar->extradata = (uint8_t *)av_mallocz(options.vSeqParams.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+            memcpy(vpar->extradata, options.vSeqParams.data(), options.vSeqParams.size());
+            vpar->extradata_size = (int)options.vSeqParams.size();
+        }
 
         // Every thing is ready. Now open the output stream.
-        if (avio_open(&oc->pb, oc->filename, AVIO_FLAG_WRITE) < 0) {
+        if (!(fmt->flags & AVFMT_NOFILE) && avio_open(&oc->pb, oc->filename, AVIO_FLAG_WRITE) < 0) {
             LOG(ERROR) << "FFMPEG: Could not open " << oc->filename;
             return ;
         }
 
-        // Write the container header
-        if (avformat_write_header(oc, NULL)) {
+        // Write the container header; it may change vs->time_base
+        if (avformat_write_header(oc, NULL) < 0) {
             LOG(ERROR) << "FFMPEG: avformat_write_header error!";
             return;
         }
+        bReady = true;
+        thMux = std::thread(&FFmpegStreamer::Run, this);
     }
     ~FFmpegStreamer() {
+        qPacket.close();
+        if (thMux.joinable()) {
+            thMux.join();
+        }
         if (oc) {
-            av_write_trailer(oc);
-            avio_close(oc->pb);
+            if (bReady) {
+                av_write_trailer(oc);
+            }
+            if (oc->pb && !(oc->oformat->flags & AVFMT_NOFILE)) {
+                avio_close(oc->pb);
+            }
             avformat_free_context(oc);
         }
+        if (nDroppedPackets) {
+            LOG(WARNING) << "FFMPEG: " << nDroppedPackets << " packets dropped because the output could not keep up";
+        }
+    }
+
+    /**
+    *  @brief Queues one access unit in decode order. nPtsUs is its presentation time in
+    *  microseconds, e.g. NvEncOutputPacketInfo::timestamp when inputTimeStamp is the
+    *  capture time; the decode time is derived from it using nReorderDelay.
+    *  Returns false if the packet was dropped.
+    */
+    bool StreamPacket(const uint8_t *pData, size_t nBytes, int64_t nPtsUs) {
+        if (!bReady) {
+            return false;
+        }
+        StreamerPacket pkt;
+        pkt.nPts = nPtsUs;
+        pkt.nDts = NextDts(nPtsUs);
+        NalPacketInfo info;
+        DescribePacket(pData, nBytes, eCodecId == AV_CODEC_ID_HEVC ? NAL_CODEC_HEVC : NAL_CODEC_H264, &info);
+        pkt.bKeyFrame = info.bKeyFrame;
+
+        // after a drop the decoder cannot use anything before the next key frame
+        if (bWaitKeyFrame && !pkt.bKeyFrame) {
+            nDroppedPackets++;
+            return false;
+        }
+        pkt.vData = GetBuffer();
+        pkt.vData.assign(pData, pData + nBytes);
+        if (!qPacket.try_push(std::move(pkt))) {
+            bWaitKeyFrame = true;
+            nDroppedPackets++;
+            return false;
+        }
+        bWaitKeyFrame = false;
+        return true;
     }
 
+    /**
+    *  @brief Legacy interface with the frame index as timestamp and no B-frames.
+    */
     bool Stream(uint8_t *pData, int nBytes, int nPts) {
-        AVPacket pkt = {0};
-        av_init_packet(&pkt);
-        pkt.pts = av_rescale_q(nPts++, AVRational {1, nFps}, vs->time_base);
-        // No B-frames
-        pkt.dts = pkt.pts;
-        pkt.stream_index = vs->index;
-        pkt.data = pData;
-        pkt.size = nBytes;
+        return StreamPacket(pData, nBytes, (int64_t)nPts * 1000000 / nFps);
+    }
+
+    uint64_t GetDroppedPackets() const {
+        return nDroppedPackets;
+    }
 
-        if(!memcmp(pData, "\x00\x00\x00\x01\x67", 5)) {
-            pkt.flags |= AV_PKT_FLAG_KEY;
+private:
+    /**
+    *  @brief Packets arrive in decode order, so the n-th decode time is the n-th smallest
+    *  presentation time once nReorderDelay packets have been seen; the first ones are
+    *  extrapolated backwards by whole frame durations. Run() makes the result strictly
+    *  increasing once it is in the time base of the stream.
+    */
+    int64_t NextDts(int64_t nPts) {
+        if (options.nReorderDelay <= 0) {
+            return nPts;
+        }
+        if (nPacket == 0) {
+            nFirstPts = nPts;
         }
+        qPendingPts.push(nPts);
+        int64_t nDts;
+        if (nPacket < options.nReorderDelay) {
+            nDts = nFirstPts - (int64_t)(options.nReorderDelay - nPacket) * 1000000 / nFps;
+        } else {
+            nDts = qPendingPts.top();
+            qPendingPts.pop();
+        }
+        nPacket++;
+        return nDts;
+    }
 
-        // Write the compressed frame into the output
-        int ret = av_write_frame(oc, &pkt);
+    std::vector<uint8_t> GetBuffer() {
+        std::lock_guard<std::mutex> lock(mtxFree);
+        if (vFreeBuffer.empty()) {
+            return std::vector<uint8_t>();
+        }
+        std::vector<uint8_t> v = std::move(vFreeBuffer.back());
+        vFreeBuffer.pop_back();
+        return v;
+    }
+
+    void RecycleBuffer(std::vector<uint8_t> &&v) {
+        std::lock_guard<std::mutex> lock(mtxFree);
+        vFreeBuffer.push_back(std::move(v));
+    }
+
+    void Flush() {
+        // drains what the muxer holds back (e.g. a partial mpegts PES), then the AVIO buffer
         av_write_frame(oc, NULL);
-        if (ret < 0) {
-            LOG(ERROR) << "FFMPEG: Error while writing video frame";
+        if (oc->pb) {
+            avio_flush(oc->pb);
         }
+    }
 
-        return true;
+    void Run() {
+        StreamerPacket pkt;
+        int nUnflushed = 0;
+        auto tLastFlush = std::chrono::steady_clock::now();
+        while (true) {
+            // with unflushed packets, wait no longer than the flush interval so a stalled encoder still gets them out
+            bool bPopped = nUnflushed == 0 ? qPacket.pop(pkt)
+                : qPacket.pop_for(pkt, tLastFlush + std::chrono::milliseconds(options.nFlushIntervalMs) - std::chrono::steady_clock::now());
+            if (!bPopped) {
+                if (nUnflushed == 0 || qPacket.closed()) {
+                    break;
+                }
+                Flush();
+                nUnflushed = 0;
+                tLastFlush = std::chrono::steady_clock::now();
+                continue;
+            }
+            AVPacket avpkt = {0};
+            av_init_packet(&avpkt);
+            avpkt.pts = av_rescale_q(pkt.nPts, AVRational {1, 1000000}, vs->time_base);
+            avpkt.dts = av_rescale_q(pkt.nDts, AVRational {1, 1000000}, vs->time_base);
+            // rounding to the time base can tie neighbouring dts; muxers require them strictly increasing and not after pts
+            avpkt.dts = std::max(std::min(avpkt.dts, avpkt.pts), nLastDts + 1);
+            avpkt.pts = std::max(avpkt.pts, avpkt.dts);
+            nLastDts = avpkt.dts;
+            avpkt.stream_index = vs->index;
+            avpkt.data = pkt.vData.data();
+            avpkt.size = (int)pkt.vData.size();
+            if (pkt.bKeyFrame) {
+                avpkt.flags |= AV_PKT_FLAG_KEY;
+            }
+
+            // Write the compressed frame into the output
+            if (av_write_frame(oc, &avpkt) < 0) {
+                LOG(ERROR) << "FFMPEG: Error while writing video frame";
+            }
+            RecycleBuffer(std::move(pkt.vData));
+
+            auto tNow = std::chrono::steady_clock::now();
+            if (++nUnflushed >= options.nFlushPackets || tNow - tLastFlush >= std::chrono::milliseconds(options.nFlushIntervalMs)) {
+                Flush();
+                nUnflushed = 0;
+                tLastFlush = tNow;
+            }
+        }
+        Flush();
     }
 };
@@ -16,6 +16,14 @@
 #include <string>
 #include <sstream>
 #include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <string.h>
 #include <time.h>
 
 #ifdef _WIN32
@@ -41,6 +49,11 @@ enum LogLevel {
     FATAL
 };
 
+// Log calls below this level are removed at compile time, e.g. /DSIMPLELOGGER_MIN_LEVEL=INFO
+#ifndef SIMPLELOGGER_MIN_LEVEL
+#define SIMPLELOGGER_MIN_LEVEL TRACE
+#endif
+
 namespace simplelogger{
 class Logger {
 public:
@@ -73,13 +86,290 @@ public:
     void LeaveCriticalSection() {
         mtx.unlock();
     }
-private:
+    /**
+    *  @brief Starts one log line and returns the stream the message is written to.
+    *  The default implementation writes synchronously under the logger mutex.
+    */
+    virtual std::ostream& BeginRecord(LogLevel l, const char *szFile, int nLine, const char *szFunc) {
+        EnterCriticalSection();
+        GetStream() << GetLead(l, szFile, nLine, szFunc);
+        return GetStream();
+    }
+    /**
+    *  @brief Completes the log line started by BeginRecord().
+    */
+    virtual void EndRecord(LogLevel l) {
+        GetStream() << std::endl;
+        FlushStream();
+        LeaveCriticalSection();
+    }
+protected:
     LogLevel level;
     char szLead[80];
     bool bPrintTimeStamp;
+private:
     std::mutex mtx;
 };
 
+/**
+* @brief Logger front end that keeps formatting and I/O off the calling thread.
+* Each calling thread owns a lock-free single-producer ring of fixed-size records.
+* A background thread drains the rings, builds the lead from a cached timestamp and
+* writes to the wrapped sink logger in batches. Records are dropped (and counted)
+* when a ring is full instead of blocking the caller. A message longer than
+* RECORD_TEXT_SIZE is cut, ends in "..." and is counted as well. The ring of a thread
+* that has exited is freed once it is drained, so short-lived threads do not add up.
+*/
+class AsyncLogger : public Logger {
+public:
+    enum { RECORD_TEXT_SIZE = 232, RING_CAPACITY = 1024, SINK_FLUSH_INTERVAL = 32 };
+
+    AsyncLogger(Logger *pSink, LogLevel level, bool bPrintTimeStamp)
+        : Logger(level, bPrintTimeStamp), pSink(pSink), nId(NextId()) {
+        tpStart = std::chrono::steady_clock::now();
+        tStart = time(NULL);
+        worker = std::thread(&AsyncLogger::Run, this);
+    }
+    ~AsyncLogger() {
+        {
+            std::lock_guard<std::mutex> lock(mtxWorker);
+            bStop = true;
+        }
+        cvWorker.notify_one();
+        if (worker.joinable()) {
+            worker.join();
+        }
+        delete pSink;
+    }
+    std::ostream& GetStream() {
+        return GetThreadState().ossRecord;
+    }
+    std::ostream& BeginRecord(LogLevel l, const char *szFile, int nLine, const char *szFunc) {
+        ThreadState &ts = GetThreadState();
+        ts.sbRecord.Reset();
+        ts.ossRecord.clear();
+        return ts.ossRecord;
+    }
+    void EndRecord(LogLevel l) {
+        ThreadState &ts = GetThreadState();
+        Ring &ring = *ts.pRing;
+        uint32_t iTail = ring.iTail.load(std::memory_order_relaxed);
+        if (iTail - ring.iHead.load(std::memory_order_acquire) >= RING_CAPACITY) {
+            nDropped.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            Record &r = ring.aRecord[iTail % RING_CAPACITY];
+            r.level = l;
+            r.nTick = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - tpStart).count();
+            r.nLength = (uint16_t)ts.sbRecord.Length();
+            memcpy(r.szText, ts.sbRecord.Data(), r.nLength);
+            if (ts.sbRecord.IsTruncated()) {
+                memcpy(r.szText + r.nLength - 3, "...", 3);
+                nTruncated.fetch_add(1, std::memory_order_relaxed);
+            }
+            ring.iTail.store(iTail + 1, std::memory_order_release);
+        }
+        if (l == FATAL) {
+            Flush();
+        }
+    }
+    /**
+    *  @brief Blocks until every record queued so far has been written to the sink.
+    */
+    void Flush() {
+        std::unique_lock<std::mutex> lock(mtxWorker);
+        uint64_t nTarget = ++nFlushRequest;
+        cvWorker.notify_one();
+        cvFlushed.wait(lock, [&] { return nFlushDone >= nTarget || bStop; });
+    }
+    uint64_t GetDroppedCount() const {
+        return nDropped.load(std::memory_order_relaxed);
+    }
+    uint64_t GetTruncatedCount() const {
+        return nTruncated.load(std::memory_order_relaxed);
+    }
+    /**
+    *  @brief Rings currently allocated: one per live logging thread plus exited ones not yet drained.
+    */
+    size_t GetRingCount() {
+        std::lock_guard<std::mutex> lock(mtxRings);
+        return vpRing.size();
+    }
+
+private:
+    struct Record {
+        LogLevel level;
+        uint16_t nLength;
+        int64_t nTick;
+        char szText[RECORD_TEXT_SIZE];
+    };
+    struct Ring {
+        std::atomic<uint32_t> iHead{0};
+        std::atomic<uint32_t> iTail{0};
+        /** Cleared when the producing thread exits or moves to another logger */
+        std::atomic<bool> bInUse{true};
+        Record aRecord[RING_CAPACITY];
+    };
+    class RecordBuf : public std::streambuf {
+    public:
+        RecordBuf() {
+            Reset();
+        }
+        void Reset() {
+            setp(szBuf, szBuf + RECORD_TEXT_SIZE);
+            bTruncated = false;
+        }
+        const char *Data() const {
+            return pbase();
+        }
+        size_t Length() const {
+            return pptr() - pbase();
+        }
+        bool IsTruncated() const {
+            return bTruncated;
+        }
+    protected:
+        // the buffer is full: discard the rest of the message, but keep the stream good
+        int_type overflow(int_type c) {
+            bTruncated = true;
+            return traits_type::not_eof(c);
+        }
+    private:
+        char szBuf[RECORD_TEXT_SIZE];
+        bool bTruncated;
+    };
+    struct ThreadState {
+        ThreadState() : ossRecord(&sbRecord) {}
+        ~ThreadState() {
+            Release();
+        }
+        void Release() {
+            if (pRing) {
+                pRing->bInUse.store(false, std::memory_order_release);
+                pRing.reset();
+            }
+        }
+        uint64_t nOwnerId = 0;
+        // shared with the logger, which may be deleted before the thread exits
+        std::shared_ptr<Ring> pRing;
+        RecordBuf sbRecord;
+        std::ostream ossRecord;
+    };
+
+    static uint64_t NextId() {
+        static std::atomic<uint64_t> nNext{1};
+        return nNext++;
+    }
+
+    ThreadState &GetThreadState() {
+        static thread_local ThreadState ts;
+        if (ts.nOwnerId != nId) {
+            ts.Release();
+            std::lock_guard<std::mutex> lock(mtxRings);
+            vpRing.push_back(std::make_shared<Ring>());
+            ts.pRing = vpRing.back();
+            ts.nOwnerId = nId;
+        }
+        return ts;
+    }
+
+    const char *GetCachedLead(LogLevel l, int64_t nTick) {
+        const char *szLevels[] = {"TRACE", "INFO", "WARN", "ERROR", "FATAL"};
+        if (!bPrintTimeStamp) {
+            sprintf(szLead, "[%-5s] ", szLevels[l]);
+            return szLead;
+        }
+        time_t t = tStart + (time_t)(nTick / 1000000);
+        if (t != tCached) {
+            struct tm *ptm = localtime(&t);
+            sprintf(szTimeCached, "%02d:%02d:%02d", ptm->tm_hour, ptm->tm_min, ptm->tm_sec);
+            tCached = t;
+        }
+        sprintf(szLead, "[%-5s][%s] ", szLevels[l], szTimeCached);
+        return szLead;
+    }
+
+    size_t Drain() {
+        std::vector<Ring *> vRing;
+        {
+            // only this thread removes rings, so the pointers stay valid until the next call
+            std::lock_guard<std::mutex> lock(mtxRings);
+            vpRing.erase(std::remove_if(vpRing.begin(), vpRing.end(), [](const std::shared_ptr<Ring> &pRing) {
+                return !pRing->bInUse.load(std::memory_order_acquire)
+                    && pRing->iHead.load(std::memory_order_relaxed) == pRing->iTail.load(std::memory_order_acquire);
+            }), vpRing.end());
+            for (auto &pRing : vpRing) {
+                vRing.push_back(pRing.get());
+            }
+        }
+        size_t n = 0;
+        std::ostream &os = pSink->GetStream();
+        for (Ring *pRing : vRing) {
+            uint32_t iHead = pRing->iHead.load(std::memory_order_relaxed);
+            uint32_t iTail = pRing->iTail.load(std::memory_order_acquire);
+            for (; iHead != iTail; iHead++, n++) {
+                Record &r = pRing->aRecord[iHead % RING_CAPACITY];
+                os << GetCachedLead(r.level, r.nTick);
+                os.write(r.szText, r.nLength);
+                os << '\n';
+                if ((n + 1) % SINK_FLUSH_INTERVAL == 0) {
+                    os.flush();
+                    pSink->FlushStream();
+                }
+            }
+            pRing->iHead.store(iHead, std::memory_order_release);
+        }
+        uint64_t nDroppedNow = nDropped.load(std::memory_order_relaxed);
+        if (nDroppedNow != nDroppedReported) {
+            os << GetCachedLead(WARNING, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - tpStart).count())
+                << nDroppedNow - nDroppedReported << " log records dropped (" << nDroppedNow << " in total)" << '\n';
+            nDroppedReported = nDroppedNow;
+            n++;
+        }
+        if (n) {
+            os.flush();
+            pSink->FlushStream();
+        }
+        return n;
+    }
+
+    void Run() {
+        std::unique_lock<std::mutex> lock(mtxWorker);
+        while (true) {
+            uint64_t nFlushTarget = nFlushRequest;
+            bool bExit = bStop;
+            lock.unlock();
+            Drain();
+            lock.lock();
+            if (nFlushTarget != nFlushDone) {
+                nFlushDone = nFlushTarget;
+                cvFlushed.notify_all();
+            }
+            if (bExit) {
+                break;
+            }
+            cvWorker.wait_for(lock, std::chrono::milliseconds(10), [&] { return bStop || nFlushRequest != nFlushDone; });
+        }
+        cvFlushed.notify_all();
+    }
+
+    Logger *pSink;
+    const uint64_t nId;
+    std::chrono::steady_clock::time_point tpStart;
+    time_t tStart;
+    time_t tCached = 0;
+    char szTimeCached[16] = {};
+    std::atomic<uint64_t> nDropped{0};
+    uint64_t nDroppedReported = 0;
+    std::atomic<uint64_t> nTruncated{0};
+    std::mutex mtxRings;
+    std::vector<std::shared_ptr<Ring>> vpRing;
+    std::mutex mtxWorker;
+    std::condition_variable cvWorker, cvFlushed;
+    uint64_t nFlushRequest = 0, nFlushDone = 0;
+    bool bStop = false;
+    std::thread worker;
+};
+
 class LoggerFactory {
 public:
     static Logger* CreateFileLogger(std::string strFilePath, 
@@ -94,6 +384,13 @@ public:
             bool bPrintTimeStamp = true) {
         return new UdpLogger(szHost, uPort, level, bPrintTimeStamp);
     }
+    /**
+    *  @brief Wraps pSink (which becomes owned by the returned logger) with an AsyncLogger.
+    */
+    static Logger* CreateAsyncLogger(Logger *pSink, LogLevel level = INFO,
+            bool bPrintTimeStamp = true) {
+        return new AsyncLogger(pSink, level, bPrintTimeStamp);
+    }
 private:
     LoggerFactory() {}
 
@@ -106,6 +403,7 @@ private:
         }
         ~FileLogger() {
             pFileOut->close();
+            delete pFileOut;
         }
         std::ostream& GetStream() {
             return *pFileOut;
@@ -201,8 +499,7 @@ public:
         if (!pLogger->ShouldLogFor(level)) {
             return;
         }
-        pLogger->EnterCriticalSection();
-        pLogger->GetStream() << pLogger->GetLead(level, szFile, nLine, szFunc);
+        pStream = &pLogger->BeginRecord(level, szFile, nLine, szFunc);
     }
     ~LogTransaction() {
         if (!pLogger) {
@@ -212,9 +509,7 @@ public:
         if (!pLogger->ShouldLogFor(level)) {
             return;
         }
-        pLogger->GetStream() << std::endl;
-        pLogger->FlushStream();
-        pLogger->LeaveCriticalSection();
+        pLogger->EndRecord(level);
         if (level == FATAL) {
             exit(1);
         }
@@ -223,18 +518,22 @@ public:
         if (!pLogger) {
             return std::cout;
         }
-        if (!pLogger->ShouldLogFor(level)) {
-            return ossNull;
+        if (!pStream) {
+            // a stream without a buffer ignores everything written to it
+            static thread_local std::ostream osNull(NULL);
+            return osNull;
         }
-        return pLogger->GetStream();
+        return *pStream;
     }
 private:
     Logger *pLogger;
     LogLevel level;
-    std::ostringstream ossNull;
+    std::ostream *pStream = NULL;
 };
 
 }
 
 extern simplelogger::Logger *logger;
-#define LOG(level) simplelogger::LogTransaction(logger, level, __FILE__, __LINE__, __FUNCTION__).GetStream()
+// Levels below SIMPLELOGGER_MIN_LEVEL are removed at compile time, levels below the logger's at run
+// time before anything is constructed or formatted
+#define LOG(level) if ((level) < SIMPLELOGGER_MIN_LEVEL || (logger && !logger->ShouldLogFor(level))) ; else simplelogger::LogTransaction(logger, level, __FILE__, __LINE__, __FUNCTION__).GetStream()
@@ -0,0 +1,324 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "NvEncoder/nvEncodeAPI.h"
+#include "CpuFeatures.h"
+
+struct MotionEstimatorOptions
+{
+    /** Largest displacement searched, in full pels in each direction */
+    int nSearchRange = 64;
+    /** Hexagon steps before the search gives up moving */
+    int nMaxSteps = 32;
+    /** Cost of one pel of difference from the predicted vector, in SAD units */
+    int nLambda = 4;
+    /** Threads sharing the macroblock rows */
+    int nThreads = 1;
+    /** 0: scalar, 1: up to SSE2, 2: up to AVX2 */
+    int nSimd = 2;
+};
+
+/**
+*  @brief Block-matching motion estimation on the CPU with the output of NVENC's motion
+*  estimation only mode (NvEncoder::RunMotionEstimation()): one NV_ENC_H264_MV_DATA per 16x16
+*  macroblock in raster order, full pel vectors in quarter pel units, the SAD as mbCost.
+*  It lets MV based analysis run on hosts without a GPU and is a reference for the hardware.
+*
+*  Every macroblock starts from the best of the zero vector, its left neighbour's and its own
+*  vector of the previous call, and refines it with a hexagon search followed by a small
+*  diamond. The SAD runs on 16 rows at once with AVX2 (two rows per register) or SSE2.
+*  Rows are split across threads; the predictors never cross rows, so the result does not
+*  depend on the number of threads.
+*/
+class MotionEstimatorCpu
+{
+public:
+    MotionEstimatorCpu(int nWidth, int nHeight, const MotionEstimatorOptions &options = MotionEstimatorOptions())
+        : nWidth(nWidth), nHeight(nHeight), nWidthInMbs((nWidth + 15) / 16), nHeightInMbs((nHeight + 15) / 16), options(options)
+    {
+        vPrev.resize(GetMbCount());
+        Sad16x16 = Sad16x16Scalar;
+#ifdef CPU_HAS_SSE2
+        if (options.nSimd >= 1)
+        {
+            Sad16x16 = Sad16x16Sse2;
+        }
+#endif
+#ifdef CPU_HAS_AVX2_TARGET
+        if (options.nSimd >= 2 && CpuHasAvx2())
+        {
+            Sad16x16 = Sad16x16Avx2;
+        }
+#endif
+    }
+
+    /**
+    *  @brief Estimates the motion of the luma plane pCur relative to pRef (both nWidth x nHeight,
+    *  e.g. the Y plane of NV12) into pMvData, which holds GetMbCount() entries.
+    */
+    void Estimate(const uint8_t *pCur, int nCurPitch, const uint8_t *pRef, int nRefPitch, NV_ENC_H264_MV_DATA *pMvData)
+    {
+        int nThreads = options.nThreads < 1 ? 1 : (options.nThreads > nHeightInMbs ? nHeightInMbs : options.nThreads);
+        std::vector<std::thread> vThread;
+        for (int i = 1; i < nThreads; i++)
+        {
+            vThread.push_back(std::thread(&MotionEstimatorCpu::EstimateRows, this, pCur, nCurPitch, pRef, nRefPitch, pMvData,
+                nHeightInMbs * i / nThreads, nHeightInMbs * (i + 1) / nThreads));
+        }
+        EstimateRows(pCur, nCurPitch, pRef, nRefPitch, pMvData, 0, nHeightInMbs / nThreads);
+        for (auto &t : vThread)
+        {
+            t.join();
+        }
+        for (size_t i = 0; i < vPrev.size(); i++)
+        {
+            vPrev[i] = pMvData[i].mv[0];
+        }
+    }
+
+    size_t GetMbCount() const { return (size_t)nWidthInMbs * nHeightInMbs; }
+    int GetWidthInMbs() const { return nWidthInMbs; }
+    int GetHeightInMbs() const { return nHeightInMbs; }
+
+    /**
+    *  @brief Most frequent non-zero vector of a frame and the share of the macroblocks that
+    *  have it, e.g. to detect a scroll. Returns false if every vector is zero.
+    */
+    static bool GetDominantVector(const NV_ENC_H264_MV_DATA *pMvData, size_t nMbs, NV_ENC_MVECTOR *pMv, double *pShare)
+    {
+        std::unordered_map<uint32_t, size_t> mCount;
+        uint32_t nBest = 0;
+        size_t nBestCount = 0;
+        for (size_t i = 0; i < nMbs; i++)
+        {
+            const NV_ENC_MVECTOR &mv = pMvData[i].mv[0];
+            if (!mv.mvx && !mv.mvy)
+            {
+                continue;
+            }
+            uint32_t nKey = (uint16_t)mv.mvx << 16 | (uint16_t)mv.mvy;
+            size_t n = ++mCount[nKey];
+            if (n > nBestCount)
+            {
+                nBest = nKey;
+                nBestCount = n;
+            }
+        }
+        if (!nBestCount)
+        {
+            return false;
+        }
+        pMv->mvx = (int16_t)(nBest >> 16);
+        pMv->mvy = (int16_t)(nBest & 0xFFFF);
+        *pShare = nMbs ? (double)nBestCount / nMbs : 0;
+        return true;
+    }
+
+    /**
+    *  @brief Share of the macroblocks whose first vectors differ by at most nToleranceQpel in
+    *  each component, to compare this estimator with the hardware (or two configurations).
+    */
+    static double GetAgreement(const NV_ENC_H264_MV_DATA *pMvData1, const NV_ENC_H264_MV_DATA *pMvData2, size_t nMbs, int nToleranceQpel)
+    {
+        size_t nAgree = 0;
+        for (size_t i = 0; i < nMbs; i++)
+        {
+            if (abs(pMvData1[i].mv[0].mvx - pMvData2[i].mv[0].mvx) <= nToleranceQpel
+                && abs(pMvData1[i].mv[0].mvy - pMvData2[i].mv[0].mvy) <= nToleranceQpel)
+            {
+                nAgree++;
+            }
+        }
+        return nMbs ? (double)nAgree / nMbs : 1.0;
+    }
+
+private:
+    typedef uint32_t (*Sad16x16Func)(const uint8_t *pCur, int nCurPitch, const uint8_t *pRef, int nRefPitch);
+
+    struct alignas(32) PackedBlock
+    {
+        uint8_t a[256];
+    };
+
+    /** Search state of one macroblock; bw and bh are smaller than 16 at the right and bottom edge */
+    struct Block
+    {
+        const uint8_t *pCur;
+        int nCurPitch;
+        const uint8_t *pRef;
+        int nRefPitch;
+        int x, y, bw, bh;
+        int xMin, xMax, yMin, yMax;
+        int xPred, yPred;
+        int xBest, yBest;
+        uint32_t nBestSad, nBestCost;
+    };
+
+    void EstimateRows(const uint8_t *pCur, int nCurPitch, const uint8_t *pRef, int nRefPitch, NV_ENC_H264_MV_DATA *pMvData,
+        int iMbRowBegin, int iMbRowEnd)
+    {
+        static const int aHexagon[6][2] = { { -2, 0 }, { -1, -2 }, { 1, -2 }, { 2, 0 }, { 1, 2 }, { -1, 2 } };
+        static const int aDiamond[4][2] = { { 0, -1 }, { -1, 0 }, { 1, 0 }, { 0, 1 } };
+        PackedBlock cur;
+        for (int yMb = iMbRowBegin; yMb < iMbRowEnd; yMb++)
+        {
+            int xLeft = 0, yLeft = 0;
+            for (int xMb = 0; xMb < nWidthInMbs; xMb++)
+            {
+                size_t iMb = (size_t)yMb * nWidthInMbs + xMb;
+                Block b;
+                b.x = xMb * 16;
+                b.y = yMb * 16;
+                b.bw = nWidth - b.x < 16 ? nWidth - b.x : 16;
+                b.bh = nHeight - b.y < 16 ? nHeight - b.y : 16;
+                b.pCur = pCur + (size_t)b.y * nCurPitch + b.x;
+                b.nCurPitch = nCurPitch;
+                if (b.bw == 16 && b.bh == 16)
+                {
+                    // packed and aligned: the SIMD SAD loads two of its rows at once
+                    for (int y = 0; y < 16; y++)
+                    {
+                        memcpy(&cur.a[y * 16], b.pCur + (size_t)y * nCurPitch, 16);
+                    }
+                    b.pCur = cur.a;
+                    b.nCurPitch = 16;
+                }
+                b.pRef = pRef;
+                b.nRefPitch = nRefPitch;
+                // the reference block stays inside the picture
+                b.xMin = -(b.x < options.nSearchRange ? b.x : options.nSearchRange);
+                b.yMin = -(b.y < options.nSearchRange ? b.y : options.nSearchRange);
+                b.xMax = nWidth - b.bw - b.x < options.nSearchRange ? nWidth - b.bw - b.x : options.nSearchRange;
+                b.yMax = nHeight - b.bh - b.y < options.nSearchRange ? nHeight - b.bh - b.y : options.nSearchRange;
+                b.xPred = xLeft;
+                b.yPred = yLeft;
+                b.nBestCost = UINT32_MAX;
+                b.nBestSad = UINT32_MAX;
+                b.xBest = b.yBest = 0;
+                Try(b, 0, 0);
+                Try(b, xLeft, yLeft);
+                Try(b, vPrev[iMb].mvx / 4, vPrev[iMb].mvy / 4);
+
+                for (int iStep = 0; iStep < options.nMaxSteps; iStep++)
+                {
+                    int xCenter = b.xBest, yCenter = b.yBest;
+                    for (auto &d : aHexagon)
+                    {
+                        Try(b, xCenter + d[0], yCenter + d[1]);
+                    }
+                    if (b.xBest == xCenter && b.yBest == yCenter)
+                    {
+                        break;
+                    }
+                }
+                for (int iStep = 0; iStep < options.nMaxSteps; iStep++)
+                {
+                    int xCenter = b.xBest, yCenter = b.yBest;
+                    for (auto &d : aDiamond)
+                    {
+                        Try(b, xCenter + d[0], yCenter + d[1]);
+                    }
+                    if (b.xBest == xCenter && b.yBest == yCenter)
+                    {
+                        break;
+                    }
+                }
+
+                NV_ENC_H264_MV_DATA &mvData = pMvData[iMb];
+                memset(&mvData, 0, sizeof(mvData));
+                for (auto &mv : mvData.mv)
+                {
+                    mv.mvx = (int16_t)(b.xBest * 4);
+                    mv.mvy = (int16_t)(b.yBest * 4);
+                }
+                mvData.mbType = 1;
+                mvData.partitionType = 0;
+                mvData.mbCost = b.nBestSad;
+                xLeft = b.xBest;
+                yLeft = b.yBest;
+            }
+        }
+    }
+
+    void Try(Block &b, int dx, int dy)
+    {
+        if (dx < b.xMin || dx > b.xMax || dy < b.yMin || dy > b.yMax)
+        {
+            return;
+        }
+        uint32_t nMvCost = (uint32_t)options.nLambda * (abs(dx - b.xPred) + abs(dy - b.yPred));
+        if (nMvCost >= b.nBestCost)
+        {
+            return;
+        }
+        const uint8_t *pRefBlock = b.pRef + (size_t)(b.y + dy) * b.nRefPitch + b.x + dx;
+        uint32_t nSad = b.bw == 16 && b.bh == 16 ? Sad16x16(b.pCur, b.nCurPitch, pRefBlock, b.nRefPitch)
+            : SadScalar(b.pCur, b.nCurPitch, pRefBlock, b.nRefPitch, b.bw, b.bh);
+        if (nSad + nMvCost < b.nBestCost)
+        {
+            b.nBestCost = nSad + nMvCost;
+            b.nBestSad = nSad;
+            b.xBest = dx;
+            b.yBest = dy;
+        }
+    }
+
+    static uint32_t SadScalar(const uint8_t *pCur, int nCurPitch, const uint8_t *pRef, int nRefPitch, int bw, int bh)
+    {
+        uint32_t nSad = 0;
+        for (int y = 0; y < bh; y++, pCur += nCurPitch, pRef += nRefPitch)
+        {
+            for (int x = 0; x < bw; x++)
+            {
+                nSad += abs(pCur[x] - pRef[x]);
+            }
+        }
+        return nSad;
+    }
+
+    static uint32_t Sad16x16Scalar(const uint8_t *pCur, int nCurPitch, const uint8_t *pRef, int nRefPitch)
+    {
+        return SadScalar(pCur, nCurPitch, pRef, nRefPitch, 16, 16);
+    }
+
+#ifdef CPU_HAS_SSE2
+    /** pCur is a PackedBlock */
+    static uint32_t Sad16x16Sse2(const uint8_t *pCur, int, const uint8_t *pRef, int nRefPitch)
+    {
+        __m128i vSum = _mm_setzero_si128();
+        for (int y = 0; y < 16; y++, pCur += 16, pRef += nRefPitch)
+        {
+            vSum = _mm_add_epi64(vSum, _mm_sad_epu8(_mm_load_si128((const __m128i *)pCur), _mm_loadu_si128((const __m128i *)pRef)));
+        }
+        return (uint32_t)(_mm_cvtsi128_si32(vSum) + _mm_cvtsi128_si32(_mm_srli_si128(vSum, 8)));
+    }
+#endif
+
+#ifdef CPU_HAS_AVX2_TARGET
+    /** pCur is a PackedBlock */
+    CPU_TARGET_AVX2 static uint32_t Sad16x16Avx2(const uint8_t *pCur, int, const uint8_t *pRef, int nRefPitch)
+    {
+        __m256i vSum = _mm256_setzero_si256();
+        for (int y = 0; y < 16; y += 2, pCur += 32, pRef += 2 * nRefPitch)
+        {
+            __m256i vCur = _mm256_load_si256((const __m256i *)pCur);
+            __m256i vRef = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)pRef)),
+                _mm_loadu_si128((const __m128i *)(pRef + nRefPitch)), 1);
+            vSum = _mm256_add_epi64(vSum, _mm256_sad_epu8(vCur, vRef));
+        }
+        __m128i vSum128 = _mm_add_epi64(_mm256_castsi256_si128(vSum), _mm256_extracti128_si256(vSum, 1));
+        return (uint32_t)(_mm_cvtsi128_si32(vSum128) + _mm_cvtsi128_si32(_mm_srli_si128(vSum128, 8)));
+    }
+#endif
+
+    int nWidth, nHeight, nWidthInMbs, nHeightInMbs;
+    MotionEstimatorOptions options;
+    Sad16x16Func Sad16x16;
+    /** Vectors of the previous call, the temporal predictors */
+    std::vector<NV_ENC_MVECTOR> vPrev;
+};
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+#include "NvEncoder/nvEncodeAPI.h"
+#include "DirtyRects.h"
+
+/**
+*  @brief Turns the move rects of each captured frame into external ME hints
+*  (NV_ENC_PIC_PARAMS::meExternalHints): one L0 candidate per 16x16 macroblock, the
+*  displacement of the move for the macroblocks whose center lies in its destination and a
+*  zero vector for the others. Where a dirty rect redraws part of the destination the content
+*  did not come from the source, so those macroblocks get the zero vector too.
+*
+*  Frames without move rects get no hints, which leaves the encoder's own search alone. The
+*  encoder has to be initialized with enableExternalMEHints and
+*  maxMEHintCountsPerBlock[0].numCandsPerBlk16x16 = 1 (see SetInitParams()), and the hints
+*  assume that every frame references the one before it, i.e. no B frames. The hints have
+*  the H.264 layout; an HEVC session takes them per CTB and CU and must not be given these.
+*/
+class MotionHintBuilder
+{
+public:
+    MotionHintBuilder(int nWidth, int nHeight, int nPoolSize = 8)
+        : nWidth(nWidth), nHeight(nHeight), nWidthInMbs((nWidth + 15) / 16), nHeightInMbs((nHeight + 15) / 16)
+    {
+        hintZero = {};
+        hintZero.lastofPart = 1;
+        hintZero.lastOfMB = 1;
+        vvHint.assign(nPoolSize > 0 ? nPoolSize : 1, std::vector<NVENC_EXTERNAL_ME_HINT>((size_t)nWidthInMbs * nHeightInMbs, hintZero));
+    }
+
+    /** Declares the single 16x16 L0 candidate per macroblock the hints use */
+    static void SetInitParams(NV_ENC_INITIALIZE_PARAMS *pInitializeParams)
+    {
+        pInitializeParams->enableExternalMEHints = 1;
+        pInitializeParams->maxMEHintCountsPerBlock[0] = {};
+        pInitializeParams->maxMEHintCountsPerBlock[0].numCandsPerBlk16x16 = 1;
+    }
+
+    /**
+    *  @brief Fills the hints of one frame into the next buffer of the pool and attaches them to
+    *  pPicParams. Returns false and attaches nothing when the frame has no move rects.
+    */
+    bool Build(const FrameChanges &changes, NV_ENC_PIC_PARAMS *pPicParams)
+    {
+        pPicParams->meExternalHints = NULL;
+        pPicParams->meHintCountsPerBlock[0] = {};
+        if (changes.bFullFrame || !changes.nMoveRects)
+        {
+            return false;
+        }
+
+        std::vector<NVENC_EXTERNAL_ME_HINT> &vHint = vvHint[iHint];
+        iHint = (iHint + 1) % vvHint.size();
+        std::fill(vHint.begin(), vHint.end(), hintZero);
+        for (uint32_t i = 0; i < changes.nMoveRects; i++)
+        {
+            const ScreenMoveRect &move = changes.pMoveRect[i];
+            int mvx = move.xSource - move.destination.left, mvy = move.ySource - move.destination.top;
+            if (mvx < -2048 || mvx > 2047 || mvy < -512 || mvy > 511)
+            {
+                // beyond the S12.0 / S10.0 range of the hint
+                continue;
+            }
+            NVENC_EXTERNAL_ME_HINT hint = hintZero;
+            hint.mvx = mvx;
+            hint.mvy = mvy;
+            Rasterize(vHint, move.destination, hint);
+        }
+        for (uint32_t i = 0; i < changes.nDirtyRects; i++)
+        {
+            Rasterize(vHint, changes.pDirtyRect[i], hintZero);
+        }
+
+        pPicParams->meExternalHints = vHint.data();
+        pPicParams->meHintCountsPerBlock[0].numCandsPerBlk16x16 = 1;
+        return true;
+    }
+
+    /** Hints per frame, one per macroblock */
+    size_t GetHintCount() const { return (size_t)nWidthInMbs * nHeightInMbs; }
+
+private:
+    /** Macroblocks whose center lies in rect; the partial ones at the right and bottom edge count as inside */
+    void Rasterize(std::vector<NVENC_EXTERNAL_ME_HINT> &vHint, const ScreenRect &rect, const NVENC_EXTERNAL_ME_HINT &hint)
+    {
+        int nRight = rect.right >= nWidth ? nWidthInMbs * 16 : rect.right, nBottom = rect.bottom >= nHeight ? nHeightInMbs * 16 : rect.bottom;
+        int x0 = ((rect.left > 0 ? rect.left : 0) + 7) / 16, x1 = nRight > 0 ? (nRight + 7) / 16 : 0;
+        int y0 = ((rect.top > 0 ? rect.top : 0) + 7) / 16, y1 = nBottom > 0 ? (nBottom + 7) / 16 : 0;
+        for (int y = y0; y < y1 && x0 < x1; y++)
+        {
+            std::fill_n(&vHint[(size_t)y * nWidthInMbs + x0], x1 - x0, hint);
+        }
+    }
+
+    int nWidth, nHeight, nWidthInMbs, nHeightInMbs;
+    NVENC_EXTERNAL_ME_HINT hintZero;
+    std::vector<std::vector<NVENC_EXTERNAL_ME_HINT>> vvHint;
+    size_t iHint = 0;
+};
@@ -0,0 +1,787 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <stdexcept>
+#include "NalScanner.h"
+
+/**
+*  @brief Big endian writer for ISO-BMFF boxes. Begin() and End() nest; End()
+*  patches the size of the box opened by the matching Begin().
+*/
+class Mp4BoxBuffer
+{
+public:
+    void U8(uint8_t v) { vBuf.push_back(v); }
+    void U16(uint16_t v) { U8(v >> 8); U8((uint8_t)v); }
+    void U24(uint32_t v) { U8((uint8_t)(v >> 16)); U16((uint16_t)v); }
+    void U32(uint32_t v) { U16(v >> 16); U16((uint16_t)v); }
+    void U64(uint64_t v) { U32((uint32_t)(v >> 32)); U32((uint32_t)v); }
+    void Bytes(const void *p, size_t n) { vBuf.insert(vBuf.end(), (const uint8_t *)p, (const uint8_t *)p + n); }
+    void Zeros(size_t n) { vBuf.insert(vBuf.end(), n, 0); }
+    void Begin(const char *szType)
+    {
+        vStack.push_back(vBuf.size());
+        U32(0);
+        Bytes(szType, 4);
+    }
+    void BeginFull(const char *szType, uint8_t nVersion, uint32_t nFlags)
+    {
+        Begin(szType);
+        U8(nVersion);
+        U24(nFlags);
+    }
+    void End()
+    {
+        size_t iStart = vStack.back();
+        vStack.pop_back();
+        Patch32(iStart, (uint32_t)(vBuf.size() - iStart));
+    }
+    void Patch32(size_t iOffset, uint32_t v)
+    {
+        uint8_t *p = &vBuf[iOffset];
+        p[0] = (uint8_t)(v >> 24); p[1] = (uint8_t)(v >> 16); p[2] = (uint8_t)(v >> 8); p[3] = (uint8_t)v;
+    }
+    size_t Size() const { return vBuf.size(); }
+    void Clear() { vBuf.clear(); vStack.clear(); }
+    const std::vector<uint8_t> &GetBuffer() const { return vBuf; }
+
+private:
+    std::vector<uint8_t> vBuf;
+    std::vector<size_t> vStack;
+};
+
+struct Mp4WriterOptions
+{
+    uint32_t nTimescale = 90000;
+    /** Write an init segment followed by moof/mdat fragments instead of a single mdat and a trailing moov */
+    bool bFragmented = false;
+    /** Frames per fragment; 0 starts a new fragment at every key frame */
+    int nFragmentFrames = 0;
+    /**
+    *  Samples the sample table of a non-fragmented file holds, about 35 minutes at 60 fps and at
+    *  most 2 MB; the file continues in fragments after that. 0 keeps the table unbounded.
+    */
+    uint32_t nMaxTableSamples = 1 << 17;
+};
+
+/**
+*  @brief Writes the H.264 packets of the encoder straight into an MP4 file.
+*  Packets are converted from Annex-B to length prefixed NAL units and appended
+*  to a single mdat as they arrive; the moov is written once at Close(), after
+*  which only the 8 byte mdat size is patched, so the file is never read back.
+*  The sample table is kept in run length / per chunk form, which costs 4 to 16
+*  bytes per frame depending on how regular the capture timestamps are. When it
+*  reaches nMaxTableSamples, the mdat is closed, the moov is written with the table
+*  so far and an mvex, the table is freed and the rest of the recording follows as
+*  fragments, so memory stays bounded however long the recording gets.
+*  SPS and PPS come from NvEncoder::GetSequenceParams() or, if not given, from
+*  the first packet that carries them.
+*
+*  In fragmented mode the moov only describes the track and every fragment is
+*  written as a self-contained moof + mdat pair as soon as it is complete, so
+*  memory is bounded by one fragment whatever the recording length, and a file
+*  cut off by a crash stays playable up to its last complete fragment.
+*/
+class Mp4Writer
+{
+public:
+    Mp4Writer(const std::string &strPath, int nWidth, int nHeight,
+        const std::vector<uint8_t> &vSeqParams = std::vector<uint8_t>(), const Mp4WriterOptions &options = Mp4WriterOptions())
+        : nWidth(nWidth), nHeight(nHeight), nTimescale(options.nTimescale), options(options)
+    {
+        fpOut.open(strPath, std::ios::out | std::ios::binary);
+        if (!fpOut)
+        {
+            throw std::invalid_argument("Unable to open output file: " + strPath);
+        }
+        if (!vSeqParams.empty())
+        {
+            SetSequenceParams(vSeqParams.data(), vSeqParams.size());
+        }
+
+        if (options.bFragmented)
+        {
+            // the init segment needs SPS/PPS, so it is written with the first sample
+            return;
+        }
+        Mp4BoxBuffer box;
+        box.Begin("ftyp");
+        box.Bytes("isom", 4);
+        box.U32(0x200);
+        box.Bytes("isomiso2avc1mp41", 16);
+        box.End();
+        // 64-bit mdat header; the size is filled in by Close()
+        box.U32(1);
+        box.Bytes("mdat", 4);
+        box.U64(0);
+        nMdatHeaderOffset = box.GetBuffer().size() - 16;
+        Write(box.GetBuffer().data(), box.GetBuffer().size());
+    }
+
+    ~Mp4Writer()
+    {
+        try
+        {
+            Close();
+        }
+        catch (...)
+        {
+        }
+    }
+
+    /**
+    *  @brief Sets SPS/PPS from an Annex-B buffer such as the one returned by NvEncoder::GetSequenceParams().
+    */
+    void SetSequenceParams(const uint8_t *pData, size_t nSize)
+    {
+        std::vector<NalUnit> vNal;
+        SplitAnnexB(pData, nSize, vNal);
+        for (const NalUnit &nal : vNal)
+        {
+            StoreParameterSet(nal);
+        }
+    }
+
+    /**
+    *  @brief Appends one access unit. Timestamps are in microseconds; pass the
+    *  same value twice when the stream has no B frames.
+    */
+    void WritePacket(const uint8_t *pData, size_t nSize, int64_t nPtsUs, int64_t nDtsUs)
+    {
+        SplitAnnexB(pData, nSize, vNal);
+        bool bKeyFrame = false, bPicture = false;
+        for (const NalUnit &nal : vNal)
+        {
+            // avc1 carries the parameter sets in the sample entry only
+            StoreParameterSet(nal);
+            bKeyFrame |= GetH264NalType(nal) == H264_NAL_IDR;
+            bPicture |= IsSampleNal(nal);
+        }
+        if (!bPicture)
+        {
+            return;
+        }
+        int64_t nPts = ToTimescale(nPtsUs), nDts = ToTimescale(nDtsUs);
+        if (!options.bFragmented && options.nMaxTableSamples && vSampleSize.size() >= options.nMaxTableSamples)
+        {
+            SwitchToFragments(nDts);
+        }
+        if (options.bFragmented)
+        {
+            AddFragmentSample(nPts, nDts, bKeyFrame);
+            return;
+        }
+        uint32_t nSampleSize = 0;
+        for (const NalUnit &nal : vNal)
+        {
+            if (!IsSampleNal(nal))
+            {
+                continue;
+            }
+            uint8_t aLength[4] = { (uint8_t)(nal.nSize >> 24), (uint8_t)(nal.nSize >> 16), (uint8_t)(nal.nSize >> 8), (uint8_t)nal.nSize };
+            Write(aLength, 4);
+            Write(nal.pData, nal.nSize);
+            nSampleSize += 4 + (uint32_t)nal.nSize;
+        }
+        AddSample(nSampleSize, nPts, nDts, bKeyFrame);
+    }
+
+    void WritePacket(const std::vector<uint8_t> &vPacket, int64_t nTimestampUs)
+    {
+        WritePacket(vPacket.data(), vPacket.size(), nTimestampUs, nTimestampUs);
+    }
+
+    /**
+    *  @brief Writes the moov and patches the mdat size. Called by the destructor if needed.
+    */
+    void Close()
+    {
+        if (!fpOut.is_open())
+        {
+            return;
+        }
+        if (options.bFragmented)
+        {
+            if (!vFragmentSample.empty())
+            {
+                vFragmentSample.back().nDuration = (uint32_t)(nLastDuration ? nLastDuration : nTimescale / 30);
+                FlushFragment();
+            }
+            fpOut.close();
+            return;
+        }
+        uint64_t nMdatEnd = nFileOffset;
+        if (!vSampleSize.empty())
+        {
+            FinishLastSample();
+            Mp4BoxBuffer box;
+            WriteMoov(box);
+            Write(box.GetBuffer().data(), box.GetBuffer().size());
+        }
+        PatchMdatSize(nMdatEnd);
+        fpOut.close();
+    }
+
+    uint64_t GetBytesWritten() const { return nFileOffset; }
+    uint32_t GetSampleCount() const { return nSampleCount; }
+    /** Samples described by the moov rather than by fragments */
+    uint32_t GetTableSampleCount() const { return nTableSamples; }
+
+private:
+    struct RunEntry
+    {
+        uint32_t nCount;
+        int64_t nValue;
+    };
+
+    struct FragmentSample
+    {
+        uint32_t nSize;
+        uint32_t nDuration;
+        bool bKeyFrame;
+        int32_t nCompositionOffset;
+    };
+
+    void Write(const void *p, size_t n)
+    {
+        fpOut.write((const char *)p, n);
+        if (!fpOut)
+        {
+            throw std::runtime_error("Mp4Writer: write failed");
+        }
+        nFileOffset += n;
+    }
+
+    static bool IsSampleNal(const NalUnit &nal)
+    {
+        int nType = GetH264NalType(nal);
+        return nType != H264_NAL_SPS && nType != H264_NAL_PPS && nType != H264_NAL_AUD;
+    }
+
+    void StoreParameterSet(const NalUnit &nal)
+    {
+        int nType = GetH264NalType(nal);
+        if (nType == H264_NAL_SPS || nType == H264_NAL_PPS)
+        {
+            (nType == H264_NAL_SPS ? vSps : vPps).assign(nal.pData, nal.pData + nal.nSize);
+        }
+    }
+
+    int64_t ToTimescale(int64_t nUs) const
+    {
+        return nUs * nTimescale / 1000000;
+    }
+
+    static void AppendRun(std::vector<RunEntry> &v, int64_t nValue)
+    {
+        if (!v.empty() && v.back().nValue == nValue)
+        {
+            v.back().nCount++;
+        }
+        else
+        {
+            v.push_back(RunEntry{ 1, nValue });
+        }
+    }
+
+    void AddSample(uint32_t nSize, int64_t nPts, int64_t nDts, bool bKeyFrame)
+    {
+        if (vSampleSize.empty())
+        {
+            nFirstDts = nDts;
+        }
+        else
+        {
+            // the duration of the previous sample is known once the next one arrives
+            int64_t nDuration = nDts - nLastDts;
+            AppendRun(vDuration, nDuration > 0 ? nDuration : 1);
+            nLastDuration = nDuration > 0 ? nDuration : 1;
+        }
+        nLastDts = nDts;
+        AppendRun(vCompositionOffset, nPts - nDts);
+        bCompositionOffset |= nPts != nDts;
+        if (bKeyFrame)
+        {
+            vSyncSample.push_back((uint32_t)vSampleSize.size() + 1);
+        }
+        if (vSampleSize.size() % nSamplesPerChunk == 0)
+        {
+            vChunkOffset.push_back(nFileOffset - nSize);
+        }
+        vSampleSize.push_back(nSize);
+        nSampleCount++;
+    }
+
+    /**
+    *  @brief Ends the progressive part of the file before the sample at nDts: patches the mdat size,
+    *  writes the moov with the table and an mvex, and frees the table.
+    */
+    void SwitchToFragments(int64_t nDts)
+    {
+        int64_t nDuration = nDts - nLastDts;
+        nLastDuration = nDuration > 0 ? nDuration : 1;
+        AppendRun(vDuration, nLastDuration);
+        PatchMdatSize(nFileOffset);
+        nTableSamples = (uint32_t)vSampleSize.size();
+        options.bFragmented = true;
+        Mp4BoxBuffer box;
+        WriteMoov(box);
+        Write(box.GetBuffer().data(), box.GetBuffer().size());
+        fpOut.flush();
+        std::vector<uint32_t>().swap(vSampleSize);
+        std::vector<RunEntry>().swap(vDuration);
+        std::vector<RunEntry>().swap(vCompositionOffset);
+        std::vector<uint32_t>().swap(vSyncSample);
+        std::vector<uint64_t>().swap(vChunkOffset);
+    }
+
+    void PatchMdatSize(uint64_t nMdatEnd)
+    {
+        uint64_t nMdatSize = nMdatEnd - nMdatHeaderOffset;
+        uint8_t aSize[8];
+        for (int i = 0; i < 8; i++)
+        {
+            aSize[i] = (uint8_t)(nMdatSize >> (56 - 8 * i));
+        }
+        fpOut.seekp(nMdatHeaderOffset + 8);
+        fpOut.write((const char *)aSize, sizeof(aSize));
+        fpOut.seekp(0, std::ios::end);
+        if (!fpOut)
+        {
+            throw std::runtime_error("Mp4Writer: write failed");
+        }
+    }
+
+    /**
+    *  @brief Buffers a sample of the current fragment; the fragment is flushed first when this sample starts the next one.
+    */
+    void AddFragmentSample(int64_t nPts, int64_t nDts, bool bKeyFrame)
+    {
+        if (!nSampleCount)
+        {
+            nFirstDts = nDts;
+            WriteInitSegment();
+        }
+        else if (!vFragmentSample.empty())
+        {
+            int64_t nDuration = nDts - nLastDts;
+            nLastDuration = nDuration > 0 ? nDuration : 1;
+            vFragmentSample.back().nDuration = (uint32_t)nLastDuration;
+        }
+        nLastDts = nDts;
+        bool bNewFragment = options.nFragmentFrames > 0 ? (int)vFragmentSample.size() >= options.nFragmentFrames : bKeyFrame;
+        if (bNewFragment && !vFragmentSample.empty())
+        {
+            FlushFragment();
+        }
+        if (vFragmentSample.empty())
+        {
+            nFragmentBaseDts = nDts - nFirstDts;
+        }
+        FragmentSample sample = { 0, 0, bKeyFrame, (int32_t)(nPts - nDts) };
+        for (const NalUnit &nal : vNal)
+        {
+            if (!IsSampleNal(nal))
+            {
+                continue;
+            }
+            uint8_t aLength[4] = { (uint8_t)(nal.nSize >> 24), (uint8_t)(nal.nSize >> 16), (uint8_t)(nal.nSize >> 8), (uint8_t)nal.nSize };
+            vFragmentData.insert(vFragmentData.end(), aLength, aLength + 4);
+            vFragmentData.insert(vFragmentData.end(), nal.pData, nal.pData + nal.nSize);
+            sample.nSize += 4 + (uint32_t)nal.nSize;
+        }
+        vFragmentSample.push_back(sample);
+        nSampleCount++;
+    }
+
+    void WriteInitSegment()
+    {
+        Mp4BoxBuffer &box = fragmentBox;
+        box.Clear();
+        box.Begin("ftyp");
+        box.Bytes("iso5", 4);
+        box.U32(0x200);
+        box.Bytes("iso5iso6avc1mp41", 16);
+        box.End();
+        WriteMoov(box);
+        Write(box.GetBuffer().data(), box.Size());
+        fpOut.flush();
+    }
+
+    /**
+    *  @brief Writes the buffered samples as one moof + mdat and hands them to the OS.
+    */
+    void FlushFragment()
+    {
+        bool bCompositionOffset = false;
+        for (const FragmentSample &sample : vFragmentSample)
+        {
+            bCompositionOffset |= sample.nCompositionOffset != 0;
+        }
+        Mp4BoxBuffer &box = fragmentBox;
+        box.Clear();
+        box.Begin("moof");
+        box.BeginFull("mfhd", 0, 0);
+        box.U32(++nFragmentSequence);
+        box.End();
+        box.Begin("traf");
+        box.BeginFull("tfhd", 0, 0x020000); // default-base-is-moof
+        box.U32(1);
+        box.End();
+        box.BeginFull("tfdt", 1, 0);
+        box.U64(nFragmentBaseDts);
+        box.End();
+        // data offset plus duration, size and flags of every sample; composition offsets only with B frames
+        box.BeginFull("trun", 1, 0x000701 | (bCompositionOffset ? 0x800 : 0));
+        box.U32((uint32_t)vFragmentSample.size());
+        size_t iDataOffset = box.Size();
+        box.U32(0);
+        for (const FragmentSample &sample : vFragmentSample)
+        {
+            box.U32(sample.nDuration);
+            box.U32(sample.nSize);
+            box.U32(sample.bKeyFrame ? 0x02000000 : 0x01010000);
+            if (bCompositionOffset)
+            {
+                box.U32((uint32_t)sample.nCompositionOffset);
+            }
+        }
+        box.End();
+        box.End();
+        box.End();
+        box.Patch32(iDataOffset, (uint32_t)box.Size() + 8);
+        box.U32((uint32_t)(8 + vFragmentData.size()));
+        box.Bytes("mdat", 4);
+        Write(box.GetBuffer().data(), box.Size());
+        Write(vFragmentData.data(), vFragmentData.size());
+        fpOut.flush();
+        // clear() keeps the capacity, so steady state fragments do not allocate
+        vFragmentSample.clear();
+        vFragmentData.clear();
+    }
+
+    void FinishLastSample()
+    {
+        AppendRun(vDuration, nLastDuration ? nLastDuration : nTimescale / 30);
+        nLastDuration = 0;
+    }
+
+    uint64_t GetMediaDuration() const
+    {
+        uint64_t n = 0;
+        for (const RunEntry &e : vDuration)
+        {
+            n += (uint64_t)e.nCount * e.nValue;
+        }
+        return n;
+    }
+
+    static void WriteMatrix(Mp4BoxBuffer &box)
+    {
+        const uint32_t aMatrix[9] = { 0x10000, 0, 0, 0, 0x10000, 0, 0, 0, 0x40000000 };
+        for (uint32_t v : aMatrix)
+        {
+            box.U32(v);
+        }
+    }
+
+    void WriteAvcC(Mp4BoxBuffer &box)
+    {
+        if (vSps.size() < 4 || vPps.empty())
+        {
+            throw std::runtime_error("Mp4Writer: no SPS/PPS in the stream");
+        }
+        box.Begin("avcC");
+        box.U8(1);
+        box.U8(vSps[1]);
+        box.U8(vSps[2]);
+        box.U8(vSps[3]);
+        box.U8(0xFF);               // 4 byte NAL unit lengths
+        box.U8(0xE1);
+        box.U16((uint16_t)vSps.size());
+        box.Bytes(vSps.data(), vSps.size());
+        box.U8(1);
+        box.U16((uint16_t)vPps.size());
+        box.Bytes(vPps.data(), vPps.size());
+        int nProfile = vSps[1];
+        if (nProfile != 66 && nProfile != 77 && nProfile != 88)
+        {
+            int nChromaFormat = 1, nBitDepthLuma = 8, nBitDepthChroma = 8;
+            ParseSpsChroma(nChromaFormat, nBitDepthLuma, nBitDepthChroma);
+            box.U8(0xFC | nChromaFormat);
+            box.U8(0xF8 | (nBitDepthLuma - 8));
+            box.U8(0xF8 | (nBitDepthChroma - 8));
+            box.U8(0);
+        }
+        box.End();
+    }
+
+    /**
+    *  @brief Reads chroma_format_idc and the bit depths that high profile SPSs carry.
+    */
+    void ParseSpsChroma(int &nChromaFormat, int &nBitDepthLuma, int &nBitDepthChroma)
+    {
+        std::vector<uint8_t> vRbsp;
+        NalToRbsp(vSps.data(), vSps.size(), vRbsp);
+        size_t iBit = 32;
+        auto ReadBit = [&]() -> int {
+            if (iBit >= vRbsp.size() * 8)
+            {
+                return 0;
+            }
+            int b = (vRbsp[iBit / 8] >> (7 - iBit % 8)) & 1;
+            iBit++;
+            return b;
+        };
+        auto ReadUe = [&]() -> uint32_t {
+            int nZeros = 0;
+            while (!ReadBit() && nZeros < 32)
+            {
+                nZeros++;
+            }
+            uint32_t v = 0;
+            for (int i = 0; i < nZeros; i++)
+            {
+                v = (v << 1) | ReadBit();
+            }
+            return (1u << nZeros) - 1 + v;
+        };
+        ReadUe();                   // seq_parameter_set_id
+        nChromaFormat = (int)ReadUe();
+        if (nChromaFormat == 3)
+        {
+            ReadBit();              // separate_colour_plane_flag
+        }
+        nBitDepthLuma = 8 + (int)ReadUe();
+        nBitDepthChroma = 8 + (int)ReadUe();
+    }
+
+    void WriteStsd(Mp4BoxBuffer &box)
+    {
+        box.BeginFull("stsd", 0, 0);
+        box.U32(1);
+        box.Begin("avc1");
+        box.Zeros(6);
+        box.U16(1);                 // data_reference_index
+        box.Zeros(16);
+        box.U16((uint16_t)nWidth);
+        box.U16((uint16_t)nHeight);
+        box.U32(0x00480000);        // 72 dpi
+        box.U32(0x00480000);
+        box.U32(0);
+        box.U16(1);                 // frame_count
+        box.Zeros(32);              // compressorname
+        box.U16(0x18);
+        box.U16(0xFFFF);
+        WriteAvcC(box);
+        box.End();
+        box.End();
+    }
+
+    void WriteStbl(Mp4BoxBuffer &box)
+    {
+        box.Begin("stbl");
+        WriteStsd(box);
+        if (options.bFragmented && !nTableSamples)
+        {
+            // the samples are described by the fragments
+            const char *aszTable[] = { "stts", "stsc", "stco" };
+            for (const char *szTable : aszTable)
+            {
+                box.BeginFull(szTable, 0, 0);
+                box.U32(0);
+                box.End();
+            }
+            box.BeginFull("stsz", 0, 0);
+            box.U32(0);
+            box.U32(0);
+            box.End();
+            box.End();
+            return;
+        }
+
+        box.BeginFull("stts", 0, 0);
+        box.U32((uint32_t)vDuration.size());
+        for (const RunEntry &e : vDuration)
+        {
+            box.U32(e.nCount);
+            box.U32((uint32_t)e.nValue);
+        }
+        box.End();
+
+        if (bCompositionOffset)
+        {
+            box.BeginFull("ctts", 1, 0);
+            box.U32((uint32_t)vCompositionOffset.size());
+            for (const RunEntry &e : vCompositionOffset)
+            {
+                box.U32(e.nCount);
+                box.U32((uint32_t)(int32_t)e.nValue);
+            }
+            box.End();
+        }
+
+        if (vSyncSample.size() != vSampleSize.size())
+        {
+            box.BeginFull("stss", 0, 0);
+            box.U32((uint32_t)vSyncSample.size());
+            for (uint32_t n : vSyncSample)
+            {
+                box.U32(n);
+            }
+            box.End();
+        }
+
+        // every chunk holds nSamplesPerChunk samples except possibly the last one
+        uint32_t nChunks = (uint32_t)vChunkOffset.size();
+        uint32_t nLastChunkSamples = (uint32_t)vSampleSize.size() - (nChunks - 1) * nSamplesPerChunk;
+        bool bShortLastChunk = nChunks > 1 && nLastChunkSamples != nSamplesPerChunk;
+        box.BeginFull("stsc", 0, 0);
+        box.U32(bShortLastChunk ? 2 : 1);
+        box.U32(1);
+        box.U32(nChunks > 1 ? nSamplesPerChunk : nLastChunkSamples);
+        box.U32(1);
+        if (bShortLastChunk)
+        {
+            box.U32(nChunks);
+            box.U32(nLastChunkSamples);
+            box.U32(1);
+        }
+        box.End();
+
+        box.BeginFull("stsz", 0, 0);
+        box.U32(0);
+        box.U32((uint32_t)vSampleSize.size());
+        for (uint32_t n : vSampleSize)
+        {
+            box.U32(n);
+        }
+        box.End();
+
+        bool bLargeOffsets = !vChunkOffset.empty() && vChunkOffset.back() > 0xFFFFFFFFull;
+        box.BeginFull(bLargeOffsets ? "co64" : "stco", 0, 0);
+        box.U32(nChunks);
+        for (uint64_t n : vChunkOffset)
+        {
+            bLargeOffsets ? box.U64(n) : box.U32((uint32_t)n);
+        }
+        box.End();
+
+        box.End();
+    }
+
+    void WriteMoov(Mp4BoxBuffer &box)
+    {
+        uint64_t nMediaDuration = GetMediaDuration();
+        uint64_t nMovieDuration = nMediaDuration * 1000 / nTimescale;
+
+        box.Begin("moov");
+
+        box.BeginFull("mvhd", 1, 0);
+        box.U64(0);
+        box.U64(0);
+        box.U32(1000);
+        box.U64(nMovieDuration);
+        box.U32(0x10000);           // rate 1.0
+        box.U16(0x100);             // volume 1.0
+        box.Zeros(10);
+        WriteMatrix(box);
+        box.Zeros(24);
+        box.U32(2);                 // next_track_ID
+        box.End();
+
+        box.Begin("trak");
+        box.BeginFull("tkhd", 1, 3);
+        box.U64(0);
+        box.U64(0);
+        box.U32(1);                 // track_ID
+        box.U32(0);
+        box.U64(nMovieDuration);
+        box.Zeros(8);
+        box.U16(0);
+        box.U16(0);
+        box.U16(0);
+        box.U16(0);
+        WriteMatrix(box);
+        box.U32((uint32_t)nWidth << 16);
+        box.U32((uint32_t)nHeight << 16);
+        box.End();
+
+        box.Begin("mdia");
+        box.BeginFull("mdhd", 1, 0);
+        box.U64(0);
+        box.U64(0);
+        box.U32(nTimescale);
+        box.U64(nMediaDuration);
+        box.U16(0x55C4);            // "und"
+        box.U16(0);
+        box.End();
+
+        box.BeginFull("hdlr", 0, 0);
+        box.U32(0);
+        box.Bytes("vide", 4);
+        box.Zeros(12);
+        box.Bytes("VideoHandler", 13);
+        box.End();
+
+        box.Begin("minf");
+        box.BeginFull("vmhd", 0, 1);
+        box.Zeros(8);
+        box.End();
+        box.Begin("dinf");
+        box.BeginFull("dref", 0, 0);
+        box.U32(1);
+        box.BeginFull("url ", 0, 1);
+        box.End();
+        box.End();
+        box.End();
+        WriteStbl(box);
+        box.End();
+        box.End();
+        box.End();
+
+        if (options.bFragmented)
+        {
+            box.Begin("mvex");
+            box.BeginFull("trex", 0, 0);
+            box.U32(1);                 // track_ID
+            box.U32(1);                 // default_sample_description_index
+            box.U32(0);
+            box.U32(0);
+            box.U32(0);
+            box.End();
+            box.End();
+        }
+
+        box.End();
+    }
+
+    std::ofstream fpOut;
+    int nWidth, nHeight;
+    uint32_t nTimescale;
+    uint64_t nFileOffset = 0;
+    uint64_t nMdatHeaderOffset = 0;
+    std::vector<uint8_t> vSps, vPps;
+    std::vector<NalUnit> vNal;
+
+    static const uint32_t nSamplesPerChunk = 30;
+    std::vector<uint32_t> vSampleSize;
+    std::vector<RunEntry> vDuration;
+    std::vector<RunEntry> vCompositionOffset;
+    std::vector<uint32_t> vSyncSample;
+    std::vector<uint64_t> vChunkOffset;
+    bool bCompositionOffset = false;
+    int64_t nLastDts = 0, nLastDuration = 0;
+    uint32_t nSampleCount = 0, nTableSamples = 0;
+
+    Mp4WriterOptions options;
+    Mp4BoxBuffer fragmentBox;
+    std::vector<FragmentSample> vFragmentSample;
+    std::vector<uint8_t> vFragmentData;
+    uint32_t nFragmentSequence = 0;
+    int64_t nFirstDts = 0, nFragmentBaseDts = 0;
+};
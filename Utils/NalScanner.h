@@ -0,0 +1,561 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "CpuFeatures.h"
+
+/**
+*  Helpers to walk the Annex-B byte streams returned by NvEncoder::EncodeFrame()
+*  and NvEncoder::GetSequenceParams().
+*/
+
+/**
+*  @brief One NAL unit of an Annex-B stream; pData points past the start code.
+*/
+struct NalUnit
+{
+    const uint8_t *pData;
+    size_t nSize;
+};
+
+enum H264NalType
+{
+    H264_NAL_SLICE = 1,
+    H264_NAL_IDR = 5,
+    H264_NAL_SEI = 6,
+    H264_NAL_SPS = 7,
+    H264_NAL_PPS = 8,
+    H264_NAL_AUD = 9,
+};
+
+enum HevcNalType
+{
+    HEVC_NAL_BLA_W_LP = 16,
+    HEVC_NAL_CRA = 21,
+    HEVC_NAL_VPS = 32,
+    HEVC_NAL_SPS = 33,
+    HEVC_NAL_PPS = 34,
+    HEVC_NAL_AUD = 35,
+};
+
+enum NalCodec
+{
+    NAL_CODEC_H264,
+    NAL_CODEC_HEVC,
+};
+
+enum NalSliceType
+{
+    NAL_SLICE_UNKNOWN = -1,
+    NAL_SLICE_P = 0,
+    NAL_SLICE_B = 1,
+    NAL_SLICE_I = 2,
+};
+
+inline int GetH264NalType(const NalUnit &nal)
+{
+    return nal.nSize ? nal.pData[0] & 0x1F : 0;
+}
+
+inline int GetHevcNalType(const NalUnit &nal)
+{
+    return nal.nSize ? (nal.pData[0] >> 1) & 0x3F : 0;
+}
+
+/**
+*  @brief Returns the first 00 00 01 start code in [p, pEnd), or pEnd. Byte by byte; see
+*  FindStartCode() for the SIMD versions.
+*/
+inline const uint8_t *FindStartCodeScalar(const uint8_t *p, const uint8_t *pEnd)
+{
+    for (; p + 3 <= pEnd; p++)
+    {
+        if (p[2] > 1)
+        {
+            // none of the next two positions can start a start code either
+            p += 2;
+        }
+        else if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+        {
+            return p;
+        }
+    }
+    return pEnd;
+}
+
+inline int CountTrailingZeros(uint32_t n)
+{
+#if defined(_MSC_VER)
+    unsigned long i;
+    _BitScanForward(&i, n);
+    return (int)i;
+#else
+    return __builtin_ctz(n);
+#endif
+}
+
+/**
+*  @brief Checks the positions in nMask, where a 00 00 pair starts at p + i, for the 01 that
+*  completes a start code. p + 32 + 2 must be inside the buffer.
+*/
+inline const uint8_t *MatchStartCode(const uint8_t *p, uint32_t nMask)
+{
+    while (nMask)
+    {
+        int i = CountTrailingZeros(nMask);
+        if (p[i + 2] == 1)
+        {
+            return p + i;
+        }
+        nMask &= nMask - 1;
+    }
+    return NULL;
+}
+
+#ifdef CPU_HAS_SSE2
+/**
+*  @brief FindStartCodeScalar() 32 bytes at a time: one compare finds the zero bytes of two
+*  overlapping loads, and only the rare 00 00 pairs are looked at one by one.
+*/
+inline const uint8_t *FindStartCodeSse2(const uint8_t *p, const uint8_t *pEnd)
+{
+    const __m128i vZero = _mm_setzero_si128();
+    for (; pEnd - p >= 34; p += 32)
+    {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)p), v1 = _mm_loadu_si128((const __m128i *)(p + 16));
+        __m128i w0 = _mm_loadu_si128((const __m128i *)(p + 1)), w1 = _mm_loadu_si128((const __m128i *)(p + 17));
+        uint32_t nMask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(v0, vZero), _mm_cmpeq_epi8(w0, vZero)))
+            | (uint32_t)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(v1, vZero), _mm_cmpeq_epi8(w1, vZero))) << 16;
+        const uint8_t *pStartCode = nMask ? MatchStartCode(p, nMask) : NULL;
+        if (pStartCode)
+        {
+            return pStartCode;
+        }
+    }
+    return FindStartCodeScalar(p, pEnd);
+}
+#endif
+
+#ifdef CPU_HAS_AVX2_TARGET
+CPU_TARGET_AVX2 inline const uint8_t *FindStartCodeAvx2(const uint8_t *p, const uint8_t *pEnd)
+{
+    const __m256i vZero = _mm256_setzero_si256();
+    for (; pEnd - p >= 66; p += 64)
+    {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)p), v1 = _mm256_loadu_si256((const __m256i *)(p + 32));
+        __m256i w0 = _mm256_loadu_si256((const __m256i *)(p + 1)), w1 = _mm256_loadu_si256((const __m256i *)(p + 33));
+        __m256i vPair0 = _mm256_and_si256(_mm256_cmpeq_epi8(v0, vZero), _mm256_cmpeq_epi8(w0, vZero));
+        __m256i vPair1 = _mm256_and_si256(_mm256_cmpeq_epi8(v1, vZero), _mm256_cmpeq_epi8(w1, vZero));
+        if (_mm256_testz_si256(_mm256_or_si256(vPair0, vPair1), _mm256_or_si256(vPair0, vPair1)))
+        {
+            continue;
+        }
+        const uint8_t *pStartCode = MatchStartCode(p, (uint32_t)_mm256_movemask_epi8(vPair0));
+        if (!pStartCode)
+        {
+            pStartCode = MatchStartCode(p + 32, (uint32_t)_mm256_movemask_epi8(vPair1));
+        }
+        if (pStartCode)
+        {
+            return pStartCode;
+        }
+    }
+    return FindStartCodeScalar(p, pEnd);
+}
+#endif
+
+/**
+*  @brief Returns the first 00 00 01 start code in [p, pEnd), or pEnd, with AVX2 where the
+*  CPU has it and SSE2 otherwise.
+*/
+inline const uint8_t *FindStartCode(const uint8_t *p, const uint8_t *pEnd)
+{
+#ifdef CPU_HAS_AVX2_TARGET
+    static const bool bAvx2 = CpuHasAvx2();
+    if (bAvx2)
+    {
+        return FindStartCodeAvx2(p, pEnd);
+    }
+#endif
+#ifdef CPU_HAS_SSE2
+    return FindStartCodeSse2(p, pEnd);
+#else
+    return FindStartCodeScalar(p, pEnd);
+#endif
+}
+
+/**
+*  @brief Splits an Annex-B buffer into NAL units. Trailing zero bytes (including
+*  the leading zero of 4-byte start codes) are not part of the returned units.
+*/
+inline void SplitAnnexB(const uint8_t *pData, size_t nSize, std::vector<NalUnit> &vNal)
+{
+    vNal.clear();
+    const uint8_t *pEnd = pData + nSize;
+    const uint8_t *p = FindStartCode(pData, pEnd);
+    while (p < pEnd)
+    {
+        const uint8_t *pNal = p + 3;
+        const uint8_t *pNext = FindStartCode(pNal, pEnd);
+        const uint8_t *pNalEnd = pNext;
+        while (pNalEnd > pNal && pNalEnd[-1] == 0)
+        {
+            pNalEnd--;
+        }
+        if (pNalEnd > pNal)
+        {
+            vNal.push_back(NalUnit{ pNal, (size_t)(pNalEnd - pNal) });
+        }
+        p = pNext;
+    }
+}
+
+/**
+*  @brief True if the access unit contains an IDR slice.
+*/
+inline bool IsH264KeyFrame(const uint8_t *pData, size_t nSize)
+{
+    const uint8_t *pEnd = pData + nSize;
+    for (const uint8_t *p = FindStartCode(pData, pEnd); p < pEnd; p = FindStartCode(p + 3, pEnd))
+    {
+        if (p + 3 < pEnd && (p[3] & 0x1F) == H264_NAL_IDR)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+*  @brief True if the HEVC access unit contains an IRAP picture (BLA, IDR or CRA, NAL types 16-21).
+*/
+inline bool IsHevcKeyFrame(const uint8_t *pData, size_t nSize)
+{
+    const uint8_t *pEnd = pData + nSize;
+    for (const uint8_t *p = FindStartCode(pData, pEnd); p < pEnd; p = FindStartCode(p + 3, pEnd))
+    {
+        if (p + 3 < pEnd)
+        {
+            int nType = (p[3] >> 1) & 0x3F;
+            if (nType >= 16 && nType <= 21)
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+*  @brief Removes the emulation prevention bytes (00 00 03) of a NAL unit.
+*/
+inline void NalToRbsp(const uint8_t *pData, size_t nSize, std::vector<uint8_t> &vRbsp)
+{
+    vRbsp.clear();
+    vRbsp.reserve(nSize);
+    int nZeros = 0;
+    for (size_t i = 0; i < nSize; i++)
+    {
+        if (nZeros >= 2 && pData[i] == 3)
+        {
+            nZeros = 0;
+            continue;
+        }
+        nZeros = pData[i] ? 0 : nZeros + 1;
+        vRbsp.push_back(pData[i]);
+    }
+}
+
+/**
+*  @brief Reads the Exp-Golomb coded fields at the start of a slice header or parameter set.
+*/
+class NalBitReader
+{
+public:
+    /** Strips the emulation prevention bytes of the first bytes of the NAL unit, past its header */
+    NalBitReader(const NalUnit &nal, size_t nHeaderBytes)
+    {
+        int nZeros = 0;
+        for (size_t i = nHeaderBytes; i < nal.nSize && nSize < sizeof(aData); i++)
+        {
+            if (nZeros >= 2 && nal.pData[i] == 3)
+            {
+                nZeros = 0;
+                continue;
+            }
+            nZeros = nal.pData[i] ? 0 : nZeros + 1;
+            aData[nSize++] = nal.pData[i];
+        }
+    }
+
+    /** Returns -1 past the end of the bytes read */
+    int ReadBit()
+    {
+        if (iBit >= nSize * 8)
+        {
+            bOverrun = true;
+            return -1;
+        }
+        int nBit = (aData[iBit / 8] >> (7 - iBit % 8)) & 1;
+        iBit++;
+        return nBit;
+    }
+
+    /** ue(v); -1 if it does not fit */
+    int ReadUe()
+    {
+        int nLeadingZeros = 0, nBit;
+        while ((nBit = ReadBit()) == 0)
+        {
+            if (++nLeadingZeros > 30)
+            {
+                return -1;
+            }
+        }
+        if (nBit < 0)
+        {
+            return -1;
+        }
+        int nValue = 0;
+        for (int i = 0; i < nLeadingZeros; i++)
+        {
+            if ((nBit = ReadBit()) < 0)
+            {
+                return -1;
+            }
+            nValue = nValue << 1 | nBit;
+        }
+        return (1 << nLeadingZeros) - 1 + nValue;
+    }
+
+    /** se(v); 0 if it does not fit */
+    int ReadSe()
+    {
+        int nValue = ReadUe();
+        if (nValue < 0)
+        {
+            return 0;
+        }
+        return nValue & 1 ? (nValue + 1) / 2 : -(nValue / 2);
+    }
+
+    /** u(n) for n up to 31; -1 past the end */
+    int ReadBits(int nBits)
+    {
+        int nValue = 0;
+        for (int i = 0; i < nBits; i++)
+        {
+            int nBit = ReadBit();
+            if (nBit < 0)
+            {
+                return -1;
+            }
+            nValue = nValue << 1 | nBit;
+        }
+        return nValue;
+    }
+
+    /** True once a read went past the bytes kept, after which the values read are not valid */
+    bool IsOverrun() const { return bOverrun; }
+
+private:
+    uint8_t aData[32];
+    size_t nSize = 0, iBit = 0;
+    bool bOverrun = false;
+};
+
+/**
+*  @brief Picture size of a H.264 SPS after cropping. False if the SPS uses scaling matrices,
+*  which NVENC does not write and which would not fit the bytes NalBitReader keeps.
+*/
+inline bool GetH264SpsSize(const NalUnit &sps, int *pnWidth, int *pnHeight)
+{
+    NalBitReader reader(sps, 1);
+    int nProfile = reader.ReadBits(8);
+    reader.ReadBits(16);                    // constraint flags, level_idc
+    reader.ReadUe();                        // seq_parameter_set_id
+    int nChromaFormat = 1;
+    bool bSeparateColourPlanes = false;
+    static const int aHighProfile[] = { 100, 110, 122, 244, 44, 83, 86, 118, 128, 138, 139, 134, 135 };
+    bool bHighProfile = false;
+    for (int n : aHighProfile)
+    {
+        bHighProfile |= n == nProfile;
+    }
+    if (bHighProfile)
+    {
+        nChromaFormat = reader.ReadUe();
+        if (nChromaFormat == 3)
+        {
+            bSeparateColourPlanes = reader.ReadBit() == 1;
+        }
+        reader.ReadUe();                    // bit_depth_luma_minus8
+        reader.ReadUe();                    // bit_depth_chroma_minus8
+        reader.ReadBit();                   // qpprime_y_zero_transform_bypass_flag
+        if (reader.ReadBit() != 0)          // seq_scaling_matrix_present_flag
+        {
+            return false;
+        }
+    }
+    reader.ReadUe();                        // log2_max_frame_num_minus4
+    int nPocType = reader.ReadUe();
+    if (nPocType == 0)
+    {
+        reader.ReadUe();                    // log2_max_pic_order_cnt_lsb_minus4
+    }
+    else if (nPocType == 1)
+    {
+        reader.ReadBit();                   // delta_pic_order_always_zero_flag
+        reader.ReadSe();                    // offset_for_non_ref_pic
+        reader.ReadSe();                    // offset_for_top_to_bottom_field
+        int nCycle = reader.ReadUe();
+        for (int i = 0; i < nCycle && !reader.IsOverrun(); i++)
+        {
+            reader.ReadSe();
+        }
+    }
+    reader.ReadUe();                        // max_num_ref_frames
+    reader.ReadBit();                       // gaps_in_frame_num_value_allowed_flag
+    int nWidthInMbs = reader.ReadUe() + 1, nHeightInMapUnits = reader.ReadUe() + 1;
+    int nFrameMbsOnly = reader.ReadBit();
+    if (nFrameMbsOnly == 0)
+    {
+        reader.ReadBit();                   // mb_adaptive_frame_field_flag
+    }
+    reader.ReadBit();                       // direct_8x8_inference_flag
+    int aCrop[4] = {};
+    if (reader.ReadBit() == 1)
+    {
+        for (int &nCrop : aCrop)
+        {
+            nCrop = reader.ReadUe();
+        }
+    }
+    if (reader.IsOverrun())
+    {
+        return false;
+    }
+    int nFieldFactor = 2 - nFrameMbsOnly;
+    int nCropUnitX = 1, nCropUnitY = nFieldFactor;
+    if (nChromaFormat != 0 && !bSeparateColourPlanes)
+    {
+        nCropUnitX = nChromaFormat == 3 ? 1 : 2;
+        nCropUnitY *= nChromaFormat == 1 ? 2 : 1;
+    }
+    *pnWidth = nWidthInMbs * 16 - nCropUnitX * (aCrop[0] + aCrop[1]);
+    *pnHeight = nFieldFactor * nHeightInMapUnits * 16 - nCropUnitY * (aCrop[2] + aCrop[3]);
+    return *pnWidth > 0 && *pnHeight > 0;
+}
+
+/**
+*  @brief What a muxer, segmenter or ring buffer needs to know about an access unit.
+*/
+struct NalPacketInfo
+{
+    /** IDR (H.264) or IRAP (HEVC) picture: decoding can start here */
+    bool bKeyFrame = false;
+    /** Carries an SPS, which the encoder emits together with the PPS (and the VPS) */
+    bool bParameterSets = false;
+    /** Of the first slice; NAL_SLICE_UNKNOWN without a slice or when its header cannot be read */
+    int eSliceType = NAL_SLICE_UNKNOWN;
+    int nNalUnits = 0;
+    int nSlices = 0;
+};
+
+/**
+*  @brief Slice type of a H.264 slice NAL unit: slice_type follows first_mb_in_slice.
+*/
+inline int GetH264SliceType(const NalUnit &nal)
+{
+    NalBitReader reader(nal, 1);
+    if (reader.ReadUe() < 0)
+    {
+        return NAL_SLICE_UNKNOWN;
+    }
+    int nSliceType = reader.ReadUe();
+    if (nSliceType < 0)
+    {
+        return NAL_SLICE_UNKNOWN;
+    }
+    // 5-9 say that all slices of the picture have this type; SP and SI count as P and I
+    static const int aType[5] = { NAL_SLICE_P, NAL_SLICE_B, NAL_SLICE_I, NAL_SLICE_P, NAL_SLICE_I };
+    return aType[nSliceType % 5];
+}
+
+/**
+*  @brief Slice type of the first slice segment of a HEVC picture. The fields before
+*  slice_type depend on the PPS only through num_extra_slice_header_bits, taken as 0 as
+*  NVENC writes it; a segment that does not start the picture is not read.
+*/
+inline int GetHevcSliceType(const NalUnit &nal)
+{
+    int nNalType = GetHevcNalType(nal);
+    NalBitReader reader(nal, 2);
+    if (reader.ReadBit() != 1)
+    {
+        return NAL_SLICE_UNKNOWN;
+    }
+    if (nNalType >= HEVC_NAL_BLA_W_LP && nNalType <= 23 && reader.ReadBit() < 0)
+    {
+        return NAL_SLICE_UNKNOWN;
+    }
+    if (reader.ReadUe() < 0)
+    {
+        return NAL_SLICE_UNKNOWN;
+    }
+    switch (reader.ReadUe())
+    {
+    case 0: return NAL_SLICE_B;
+    case 1: return NAL_SLICE_P;
+    case 2: return NAL_SLICE_I;
+    default: return NAL_SLICE_UNKNOWN;
+    }
+}
+
+/**
+*  @brief Describes an Annex-B access unit in one pass over its start codes, without copying
+*  or allocating.
+*/
+inline void DescribePacket(const uint8_t *pData, size_t nSize, NalCodec eCodec, NalPacketInfo *pInfo)
+{
+    *pInfo = NalPacketInfo();
+    const uint8_t *pEnd = pData + nSize;
+    const uint8_t *p = FindStartCode(pData, pEnd);
+    while (p < pEnd)
+    {
+        const uint8_t *pNal = p + 3;
+        const uint8_t *pNext = FindStartCode(pNal, pEnd);
+        NalUnit nal = { pNal, (size_t)(pNext - pNal) };
+        p = pNext;
+        if (!nal.nSize)
+        {
+            continue;
+        }
+        pInfo->nNalUnits++;
+        bool bSlice;
+        if (eCodec == NAL_CODEC_HEVC)
+        {
+            int nType = GetHevcNalType(nal);
+            bSlice = nType < HEVC_NAL_VPS;
+            pInfo->bKeyFrame |= nType >= HEVC_NAL_BLA_W_LP && nType <= HEVC_NAL_CRA;
+            pInfo->bParameterSets |= nType == HEVC_NAL_SPS;
+            if (bSlice && !pInfo->nSlices)
+            {
+                pInfo->eSliceType = GetHevcSliceType(nal);
+            }
+        }
+        else
+        {
+            int nType = GetH264NalType(nal);
+            bSlice = nType >= H264_NAL_SLICE && nType <= H264_NAL_IDR;
+            pInfo->bKeyFrame |= nType == H264_NAL_IDR;
+            pInfo->bParameterSets |= nType == H264_NAL_SPS;
+            if (bSlice && !pInfo->nSlices)
+            {
+                pInfo->eSliceType = GetH264SliceType(nal);
+            }
+        }
+        pInfo->nSlices += bSlice;
+    }
+}
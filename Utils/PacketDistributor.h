@@ -0,0 +1,229 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Logger.h"
+#include "../Queue.h"
+
+extern simplelogger::Logger *logger;
+
+/**
+*  @brief One encoded access unit. Packets are immutable once handed to the
+*  distributor and shared by every sink through EncodedPacketPtr.
+*/
+struct EncodedPacket
+{
+    std::vector<uint8_t> vData;
+    /** Presentation time in microseconds since the start of the recording */
+    int64_t nTimestampUs = 0;
+    /** Wall clock capture time in microseconds, for latency measurement */
+    int64_t nCaptureTimeUs = 0;
+    bool bKeyFrame = false;
+};
+
+typedef std::shared_ptr<const EncodedPacket> EncodedPacketPtr;
+
+class PacketSink
+{
+public:
+    virtual ~PacketSink() {}
+    /** The sink may keep pPacket for as long as it needs the payload */
+    virtual void Write(const EncodedPacketPtr &pPacket) = 0;
+    /** Called on the sink thread after the last packet */
+    virtual void Close() {}
+    /** Polled by the encoding thread; true asks for an IDR on the next frame */
+    virtual bool IsKeyFrameWanted() { return false; }
+};
+
+enum PacketDropPolicy
+{
+    /** Never drop; a full queue blocks Deliver(). For the recording itself. */
+    PACKET_DROP_NEVER,
+    /** A full queue drops the packet and everything up to the next key frame, and asks the encoder for one. For live sinks. */
+    PACKET_DROP_TO_KEYFRAME,
+};
+
+/**
+*  @brief Fans encoded packets out to any number of sinks. Every sink has its own
+*  bounded queue, drop policy and thread, so a sink that falls behind only affects
+*  itself (unless its policy is PACKET_DROP_NEVER). Payloads are shared, not copied.
+*/
+class PacketDistributor
+{
+public:
+    ~PacketDistributor()
+    {
+        Close();
+    }
+
+    /**
+    *  @brief Takes ownership of pSink and starts its thread.
+    */
+    void AddSink(PacketSink *pSink, const char *szName, size_t nQueuePackets, PacketDropPolicy ePolicy)
+    {
+        SinkContext *pContext = new SinkContext(pSink, szName, nQueuePackets, ePolicy);
+        pContext->thSink = std::thread(&PacketDistributor::Run, pContext);
+        vSink.push_back(std::unique_ptr<SinkContext>(pContext));
+    }
+
+    /**
+    *  @brief Lets the sinks be added on another thread while the encoder already starts:
+    *  until Open() is called, Deliver() waits and IsKeyFrameWanted() is false.
+    */
+    void Hold()
+    {
+        bHeld = true;
+    }
+
+    void Open()
+    {
+        std::lock_guard<std::mutex> lock(mtxHold);
+        bHeld = false;
+        cvHold.notify_all();
+    }
+
+    void Deliver(const EncodedPacketPtr &pPacket)
+    {
+        if (bHeld)
+        {
+            std::unique_lock<std::mutex> lock(mtxHold);
+            cvHold.wait(lock, [this] { return !bHeld; });
+        }
+        for (auto &pContext : vSink)
+        {
+            if (pContext->ePolicy == PACKET_DROP_NEVER)
+            {
+                pContext->nQueuedBytes += pPacket->vData.size();
+                pContext->qPacket.push(pPacket);
+                continue;
+            }
+            if (pContext->bWaitKeyFrame && !pPacket->bKeyFrame)
+            {
+                pContext->nDropped++;
+                continue;
+            }
+            pContext->nQueuedBytes += pPacket->vData.size();
+            pContext->bWaitKeyFrame = !pContext->qPacket.try_push(pPacket);
+            if (pContext->bWaitKeyFrame)
+            {
+                pContext->nQueuedBytes -= pPacket->vData.size();
+                pContext->nDropped++;
+            }
+        }
+    }
+
+    /**
+    *  @brief True if any sink wants the next frame to be an IDR, either on its own
+    *  (e.g. a segment boundary) or because it dropped packets and waits to resync.
+    */
+    bool IsKeyFrameWanted()
+    {
+        if (bHeld)
+        {
+            return false;
+        }
+        for (auto &pContext : vSink)
+        {
+            if (pContext->bWaitKeyFrame || pContext->pSink->IsKeyFrameWanted())
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+    *  @brief Encoded bytes delivered to the slowest sink and not yet written by it.
+    */
+    int64_t GetBacklogBytes()
+    {
+        if (bHeld)
+        {
+            return 0;
+        }
+        int64_t nMax = 0;
+        for (auto &pContext : vSink)
+        {
+            int64_t n = pContext->nQueuedBytes;
+            nMax = n > nMax ? n : nMax;
+        }
+        return nMax;
+    }
+
+    /**
+    *  @brief Lets every sink drain its queue, closes the sinks and joins their threads.
+    */
+    void Close()
+    {
+        for (auto &pContext : vSink)
+        {
+            pContext->qPacket.close();
+        }
+        for (auto &pContext : vSink)
+        {
+            pContext->thSink.join();
+            if (pContext->nDropped)
+            {
+                LOG(WARNING) << "Sink " << pContext->strName << " dropped " << pContext->nDropped << " packets";
+            }
+        }
+        vSink.clear();
+    }
+
+private:
+    struct SinkContext
+    {
+        SinkContext(PacketSink *pSink, const char *szName, size_t nQueuePackets, PacketDropPolicy ePolicy)
+            : pSink(pSink), strName(szName), ePolicy(ePolicy), qPacket(nQueuePackets) {}
+
+        std::unique_ptr<PacketSink> pSink;
+        std::string strName;
+        PacketDropPolicy ePolicy;
+        BoundedQueue<EncodedPacketPtr> qPacket;
+        std::atomic<bool> bWaitKeyFrame{false};
+        std::atomic<uint64_t> nDropped{0};
+        /** Counted from Deliver() until Write() returns */
+        std::atomic<int64_t> nQueuedBytes{0};
+        std::thread thSink;
+    };
+
+    static void Run(SinkContext *pContext)
+    {
+        EncodedPacketPtr pPacket;
+        try
+        {
+            while (pContext->qPacket.pop(pPacket))
+            {
+                pContext->pSink->Write(pPacket);
+                pContext->nQueuedBytes -= pPacket->vData.size();
+                pPacket.reset();
+            }
+            pContext->pSink->Close();
+        }
+        catch (const std::exception &ex)
+        {
+            // a failed sink stops consuming; keep draining so Deliver() never blocks on it
+            LOG(ERROR) << "Sink " << pContext->strName << " failed: " << ex.what();
+            if (pPacket)
+            {
+                pContext->nQueuedBytes -= pPacket->vData.size();
+            }
+            while (pContext->qPacket.pop(pPacket))
+            {
+                pContext->nQueuedBytes -= pPacket->vData.size();
+                pContext->nDropped++;
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<SinkContext>> vSink;
+    std::atomic<bool> bHeld{false};
+    std::mutex mtxHold;
+    std::condition_variable cvHold;
+};
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include "PacketDistributor.h"
+#include "Mp4Writer.h"
+#include "SegmentWriter.h"
+#include "SeekIndex.h"
+#include "RtpStreamer.h"
+
+/**
+*  PacketSink adapters for the recorder outputs. Each runs on its distributor thread.
+*/
+
+/**
+*  @brief Raw Annex-B elementary stream of codec eCodec, with a seek index next to it unless
+*  bIndex is false.
+*/
+class FilePacketSink : public PacketSink
+{
+public:
+    FilePacketSink(const std::string &strPath, bool bIndex = true, NalCodec eCodec = NAL_CODEC_H264)
+    {
+        fpOut.open(strPath, std::ios::out | std::ios::binary);
+        if (!fpOut)
+        {
+            throw std::invalid_argument("Unable to open output file: " + strPath);
+        }
+        if (bIndex)
+        {
+            pIndex.reset(new SeekIndexWriter(GetSeekIndexPath(strPath), eCodec));
+        }
+    }
+    void Write(const EncodedPacketPtr &pPacket)
+    {
+        fpOut.write(reinterpret_cast<const char *>(pPacket->vData.data()), pPacket->vData.size());
+        if (pIndex)
+        {
+            // after the frame, so that the index never points past the data
+            pIndex->Append(pPacket->vData.data(), pPacket->vData.size(), pPacket->nTimestampUs);
+        }
+    }
+    void Close()
+    {
+        fpOut.close();
+        if (pIndex)
+        {
+            pIndex->Close();
+        }
+    }
+
+private:
+    std::ofstream fpOut;
+    std::unique_ptr<SeekIndexWriter> pIndex;
+};
+
+class Mp4PacketSink : public PacketSink
+{
+public:
+    Mp4PacketSink(const std::string &strPath, int nWidth, int nHeight, const std::vector<uint8_t> &vSeqParams, const Mp4WriterOptions &options)
+        : writer(strPath, nWidth, nHeight, vSeqParams, options) {}
+    void Write(const EncodedPacketPtr &pPacket)
+    {
+        writer.WritePacket(pPacket->vData, pPacket->nTimestampUs);
+    }
+    void Close()
+    {
+        writer.Close();
+    }
+
+private:
+    Mp4Writer writer;
+};
+
+/**
+*  @brief Segmented recording; asks for an IDR once the current segment is due.
+*/
+class SegmentPacketSink : public PacketSink
+{
+public:
+    SegmentPacketSink(const std::string &strPath, int nWidth, int nHeight, const std::vector<uint8_t> &vSeqParams, const SegmentOptions &options,
+        NalCodec eCodec = NAL_CODEC_H264)
+        : writer(strPath, nWidth, nHeight, vSeqParams, options, eCodec) {}
+    void Write(const EncodedPacketPtr &pPacket)
+    {
+        writer.WritePacket(pPacket->vData, pPacket->nTimestampUs, pPacket->bKeyFrame);
+    }
+    void Close()
+    {
+        writer.Close();
+    }
+    bool IsKeyFrameWanted()
+    {
+        return writer.IsRolloverDue();
+    }
+
+private:
+    SegmentWriter writer;
+};
+
+/**
+*  @brief RTP live preview; the distributor queue replaces the sender's own, so packets are sent without a copy.
+*/
+class RtpPacketSink : public PacketSink
+{
+public:
+    RtpPacketSink(const std::string &strHost, unsigned short uPort, const RtpSenderOptions &options)
+        : sender(strHost, uPort, options) {}
+    void Write(const EncodedPacketPtr &pPacket)
+    {
+        sender.SendNow(pPacket->vData.data(), pPacket->vData.size(), pPacket->nTimestampUs, pPacket->nCaptureTimeUs);
+    }
+
+private:
+    RtpSender sender;
+};
@@ -0,0 +1,317 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <stdexcept>
+#include <algorithm>
+
+/**
+* @brief Writer for H.264 RBSP syntax elements (u(n), ue(v), se(v)).
+*/
+class H264BitWriter {
+public:
+    void PutBits(uint32_t nValue, int nBits) {
+        for (int i = nBits - 1; i >= 0; i--) {
+            PutBit((nValue >> i) & 1);
+        }
+    }
+    void PutBit(int b) {
+        nCurrent = (uint8_t)((nCurrent << 1) | (b & 1));
+        if (++nBitsInCurrent == 8) {
+            vRbsp.push_back(nCurrent);
+            nCurrent = 0;
+            nBitsInCurrent = 0;
+        }
+    }
+    void PutUe(uint32_t nValue) {
+        uint32_t v = nValue + 1;
+        int nLen = 0;
+        while ((v >> nLen) > 1) {
+            nLen++;
+        }
+        PutBits(0, nLen);
+        PutBits(v, nLen + 1);
+    }
+    void PutSe(int32_t nValue) {
+        PutUe(nValue <= 0 ? (uint32_t)(-2 * nValue) : (uint32_t)(2 * nValue - 1));
+    }
+    bool IsByteAligned() const {
+        return nBitsInCurrent == 0;
+    }
+    void AlignZero() {
+        while (!IsByteAligned()) {
+            PutBit(0);
+        }
+    }
+    // Appends whole bytes; the writer must be byte aligned.
+    void PutBytes(const uint8_t *p, size_t n) {
+        vRbsp.insert(vRbsp.end(), p, p + n);
+    }
+    void TrailingBits() {
+        PutBit(1);
+        AlignZero();
+    }
+    /**
+    *  @brief Appends the NAL unit (start code, header, escaped payload) to vOut and resets the writer.
+    */
+    void FlushNal(int nRefIdc, int nType, std::vector<uint8_t> &vOut) {
+        static const uint8_t aStartCode[] = {0, 0, 0, 1};
+        vOut.insert(vOut.end(), aStartCode, aStartCode + 4);
+        vOut.push_back((uint8_t)((nRefIdc << 5) | nType));
+        int nZeros = 0;
+        for (uint8_t b : vRbsp) {
+            if (nZeros == 2 && b <= 3) {
+                vOut.push_back(3);
+                nZeros = 0;
+            }
+            vOut.push_back(b);
+            nZeros = b ? 0 : nZeros + 1;
+        }
+        vRbsp.clear();
+    }
+
+private:
+    std::vector<uint8_t> vRbsp;
+    uint8_t nCurrent = 0;
+    int nBitsInCurrent = 0;
+};
+
+/**
+* @brief CPU-only H.264 encoder for screen content, used where no NVENC device exists.
+* Every macroblock is either sent uncompressed (I_PCM) or skipped when it is
+* identical to the previous frame, so the output is lossless, decodable by any
+* baseline decoder and costs nothing but memory bandwidth for static content.
+* The interface mirrors NvEncoder: one EncodeFrame() call per NV12 input frame
+* returns the Annex-B packets for that frame.
+*/
+class PcmH264Encoder {
+public:
+    PcmH264Encoder(int nWidth, int nHeight, int nGopLength = 0)
+        : nWidth(nWidth), nHeight(nHeight), nGopLength(nGopLength) {
+        if (nWidth <= 0 || nHeight <= 0 || (nWidth & 1) || (nHeight & 1)) {
+            throw std::invalid_argument("PcmH264Encoder: width and height must be positive and even");
+        }
+        nMbWidth = (nWidth + 15) / 16;
+        nMbHeight = (nHeight + 15) / 16;
+        nPaddedWidth = nMbWidth * 16;
+        nPaddedHeight = nMbHeight * 16;
+        vReference.resize(nPaddedWidth * nPaddedHeight * 3 / 2);
+        vCurrent.resize(vReference.size());
+    }
+
+    int GetWidth() const { return nWidth; }
+    int GetHeight() const { return nHeight; }
+    int GetFrameSize() const { return nWidth * nHeight * 3 / 2; }
+
+    /**
+    *  @brief Makes the next encoded frame an IDR frame.
+    */
+    void ForceIdr() {
+        bForceIdr = true;
+    }
+
+    /**
+    *  @brief Returns the SPS and PPS NAL units in Annex-B format.
+    */
+    void GetSequenceParams(std::vector<uint8_t> &seqParams) {
+        seqParams.clear();
+        WriteSps(seqParams);
+        WritePps(seqParams);
+    }
+
+    /**
+    *  @brief Encodes one NV12 frame (Y plane followed by interleaved UV; nPitch 0 means nWidth).
+    *  vPacket receives one packet per frame, including SPS/PPS on IDR frames.
+    */
+    void EncodeFrame(const uint8_t *pNv12, int nPitch, std::vector<std::vector<uint8_t>> &vPacket, bool *pbKeyFrame = NULL) {
+        if (nPitch == 0) {
+            nPitch = nWidth;
+        }
+        LoadPadded(pNv12, nPitch);
+        bool bIdr = bForceIdr || nFrame == 0 || (nGopLength > 0 && nFrameInGop >= nGopLength);
+        vPacket.resize(1);
+        std::vector<uint8_t> &vOut = vPacket[0];
+        vOut.clear();
+        if (bIdr) {
+            WriteSps(vOut);
+            WritePps(vOut);
+            nFrameNum = 0;
+            nFrameInGop = 0;
+            bForceIdr = false;
+        }
+        WriteSlice(bIdr, vOut);
+        vReference.swap(vCurrent);
+        nFrameNum = (nFrameNum + 1) & 0xFFFF;
+        nFrameInGop++;
+        nFrame++;
+        if (pbKeyFrame) {
+            *pbKeyFrame = bIdr;
+        }
+    }
+
+    /**
+    *  @brief Nothing is buffered, so flushing returns no packets.
+    */
+    void EndEncode(std::vector<std::vector<uint8_t>> &vPacket) {
+        vPacket.clear();
+    }
+
+private:
+    void LoadPadded(const uint8_t *pNv12, int nPitch) {
+        uint8_t *pY = vCurrent.data(), *pUV = pY + nPaddedWidth * nPaddedHeight;
+        const uint8_t *pSrcUV = pNv12 + nPitch * nHeight;
+        for (int y = 0; y < nPaddedHeight; y++) {
+            const uint8_t *pSrc = pNv12 + std::min(y, nHeight - 1) * nPitch;
+            memcpy(pY + y * nPaddedWidth, pSrc, nWidth);
+            memset(pY + y * nPaddedWidth + nWidth, pSrc[nWidth - 1], nPaddedWidth - nWidth);
+        }
+        for (int y = 0; y < nPaddedHeight / 2; y++) {
+            const uint8_t *pSrc = pSrcUV + std::min(y, nHeight / 2 - 1) * nPitch;
+            uint8_t *pDst = pUV + y * nPaddedWidth;
+            memcpy(pDst, pSrc, nWidth);
+            for (int x = nWidth; x < nPaddedWidth; x += 2) {
+                pDst[x] = pSrc[nWidth - 2];
+                pDst[x + 1] = pSrc[nWidth - 1];
+            }
+        }
+    }
+
+    bool IsMbStatic(int mbx, int mby) const {
+        const uint8_t *pCur = vCurrent.data(), *pRef = vReference.data();
+        for (int y = 0; y < 16; y++) {
+            size_t k = (mby * 16 + y) * nPaddedWidth + mbx * 16;
+            if (memcmp(pCur + k, pRef + k, 16)) {
+                return false;
+            }
+        }
+        size_t nUVOffset = nPaddedWidth * nPaddedHeight;
+        for (int y = 0; y < 8; y++) {
+            size_t k = nUVOffset + (mby * 8 + y) * nPaddedWidth + mbx * 16;
+            if (memcmp(pCur + k, pRef + k, 16)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void WritePcmMb(int mbx, int mby) {
+        bw.AlignZero();
+        const uint8_t *pY = vCurrent.data(), *pUV = pY + nPaddedWidth * nPaddedHeight;
+        for (int y = 0; y < 16; y++) {
+            bw.PutBytes(pY + (mby * 16 + y) * nPaddedWidth + mbx * 16, 16);
+        }
+        uint8_t aChroma[64];
+        for (int c = 0; c < 2; c++) {
+            for (int y = 0; y < 8; y++) {
+                for (int x = 0; x < 8; x++) {
+                    aChroma[y * 8 + x] = pUV[(mby * 8 + y) * nPaddedWidth + mbx * 16 + x * 2 + c];
+                }
+            }
+            bw.PutBytes(aChroma, 64);
+        }
+    }
+
+    void WriteSps(std::vector<uint8_t> &vOut) {
+        bw.PutBits(66, 8);                  // profile_idc: baseline
+        bw.PutBits(0xC0, 8);                // constraint_set0/1
+        bw.PutBits(51, 8);                  // level_idc
+        bw.PutUe(0);                        // seq_parameter_set_id
+        bw.PutUe(12);                       // log2_max_frame_num_minus4
+        bw.PutUe(2);                        // pic_order_cnt_type
+        bw.PutUe(1);                        // max_num_ref_frames
+        bw.PutBit(0);                       // gaps_in_frame_num_value_allowed_flag
+        bw.PutUe(nMbWidth - 1);
+        bw.PutUe(nMbHeight - 1);
+        bw.PutBit(1);                       // frame_mbs_only_flag
+        bw.PutBit(1);                       // direct_8x8_inference_flag
+        bool bCrop = nPaddedWidth != nWidth || nPaddedHeight != nHeight;
+        bw.PutBit(bCrop);
+        if (bCrop) {
+            bw.PutUe(0);
+            bw.PutUe((nPaddedWidth - nWidth) / 2);
+            bw.PutUe(0);
+            bw.PutUe((nPaddedHeight - nHeight) / 2);
+        }
+        bw.PutBit(0);                       // vui_parameters_present_flag
+        bw.TrailingBits();
+        bw.FlushNal(3, 7, vOut);
+    }
+
+    void WritePps(std::vector<uint8_t> &vOut) {
+        bw.PutUe(0);                        // pic_parameter_set_id
+        bw.PutUe(0);                        // seq_parameter_set_id
+        bw.PutBit(0);                       // entropy_coding_mode_flag: CAVLC
+        bw.PutBit(0);                       // bottom_field_pic_order_in_frame_present_flag
+        bw.PutUe(0);                        // num_slice_groups_minus1
+        bw.PutUe(0);                        // num_ref_idx_l0_default_active_minus1
+        bw.PutUe(0);                        // num_ref_idx_l1_default_active_minus1
+        bw.PutBit(0);                       // weighted_pred_flag
+        bw.PutBits(0, 2);                   // weighted_bipred_idc
+        bw.PutSe(0);                        // pic_init_qp_minus26
+        bw.PutSe(0);                        // pic_init_qs_minus26
+        bw.PutSe(0);                        // chroma_qp_index_offset
+        bw.PutBit(1);                       // deblocking_filter_control_present_flag
+        bw.PutBit(0);                       // constrained_intra_pred_flag
+        bw.PutBit(0);                       // redundant_pic_cnt_present_flag
+        bw.TrailingBits();
+        bw.FlushNal(3, 8, vOut);
+    }
+
+    void WriteSlice(bool bIdr, std::vector<uint8_t> &vOut) {
+        bw.PutUe(0);                        // first_mb_in_slice
+        bw.PutUe(bIdr ? 7 : 5);             // slice_type: I or P, all slices of the picture
+        bw.PutUe(0);                        // pic_parameter_set_id
+        bw.PutBits(nFrameNum, 16);          // frame_num
+        if (bIdr) {
+            bw.PutUe(nIdrPicId);
+            nIdrPicId = (nIdrPicId + 1) & 0xFFFF;
+        } else {
+            bw.PutBit(0);                   // num_ref_idx_active_override_flag
+            bw.PutBit(0);                   // ref_pic_list_modification_flag_l0
+        }
+        if (bIdr) {
+            bw.PutBit(0);                   // no_output_of_prior_pics_flag
+            bw.PutBit(0);                   // long_term_reference_flag
+        } else {
+            bw.PutBit(0);                   // adaptive_ref_pic_marking_mode_flag
+        }
+        bw.PutSe(0);                        // slice_qp_delta
+        bw.PutUe(1);                        // disable_deblocking_filter_idc
+
+        uint32_t nSkipRun = 0;
+        for (int mby = 0; mby < nMbHeight; mby++) {
+            for (int mbx = 0; mbx < nMbWidth; mbx++) {
+                if (bIdr) {
+                    bw.PutUe(25);           // mb_type: I_PCM
+                    WritePcmMb(mbx, mby);
+                    continue;
+                }
+                if (IsMbStatic(mbx, mby)) {
+                    nSkipRun++;
+                    continue;
+                }
+                bw.PutUe(nSkipRun);         // mb_skip_run
+                nSkipRun = 0;
+                bw.PutUe(30);               // mb_type: I_PCM in a P slice
+                WritePcmMb(mbx, mby);
+            }
+        }
+        if (nSkipRun) {
+            bw.PutUe(nSkipRun);
+        }
+        bw.TrailingBits();
+        bw.FlushNal(bIdr ? 3 : 2, bIdr ? 5 : 1, vOut);
+    }
+
+    int nWidth, nHeight;
+    int nMbWidth, nMbHeight, nPaddedWidth, nPaddedHeight;
+    int nGopLength;
+    uint64_t nFrame = 0;
+    int nFrameInGop = 0;
+    uint32_t nFrameNum = 0;
+    uint32_t nIdrPicId = 0;
+    bool bForceIdr = false;
+    std::vector<uint8_t> vReference, vCurrent;
+    H264BitWriter bw;
+};
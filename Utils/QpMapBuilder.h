@@ -0,0 +1,137 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "DirtyRects.h"
+#include "CpuFeatures.h"
+
+struct QpMapOptions
+{
+    /** QP delta of the macroblocks that changed in this frame or in the nHoldFrames before */
+    int nDirtyDelta = -4;
+    /** QP delta of the content the capture reports as moved (scrolled, dragged) */
+    int nMovedDelta = 0;
+    /** QP delta of everything else: the bits go where the screen changes */
+    int nStaticDelta = 2;
+    /** Text that was just typed stays sharp while the encoder refines it over the next frames */
+    int nHoldFrames = 15;
+    /** Maps kept valid at a time; at least NvEncoder::GetEncoderBufferCount() */
+    int nPoolSize = 8;
+    /** Size of the blocks the map has one delta for: 16 (macroblocks) for H.264, the CTB size (32) for HEVC */
+    int nBlockSize = 16;
+    /** Scalar code only, to compare */
+    bool bSimd = true;
+};
+
+/**
+*  @brief Turns the dirty and move rects of each captured frame into the per-macroblock QP
+*  delta map of NV_ENC_PIC_PARAMS::qpDeltaMap (rate control in NV_ENC_QP_MAP_DELTA mode).
+*  NVENC reads the map per macroblock for H.264 and per CTB for HEVC; QpMapOptions::nBlockSize
+*  selects which, and "macroblock" below stands for either.
+*  The rects are rasterized into a macroblock mask, which is combined with the age of every
+*  macroblock since its last change into the map, 16 macroblocks at a time with SSE2.
+*  The maps come from a pool, so one stays valid while the encoder still holds its frame.
+*/
+class QpMapBuilder
+{
+public:
+    QpMapBuilder(int nWidth, int nHeight, const QpMapOptions &options = QpMapOptions())
+        : nWidth(nWidth), nHeight(nHeight), nBlockSize(options.nBlockSize > 0 ? options.nBlockSize : 16),
+        nWidthInMbs((nWidth + nBlockSize - 1) / nBlockSize), nHeightInMbs((nHeight + nBlockSize - 1) / nBlockSize), options(options)
+    {
+        size_t nMbs = (size_t)nWidthInMbs * nHeightInMbs;
+        vMask.resize(nMbs);
+        vAge.assign(nMbs, 0xFF);
+        vvMap.assign(this->options.nPoolSize > 0 ? this->options.nPoolSize : 1, std::vector<int8_t>(nMbs));
+    }
+
+    /**
+    *  @brief Builds the map of one frame into the next buffer of the pool. A full frame change
+    *  (first frame, regions unknown) gets a neutral map.
+    */
+    int8_t *Build(const FrameChanges &changes)
+    {
+        std::vector<int8_t> &vMap = vvMap[iMap];
+        iMap = (iMap + 1) % vvMap.size();
+        if (changes.bFullFrame)
+        {
+            memset(vMap.data(), 0, vMap.size());
+            memset(vAge.data(), 0xFF, vAge.size());
+            return vMap.data();
+        }
+
+        memset(vMask.data(), MB_STATIC, vMask.size());
+        for (uint32_t i = 0; i < changes.nMoveRects; i++)
+        {
+            Rasterize(changes.pMoveRect[i].destination, MB_MOVED);
+        }
+        for (uint32_t i = 0; i < changes.nDirtyRects; i++)
+        {
+            Rasterize(changes.pDirtyRect[i], MB_DIRTY);
+        }
+        Combine(vMap.data());
+        return vMap.data();
+    }
+
+    uint32_t GetMapSize() const { return (uint32_t)vMask.size(); }
+    int GetWidthInMbs() const { return nWidthInMbs; }
+    int GetHeightInMbs() const { return nHeightInMbs; }
+
+private:
+    enum { MB_STATIC = 0, MB_MOVED = 1, MB_DIRTY = 2 };
+
+    /** Every macroblock the rect touches, one memset per macroblock row */
+    void Rasterize(const ScreenRect &rect, uint8_t value)
+    {
+        int x0 = (rect.left > 0 ? rect.left : 0) / nBlockSize, x1 = ((rect.right < nWidth ? rect.right : nWidth) + nBlockSize - 1) / nBlockSize;
+        int y0 = (rect.top > 0 ? rect.top : 0) / nBlockSize, y1 = ((rect.bottom < nHeight ? rect.bottom : nHeight) + nBlockSize - 1) / nBlockSize;
+        for (int y = y0; y < y1 && x0 < x1; y++)
+        {
+            memset(&vMask[(size_t)y * nWidthInMbs + x0], value, x1 - x0);
+        }
+    }
+
+    /** Ages the macroblocks, restarting the changed ones at 0, and picks the delta of each */
+    void Combine(int8_t *pMap)
+    {
+        size_t n = vMask.size(), i = 0;
+        uint8_t nHold = (uint8_t)(options.nHoldFrames < 0 ? 0 : (options.nHoldFrames > 254 ? 254 : options.nHoldFrames));
+#ifdef CPU_HAS_SSE2
+        if (options.bSimd)
+        {
+            const __m128i vOne = _mm_set1_epi8(1), vDirty = _mm_set1_epi8(MB_DIRTY), vMoved = _mm_set1_epi8(MB_MOVED);
+            const __m128i vHold = _mm_set1_epi8((char)nHold);
+            const __m128i vDirtyDelta = _mm_set1_epi8((char)options.nDirtyDelta);
+            const __m128i vMovedDelta = _mm_set1_epi8((char)options.nMovedDelta);
+            const __m128i vStaticDelta = _mm_set1_epi8((char)options.nStaticDelta);
+            for (; i + 16 <= n; i += 16)
+            {
+                __m128i vMb = _mm_loadu_si128((const __m128i *)&vMask[i]);
+                __m128i vIsDirty = _mm_cmpeq_epi8(vMb, vDirty);
+                __m128i vIsMoved = _mm_cmpeq_epi8(vMb, vMoved);
+                __m128i vNewAge = _mm_andnot_si128(vIsDirty, _mm_adds_epu8(_mm_loadu_si128((const __m128i *)&vAge[i]), vOne));
+                _mm_storeu_si128((__m128i *)&vAge[i], vNewAge);
+                // unsigned age <= hold
+                __m128i vRecent = _mm_cmpeq_epi8(_mm_min_epu8(vNewAge, vHold), vNewAge);
+                __m128i vOther = _mm_or_si128(_mm_and_si128(vIsMoved, vMovedDelta), _mm_andnot_si128(vIsMoved, vStaticDelta));
+                _mm_storeu_si128((__m128i *)&pMap[i], _mm_or_si128(_mm_and_si128(vRecent, vDirtyDelta), _mm_andnot_si128(vRecent, vOther)));
+            }
+        }
+#endif
+        for (; i < n; i++)
+        {
+            uint8_t nAge = vMask[i] == MB_DIRTY ? 0 : (vAge[i] == 0xFF ? 0xFF : vAge[i] + 1);
+            vAge[i] = nAge;
+            pMap[i] = (int8_t)(nAge <= nHold ? options.nDirtyDelta : (vMask[i] == MB_MOVED ? options.nMovedDelta : options.nStaticDelta));
+        }
+    }
+
+    int nWidth, nHeight, nBlockSize, nWidthInMbs, nHeightInMbs;
+    QpMapOptions options;
+    std::vector<uint8_t> vMask;
+    /** Frames since each macroblock last changed, saturating at 255 */
+    std::vector<uint8_t> vAge;
+    std::vector<std::vector<int8_t>> vvMap;
+    size_t iMap = 0;
+};
@@ -0,0 +1,637 @@
+#pragma once
+
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include "CpuFeatures.h"
+
+/**
+*  Objective quality of decoded frames against their source: PSNR per plane and SSIM of the
+*  luma, on 8-bit 4:2:0 frames (I420 or NV12). The free functions are the scalar reference;
+*  QualityEvaluator computes the same numbers with SSE2/AVX2 on bands of the frame that threads
+*  share, and sums up a sequence frame by frame.
+*/
+
+/**
+*  @brief One 8-bit plane of a frame.
+*/
+struct ImagePlane
+{
+    const uint8_t *pData;
+    int nPitch;
+    int nWidth, nHeight;
+};
+
+/**
+*  @brief The planes of an I420 frame; the chroma planes are half the size of the luma. With
+*  bNv12, aPlane[1] is the interleaved UV plane (nWidth counts the samples of one component)
+*  and aPlane[2] is unused.
+*/
+struct YuvFrame
+{
+    ImagePlane aPlane[3];
+    bool bNv12 = false;
+
+    /** A packed I420 buffer, chroma pitch half the luma pitch */
+    static YuvFrame FromI420(const uint8_t *pData, int nWidth, int nHeight)
+    {
+        int nChromaWidth = (nWidth + 1) / 2, nChromaHeight = (nHeight + 1) / 2;
+        const uint8_t *pU = pData + (size_t)nWidth * nHeight, *pV = pU + (size_t)nChromaWidth * nChromaHeight;
+        YuvFrame frame;
+        frame.aPlane[0] = ImagePlane{ pData, nWidth, nWidth, nHeight };
+        frame.aPlane[1] = ImagePlane{ pU, nChromaWidth, nChromaWidth, nChromaHeight };
+        frame.aPlane[2] = ImagePlane{ pV, nChromaWidth, nChromaWidth, nChromaHeight };
+        return frame;
+    }
+
+    /** An NV12 buffer as the encoder takes it: the UV plane follows nHeight rows of nPitch bytes */
+    static YuvFrame FromNv12(const uint8_t *pData, int nPitch, int nWidth, int nHeight)
+    {
+        int nChromaWidth = (nWidth + 1) / 2, nChromaHeight = (nHeight + 1) / 2;
+        YuvFrame frame;
+        frame.aPlane[0] = ImagePlane{ pData, nPitch, nWidth, nHeight };
+        frame.aPlane[1] = ImagePlane{ pData + (size_t)nPitch * nHeight, nPitch, nChromaWidth, nChromaHeight };
+        frame.aPlane[2] = ImagePlane{ NULL, 0, 0, 0 };
+        frame.bNv12 = true;
+        return frame;
+    }
+};
+
+inline uint64_t PlaneSse(const ImagePlane &a, const ImagePlane &b)
+{
+    uint64_t nSse = 0;
+    for (int y = 0; y < a.nHeight; y++)
+    {
+        const uint8_t *pA = a.pData + (size_t)y * a.nPitch, *pB = b.pData + (size_t)y * b.nPitch;
+        uint32_t nRow = 0;
+        for (int x = 0; x < a.nWidth; x++)
+        {
+            int d = pA[x] - pB[x];
+            nRow += d * d;
+        }
+        nSse += nRow;
+    }
+    return nSse;
+}
+
+/** Identical content gets 100 dB instead of infinity, so that averages stay finite */
+inline double SseToPsnr(uint64_t nSse, uint64_t nSamples)
+{
+    if (!nSse || !nSamples)
+    {
+        return 100.0;
+    }
+    return (std::min)(100.0, 10.0 * log10(255.0 * 255.0 * nSamples / nSse));
+}
+
+/**
+*  @brief Sums of a, b, a^2 + b^2 and a*b over one 4x4 block.
+*/
+inline void SsimBlockSums(const uint8_t *pA, int nPitchA, const uint8_t *pB, int nPitchB, int aSum[4])
+{
+    int s1 = 0, s2 = 0, ss = 0, s12 = 0;
+    for (int y = 0; y < 4; y++)
+    {
+        for (int x = 0; x < 4; x++)
+        {
+            int a = pA[y * nPitchA + x], b = pB[y * nPitchB + x];
+            s1 += a;
+            s2 += b;
+            ss += a * a + b * b;
+            s12 += a * b;
+        }
+    }
+    aSum[0] = s1;
+    aSum[1] = s2;
+    aSum[2] = ss;
+    aSum[3] = s12;
+}
+
+/**
+*  @brief SSIM of one 8x8 window from its sums of a, b, a^2 + b^2 and a*b, with the constants
+*  of the SSIM paper (K1 0.01, K2 0.03) scaled to sums over 64 samples.
+*/
+inline double SsimFromSums(double s1, double s2, double ss, double s12)
+{
+    static const double c1 = 0.01 * 0.01 * 255 * 255 * 64, c2 = 0.03 * 0.03 * 255 * 255 * 64 * 63;
+    double dVars = ss * 64 - s1 * s1 - s2 * s2, dCovar = s12 * 64 - s1 * s2;
+    return (2 * s1 * s2 + c1) * (2 * dCovar + c2) / ((s1 * s1 + s2 * s2 + c1) * (dVars + c2));
+}
+
+/** The window made of four 4x4 blocks of SsimBlockSums() */
+inline double SsimWindow(const int *p00, const int *p01, const int *p10, const int *p11)
+{
+    return SsimFromSums(p00[0] + p01[0] + p10[0] + p11[0], p00[1] + p01[1] + p10[1] + p11[1],
+        p00[2] + p01[2] + p10[2] + p11[2], p00[3] + p01[3] + p10[3] + p11[3]);
+}
+
+/**
+*  @brief Mean SSIM over 8x8 windows that overlap by 4 samples, as x264 and FFmpeg compute it.
+*  The block sums of two rows of 4x4 blocks are kept, so every sample is read once.
+*/
+inline double PlaneSsim(const ImagePlane &a, const ImagePlane &b)
+{
+    int nBlocksX = a.nWidth / 4, nBlocksY = a.nHeight / 4;
+    if (nBlocksX < 2 || nBlocksY < 2)
+    {
+        return 1.0;
+    }
+    std::vector<int> vRow[2] = { std::vector<int>(nBlocksX * 4), std::vector<int>(nBlocksX * 4) };
+    double dSum = 0;
+    for (int y = 0; y < nBlocksY; y++)
+    {
+        int *pCur = vRow[y & 1].data(), *pPrev = vRow[~y & 1].data();
+        for (int x = 0; x < nBlocksX; x++)
+        {
+            SsimBlockSums(a.pData + (size_t)y * 4 * a.nPitch + x * 4, a.nPitch, b.pData + (size_t)y * 4 * b.nPitch + x * 4, b.nPitch, pCur + x * 4);
+        }
+        if (y == 0)
+        {
+            continue;
+        }
+        for (int x = 0; x + 1 < nBlocksX; x++)
+        {
+            dSum += SsimWindow(pPrev + x * 4, pPrev + x * 4 + 4, pCur + x * 4, pCur + x * 4 + 4);
+        }
+    }
+    return dSum / ((double)(nBlocksX - 1) * (nBlocksY - 1));
+}
+
+/**
+*  @brief Quality of one frame. The SSE are kept so that sequences can be summed up as the PSNR
+*  of their total error, the usual "global" PSNR.
+*/
+struct FrameQuality
+{
+    uint64_t aSse[3] = {};
+    uint64_t aSamples[3] = {};
+    double aPsnr[3] = {};
+    /** Of all planes together, weighted by their sample counts */
+    double dPsnr = 0;
+    double dSsimY = 0;
+};
+
+/**
+*  @brief Running summary of a sequence; frames can be added in any order and partial
+*  summaries (one per thread or GOP) merged.
+*/
+struct QualityStats
+{
+    uint64_t nFrames = 0;
+    uint64_t aSse[3] = {}, aSamples[3] = {};
+    double dPsnrSum = 0, dPsnrMin = 100.0;
+    double dSsimSum = 0, dSsimMin = 1.0;
+
+    void Add(const FrameQuality &q)
+    {
+        nFrames++;
+        for (int i = 0; i < 3; i++)
+        {
+            aSse[i] += q.aSse[i];
+            aSamples[i] += q.aSamples[i];
+        }
+        dPsnrSum += q.dPsnr;
+        dPsnrMin = (std::min)(dPsnrMin, q.dPsnr);
+        dSsimSum += q.dSsimY;
+        dSsimMin = (std::min)(dSsimMin, q.dSsimY);
+    }
+
+    void Merge(const QualityStats &s)
+    {
+        nFrames += s.nFrames;
+        for (int i = 0; i < 3; i++)
+        {
+            aSse[i] += s.aSse[i];
+            aSamples[i] += s.aSamples[i];
+        }
+        dPsnrSum += s.dPsnrSum;
+        dPsnrMin = (std::min)(dPsnrMin, s.dPsnrMin);
+        dSsimSum += s.dSsimSum;
+        dSsimMin = (std::min)(dSsimMin, s.dSsimMin);
+    }
+
+    double GetAveragePsnr() const { return nFrames ? dPsnrSum / nFrames : 0; }
+    double GetGlobalPsnr() const { return SseToPsnr(aSse[0] + aSse[1] + aSse[2], aSamples[0] + aSamples[1] + aSamples[2]); }
+    double GetPlanePsnr(int i) const { return SseToPsnr(aSse[i], aSamples[i]); }
+    double GetAverageSsim() const { return nFrames ? dSsimSum / nFrames : 0; }
+};
+
+struct QualityOptions
+{
+    /** Threads sharing the bands of a frame */
+    int nThreads = 1;
+    /** 0: scalar, 1: up to SSE2, 2: up to AVX2 */
+    int nSimd = 2;
+    /** Luma rows per band (rounded up to a multiple of 4), the unit of work of the threads */
+    int nBandRows = 64;
+};
+
+/**
+*  @brief PSNR and luma SSIM of frames of one size with SIMD kernels on horizontal bands of the
+*  frame, which threads take in turn. A band's SSIM windows need the 4x4 block row above it, so
+*  bands overlap by 4 luma rows and read every other sample once. NV12 chroma rows are split
+*  into U and V as they are read, so I420 and NV12 frames can be compared with each other.
+*
+*  The SSE kernels square differences in 16-bit lanes (madd); the block sums of SSIM come out
+*  of the same registers for 4 (SSE2) or 8 (AVX2) blocks at a time, kept as separate arrays of
+*  each sum so that AVX2 also evaluates 4 windows at once in double precision. The results sum
+*  up band by band in order, so they do not depend on the number of threads.
+*
+*  Compare() keeps no state and may be called from several threads; Add() also sums up the
+*  sequence in GetStats(), so that only the frames being compared need to be in memory.
+*/
+class QualityEvaluator
+{
+public:
+    QualityEvaluator(const QualityOptions &options = QualityOptions()) : options(options)
+    {
+        this->options.nBandRows = (std::max)(4, (options.nBandRows + 3) & ~3);
+        RowSse = RowSseScalar;
+        SplitUV = SplitUVScalar;
+        SsimRow = SsimRowScalar;
+        SsimWindows = SsimWindowsScalar;
+#ifdef CPU_HAS_SSE2
+        if (options.nSimd >= 1)
+        {
+            RowSse = RowSseSse2;
+            SplitUV = SplitUVSse2;
+            SsimRow = SsimRowSse2;
+        }
+#endif
+#ifdef CPU_HAS_AVX2_TARGET
+        if (options.nSimd >= 2 && CpuHasAvx2())
+        {
+            RowSse = RowSseAvx2;
+            SsimRow = SsimRowAvx2;
+            SsimWindows = SsimWindowsAvx2;
+        }
+#endif
+    }
+
+    FrameQuality Compare(const YuvFrame &ref, const YuvFrame &test) const
+    {
+        int nHeight = ref.aPlane[0].nHeight;
+        int nBands = (nHeight + options.nBandRows - 1) / options.nBandRows;
+        std::vector<BandResult> vResult(nBands);
+        std::atomic<int> iNext(0);
+        int nThreads = options.nThreads < 1 ? 1 : (options.nThreads > nBands ? nBands : options.nThreads);
+        std::vector<std::thread> vThread;
+        for (int i = 1; i < nThreads; i++)
+        {
+            vThread.push_back(std::thread(&QualityEvaluator::EvaluateBands, this, std::cref(ref), std::cref(test), std::ref(iNext), vResult.data(), nBands));
+        }
+        EvaluateBands(ref, test, iNext, vResult.data(), nBands);
+        for (auto &t : vThread)
+        {
+            t.join();
+        }
+
+        FrameQuality q;
+        double dSsimSum = 0;
+        for (const BandResult &r : vResult)
+        {
+            for (int i = 0; i < 3; i++)
+            {
+                q.aSse[i] += r.aSse[i];
+            }
+            dSsimSum += r.dSsimSum;
+        }
+        uint64_t nSse = 0, nSamples = 0;
+        for (int i = 0; i < 3; i++)
+        {
+            const ImagePlane &plane = ref.aPlane[i == 2 && ref.bNv12 ? 1 : i];
+            q.aSamples[i] = (uint64_t)plane.nWidth * plane.nHeight;
+            q.aPsnr[i] = SseToPsnr(q.aSse[i], q.aSamples[i]);
+            nSse += q.aSse[i];
+            nSamples += q.aSamples[i];
+        }
+        q.dPsnr = SseToPsnr(nSse, nSamples);
+        int nBlocksX = ref.aPlane[0].nWidth / 4, nBlocksY = nHeight / 4;
+        q.dSsimY = nBlocksX < 2 || nBlocksY < 2 ? 1.0 : dSsimSum / ((double)(nBlocksX - 1) * (nBlocksY - 1));
+        return q;
+    }
+
+    FrameQuality Add(const YuvFrame &ref, const YuvFrame &test)
+    {
+        FrameQuality q = Compare(ref, test);
+        stats.Add(q);
+        return q;
+    }
+
+    const QualityStats &GetStats() const { return stats; }
+    void Reset() { stats = QualityStats(); }
+
+private:
+    struct BandResult
+    {
+        uint64_t aSse[3];
+        double dSsimSum;
+    };
+
+    void EvaluateBands(const YuvFrame &ref, const YuvFrame &test, std::atomic<int> &iNext, BandResult *pResult, int nBands) const
+    {
+        const ImagePlane &y1 = ref.aPlane[0], &y2 = test.aPlane[0];
+        int nChromaWidth = ref.aPlane[1].nWidth, nChromaHeight = ref.aPlane[1].nHeight;
+        int nBlocksX = y1.nWidth / 4, nBlocksY = y1.nHeight / 4;
+        // U and V of a chroma row of each frame, and two rows of the four block sums
+        std::vector<uint8_t> vSplit((size_t)nChromaWidth * 4);
+        std::vector<int> vBlockSums((size_t)nBlocksX * 8);
+        int *aaSum[2][4];
+        for (int i = 0; i < 8; i++)
+        {
+            aaSum[i / 4][i % 4] = vBlockSums.data() + (size_t)nBlocksX * i;
+        }
+
+        int iBand;
+        while ((iBand = iNext++) < nBands)
+        {
+            BandResult &r = pResult[iBand];
+            int yBegin = iBand * options.nBandRows, yEnd = (std::min)(y1.nHeight, yBegin + options.nBandRows);
+            r.aSse[0] = 0;
+            for (int y = yBegin; y < yEnd; y++)
+            {
+                r.aSse[0] += RowSse(y1.pData + (size_t)y * y1.nPitch, y2.pData + (size_t)y * y2.nPitch, y1.nWidth);
+            }
+
+            r.aSse[1] = r.aSse[2] = 0;
+            int yChromaEnd = yEnd == y1.nHeight ? nChromaHeight : yEnd / 2;
+            for (int y = yBegin / 2; y < yChromaEnd; y++)
+            {
+                const uint8_t *aU[2], *aV[2];
+                const YuvFrame *apFrame[2] = { &ref, &test };
+                for (int i = 0; i < 2; i++)
+                {
+                    const ImagePlane &u = apFrame[i]->aPlane[1], &v = apFrame[i]->aPlane[2];
+                    if (apFrame[i]->bNv12)
+                    {
+                        uint8_t *pU = vSplit.data() + (size_t)nChromaWidth * 2 * i;
+                        SplitUV(u.pData + (size_t)y * u.nPitch, nChromaWidth, pU, pU + nChromaWidth);
+                        aU[i] = pU;
+                        aV[i] = pU + nChromaWidth;
+                    }
+                    else
+                    {
+                        aU[i] = u.pData + (size_t)y * u.nPitch;
+                        aV[i] = v.pData + (size_t)y * v.nPitch;
+                    }
+                }
+                r.aSse[1] += RowSse(aU[0], aU[1], nChromaWidth);
+                r.aSse[2] += RowSse(aV[0], aV[1], nChromaWidth);
+            }
+
+            // the windows whose lower blocks are in the band
+            r.dSsimSum = 0;
+            int yWindowBegin = (std::max)(1, yBegin / 4), yWindowEnd = (std::min)(nBlocksY, yEnd / 4);
+            if (nBlocksX < 2 || yWindowBegin >= yWindowEnd)
+            {
+                continue;
+            }
+            for (int y = yWindowBegin - 1; y < yWindowEnd; y++)
+            {
+                SsimRow(y1.pData + (size_t)y * 4 * y1.nPitch, y1.nPitch, y2.pData + (size_t)y * 4 * y2.nPitch, y2.nPitch, nBlocksX, aaSum[y & 1]);
+                if (y >= yWindowBegin)
+                {
+                    r.dSsimSum += SsimWindows(aaSum[~y & 1], aaSum[y & 1], nBlocksX);
+                }
+            }
+        }
+    }
+
+    static uint64_t RowSseScalar(const uint8_t *pA, const uint8_t *pB, int n)
+    {
+        uint64_t nSse = 0;
+        for (int x = 0; x < n; x++)
+        {
+            int d = pA[x] - pB[x];
+            nSse += d * d;
+        }
+        return nSse;
+    }
+
+    static void SplitUVScalar(const uint8_t *pUV, int n, uint8_t *pU, uint8_t *pV)
+    {
+        for (int x = 0; x < n; x++)
+        {
+            pU[x] = pUV[2 * x];
+            pV[x] = pUV[2 * x + 1];
+        }
+    }
+
+    static void SsimRowScalar(const uint8_t *pA, int nPitchA, const uint8_t *pB, int nPitchB, int nBlocks, int *const apSum[4])
+    {
+        for (int x = 0; x < nBlocks; x++)
+        {
+            int aSum[4];
+            SsimBlockSums(pA + x * 4, nPitchA, pB + x * 4, nPitchB, aSum);
+            for (int i = 0; i < 4; i++)
+            {
+                apSum[i][x] = aSum[i];
+            }
+        }
+    }
+
+    static double SsimWindowsScalar(int *const apTop[4], int *const apBottom[4], int nBlocks)
+    {
+        double dSum = 0;
+        for (int x = 0; x + 1 < nBlocks; x++)
+        {
+            double aSum[4];
+            for (int i = 0; i < 4; i++)
+            {
+                aSum[i] = apTop[i][x] + apTop[i][x + 1] + apBottom[i][x] + apBottom[i][x + 1];
+            }
+            dSum += SsimFromSums(aSum[0], aSum[1], aSum[2], aSum[3]);
+        }
+        return dSum;
+    }
+
+#ifdef CPU_HAS_SSE2
+    static uint64_t RowSseSse2(const uint8_t *pA, const uint8_t *pB, int n)
+    {
+        __m128i vZero = _mm_setzero_si128(), vSum = vZero;
+        int x = 0;
+        for (; x + 16 <= n; x += 16)
+        {
+            __m128i vA = _mm_loadu_si128((const __m128i *)(pA + x)), vB = _mm_loadu_si128((const __m128i *)(pB + x));
+            __m128i vLo = _mm_sub_epi16(_mm_unpacklo_epi8(vA, vZero), _mm_unpacklo_epi8(vB, vZero));
+            __m128i vHi = _mm_sub_epi16(_mm_unpackhi_epi8(vA, vZero), _mm_unpackhi_epi8(vB, vZero));
+            vSum = _mm_add_epi32(vSum, _mm_add_epi32(_mm_madd_epi16(vLo, vLo), _mm_madd_epi16(vHi, vHi)));
+        }
+        uint32_t aSum[4];
+        _mm_storeu_si128((__m128i *)aSum, vSum);
+        return (uint64_t)aSum[0] + aSum[1] + aSum[2] + aSum[3] + RowSseScalar(pA + x, pB + x, n - x);
+    }
+
+    static void SplitUVSse2(const uint8_t *pUV, int n, uint8_t *pU, uint8_t *pV)
+    {
+        __m128i vMask = _mm_set1_epi16(0xFF);
+        int x = 0;
+        for (; x + 16 <= n; x += 16)
+        {
+            __m128i v0 = _mm_loadu_si128((const __m128i *)(pUV + 2 * x)), v1 = _mm_loadu_si128((const __m128i *)(pUV + 2 * x + 16));
+            _mm_storeu_si128((__m128i *)(pU + x), _mm_packus_epi16(_mm_and_si128(v0, vMask), _mm_and_si128(v1, vMask)));
+            _mm_storeu_si128((__m128i *)(pV + x), _mm_packus_epi16(_mm_srli_epi16(v0, 8), _mm_srli_epi16(v1, 8)));
+        }
+        SplitUVScalar(pUV + 2 * x, n - x, pU + x, pV + x);
+    }
+
+    // The 4x4 block sums from pair sums: lanes 2i and 2i+1 of lo and hi
+    static __m128i SumPairs(__m128i vLo, __m128i vHi)
+    {
+        __m128 lo = _mm_castsi128_ps(vLo), hi = _mm_castsi128_ps(vHi);
+        return _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0))),
+            _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1))));
+    }
+
+    static void SsimRowSse2(const uint8_t *pA, int nPitchA, const uint8_t *pB, int nPitchB, int nBlocks, int *const apSum[4])
+    {
+        __m128i vZero = _mm_setzero_si128(), vOne = _mm_set1_epi16(1);
+        int x = 0;
+        for (; x + 4 <= nBlocks; x += 4)
+        {
+            // sums of a and b in 16 bits, of the products in 32 bits per pair of samples
+            __m128i vS1Lo = vZero, vS1Hi = vZero, vS2Lo = vZero, vS2Hi = vZero;
+            __m128i vSsLo = vZero, vSsHi = vZero, vS12Lo = vZero, vS12Hi = vZero;
+            for (int y = 0; y < 4; y++)
+            {
+                __m128i vA = _mm_loadu_si128((const __m128i *)(pA + y * nPitchA + x * 4));
+                __m128i vB = _mm_loadu_si128((const __m128i *)(pB + y * nPitchB + x * 4));
+                __m128i vALo = _mm_unpacklo_epi8(vA, vZero), vAHi = _mm_unpackhi_epi8(vA, vZero);
+                __m128i vBLo = _mm_unpacklo_epi8(vB, vZero), vBHi = _mm_unpackhi_epi8(vB, vZero);
+                vS1Lo = _mm_add_epi16(vS1Lo, vALo);
+                vS1Hi = _mm_add_epi16(vS1Hi, vAHi);
+                vS2Lo = _mm_add_epi16(vS2Lo, vBLo);
+                vS2Hi = _mm_add_epi16(vS2Hi, vBHi);
+                vSsLo = _mm_add_epi32(vSsLo, _mm_add_epi32(_mm_madd_epi16(vALo, vALo), _mm_madd_epi16(vBLo, vBLo)));
+                vSsHi = _mm_add_epi32(vSsHi, _mm_add_epi32(_mm_madd_epi16(vAHi, vAHi), _mm_madd_epi16(vBHi, vBHi)));
+                vS12Lo = _mm_add_epi32(vS12Lo, _mm_madd_epi16(vALo, vBLo));
+                vS12Hi = _mm_add_epi32(vS12Hi, _mm_madd_epi16(vAHi, vBHi));
+            }
+            _mm_storeu_si128((__m128i *)(apSum[0] + x), SumPairs(_mm_madd_epi16(vS1Lo, vOne), _mm_madd_epi16(vS1Hi, vOne)));
+            _mm_storeu_si128((__m128i *)(apSum[1] + x), SumPairs(_mm_madd_epi16(vS2Lo, vOne), _mm_madd_epi16(vS2Hi, vOne)));
+            _mm_storeu_si128((__m128i *)(apSum[2] + x), SumPairs(vSsLo, vSsHi));
+            _mm_storeu_si128((__m128i *)(apSum[3] + x), SumPairs(vS12Lo, vS12Hi));
+        }
+        int *const apTail[4] = { apSum[0] + x, apSum[1] + x, apSum[2] + x, apSum[3] + x };
+        SsimRowScalar(pA + x * 4, nPitchA, pB + x * 4, nPitchB, nBlocks - x, apTail);
+    }
+#endif
+
+#ifdef CPU_HAS_AVX2_TARGET
+    CPU_TARGET_AVX2 static uint64_t RowSseAvx2(const uint8_t *pA, const uint8_t *pB, int n)
+    {
+        __m256i vZero = _mm256_setzero_si256(), vSum = vZero;
+        int x = 0;
+        for (; x + 32 <= n; x += 32)
+        {
+            __m256i vA = _mm256_loadu_si256((const __m256i *)(pA + x)), vB = _mm256_loadu_si256((const __m256i *)(pB + x));
+            __m256i vLo = _mm256_sub_epi16(_mm256_unpacklo_epi8(vA, vZero), _mm256_unpacklo_epi8(vB, vZero));
+            __m256i vHi = _mm256_sub_epi16(_mm256_unpackhi_epi8(vA, vZero), _mm256_unpackhi_epi8(vB, vZero));
+            vSum = _mm256_add_epi32(vSum, _mm256_add_epi32(_mm256_madd_epi16(vLo, vLo), _mm256_madd_epi16(vHi, vHi)));
+        }
+        uint32_t aSum[8];
+        _mm256_storeu_si256((__m256i *)aSum, vSum);
+        uint64_t nSse = 0;
+        for (int i = 0; i < 8; i++)
+        {
+            nSse += aSum[i];
+        }
+        return nSse + RowSseScalar(pA + x, pB + x, n - x);
+    }
+
+    // Unpacking works within 128-bit lanes, so lo holds samples 0-7 and 16-23, hi 8-15 and 24-31:
+    // the shuffle of each lane yields blocks 0-3 and 4-7 in order
+    CPU_TARGET_AVX2 static __m256i SumPairsAvx2(__m256i vLo, __m256i vHi)
+    {
+        __m256 lo = _mm256_castsi256_ps(vLo), hi = _mm256_castsi256_ps(vHi);
+        return _mm256_add_epi32(_mm256_castps_si256(_mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0))),
+            _mm256_castps_si256(_mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1))));
+    }
+
+    CPU_TARGET_AVX2 static void SsimRowAvx2(const uint8_t *pA, int nPitchA, const uint8_t *pB, int nPitchB, int nBlocks, int *const apSum[4])
+    {
+        __m256i vZero = _mm256_setzero_si256(), vOne = _mm256_set1_epi16(1);
+        int x = 0;
+        for (; x + 8 <= nBlocks; x += 8)
+        {
+            __m256i vS1Lo = vZero, vS1Hi = vZero, vS2Lo = vZero, vS2Hi = vZero;
+            __m256i vSsLo = vZero, vSsHi = vZero, vS12Lo = vZero, vS12Hi = vZero;
+            for (int y = 0; y < 4; y++)
+            {
+                __m256i vA = _mm256_loadu_si256((const __m256i *)(pA + y * nPitchA + x * 4));
+                __m256i vB = _mm256_loadu_si256((const __m256i *)(pB + y * nPitchB + x * 4));
+                __m256i vALo = _mm256_unpacklo_epi8(vA, vZero), vAHi = _mm256_unpackhi_epi8(vA, vZero);
+                __m256i vBLo = _mm256_unpacklo_epi8(vB, vZero), vBHi = _mm256_unpackhi_epi8(vB, vZero);
+                vS1Lo = _mm256_add_epi16(vS1Lo, vALo);
+                vS1Hi = _mm256_add_epi16(vS1Hi, vAHi);
+                vS2Lo = _mm256_add_epi16(vS2Lo, vBLo);
+                vS2Hi = _mm256_add_epi16(vS2Hi, vBHi);
+                vSsLo = _mm256_add_epi32(vSsLo, _mm256_add_epi32(_mm256_madd_epi16(vALo, vALo), _mm256_madd_epi16(vBLo, vBLo)));
+                vSsHi = _mm256_add_epi32(vSsHi, _mm256_add_epi32(_mm256_madd_epi16(vAHi, vAHi), _mm256_madd_epi16(vBHi, vBHi)));
+                vS12Lo = _mm256_add_epi32(vS12Lo, _mm256_madd_epi16(vALo, vBLo));
+                vS12Hi = _mm256_add_epi32(vS12Hi, _mm256_madd_epi16(vAHi, vBHi));
+            }
+            _mm256_storeu_si256((__m256i *)(apSum[0] + x), SumPairsAvx2(_mm256_madd_epi16(vS1Lo, vOne), _mm256_madd_epi16(vS1Hi, vOne)));
+            _mm256_storeu_si256((__m256i *)(apSum[1] + x), SumPairsAvx2(_mm256_madd_epi16(vS2Lo, vOne), _mm256_madd_epi16(vS2Hi, vOne)));
+            _mm256_storeu_si256((__m256i *)(apSum[2] + x), SumPairsAvx2(vSsLo, vSsHi));
+            _mm256_storeu_si256((__m256i *)(apSum[3] + x), SumPairsAvx2(vS12Lo, vS12Hi));
+        }
+        int *const apTail[4] = { apSum[0] + x, apSum[1] + x, apSum[2] + x, apSum[3] + x };
+        SsimRowScalar(pA + x * 4, nPitchA, pB + x * 4, nPitchB, nBlocks - x, apTail);
+    }
+
+    // Four windows at once, with the operations of SsimFromSums() in the same order
+    CPU_TARGET_AVX2 static double SsimWindowsAvx2(int *const apTop[4], int *const apBottom[4], int nBlocks)
+    {
+        const __m256d c1 = _mm256_set1_pd(0.01 * 0.01 * 255 * 255 * 64), c2 = _mm256_set1_pd(0.03 * 0.03 * 255 * 255 * 64 * 63);
+        const __m256d v2 = _mm256_set1_pd(2), v64 = _mm256_set1_pd(64);
+        __m256d vSum = _mm256_setzero_pd();
+        int x = 0;
+        for (; x + 4 < nBlocks; x += 4)
+        {
+            __m256d aSum[4];
+            for (int i = 0; i < 4; i++)
+            {
+                __m128i vTop = _mm_add_epi32(_mm_loadu_si128((const __m128i *)(apTop[i] + x)), _mm_loadu_si128((const __m128i *)(apTop[i] + x + 1)));
+                __m128i vBottom = _mm_add_epi32(_mm_loadu_si128((const __m128i *)(apBottom[i] + x)), _mm_loadu_si128((const __m128i *)(apBottom[i] + x + 1)));
+                aSum[i] = _mm256_cvtepi32_pd(_mm_add_epi32(vTop, vBottom));
+            }
+            __m256d s1 = aSum[0], s2 = aSum[1];
+            __m256d vS1S1 = _mm256_mul_pd(s1, s1), vS2S2 = _mm256_mul_pd(s2, s2), vS1S2 = _mm256_mul_pd(s1, s2);
+            __m256d vVars = _mm256_sub_pd(_mm256_sub_pd(_mm256_mul_pd(aSum[2], v64), vS1S1), vS2S2);
+            __m256d vCovar = _mm256_sub_pd(_mm256_mul_pd(aSum[3], v64), vS1S2);
+            __m256d vNum = _mm256_mul_pd(_mm256_add_pd(_mm256_mul_pd(_mm256_mul_pd(v2, s1), s2), c1), _mm256_add_pd(_mm256_mul_pd(v2, vCovar), c2));
+            __m256d vDen = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(vS1S1, vS2S2), c1), _mm256_add_pd(vVars, c2));
+            vSum = _mm256_add_pd(vSum, _mm256_div_pd(vNum, vDen));
+        }
+        double aSum[4];
+        _mm256_storeu_pd(aSum, vSum);
+        int *const apTopTail[4] = { apTop[0] + x, apTop[1] + x, apTop[2] + x, apTop[3] + x };
+        int *const apBottomTail[4] = { apBottom[0] + x, apBottom[1] + x, apBottom[2] + x, apBottom[3] + x };
+        return aSum[0] + aSum[1] + aSum[2] + aSum[3] + SsimWindowsScalar(apTopTail, apBottomTail, nBlocks - x);
+    }
+#endif
+
+    typedef uint64_t (*RowSseFunc)(const uint8_t *pA, const uint8_t *pB, int n);
+    typedef void (*SplitUVFunc)(const uint8_t *pUV, int n, uint8_t *pU, uint8_t *pV);
+    typedef void (*SsimRowFunc)(const uint8_t *pA, int nPitchA, const uint8_t *pB, int nPitchB, int nBlocks, int *const apSum[4]);
+    typedef double (*SsimWindowsFunc)(int *const apTop[4], int *const apBottom[4], int nBlocks);
+
+    QualityOptions options;
+    QualityStats stats;
+    RowSseFunc RowSse;
+    SplitUVFunc SplitUV;
+    SsimRowFunc SsimRow;
+    SsimWindowsFunc SsimWindows;
+};
+
+/**
+*  @brief Quality of one frame; for a sequence, keep a QualityEvaluator and Add() its frames.
+*/
+inline FrameQuality CompareFrames(const YuvFrame &ref, const YuvFrame &test, const QualityOptions &options = QualityOptions())
+{
+    return QualityEvaluator(options).Compare(ref, test);
+}
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <stdint.h>
+#include <math.h>
+#include <algorithm>
+#include "NvEncoder/NvEncoder.h"
+
+struct RateControlOptions
+{
+    /** Bitrate range in bps; a 0 maximum keeps the bitrate the encoder was created with as the maximum */
+    uint32_t nMinBitrate = 500000;
+    uint32_t nMaxBitrate = 0;
+    /** Used instead of the bitrate when the encoder runs in constant QP mode */
+    int nMinQp = 20;
+    int nMaxQp = 42;
+    /** Least time between two decisions; every reconfiguration is at least this far apart */
+    int nIntervalMs = 1000;
+    /** Smaller relative changes are not worth a reconfiguration */
+    int nMinChangePercent = 10;
+    /** Share of the screen that has to change every frame for the maximum bitrate */
+    int nBusyPercent = 20;
+    /**
+    *  @brief Sink backlog, in milliseconds of output, above which the bitrate is held below
+    *  what the sinks drain, and below which it is raised again
+    */
+    int nBacklogHighMs = 500;
+    int nBacklogLowMs = 100;
+};
+
+/**
+*  @brief Adapts the encoder bitrate (or QP) at runtime. Screen activity, measured from the
+*  dirty and move rects of every frame, sets a target between the minimum and the maximum:
+*  a static desktop is encoded with a fraction of the bitrate a scrolling one gets. The sink
+*  backlog caps it: when the sinks fall behind, the bitrate is brought below what they
+*  actually drained, and probed upwards again once they have caught up.
+*
+*  Decisions are taken at most once per nIntervalMs and only applied when they move the
+*  bitrate by nMinChangePercent or more. Reconfigure() changes the rate control parameters
+*  only: the encoder is neither reset nor forced to an IDR.
+*/
+class RateController
+{
+public:
+    RateController(const RateControlOptions &options, uint32_t nInitialBitrate) : options(options)
+    {
+        if (!this->options.nMaxBitrate)
+        {
+            this->options.nMaxBitrate = nInitialBitrate ? nInitialBitrate : 8000000;
+        }
+        if (this->options.nMinBitrate > this->options.nMaxBitrate)
+        {
+            this->options.nMinBitrate = this->options.nMaxBitrate;
+        }
+        nBitrate = nInitialBitrate ? Clamp(nInitialBitrate) : this->options.nMaxBitrate;
+        dCap = this->options.nMaxBitrate;
+        nQp = QpForBitrate(nBitrate);
+    }
+
+    /** Called for every captured frame with the pixels it changed */
+    void OnFrame(int64_t nChangedArea, int64_t nFrameArea)
+    {
+        double dChanged = nFrameArea > 0 ? (double)nChangedArea / nFrameArea : 1.0;
+        // rises within a few frames when something starts moving, decays over a couple of seconds
+        double dAlpha = dChanged > dActivity ? 0.5 : 0.02;
+        dActivity += dAlpha * (dChanged - dActivity);
+    }
+
+    /** Called for every encoded packet */
+    void OnPacket(size_t nBytes)
+    {
+        nBytesInInterval += nBytes;
+    }
+
+    /**
+    *  @brief Called before every frame is encoded with the current time and the largest sink
+    *  backlog in bytes. Returns true if GetBitrate()/GetQp() changed and the encoder should be
+    *  reconfigured.
+    */
+    bool Update(int64_t nNowUs, int64_t nBacklogBytes)
+    {
+        if (nLastUpdateUs < 0)
+        {
+            nLastUpdateUs = nNowUs;
+            nLastBacklogBytes = nBacklogBytes;
+            return false;
+        }
+        int64_t nElapsedUs = nNowUs - nLastUpdateUs;
+        if (nElapsedUs < (int64_t)options.nIntervalMs * 1000 || nElapsedUs <= 0)
+        {
+            return false;
+        }
+
+        double dOutputBps = nBytesInInterval * 8.0e6 / nElapsedUs;
+        // whatever was produced and did not add to the backlog was drained by the slowest sink
+        double dDrainBps = ((int64_t)nBytesInInterval - (nBacklogBytes - nLastBacklogBytes)) * 8.0e6 / nElapsedUs;
+        double dBacklogMs = nBacklogBytes * 8000.0 / (dOutputBps > options.nMinBitrate ? dOutputBps : options.nMinBitrate);
+        nLastUpdateUs = nNowUs;
+        nLastBacklogBytes = nBacklogBytes;
+        nBytesInInterval = 0;
+
+        if (dBacklogMs > options.nBacklogHighMs)
+        {
+            // leave a fifth of the drain rate to work the backlog off
+            dCap = dDrainBps > 0 ? (std::min)(dCap, 0.8 * dDrainBps) : dCap / 2;
+        }
+        else if (dBacklogMs < options.nBacklogLowMs)
+        {
+            dCap = (std::min)(dCap * 1.25, (double)options.nMaxBitrate);
+        }
+
+        double dLevel = (std::min)(1.0, dActivity * 100.0 / options.nBusyPercent);
+        double dTarget = options.nMinBitrate + (options.nMaxBitrate - options.nMinBitrate) * sqrt(dLevel);
+        uint32_t nNewBitrate = Clamp((uint32_t)(std::min)(dTarget, dCap));
+        if (fabs((double)nNewBitrate - nBitrate) * 100 < (double)nBitrate * options.nMinChangePercent
+            && nNewBitrate != options.nMinBitrate && nNewBitrate != options.nMaxBitrate)
+        {
+            return false;
+        }
+        if (nNewBitrate == nBitrate)
+        {
+            return false;
+        }
+        nBitrate = nNewBitrate;
+        nQp = QpForBitrate(nBitrate);
+        return true;
+    }
+
+    /**
+    *  @brief Starts a new measurement interval, for a recording whose timestamps restart at 0.
+    *  The bitrate and the screen activity are kept, as the encoder keeps its configuration.
+    */
+    void Reset()
+    {
+        nLastUpdateUs = -1;
+        nLastBacklogBytes = 0;
+        nBytesInInterval = 0;
+    }
+
+    /**
+    *  @brief Applies GetBitrate() (or GetQp() in constant QP mode) to pEnc. The peak bitrate
+    *  and the VBV buffer are scaled with the average, so the buffer keeps its length in time.
+    */
+    void Reconfigure(NvEncoder *pEnc)
+    {
+        NV_ENC_RECONFIGURE_PARAMS reconfigureParams = { NV_ENC_RECONFIGURE_PARAMS_VER };
+        NV_ENC_CONFIG encodeConfig = { NV_ENC_CONFIG_VER };
+        reconfigureParams.reInitEncodeParams.encodeConfig = &encodeConfig;
+        pEnc->GetInitializeParams(&reconfigureParams.reInitEncodeParams);
+        NV_ENC_RC_PARAMS &rcParams = encodeConfig.rcParams;
+        if (rcParams.rateControlMode == NV_ENC_PARAMS_RC_CONSTQP)
+        {
+            int nDelta = nQp - (int)rcParams.constQP.qpInterP;
+            rcParams.constQP.qpInterP = ShiftQp(rcParams.constQP.qpInterP, nDelta);
+            rcParams.constQP.qpInterB = ShiftQp(rcParams.constQP.qpInterB, nDelta);
+            rcParams.constQP.qpIntra = ShiftQp(rcParams.constQP.qpIntra, nDelta);
+        }
+        else
+        {
+            double dScale = rcParams.averageBitRate ? (double)nBitrate / rcParams.averageBitRate : 1.0;
+            rcParams.averageBitRate = nBitrate;
+            rcParams.maxBitRate = (uint32_t)(rcParams.maxBitRate * dScale);
+            rcParams.vbvBufferSize = (uint32_t)(rcParams.vbvBufferSize * dScale);
+            rcParams.vbvInitialDelay = (uint32_t)(rcParams.vbvInitialDelay * dScale);
+        }
+        reconfigureParams.resetEncoder = 0;
+        reconfigureParams.forceIDR = 0;
+        pEnc->Reconfigure(&reconfigureParams);
+        nReconfigures++;
+    }
+
+    uint32_t GetBitrate() const { return nBitrate; }
+    int GetQp() const { return nQp; }
+    /** Smoothed share of the screen changing per frame, 0 to 1 */
+    double GetActivity() const { return dActivity; }
+    uint64_t GetReconfigureCount() const { return nReconfigures; }
+
+private:
+    uint32_t Clamp(uint32_t n) const
+    {
+        return n < options.nMinBitrate ? options.nMinBitrate : (n > options.nMaxBitrate ? options.nMaxBitrate : n);
+    }
+
+    /** Half the bitrate is about 6 QP more */
+    int QpForBitrate(uint32_t n) const
+    {
+        int nNewQp = options.nMinQp + (int)lround(6.0 * log2((double)options.nMaxBitrate / n));
+        return nNewQp < options.nMinQp ? options.nMinQp : (nNewQp > options.nMaxQp ? options.nMaxQp : nNewQp);
+    }
+
+    static uint32_t ShiftQp(uint32_t nQpIn, int nDelta)
+    {
+        int n = (int)nQpIn + nDelta;
+        return n < 0 ? 0 : (n > 51 ? 51 : n);
+    }
+
+    RateControlOptions options;
+    uint32_t nBitrate;
+    int nQp;
+    double dActivity = 1.0;
+    double dCap;
+    int64_t nLastUpdateUs = -1;
+    int64_t nLastBacklogBytes = 0;
+    uint64_t nBytesInInterval = 0;
+    uint64_t nReconfigures = 0;
+};
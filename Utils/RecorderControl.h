@@ -0,0 +1,460 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <signal.h>
+#include <ctype.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "Logger.h"
+#include "RecorderMetrics.h"
+#include "SocketUtils.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <conio.h>
+#else
+#include <unistd.h>
+#include <sys/select.h>
+#endif
+
+extern simplelogger::Logger *logger;
+
+enum RecorderState
+{
+    RECORDER_RECORDING,
+    RECORDER_PAUSED,
+    RECORDER_STOPPED,
+    /** Service mode: warm, waiting for a record command */
+    RECORDER_IDLE,
+};
+
+/**
+*  @brief State of a running recording, shared by the capture thread and whoever controls it.
+*  The capture thread blocks in WaitWhilePaused() between frames; encoder, duplication and
+*  sinks stay alive meanwhile, so resuming costs one condition variable wake-up.
+*  Stop() ends the recording: the capture thread leaves its loop and the encoder gets flushed.
+*  A recorder service then goes back to RECORDER_IDLE with Finish() and waits for the next
+*  record command in WaitForRecording(), until Quit().
+*/
+class RecorderControl
+{
+public:
+    RecorderControl(RecorderState eInitialState = RECORDER_RECORDING, RecorderMetrics *pMetrics = NULL)
+        : eState(eInitialState), pMetrics(pMetrics)
+    {
+        UpdateMetrics();
+    }
+
+    RecorderState GetState() const { return eState; }
+
+    bool Pause()
+    {
+        return Transition(RECORDER_RECORDING, RECORDER_PAUSED);
+    }
+
+    /** Starts a recording created paused, or resumes a paused one */
+    bool Resume()
+    {
+        return Transition(RECORDER_PAUSED, RECORDER_RECORDING);
+    }
+
+    void Stop()
+    {
+        std::lock_guard<std::mutex> lock(mtxState);
+        if (eState == RECORDER_RECORDING || eState == RECORDER_PAUSED)
+        {
+            eState = RECORDER_STOPPED;
+            LOG(INFO) << "Recording stopped";
+            UpdateMetrics();
+        }
+        cvState.notify_all();
+    }
+
+    /** Starts a recording to strPath (empty: the default one) from RECORDER_IDLE */
+    bool Record(const std::string &strPath)
+    {
+        std::lock_guard<std::mutex> lock(mtxState);
+        if (eState != RECORDER_IDLE || bQuit)
+        {
+            return false;
+        }
+        strNextPath = strPath;
+        eState = RECORDER_RECORDING;
+        UpdateMetrics();
+        cvState.notify_all();
+        return true;
+    }
+
+    /** Stops the current recording, if any, and makes WaitForRecording() return false */
+    void Quit()
+    {
+        std::lock_guard<std::mutex> lock(mtxState);
+        bQuit = true;
+        if (eState == RECORDER_RECORDING || eState == RECORDER_PAUSED)
+        {
+            eState = RECORDER_STOPPED;
+            LOG(INFO) << "Recording stopped";
+            UpdateMetrics();
+        }
+        cvState.notify_all();
+    }
+
+    /** Called by the service once a stopped recording is flushed and closed, or has failed */
+    void Finish(bool bSucceeded = true)
+    {
+        std::lock_guard<std::mutex> lock(mtxState);
+        eState = RECORDER_IDLE;
+        bLastFailed = !bSucceeded;
+        if (pMetrics && !bSucceeded)
+        {
+            pMetrics->nRecordingsFailed++;
+        }
+        UpdateMetrics();
+        cvState.notify_all();
+    }
+
+    /** True if the last recording of the service ended with an error */
+    bool HasLastRecordingFailed() const { return bLastFailed; }
+
+    /**
+    *  @brief Blocks in RECORDER_IDLE until a record command arrives and returns its path
+    *  in *pstrPath; returns false on Quit().
+    */
+    bool WaitForRecording(std::string *pstrPath)
+    {
+        std::unique_lock<std::mutex> lock(mtxState);
+        cvState.wait(lock, [this]() { return eState != RECORDER_IDLE || bQuit; });
+        *pstrPath = strNextPath;
+        return !bQuit;
+    }
+
+    /**
+    *  @brief Called by the capture thread before every frame. Blocks while paused and returns
+    *  false once stopped. *pnPausedUs receives how long it blocked, which the caller takes out
+    *  of its timestamps so the recording continues where it was paused.
+    */
+    bool WaitWhilePaused(int64_t *pnPausedUs)
+    {
+        *pnPausedUs = 0;
+        if (eState == RECORDER_RECORDING)
+        {
+            return true;
+        }
+        auto tPause = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(mtxState);
+        cvState.wait(lock, [this]() { return eState != RECORDER_PAUSED; });
+        *pnPausedUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - tPause).count();
+        return eState == RECORDER_RECORDING;
+    }
+
+    /**
+    *  @brief Executes a text command and returns the reply:
+    *  start | resume (r), pause (p), stop (q), status, and for a service
+    *  record [path] (start also takes the path) and quit.
+    */
+    std::string Execute(const std::string &strLine)
+    {
+        std::string strCommand, strArgument;
+        size_t i = 0;
+        while (i < strLine.size() && isspace((unsigned char)strLine[i]))
+        {
+            i++;
+        }
+        for (; i < strLine.size() && !isspace((unsigned char)strLine[i]); i++)
+        {
+            strCommand += (char)tolower((unsigned char)strLine[i]);
+        }
+        while (i < strLine.size() && isspace((unsigned char)strLine[i]))
+        {
+            i++;
+        }
+        strArgument = strLine.substr(i);
+        while (!strArgument.empty() && isspace((unsigned char)strArgument.back()))
+        {
+            strArgument.pop_back();
+        }
+        if ((strCommand == "record" || strCommand == "start") && eState == RECORDER_IDLE)
+        {
+            Record(strArgument);
+        }
+        else if (strCommand == "start" || strCommand == "resume" || strCommand == "r")
+        {
+            Resume();
+        }
+        else if (strCommand == "pause" || strCommand == "p")
+        {
+            Pause();
+        }
+        else if (strCommand == "stop" || strCommand == "q")
+        {
+            Stop();
+        }
+        else if (strCommand == "quit")
+        {
+            Quit();
+        }
+        else if (strCommand != "status")
+        {
+            return "error: expected record, start, pause, resume, stop, quit or status\n";
+        }
+        return std::string(GetStateName(eState)) + (eState == RECORDER_IDLE && bLastFailed ? " (last recording failed)" : "") + "\n";
+    }
+
+    static const char *GetStateName(RecorderState eState)
+    {
+        static const char *aszState[] = {"recording", "paused", "stopped", "idle"};
+        return aszState[eState];
+    }
+
+private:
+    bool Transition(RecorderState eFrom, RecorderState eTo)
+    {
+        std::lock_guard<std::mutex> lock(mtxState);
+        if (eState != eFrom)
+        {
+            return false;
+        }
+        eState = eTo;
+        LOG(INFO) << (eTo == RECORDER_PAUSED ? "Recording paused" : "Recording resumed");
+        UpdateMetrics();
+        cvState.notify_all();
+        return true;
+    }
+
+    void UpdateMetrics()
+    {
+        if (pMetrics)
+        {
+            pMetrics->nPaused = eState == RECORDER_PAUSED;
+        }
+    }
+
+    std::atomic<RecorderState> eState;
+    RecorderMetrics *pMetrics;
+    std::mutex mtxState;
+    std::condition_variable cvState;
+    std::string strNextPath;
+    bool bQuit = false;
+    std::atomic<bool> bLastFailed{false};
+};
+
+/**
+*  @brief Feeds RecorderControl from outside the pipeline: command lines typed on stdin,
+*  Ctrl+C / SIGINT / SIGTERM (quit; a second one kills the process as usual) and, if uPort
+*  is set, one command per connection to 127.0.0.1:uPort, answered with the resulting state.
+*  Try it with: echo pause | nc 127.0.0.1 <port>
+*/
+class RecorderControlChannel {
+public:
+    RecorderControlChannel(RecorderControl *pControl, unsigned short uPort = 0, bool bStdin = true)
+        : pControl(pControl), bStdin(bStdin) {
+        StopFlag() = false;
+#ifdef _WIN32
+        SetConsoleCtrlHandler(CtrlHandler, TRUE);
+#else
+        signal(SIGINT, SignalHandler);
+        signal(SIGTERM, SignalHandler);
+#endif
+        if (uPort) {
+            Listen(uPort);
+        }
+        thControl = std::thread(&RecorderControlChannel::Run, this);
+    }
+    ~RecorderControlChannel() {
+        bStop = true;
+        thControl.join();
+#ifdef _WIN32
+        SetConsoleCtrlHandler(CtrlHandler, FALSE);
+#else
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+#endif
+        if (sListen != INVALID_SOCKET) {
+            CloseSocket(sListen);
+        }
+#ifdef _WIN32
+        if (bWsa) {
+            WSACleanup();
+        }
+#endif
+    }
+
+private:
+    static std::atomic<bool> &StopFlag() {
+        static std::atomic<bool> bSignaled{false};
+        return bSignaled;
+    }
+#ifdef _WIN32
+    static BOOL WINAPI CtrlHandler(DWORD dwType) {
+        // a second Ctrl+C falls through to the default handler and terminates
+        if (dwType != CTRL_C_EVENT || StopFlag().exchange(true)) {
+            return FALSE;
+        }
+        return TRUE;
+    }
+#else
+    static void SignalHandler(int nSignal) {
+        if (StopFlag().exchange(true)) {
+            signal(nSignal, SIG_DFL);
+            raise(nSignal);
+        }
+    }
+#endif
+
+    void Listen(unsigned short uPort) {
+#ifdef _WIN32
+        WSADATA w;
+        if (WSAStartup(0x0101, &w) != 0) {
+            LOG(ERROR) << "WSAStartup() failed";
+            return;
+        }
+        bWsa = true;
+#endif
+        sListen = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (sListen == INVALID_SOCKET) {
+            LOG(ERROR) << "RecorderControlChannel: socket() failed";
+            return;
+        }
+        int nReuse = 1;
+        setsockopt(sListen, SOL_SOCKET, SO_REUSEADDR, (const char *)&nReuse, sizeof(nReuse));
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(uPort);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(sListen, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sListen, 4) != 0) {
+            LOG(ERROR) << "RecorderControlChannel: unable to listen on 127.0.0.1:" << uPort;
+            CloseSocket(sListen);
+            sListen = INVALID_SOCKET;
+            return;
+        }
+        LOG(INFO) << "Recording control at 127.0.0.1:" << uPort;
+    }
+
+    static bool WaitReadable(SOCKET s, int nTimeoutMs) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(s, &fds);
+        struct timeval tv = {nTimeoutMs / 1000, (nTimeoutMs % 1000) * 1000};
+        return select((int)s + 1, &fds, NULL, NULL, &tv) > 0;
+    }
+
+    /**
+    *  @brief Appends whatever stdin has without blocking and executes complete lines.
+    *  Blocking reads are avoided so the thread can always be joined.
+    */
+    void PollStdin(int nTimeoutMs) {
+        char buf[256];
+        int nRead = 0;
+#ifdef _WIN32
+        HANDLE hStdin = GetStdHandle(STD_INPUT_HANDLE);
+        DWORD dwMode, dwAvail = 0;
+        if (GetConsoleMode(hStdin, &dwMode)) {
+            // _kbhit() ignores the mouse and focus events that also signal the console handle
+            auto tEnd = std::chrono::steady_clock::now() + std::chrono::milliseconds(nTimeoutMs);
+            while (!_kbhit() && std::chrono::steady_clock::now() < tEnd) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            while (_kbhit() && nRead < (int)sizeof(buf)) {
+                int c = _getche();
+                if (c == '\r') {
+                    _putch('\n');
+                    c = '\n';
+                }
+                buf[nRead++] = (char)c;
+            }
+        } else if (PeekNamedPipe(hStdin, NULL, 0, NULL, &dwAvail, NULL)) {
+            if (!dwAvail) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(nTimeoutMs));
+                return;
+            }
+            DWORD dwRead = 0;
+            ReadFile(hStdin, buf, dwAvail < sizeof(buf) ? dwAvail : sizeof(buf), &dwRead, NULL);
+            nRead = (int)dwRead;
+        } else {
+            bStdin = false;
+            return;
+        }
+#else
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(STDIN_FILENO, &fds);
+        struct timeval tv = {nTimeoutMs / 1000, (nTimeoutMs % 1000) * 1000};
+        if (select(STDIN_FILENO + 1, &fds, NULL, NULL, &tv) <= 0) {
+            return;
+        }
+        nRead = (int)read(STDIN_FILENO, buf, sizeof(buf));
+        if (nRead <= 0) {
+            // end of input (e.g. < /dev/null): only the other sources remain
+            bStdin = false;
+            return;
+        }
+#endif
+        for (int i = 0; i < nRead; i++) {
+            if (buf[i] == '\b') {
+                if (!strLine.empty()) {
+                    strLine.pop_back();
+                }
+            } else if (buf[i] != '\n') {
+                strLine += buf[i];
+            } else {
+                Execute(strLine, "stdin");
+                strLine.clear();
+            }
+        }
+    }
+
+    std::string Execute(const std::string &strCommand, const char *szSource) {
+        std::string strReply = pControl->Execute(strCommand);
+        if (!strReply.compare(0, 6, "error:")) {
+            LOG(WARNING) << "Control command \"" << strCommand << "\" from " << szSource << " ignored";
+        }
+        return strReply;
+    }
+
+    void Run() {
+        while (!bStop) {
+            if (StopFlag()) {
+                pControl->Quit();
+            }
+            int nTimeoutMs = sListen != INVALID_SOCKET && bStdin ? 50 : 100;
+            if (bStdin) {
+                PollStdin(nTimeoutMs);
+            }
+            if (sListen == INVALID_SOCKET) {
+                if (!bStdin) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(nTimeoutMs));
+                }
+                continue;
+            }
+            if (!WaitReadable(sListen, nTimeoutMs)) {
+                continue;
+            }
+            SOCKET s = accept(sListen, NULL, NULL);
+            if (s == INVALID_SOCKET) {
+                continue;
+            }
+            char szCommand[256] = {};
+            std::string strReply = "error: no command\n";
+            if (WaitReadable(s, 1000) && recv(s, szCommand, sizeof(szCommand) - 1, 0) > 0) {
+                strReply = Execute(szCommand, "socket");
+            }
+            SendAll(s, strReply.data(), strReply.size());
+            CloseSocket(s);
+        }
+    }
+
+    RecorderControl *pControl;
+    bool bStdin;
+    std::string strLine;
+    SOCKET sListen = INVALID_SOCKET;
+    std::atomic<bool> bStop{false};
+    std::thread thControl;
+#ifdef _WIN32
+    bool bWsa = false;
+#endif
+};
@@ -0,0 +1,367 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <string.h>
+#include <sstream>
+#include <thread>
+#include "Logger.h"
+#include "SocketUtils.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#include <sys/select.h>
+#endif
+
+extern simplelogger::Logger *logger;
+
+/**
+* @brief Lock-free latency histogram.
+* Values are recorded in microseconds into log-linear buckets (4 sub-buckets per
+* power of two), which keeps the relative quantile error below 25% while Record()
+* is a single relaxed atomic increment.
+*/
+class LatencyHistogram {
+public:
+    enum { SUB_BUCKETS = 4, NUM_BUCKETS = 32 * SUB_BUCKETS };
+
+    void Record(uint64_t nUs) {
+        aBucket[BucketIndex(nUs)].fetch_add(1, std::memory_order_relaxed);
+        nSumUs.fetch_add(nUs, std::memory_order_relaxed);
+        nCount.fetch_add(1, std::memory_order_relaxed);
+    }
+    uint64_t GetCount() const {
+        return nCount.load(std::memory_order_relaxed);
+    }
+    uint64_t GetSumUs() const {
+        return nSumUs.load(std::memory_order_relaxed);
+    }
+    /**
+    *  @brief Returns the upper bound (in microseconds) of the bucket holding quantile q.
+    */
+    uint64_t GetQuantileUs(double q) const {
+        uint64_t aSnapshot[NUM_BUCKETS], nTotal = 0;
+        for (int i = 0; i < NUM_BUCKETS; i++) {
+            aSnapshot[i] = aBucket[i].load(std::memory_order_relaxed);
+            nTotal += aSnapshot[i];
+        }
+        if (!nTotal) {
+            return 0;
+        }
+        uint64_t nRank = (uint64_t)(q * (nTotal - 1)) + 1, nSeen = 0;
+        for (int i = 0; i < NUM_BUCKETS; i++) {
+            nSeen += aSnapshot[i];
+            if (nSeen >= nRank) {
+                return BucketUpperBound(i);
+            }
+        }
+        return BucketUpperBound(NUM_BUCKETS - 1);
+    }
+
+private:
+    static int BucketIndex(uint64_t n) {
+        if (n < SUB_BUCKETS) {
+            return (int)n;
+        }
+        int nLog = 63;
+        while (!(n >> nLog)) {
+            nLog--;
+        }
+        int iSub = (int)((n >> (nLog - 2)) & (SUB_BUCKETS - 1));
+        int i = (nLog - 1) * SUB_BUCKETS + iSub;
+        return i < NUM_BUCKETS ? i : NUM_BUCKETS - 1;
+    }
+    static uint64_t BucketUpperBound(int i) {
+        if (i < SUB_BUCKETS) {
+            return i;
+        }
+        int nLog = i / SUB_BUCKETS + 1, iSub = i % SUB_BUCKETS;
+        return ((uint64_t)(SUB_BUCKETS + iSub + 1) << (nLog - 2)) - 1;
+    }
+
+    std::atomic<uint64_t> aBucket[NUM_BUCKETS] = {};
+    std::atomic<uint64_t> nSumUs{0};
+    std::atomic<uint64_t> nCount{0};
+};
+
+/**
+* @brief Health counters of a running recording.
+* Apart from registering once, pipeline threads only ever do relaxed atomic
+* updates; everything derived
+* (rates, quantiles, thread CPU time) is computed by the reader.
+*/
+struct RecorderMetrics {
+    enum Stage { STAGE_CAPTURE, STAGE_ENCODE, STAGE_WRITE, NUM_STAGES };
+    enum { MAX_THREADS = 16 };
+
+#ifdef _WIN32
+    ~RecorderMetrics() {
+        for (int i = 0; i < nThreads; i++) {
+            if (aThread[i].hThread) {
+                CloseHandle(aThread[i].hThread);
+            }
+        }
+    }
+#endif
+
+    std::atomic<uint64_t> nFramesCaptured{0};
+    std::atomic<uint64_t> nFramesEncoded{0};
+    std::atomic<uint64_t> nFramesDropped{0};
+    std::atomic<uint64_t> nBytesEncoded{0};
+    std::atomic<uint64_t> nBytesWritten{0};
+    std::atomic<int64_t> nCaptureQueueDepth{0};
+    std::atomic<int64_t> nWriterBacklogBytes{0};
+    std::atomic<int64_t> nTargetBitrate{0};
+    std::atomic<int64_t> nPaused{0};
+    std::atomic<uint64_t> nRecordingsFailed{0};
+    LatencyHistogram aStageLatency[NUM_STAGES];
+
+    /**
+    *  @brief Registers the calling thread so its CPU time is reported under szName.
+    *  szName must outlive the metrics object. A thread registered under the name of an
+    *  earlier one (the pipeline threads of the next recording) takes over its slot, and
+    *  the counter restarts with the new thread.
+    */
+    void RegisterCurrentThread(const char *szName) {
+        std::lock_guard<std::mutex> lock(mtxThreads);
+        int i = 0;
+        while (i < nThreads && strcmp(aThread[i].szName, szName)) {
+            i++;
+        }
+        if (i == MAX_THREADS) {
+            return;
+        }
+        ThreadEntry &e = aThread[i];
+        e.szName = szName;
+#ifdef _WIN32
+        if (e.hThread) {
+            CloseHandle(e.hThread);
+        }
+        DuplicateHandle(GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(), &e.hThread, 0, FALSE, DUPLICATE_SAME_ACCESS);
+#else
+        pthread_getcpuclockid(pthread_self(), &e.clockId);
+#endif
+        if (i == nThreads) {
+            nThreads++;
+        }
+    }
+
+    /**
+    *  @brief Renders all metrics in the Prometheus text exposition format.
+    */
+    std::string ToPrometheusText() {
+        static const char *aszStage[NUM_STAGES] = {"capture", "encode", "write"};
+        static const double aQuantile[] = {0.5, 0.9, 0.99};
+        std::ostringstream oss;
+        auto now = std::chrono::steady_clock::now();
+        uint64_t nEncoded = nFramesEncoded.load(), nBytes = nBytesEncoded.load();
+        double dt = std::chrono::duration<double>(now - tLastScrape).count();
+        double fps = 0, bps = 0;
+        if (bScraped && dt > 0) {
+            fps = (nEncoded - nLastFramesEncoded) / dt;
+            bps = 8.0 * (nBytes - nLastBytesEncoded) / dt;
+        }
+        bScraped = true;
+        tLastScrape = now;
+        nLastFramesEncoded = nEncoded;
+        nLastBytesEncoded = nBytes;
+
+        Counter(oss, "recorder_frames_captured_total", "Frames acquired from the desktop duplication", nFramesCaptured.load());
+        Counter(oss, "recorder_frames_encoded_total", "Frames submitted to the encoder", nEncoded);
+        Counter(oss, "recorder_frames_dropped_total", "Frames lost because of capture timeouts or full sink queues", nFramesDropped.load());
+        Counter(oss, "recorder_encoded_bytes_total", "Bytes produced by the encoder", nBytes);
+        Counter(oss, "recorder_written_bytes_total", "Bytes handed to output sinks", nBytesWritten.load());
+        Counter(oss, "recorder_recordings_failed_total", "Service mode recordings that ended with an error", nRecordingsFailed.load());
+        Gauge(oss, "recorder_fps", "Encoded frames per second since the previous scrape", fps);
+        Gauge(oss, "recorder_output_bitrate_bps", "Encoded bitrate since the previous scrape", bps);
+        Gauge(oss, "recorder_target_bitrate_bps", "Bitrate configured on the encoder", (double)nTargetBitrate.load());
+        Gauge(oss, "recorder_capture_queue_depth", "Frames waiting between capture and encode", (double)nCaptureQueueDepth.load());
+        Gauge(oss, "recorder_writer_backlog_bytes", "Encoded bytes not yet written by the sinks", (double)nWriterBacklogBytes.load());
+        Gauge(oss, "recorder_paused", "1 while the recording is paused", (double)nPaused.load());
+
+        oss << "# HELP recorder_stage_latency_seconds Per-stage latency\n"
+            << "# TYPE recorder_stage_latency_seconds summary\n";
+        for (int s = 0; s < NUM_STAGES; s++) {
+            for (double q : aQuantile) {
+                oss << "recorder_stage_latency_seconds{stage=\"" << aszStage[s] << "\",quantile=\"" << q << "\"} "
+                    << aStageLatency[s].GetQuantileUs(q) / 1.0e6 << "\n";
+            }
+            oss << "recorder_stage_latency_seconds_sum{stage=\"" << aszStage[s] << "\"} " << aStageLatency[s].GetSumUs() / 1.0e6 << "\n"
+                << "recorder_stage_latency_seconds_count{stage=\"" << aszStage[s] << "\"} " << aStageLatency[s].GetCount() << "\n";
+        }
+
+        oss << "# HELP recorder_thread_cpu_seconds_total CPU time consumed per pipeline thread\n"
+            << "# TYPE recorder_thread_cpu_seconds_total counter\n";
+        std::lock_guard<std::mutex> lock(mtxThreads);
+        for (int i = 0; i < nThreads; i++) {
+            oss << "recorder_thread_cpu_seconds_total{thread=\"" << aThread[i].szName << "\"} " << ThreadCpuSeconds(aThread[i]) << "\n";
+        }
+        return oss.str();
+    }
+
+private:
+    struct ThreadEntry {
+        const char *szName = "";
+#ifdef _WIN32
+        HANDLE hThread = NULL;
+#else
+        clockid_t clockId;
+#endif
+    };
+
+    static double ThreadCpuSeconds(const ThreadEntry &e) {
+#ifdef _WIN32
+        FILETIME ftCreate, ftExit, ftKernel, ftUser;
+        if (!GetThreadTimes(e.hThread, &ftCreate, &ftExit, &ftKernel, &ftUser)) {
+            return 0;
+        }
+        uint64_t nKernel = ((uint64_t)ftKernel.dwHighDateTime << 32) | ftKernel.dwLowDateTime;
+        uint64_t nUser = ((uint64_t)ftUser.dwHighDateTime << 32) | ftUser.dwLowDateTime;
+        return (nKernel + nUser) / 1.0e7;
+#else
+        struct timespec ts;
+        if (clock_gettime(e.clockId, &ts) != 0) {
+            return 0;
+        }
+        return ts.tv_sec + ts.tv_nsec / 1.0e9;
+#endif
+    }
+    static void Counter(std::ostringstream &oss, const char *szName, const char *szHelp, uint64_t n) {
+        oss << "# HELP " << szName << " " << szHelp << "\n# TYPE " << szName << " counter\n" << szName << " " << n << "\n";
+    }
+    static void Gauge(std::ostringstream &oss, const char *szName, const char *szHelp, double v) {
+        oss << "# HELP " << szName << " " << szHelp << "\n# TYPE " << szName << " gauge\n" << szName << " " << v << "\n";
+    }
+
+    // Registration is rare, so the slots are shared with the scraping thread under a lock
+    std::mutex mtxThreads;
+    int nThreads = 0;
+    ThreadEntry aThread[MAX_THREADS];
+    // Only touched by the scraping thread
+    bool bScraped = false;
+    std::chrono::steady_clock::time_point tLastScrape;
+    uint64_t nLastFramesEncoded = 0, nLastBytesEncoded = 0;
+};
+
+/**
+* @brief Scoped timer that records its lifetime into one stage of RecorderMetrics.
+*/
+class StageTimer {
+public:
+    StageTimer(RecorderMetrics *pMetrics, RecorderMetrics::Stage eStage) : pMetrics(pMetrics), eStage(eStage) {
+        t0 = std::chrono::steady_clock::now();
+    }
+    ~StageTimer() {
+        if (pMetrics) {
+            pMetrics->aStageLatency[eStage].Record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count());
+        }
+    }
+private:
+    RecorderMetrics *pMetrics;
+    RecorderMetrics::Stage eStage;
+    std::chrono::steady_clock::time_point t0;
+};
+
+/**
+* @brief Minimal HTTP/1.0 server answering every request with the metrics text.
+* It listens on 127.0.0.1 only and serves one connection at a time on its own
+* thread, so a slow scraper can delay other scrapers but never the pipeline.
+* Try it with: curl http://127.0.0.1:<port>/metrics
+*/
+class MetricsServer {
+public:
+    MetricsServer(RecorderMetrics *pMetrics, unsigned short uPort) : pMetrics(pMetrics) {
+#ifdef _WIN32
+        WSADATA w;
+        if (WSAStartup(0x0101, &w) != 0) {
+            LOG(ERROR) << "WSAStartup() failed";
+            return;
+        }
+        bWsa = true;
+#endif
+        sListen = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (sListen == INVALID_SOCKET) {
+            LOG(ERROR) << "MetricsServer: socket() failed";
+            return;
+        }
+        int nReuse = 1;
+        setsockopt(sListen, SOL_SOCKET, SO_REUSEADDR, (const char *)&nReuse, sizeof(nReuse));
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(uPort);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(sListen, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sListen, 4) != 0) {
+            LOG(ERROR) << "MetricsServer: unable to listen on 127.0.0.1:" << uPort;
+            CloseSocket(sListen);
+            sListen = INVALID_SOCKET;
+            return;
+        }
+        LOG(INFO) << "Metrics available at http://127.0.0.1:" << uPort << "/metrics";
+        thServer = std::thread(&MetricsServer::Run, this);
+    }
+    ~MetricsServer() {
+        bStop = true;
+        if (thServer.joinable()) {
+            thServer.join();
+        }
+        if (sListen != INVALID_SOCKET) {
+            CloseSocket(sListen);
+        }
+#ifdef _WIN32
+        if (bWsa) {
+            WSACleanup();
+        }
+#endif
+    }
+
+private:
+    static bool WaitReadable(SOCKET s, int nTimeoutMs) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(s, &fds);
+        struct timeval tv = {nTimeoutMs / 1000, (nTimeoutMs % 1000) * 1000};
+        return select((int)s + 1, &fds, NULL, NULL, &tv) > 0;
+    }
+
+    void Run() {
+        while (!bStop) {
+            if (!WaitReadable(sListen, 200)) {
+                continue;
+            }
+            SOCKET s = accept(sListen, NULL, NULL);
+            if (s == INVALID_SOCKET) {
+                continue;
+            }
+            // The request itself is irrelevant; consume what arrives within a short time
+            char szRequest[1024];
+            if (WaitReadable(s, 1000)) {
+                recv(s, szRequest, sizeof(szRequest), 0);
+            }
+            std::string strBody = pMetrics->ToPrometheusText();
+            std::ostringstream oss;
+            oss << "HTTP/1.0 200 OK\r\n"
+                << "Content-Type: text/plain; version=0.0.4\r\n"
+                << "Content-Length: " << strBody.size() << "\r\n"
+                << "Connection: close\r\n\r\n"
+                << strBody;
+            std::string strResponse = oss.str();
+            // a scraper that hangs up early only loses its response
+            SendAll(s, strResponse.data(), strResponse.size());
+            CloseSocket(s);
+        }
+    }
+
+    RecorderMetrics *pMetrics;
+    SOCKET sListen = INVALID_SOCKET;
+    std::atomic<bool> bStop{false};
+    std::thread thServer;
+#ifdef _WIN32
+    bool bWsa = false;
+#endif
+};
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <stdio.h>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+#include "Logger.h"
+#include "PacketDistributor.h"
+#include "RecorderControl.h"
+#include "StartupTimer.h"
+
+extern simplelogger::Logger *logger;
+
+/**
+*  @brief The capture and encode half of a recorder: a device, an encoder session and its
+*  buffers that are created once in Init() and reused by every Run().
+*/
+class RecordingPipeline
+{
+public:
+    virtual ~RecordingPipeline() {}
+    /** One-time initialization; every step is marked as a phase of timer */
+    virtual void Init(StartupTimer &timer) = 0;
+    /** Annex-B SPS/PPS of the encoder session, for containers */
+    virtual void GetSequenceParams(std::vector<uint8_t> &vSeqParams) = 0;
+    /**
+    *  @brief Records into pDistributor until pControl is stopped, then flushes the encoder.
+    *  Timestamps start at 0 and the first frame is an IDR with SPS/PPS, whatever the previous
+    *  run left behind. Marks "first frame" on timer once it is delivered.
+    */
+    virtual void Run(PacketDistributor *pDistributor, RecorderControl *pControl, StartupTimer &timer) = 0;
+};
+
+/**
+*  @brief Creates the sinks of one recording in distributor. Whatever is returned is released
+*  before the sinks are closed (e.g. a trigger that calls into one of them).
+*/
+typedef std::function<std::shared_ptr<void>(PacketDistributor &distributor, const std::string &strPath)> AddSinksFunc;
+
+/**
+*  @brief Keeps a RecordingPipeline warm across recordings. A recording then only costs
+*  creating its sinks and starting the capture; the device, the encoder session and its
+*  buffers are reused. Startup is reported phase by phase, both the one-time
+*  initialization and what each recording adds to it.
+*/
+class RecorderService
+{
+public:
+    RecorderService(RecordingPipeline *pPipeline, AddSinksFunc funcAddSinks)
+        : pPipeline(pPipeline), funcAddSinks(funcAddSinks)
+    {
+        pPipeline->Init(initTimer);
+        LOG(INFO) << "Recorder initialized: " << initTimer.ToString();
+    }
+
+    /**
+    *  @brief Runs one recording to strPath until pControl is stopped; returns once the
+    *  encoder is flushed and all sinks are closed. The outputs are opened while the capture
+    *  starts; the first packet waits for them. If they cannot be opened the recording is
+    *  stopped and the error is thrown once the pipeline has returned.
+    */
+    void Record(const std::string &strPath, RecorderControl *pControl)
+    {
+        recordTimer.Restart();
+        PacketDistributor distributor;
+        distributor.Hold();
+        std::future<std::shared_ptr<void>> sinksAdded = std::async(std::launch::async, [&]() {
+            StartupTimer::Scope scope(recordTimer, "sinks");
+            try
+            {
+                std::shared_ptr<void> pKeepAlive = funcAddSinks(distributor, strPath);
+                distributor.Open();
+                return pKeepAlive;
+            }
+            catch (...)
+            {
+                pControl->Stop();
+                distributor.Open();
+                throw;
+            }
+        });
+        pPipeline->Run(&distributor, pControl, recordTimer);
+        std::shared_ptr<void> pKeepAlive = sinksAdded.get();
+        pKeepAlive.reset();
+        distributor.Close();
+        nRecordings++;
+        LOG(INFO) << "Recording has finished, saved in file " << strPath << " (started in " << recordTimer.ToString() << ")";
+    }
+
+    /**
+    *  @brief Service mode: waits on pControl for record commands and runs them one after the
+    *  other until quit. Recordings without a path are numbered after strDefaultPath
+    *  (name_0000.ext, name_0001.ext, ...). A recording that fails is logged and reported
+    *  through pControl, and the service waits for the next command.
+    */
+    void Serve(RecorderControl *pControl, const std::string &strDefaultPath)
+    {
+        LOG(INFO) << "Waiting for commands: record [path], pause, resume, stop, quit";
+        std::string strPath;
+        while (pControl->WaitForRecording(&strPath))
+        {
+            std::string strRecordingPath = strPath.empty() ? NumberedPath(strDefaultPath, nRecordings) : strPath;
+            try
+            {
+                Record(strRecordingPath, pControl);
+                pControl->Finish();
+            }
+            catch (const std::exception &ex)
+            {
+                LOG(ERROR) << "Recording to " << strRecordingPath << " failed: " << ex.what();
+                pControl->Finish(false);
+            }
+        }
+    }
+
+    StartupTimer &GetInitTimer() { return initTimer; }
+    /** Phases of the last (or current) recording's start */
+    StartupTimer &GetRecordTimer() { return recordTimer; }
+
+    static std::string NumberedPath(const std::string &strPath, int i)
+    {
+        size_t iDot = strPath.find_last_of('.');
+        size_t iSlash = strPath.find_last_of("/\\");
+        if (iDot == std::string::npos || (iSlash != std::string::npos && iDot < iSlash))
+        {
+            iDot = strPath.size();
+        }
+        char szIndex[16];
+        sprintf(szIndex, "_%04d", i);
+        return strPath.substr(0, iDot) + szIndex + strPath.substr(iDot);
+    }
+
+private:
+    RecordingPipeline *pPipeline;
+    AddSinksFunc funcAddSinks;
+    StartupTimer initTimer, recordTimer;
+    int nRecordings = 0;
+};
@@ -0,0 +1,353 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <signal.h>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <functional>
+#include "Logger.h"
+#include "PacketDistributor.h"
+#include "SegmentWriter.h"
+#include "RecorderMetrics.h"
+#include "SocketUtils.h"
+#include "../Queue.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+extern simplelogger::Logger *logger;
+
+struct ReplayOptions
+{
+    /** Length of the window kept in memory and written by a dump */
+    int nSeconds = 30;
+    /** Memory budget; whole GOPs are evicted from the front to stay below it */
+    uint64_t nMaxBytes = 512 << 20;
+    /** An IDR is requested when the encoder did not produce one for this long, which bounds the GOP size of the window */
+    int nKeyFrameIntervalMs = 2000;
+    /** Settings of dumps to .mp4 */
+    Mp4WriterOptions mp4Options;
+    /** Write a seek index next to raw dumps */
+    bool bIndex = true;
+};
+
+/**
+*  @brief Flight recorder sink: keeps the last nSeconds of encoded packets in memory,
+*  organized in GOPs so that the window always starts with a key frame. The packets are
+*  the distributor's shared ones, so the window costs no copies. Dump() snapshots the
+*  window (a vector of pointers, taken under a short lock) and writes it from a
+*  background thread, so neither capture nor encoding ever wait for the disk.
+*/
+class ReplayBuffer : public PacketSink
+{
+public:
+    ReplayBuffer(const std::string &strPath, int nWidth, int nHeight, const std::vector<uint8_t> &vSeqParams, const ReplayOptions &options,
+        NalCodec eCodec = NAL_CODEC_H264)
+        : nWidth(nWidth), nHeight(nHeight), vSeqParams(vSeqParams), options(options), eCodec(eCodec)
+    {
+        size_t iDot = strPath.find_last_of('.');
+        size_t iSlash = strPath.find_last_of("/\\");
+        if (iDot == std::string::npos || (iSlash != std::string::npos && iDot < iSlash))
+        {
+            iDot = strPath.size();
+        }
+        strStem = strPath.substr(0, iDot);
+        strExtension = strPath.substr(iDot);
+        thDump = std::thread(&ReplayBuffer::RunDump, this);
+    }
+
+    ~ReplayBuffer()
+    {
+        Close();
+    }
+
+    void Write(const EncodedPacketPtr &pPacket)
+    {
+        const EncodedPacket &packet = *pPacket;
+        std::lock_guard<std::mutex> lock(mtxWindow);
+        if (packet.bKeyFrame)
+        {
+            dqGop.push_back(Gop());
+            nLastKeyFrameUs = packet.nTimestampUs;
+        }
+        if (dqGop.empty())
+        {
+            // nothing decodable before the first key frame
+            return;
+        }
+        dqGop.back().vPacket.push_back(pPacket);
+        dqGop.back().nBytes += packet.vData.size();
+        nBytes += packet.vData.size();
+        nNewestUs = packet.nTimestampUs;
+        Evict();
+        bKeyFrameWanted = nNewestUs - nLastKeyFrameUs >= (int64_t)options.nKeyFrameIntervalMs * 1000;
+    }
+
+    bool IsKeyFrameWanted()
+    {
+        return bKeyFrameWanted;
+    }
+
+    /**
+    *  @brief Queues a dump of the last nSeconds (0: the whole window) and returns the file name
+    *  it will be written to, or an empty string if there is nothing to dump yet. Thread safe.
+    */
+    std::string Dump(int nSeconds = 0)
+    {
+        std::vector<EncodedPacketPtr> vSnapshot;
+        {
+            std::lock_guard<std::mutex> lock(mtxWindow);
+            int64_t nStartUs = nNewestUs - (int64_t)(nSeconds > 0 ? nSeconds : options.nSeconds) * 1000000;
+            // the latest GOP starting at or before the requested start, so the dump covers at least nSeconds
+            size_t iFirst = 0;
+            for (size_t i = 0; i < dqGop.size(); i++)
+            {
+                if (dqGop[i].vPacket.front()->nTimestampUs <= nStartUs)
+                {
+                    iFirst = i;
+                }
+            }
+            for (size_t i = iFirst; i < dqGop.size(); i++)
+            {
+                vSnapshot.insert(vSnapshot.end(), dqGop[i].vPacket.begin(), dqGop[i].vPacket.end());
+            }
+        }
+        if (vSnapshot.empty())
+        {
+            return std::string();
+        }
+        char szIndex[32];
+        sprintf(szIndex, "_replay_%04d", iDump++);
+        std::string strPath = strStem + szIndex + strExtension;
+        qDump.push(DumpJob{ strPath, std::move(vSnapshot) });
+        return strPath;
+    }
+
+    /**
+    *  @brief Waits for pending dumps; called by the distributor on the sink thread.
+    */
+    void Close()
+    {
+        if (!thDump.joinable())
+        {
+            return;
+        }
+        qDump.push(DumpJob());
+        thDump.join();
+    }
+
+    uint64_t GetBytes()
+    {
+        std::lock_guard<std::mutex> lock(mtxWindow);
+        return nBytes;
+    }
+
+private:
+    struct Gop
+    {
+        std::vector<EncodedPacketPtr> vPacket;
+        uint64_t nBytes = 0;
+    };
+
+    struct DumpJob
+    {
+        std::string strPath;
+        std::vector<EncodedPacketPtr> vPacket;
+    };
+
+    void Evict()
+    {
+        // drop the oldest GOP while the next one still starts early enough to cover the window
+        int64_t nWindowUs = (int64_t)options.nSeconds * 1000000;
+        while (dqGop.size() > 1 && (dqGop[1].vPacket.front()->nTimestampUs <= nNewestUs - nWindowUs || nBytes > options.nMaxBytes))
+        {
+            nBytes -= dqGop.front().nBytes;
+            dqGop.pop_front();
+        }
+        if (nBytes > options.nMaxBytes)
+        {
+            // a single GOP over budget: start over at the next key frame
+            nBytes = 0;
+            dqGop.clear();
+        }
+    }
+
+    void RunDump()
+    {
+        while (true)
+        {
+            DumpJob job = qDump.pop();
+            if (job.strPath.empty())
+            {
+                break;
+            }
+            try
+            {
+                SegmentFile file(job.strPath, nWidth, nHeight, vSeqParams, options.mp4Options, options.bIndex, eCodec);
+                for (const EncodedPacketPtr &pPacket : job.vPacket)
+                {
+                    file.WritePacket(pPacket->vData, pPacket->nTimestampUs);
+                }
+                file.Close();
+                LOG(INFO) << "Replay of " << (job.vPacket.back()->nTimestampUs - job.vPacket.front()->nTimestampUs) / 1000 << " ms saved in file " << job.strPath;
+            }
+            catch (const std::exception &ex)
+            {
+                LOG(ERROR) << "Replay dump failed: " << ex.what();
+            }
+        }
+    }
+
+    int nWidth, nHeight;
+    std::vector<uint8_t> vSeqParams;
+    ReplayOptions options;
+    NalCodec eCodec;
+    std::string strStem, strExtension;
+
+    std::mutex mtxWindow;
+    std::deque<Gop> dqGop;
+    uint64_t nBytes = 0;
+    int64_t nNewestUs = 0, nLastKeyFrameUs = 0;
+    std::atomic<bool> bKeyFrameWanted{false};
+
+    std::atomic<int> iDump{0};
+    Queue<DumpJob> qDump;
+    std::thread thDump;
+};
+
+/**
+*  @brief Triggers replay dumps from outside the process: SIGUSR1 (Ctrl+Break on Windows)
+*  and, if uPort is set, a "dump [seconds]" line sent to 127.0.0.1:uPort, which is answered
+*  with the name of the file being written. Try it with: echo dump 10 | nc 127.0.0.1 <port>
+*/
+class ReplayTrigger {
+public:
+    ReplayTrigger(std::function<std::string(int)> funcDump, unsigned short uPort = 0) : funcDump(funcDump) {
+#ifdef _WIN32
+        SetConsoleCtrlHandler(CtrlHandler, TRUE);
+#else
+        signal(SIGUSR1, SignalHandler);
+#endif
+        if (uPort) {
+            Listen(uPort);
+        }
+        thTrigger = std::thread(&ReplayTrigger::Run, this);
+    }
+    ~ReplayTrigger() {
+        bStop = true;
+        thTrigger.join();
+#ifdef _WIN32
+        SetConsoleCtrlHandler(CtrlHandler, FALSE);
+#else
+        signal(SIGUSR1, SIG_DFL);
+#endif
+        if (sListen != INVALID_SOCKET) {
+            CloseSocket(sListen);
+        }
+#ifdef _WIN32
+        if (bWsa) {
+            WSACleanup();
+        }
+#endif
+    }
+
+private:
+    static std::atomic<bool> &SignalFlag() {
+        static std::atomic<bool> bSignaled{false};
+        return bSignaled;
+    }
+#ifdef _WIN32
+    static BOOL WINAPI CtrlHandler(DWORD dwType) {
+        if (dwType != CTRL_BREAK_EVENT) {
+            return FALSE;
+        }
+        SignalFlag() = true;
+        return TRUE;
+    }
+#else
+    static void SignalHandler(int) {
+        SignalFlag() = true;
+    }
+#endif
+
+    void Listen(unsigned short uPort) {
+#ifdef _WIN32
+        WSADATA w;
+        if (WSAStartup(0x0101, &w) != 0) {
+            LOG(ERROR) << "WSAStartup() failed";
+            return;
+        }
+        bWsa = true;
+#endif
+        sListen = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (sListen == INVALID_SOCKET) {
+            LOG(ERROR) << "ReplayTrigger: socket() failed";
+            return;
+        }
+        int nReuse = 1;
+        setsockopt(sListen, SOL_SOCKET, SO_REUSEADDR, (const char *)&nReuse, sizeof(nReuse));
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(uPort);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(sListen, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sListen, 4) != 0) {
+            LOG(ERROR) << "ReplayTrigger: unable to listen on 127.0.0.1:" << uPort;
+            CloseSocket(sListen);
+            sListen = INVALID_SOCKET;
+            return;
+        }
+        LOG(INFO) << "Replay dumps on request at 127.0.0.1:" << uPort;
+    }
+
+    static bool WaitReadable(SOCKET s, int nTimeoutMs) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(s, &fds);
+        struct timeval tv = {nTimeoutMs / 1000, (nTimeoutMs % 1000) * 1000};
+        return select((int)s + 1, &fds, NULL, NULL, &tv) > 0;
+    }
+
+    void Run() {
+        while (!bStop) {
+            if (SignalFlag().exchange(false)) {
+                std::string strPath = funcDump(0);
+                LOG(INFO) << "Replay dump requested by signal: " << (strPath.empty() ? "nothing recorded yet" : strPath);
+            }
+            if (sListen == INVALID_SOCKET) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                continue;
+            }
+            if (!WaitReadable(sListen, 100)) {
+                continue;
+            }
+            SOCKET s = accept(sListen, NULL, NULL);
+            if (s == INVALID_SOCKET) {
+                continue;
+            }
+            char szCommand[256] = {};
+            int nSeconds = 0;
+            std::string strReply = "error: expected \"dump [seconds]\"\n";
+            if (WaitReadable(s, 1000) && recv(s, szCommand, sizeof(szCommand) - 1, 0) > 0 && !strncmp(szCommand, "dump", 4)) {
+                sscanf(szCommand + 4, "%d", &nSeconds);
+                std::string strPath = funcDump(nSeconds);
+                strReply = strPath.empty() ? "error: nothing recorded yet\n" : strPath + "\n";
+            }
+            SendAll(s, strReply.data(), strReply.size());
+            CloseSocket(s);
+        }
+    }
+
+    std::function<std::string(int)> funcDump;
+    SOCKET sListen = INVALID_SOCKET;
+    std::atomic<bool> bStop{false};
+    std::thread thTrigger;
+#ifdef _WIN32
+    bool bWsa = false;
+#endif
+};
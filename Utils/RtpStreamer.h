@@ -0,0 +1,536 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <functional>
+#include "Logger.h"
+#include "NalScanner.h"
+#include "RecorderMetrics.h"
+#include "SocketUtils.h"
+#include "../Queue.h"
+
+#ifdef __linux__
+#include <sys/uio.h>
+#endif
+
+extern simplelogger::Logger *logger;
+
+/**
+*  Live preview of the encoded stream over RTP (RFC 3550) with the H.264 payload
+*  format of RFC 6184: NAL units that fit the MTU go out as single NAL unit packets,
+*  larger ones are split into FU-A fragments. The first packet of every access unit
+*  carries the capture time (wall clock, microseconds) in a one-byte header extension
+*  (RFC 8285, ID 1), so a receiver can measure capture-to-display latency.
+*  Play it with an SDP file describing "m=video <port> RTP/AVP 96" / "a=rtpmap:96 H264/90000".
+*/
+
+/** Wall clock in microseconds; comparable across machines as far as their clocks are synchronized */
+inline int64_t RtpWallClockUs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+/**
+*  @brief Token bucket limiting the average send rate while allowing bursts of up to nBurstBytes.
+*/
+class TokenBucket {
+public:
+    TokenBucket(double dBytesPerSecond, double dBurstBytes) : dRate(dBytesPerSecond), dBurst(dBurstBytes), dTokens(dBurstBytes) {}
+
+    /**
+    *  @brief Takes n tokens if available without waiting.
+    */
+    bool TryConsume(size_t n) {
+        if (dRate <= 0) {
+            return true;
+        }
+        Refill();
+        if (dTokens < n) {
+            return false;
+        }
+        dTokens -= n;
+        return true;
+    }
+
+    /**
+    *  @brief Sleeps until n tokens are available, then takes them.
+    */
+    void Consume(size_t n) {
+        if (dRate <= 0) {
+            return;
+        }
+        Refill();
+        if (dTokens < n) {
+            std::this_thread::sleep_for(std::chrono::duration<double>((n - dTokens) / dRate));
+            Refill();
+        }
+        dTokens -= n;
+    }
+
+private:
+    void Refill() {
+        auto tNow = std::chrono::steady_clock::now();
+        dTokens += std::chrono::duration<double>(tNow - tLast).count() * dRate;
+        if (dTokens > dBurst) {
+            dTokens = dBurst;
+        }
+        tLast = tNow;
+    }
+
+    double dRate, dBurst, dTokens;
+    std::chrono::steady_clock::time_point tLast = std::chrono::steady_clock::now();
+};
+
+/**
+*  @brief Turns Annex-B access units into RTP packets. All packets of an access unit
+*  live in one reused buffer, so steady state packetization does not allocate.
+*/
+class RtpH264Packetizer {
+public:
+    enum { RTP_HEADER_SIZE = 12, CAPTURE_TIME_EXTENSION_SIZE = 16, FU_A = 28 };
+
+    RtpH264Packetizer(uint32_t nSsrc, int nMaxPacketSize, uint8_t nPayloadType = 96)
+        : nSsrc(nSsrc), nMaxPacketSize(nMaxPacketSize), nPayloadType(nPayloadType) {}
+
+    /**
+    *  @brief Packetizes one access unit; the packets are then available through GetPacketCount()/GetPacket().
+    */
+    void Packetize(const uint8_t *pData, size_t nSize, uint32_t nRtpTimestamp, int64_t nCaptureTimeUs) {
+        vBuffer.clear();
+        vPacket.clear();
+        SplitAnnexB(pData, nSize, vNal);
+        for (size_t i = 0; i < vNal.size(); i++) {
+            const NalUnit &nal = vNal[i];
+            bool bLastNal = i + 1 == vNal.size();
+            size_t nRoom = nMaxPacketSize - RTP_HEADER_SIZE - (vPacket.empty() ? CAPTURE_TIME_EXTENSION_SIZE : 0);
+            if (nal.nSize <= nRoom) {
+                BeginPacket(nRtpTimestamp, nCaptureTimeUs, bLastNal);
+                Append(nal.pData, nal.nSize);
+                continue;
+            }
+            // FU-A: the NAL header is replaced by the FU indicator and FU header
+            uint8_t uIndicator = (nal.pData[0] & 0xE0) | FU_A, uType = nal.pData[0] & 0x1F;
+            const uint8_t *p = nal.pData + 1, *pEnd = nal.pData + nal.nSize;
+            while (p < pEnd) {
+                nRoom = nMaxPacketSize - RTP_HEADER_SIZE - 2 - (vPacket.empty() ? CAPTURE_TIME_EXTENSION_SIZE : 0);
+                size_t nChunk = std::min<size_t>(nRoom, pEnd - p);
+                bool bStart = p == nal.pData + 1, bEnd = p + nChunk == pEnd;
+                BeginPacket(nRtpTimestamp, nCaptureTimeUs, bLastNal && bEnd);
+                uint8_t aFu[2] = { uIndicator, (uint8_t)((bStart ? 0x80 : 0) | (bEnd ? 0x40 : 0) | uType) };
+                Append(aFu, 2);
+                Append(p, nChunk);
+                p += nChunk;
+            }
+        }
+    }
+
+    size_t GetPacketCount() const { return vPacket.size(); }
+    const uint8_t *GetPacket(size_t i) const { return vBuffer.data() + vPacket[i].first; }
+    size_t GetPacketSize(size_t i) const { return vPacket[i].second; }
+
+private:
+    void BeginPacket(uint32_t nRtpTimestamp, int64_t nCaptureTimeUs, bool bMarker) {
+        bool bExtension = vPacket.empty();
+        vPacket.push_back(std::make_pair(vBuffer.size(), (size_t)0));
+        uint8_t aHeader[RTP_HEADER_SIZE + CAPTURE_TIME_EXTENSION_SIZE];
+        aHeader[0] = 0x80 | (bExtension ? 0x10 : 0);
+        aHeader[1] = (bMarker ? 0x80 : 0) | nPayloadType;
+        PutBE(aHeader + 2, nSeq++, 2);
+        PutBE(aHeader + 4, nRtpTimestamp, 4);
+        PutBE(aHeader + 8, nSsrc, 4);
+        size_t n = RTP_HEADER_SIZE;
+        if (bExtension) {
+            // 0xBEDE profile, 3 words: ID 1 with 8 bytes of capture time, then 3 bytes of padding
+            uint8_t *pExt = aHeader + RTP_HEADER_SIZE;
+            PutBE(pExt, 0xBEDE, 2);
+            PutBE(pExt + 2, 3, 2);
+            pExt[4] = (1 << 4) | (8 - 1);
+            PutBE(pExt + 5, (uint64_t)nCaptureTimeUs, 8);
+            memset(pExt + 13, 0, 3);
+            n += CAPTURE_TIME_EXTENSION_SIZE;
+        }
+        Append(aHeader, n);
+    }
+
+    void Append(const uint8_t *p, size_t n) {
+        vBuffer.insert(vBuffer.end(), p, p + n);
+        vPacket.back().second += n;
+    }
+
+    static void PutBE(uint8_t *p, uint64_t v, int nBytes) {
+        for (int i = nBytes - 1; i >= 0; i--, v >>= 8) {
+            p[i] = (uint8_t)v;
+        }
+    }
+
+    uint32_t nSsrc;
+    int nMaxPacketSize;
+    uint8_t nPayloadType;
+    uint16_t nSeq = 0;
+    std::vector<uint8_t> vBuffer;
+    std::vector<std::pair<size_t, size_t>> vPacket;
+    std::vector<NalUnit> vNal;
+};
+
+struct RtpSenderOptions {
+    /** Largest UDP payload; 1200 stays below the usual 1500 byte MTU with room for tunnels */
+    int nMaxPacketSize = 1200;
+    /** Average send rate; 0 sends every access unit as fast as possible */
+    int nPaceMbps = 100;
+    /** Bytes that may leave back to back before pacing kicks in */
+    int nBurstBytes = 64 * 1024;
+    /** Datagrams handed to the kernel per sendmmsg() call */
+    int nBatch = 32;
+    /** Access units buffered between Send() and the sending thread */
+    size_t nQueueFrames = 16;
+    uint8_t nPayloadType = 96;
+};
+
+/**
+*  @brief Sends access units to one UDP destination from its own thread.
+*  Send() copies the access unit and returns; pacing and socket calls never block the
+*  encoding thread. When the queue is full the access unit is dropped, and so is
+*  everything up to the next IDR.
+*/
+class RtpSender {
+public:
+    RtpSender(const std::string &strHost, unsigned short uPort, const RtpSenderOptions &options = RtpSenderOptions())
+        : options(options), packetizer((uint32_t)RtpWallClockUs(), options.nMaxPacketSize, options.nPayloadType),
+        bucket(options.nPaceMbps * 1.0e6 / 8, options.nBurstBytes), qFrame(options.nQueueFrames) {
+#ifdef _WIN32
+        WSADATA w;
+        if (WSAStartup(0x0101, &w) != 0) {
+            LOG(ERROR) << "WSAStartup() failed";
+            return;
+        }
+        bWsa = true;
+#endif
+        s = ::socket(AF_INET, SOCK_DGRAM, 0);
+        if (s == INVALID_SOCKET) {
+            LOG(ERROR) << "RtpSender: socket() failed";
+            return;
+        }
+        int nSndBuf = 1 << 20;
+        setsockopt(s, SOL_SOCKET, SO_SNDBUF, (const char *)&nSndBuf, sizeof(nSndBuf));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(uPort);
+        addr.sin_addr.s_addr = inet_addr(strHost.c_str());
+        LOG(INFO) << "RTP preview to " << strHost << ":" << uPort;
+    }
+    ~RtpSender() {
+        qFrame.close();
+        if (thSend.joinable()) {
+            thSend.join();
+        }
+        if (s != INVALID_SOCKET) {
+            CloseSocket(s);
+        }
+#ifdef _WIN32
+        if (bWsa) {
+            WSACleanup();
+        }
+#endif
+        if (nDroppedFrames) {
+            LOG(WARNING) << "RtpSender: " << nDroppedFrames << " frames dropped because the network could not keep up";
+        }
+    }
+
+    /**
+    *  @brief Queues one access unit; nTimestampUs is its presentation time, nCaptureTimeUs
+    *  the wall clock time (RtpWallClockUs()) it was captured at. Returns false if dropped.
+    */
+    bool Send(const uint8_t *pData, size_t nSize, int64_t nTimestampUs, int64_t nCaptureTimeUs) {
+        if (s == INVALID_SOCKET) {
+            return false;
+        }
+        bool bKeyFrame = IsH264KeyFrame(pData, nSize);
+        if (bWaitKeyFrame && !bKeyFrame) {
+            nDroppedFrames++;
+            return false;
+        }
+        RtpFrame frame;
+        frame.vData = GetBuffer();
+        frame.vData.assign(pData, pData + nSize);
+        frame.nRtpTimestamp = (uint32_t)(nTimestampUs * 9 / 100);
+        frame.nCaptureTimeUs = nCaptureTimeUs;
+        if (!thSend.joinable()) {
+            thSend = std::thread(&RtpSender::Run, this);
+        }
+        if (!qFrame.try_push(std::move(frame))) {
+            bWaitKeyFrame = true;
+            nDroppedFrames++;
+            return false;
+        }
+        bWaitKeyFrame = false;
+        return true;
+    }
+
+    /**
+    *  @brief Packetizes and sends one access unit on the calling thread, waiting for the
+    *  pacer as needed. For callers that already run on their own thread; do not mix with Send().
+    */
+    void SendNow(const uint8_t *pData, size_t nSize, int64_t nTimestampUs, int64_t nCaptureTimeUs) {
+        if (s == INVALID_SOCKET) {
+            return;
+        }
+        packetizer.Packetize(pData, nSize, (uint32_t)(nTimestampUs * 9 / 100), nCaptureTimeUs);
+        SendPackets();
+    }
+
+    uint64_t GetPacketsSent() const { return nPacketsSent; }
+    uint64_t GetDroppedFrames() const { return nDroppedFrames; }
+
+private:
+    struct RtpFrame {
+        std::vector<uint8_t> vData;
+        uint32_t nRtpTimestamp;
+        int64_t nCaptureTimeUs;
+    };
+
+    std::vector<uint8_t> GetBuffer() {
+        std::lock_guard<std::mutex> lock(mtxFree);
+        if (vFreeBuffer.empty()) {
+            return std::vector<uint8_t>();
+        }
+        std::vector<uint8_t> v = std::move(vFreeBuffer.back());
+        vFreeBuffer.pop_back();
+        return v;
+    }
+
+    void RecycleBuffer(std::vector<uint8_t> &&v) {
+        std::lock_guard<std::mutex> lock(mtxFree);
+        vFreeBuffer.push_back(std::move(v));
+    }
+
+    void Run() {
+        RtpFrame frame;
+        while (qFrame.pop(frame)) {
+            packetizer.Packetize(frame.vData.data(), frame.vData.size(), frame.nRtpTimestamp, frame.nCaptureTimeUs);
+            RecycleBuffer(std::move(frame.vData));
+            SendPackets();
+        }
+    }
+
+    void SendPackets() {
+        // packets covered by the bucket go out together; the batch is flushed before waiting for tokens
+        size_t iFirst = 0;
+        for (size_t i = 0; i < packetizer.GetPacketCount(); i++) {
+            size_t nSize = packetizer.GetPacketSize(i);
+            if (!bucket.TryConsume(nSize)) {
+                SendBatch(iFirst, i);
+                iFirst = i;
+                bucket.Consume(nSize);
+            }
+            if (i + 1 - iFirst >= (size_t)options.nBatch) {
+                SendBatch(iFirst, i + 1);
+                iFirst = i + 1;
+            }
+        }
+        SendBatch(iFirst, packetizer.GetPacketCount());
+    }
+
+    void SendBatch(size_t iBegin, size_t iEnd) {
+        if (iBegin >= iEnd) {
+            return;
+        }
+#ifdef __linux__
+        size_t n = iEnd - iBegin;
+        vIov.resize(n);
+        vMsg.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            vIov[i].iov_base = (void *)packetizer.GetPacket(iBegin + i);
+            vIov[i].iov_len = packetizer.GetPacketSize(iBegin + i);
+            memset(&vMsg[i], 0, sizeof(vMsg[i]));
+            vMsg[i].msg_hdr.msg_name = &addr;
+            vMsg[i].msg_hdr.msg_namelen = sizeof(addr);
+            vMsg[i].msg_hdr.msg_iov = &vIov[i];
+            vMsg[i].msg_hdr.msg_iovlen = 1;
+        }
+        size_t nDone = 0;
+        while (nDone < n) {
+            int r = sendmmsg(s, vMsg.data() + nDone, (unsigned)(n - nDone), 0);
+            if (r <= 0) {
+                LOG(ERROR) << "RtpSender: sendmmsg() failed";
+                break;
+            }
+            nDone += r;
+        }
+        nPacketsSent += nDone;
+#else
+        for (size_t i = iBegin; i < iEnd; i++) {
+            if (sendto(s, (const char *)packetizer.GetPacket(i), (int)packetizer.GetPacketSize(i), 0, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+                LOG(ERROR) << "RtpSender: sendto() failed";
+                break;
+            }
+            nPacketsSent++;
+        }
+#endif
+    }
+
+    RtpSenderOptions options;
+    RtpH264Packetizer packetizer;
+    TokenBucket bucket;
+    SOCKET s = INVALID_SOCKET;
+    struct sockaddr_in addr = {};
+#ifdef __linux__
+    std::vector<struct iovec> vIov;
+    std::vector<struct mmsghdr> vMsg;
+#endif
+    bool bWaitKeyFrame = false;
+    BoundedQueue<RtpFrame> qFrame;
+    std::mutex mtxFree;
+    std::vector<std::vector<uint8_t>> vFreeBuffer;
+    std::thread thSend;
+    std::atomic<uint64_t> nPacketsSent{0}, nDroppedFrames{0};
+#ifdef _WIN32
+    bool bWsa = false;
+#endif
+};
+
+/**
+*  @brief Loopback receiver for RtpSender: reassembles the access units, counts lost
+*  packets and records the capture-to-reassembly latency of every complete frame.
+*/
+class RtpReceiver {
+public:
+    RtpReceiver(unsigned short uPort, std::function<void(const std::vector<uint8_t> &)> funcFrame = nullptr) : funcFrame(funcFrame) {
+#ifdef _WIN32
+        WSADATA w;
+        if (WSAStartup(0x0101, &w) != 0) {
+            LOG(ERROR) << "WSAStartup() failed";
+            return;
+        }
+        bWsa = true;
+#endif
+        s = ::socket(AF_INET, SOCK_DGRAM, 0);
+        if (s == INVALID_SOCKET) {
+            LOG(ERROR) << "RtpReceiver: socket() failed";
+            return;
+        }
+        int nRcvBuf = 4 << 20;
+        setsockopt(s, SOL_SOCKET, SO_RCVBUF, (const char *)&nRcvBuf, sizeof(nRcvBuf));
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(uPort);
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            LOG(ERROR) << "RtpReceiver: unable to bind port " << uPort;
+            CloseSocket(s);
+            s = INVALID_SOCKET;
+            return;
+        }
+        thReceive = std::thread(&RtpReceiver::Run, this);
+    }
+    ~RtpReceiver() {
+        bStop = true;
+        if (thReceive.joinable()) {
+            thReceive.join();
+        }
+        if (s != INVALID_SOCKET) {
+            CloseSocket(s);
+        }
+#ifdef _WIN32
+        if (bWsa) {
+            WSACleanup();
+        }
+#endif
+    }
+
+    const LatencyHistogram &GetLatency() const { return latency; }
+    uint64_t GetFrames() const { return nFrames; }
+    uint64_t GetLostPackets() const { return nLostPackets; }
+
+private:
+    void Run() {
+        std::vector<uint8_t> vPacket(65536);
+        while (!bStop) {
+            fd_set fds;
+            FD_ZERO(&fds);
+            FD_SET(s, &fds);
+            struct timeval tv = {0, 100000};
+            if (select((int)s + 1, &fds, NULL, NULL, &tv) <= 0) {
+                continue;
+            }
+            int n = recv(s, (char *)vPacket.data(), (int)vPacket.size(), 0);
+            if (n >= RtpH264Packetizer::RTP_HEADER_SIZE) {
+                OnPacket(vPacket.data(), n);
+            }
+        }
+    }
+
+    void OnPacket(const uint8_t *p, int n) {
+        uint16_t nSeq = (uint16_t)(p[2] << 8 | p[3]);
+        if (bHaveSeq && nSeq != (uint16_t)(nLastSeq + 1)) {
+            nLostPackets += (uint16_t)(nSeq - nLastSeq - 1);
+            bBroken = true;
+        }
+        bHaveSeq = true;
+        nLastSeq = nSeq;
+        bool bMarker = (p[1] & 0x80) != 0;
+        int iPayload = RtpH264Packetizer::RTP_HEADER_SIZE + (p[0] & 0x0F) * 4;
+        if (p[0] & 0x10) {
+            if (n < iPayload + 4) {
+                return;
+            }
+            int nExtWords = p[iPayload + 2] << 8 | p[iPayload + 3];
+            if (p[iPayload] == 0xBE && p[iPayload + 1] == 0xDE && nExtWords >= 3 && p[iPayload + 4] == ((1 << 4) | 7)) {
+                nCaptureTimeUs = 0;
+                for (int i = 0; i < 8; i++) {
+                    nCaptureTimeUs = nCaptureTimeUs << 8 | p[iPayload + 5 + i];
+                }
+            }
+            iPayload += 4 + nExtWords * 4;
+        }
+        if (iPayload >= n) {
+            return;
+        }
+        const uint8_t *pPayload = p + iPayload;
+        int nPayload = n - iPayload;
+        static const uint8_t aStartCode[] = { 0, 0, 0, 1 };
+        if ((pPayload[0] & 0x1F) == RtpH264Packetizer::FU_A) {
+            if (nPayload < 2) {
+                return;
+            }
+            if (pPayload[1] & 0x80) {
+                vFrame.insert(vFrame.end(), aStartCode, aStartCode + 4);
+                vFrame.push_back((pPayload[0] & 0xE0) | (pPayload[1] & 0x1F));
+            }
+            vFrame.insert(vFrame.end(), pPayload + 2, pPayload + nPayload);
+        } else {
+            vFrame.insert(vFrame.end(), aStartCode, aStartCode + 4);
+            vFrame.insert(vFrame.end(), pPayload, pPayload + nPayload);
+        }
+        if (bMarker) {
+            if (!bBroken) {
+                latency.Record((uint64_t)std::max<int64_t>(0, RtpWallClockUs() - nCaptureTimeUs));
+                nFrames++;
+                if (funcFrame) {
+                    funcFrame(vFrame);
+                }
+            }
+            vFrame.clear();
+            bBroken = false;
+        }
+    }
+
+    SOCKET s = INVALID_SOCKET;
+    std::function<void(const std::vector<uint8_t> &)> funcFrame;
+    std::vector<uint8_t> vFrame;
+    int64_t nCaptureTimeUs = 0;
+    uint16_t nLastSeq = 0;
+    bool bHaveSeq = false, bBroken = false;
+    LatencyHistogram latency;
+    std::atomic<uint64_t> nFrames{0}, nLostPackets{0};
+    std::atomic<bool> bStop{false};
+    std::thread thReceive;
+#ifdef _WIN32
+    bool bWsa = false;
+#endif
+};
@@ -0,0 +1,365 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <ostream>
+#include <algorithm>
+#include <stdexcept>
+#include "NalScanner.h"
+
+/**
+*  Sidecar seek index of a raw Annex-B recording, written next to it as <recording>.idx.
+*  The file is a header followed by one fixed-size record per access unit in stream order,
+*  all little-endian. Records are only ever appended, so the index can be read (or
+*  memory-mapped) while the recording grows, a lookup is a binary search in place, and a
+*  recording cut short by a crash keeps the index of everything up to its last whole record.
+*
+*  Header (16 bytes): "NVSI" | uint16 version | uint16 record size | uint8 codec | 7 reserved
+*  Record (24 bytes): uint64 byte offset | int64 pts in us | uint32 size | uint32 flags
+*/
+
+enum SeekIndexFlags
+{
+    SEEK_INDEX_KEY_FRAME = 1,
+    /** The bytes of the frame start with the SPS/PPS (and VPS) */
+    SEEK_INDEX_PARAMETER_SETS = 2,
+};
+
+struct SeekIndexEntry
+{
+    uint64_t nOffset = 0;
+    int64_t nPtsUs = 0;
+    uint32_t nSize = 0;
+    uint32_t nFlags = 0;
+
+    bool IsKeyFrame() const { return (nFlags & SEEK_INDEX_KEY_FRAME) != 0; }
+};
+
+static const char SEEK_INDEX_MAGIC[4] = { 'N', 'V', 'S', 'I' };
+static const uint16_t SEEK_INDEX_VERSION = 1;
+static const uint32_t SEEK_INDEX_HEADER_SIZE = 16;
+static const uint32_t SEEK_INDEX_RECORD_SIZE = 24;
+
+inline std::string GetSeekIndexPath(const std::string &strRecordingPath)
+{
+    return strRecordingPath + ".idx";
+}
+
+inline void PutLe(uint8_t *p, uint64_t n, int nBytes)
+{
+    for (int i = 0; i < nBytes; i++)
+    {
+        p[i] = (uint8_t)(n >> (8 * i));
+    }
+}
+
+inline uint64_t GetLe(const uint8_t *p, int nBytes)
+{
+    uint64_t n = 0;
+    for (int i = nBytes - 1; i >= 0; i--)
+    {
+        n = n << 8 | p[i];
+    }
+    return n;
+}
+
+/**
+*  @brief Appends the index records of a raw recording as its writer stores the frames. The
+*  offsets are implied: every byte of the recording belongs to the record it was appended with.
+*/
+class SeekIndexWriter
+{
+public:
+    SeekIndexWriter(const std::string &strPath, NalCodec eCodec = NAL_CODEC_H264) : eCodec(eCodec)
+    {
+        fpOut.open(strPath, std::ios::out | std::ios::binary);
+        if (!fpOut)
+        {
+            throw std::invalid_argument("Unable to open index file: " + strPath);
+        }
+        uint8_t aHeader[SEEK_INDEX_HEADER_SIZE] = {};
+        memcpy(aHeader, SEEK_INDEX_MAGIC, 4);
+        PutLe(aHeader + 4, SEEK_INDEX_VERSION, 2);
+        PutLe(aHeader + 6, SEEK_INDEX_RECORD_SIZE, 2);
+        aHeader[8] = (uint8_t)eCodec;
+        fpOut.write(reinterpret_cast<const char *>(aHeader), sizeof(aHeader));
+        fpOut.flush();
+    }
+
+    /** Indexes an access unit the recording stores as is */
+    void Append(const uint8_t *pData, size_t nSize, int64_t nPtsUs)
+    {
+        Append(nSize, nPtsUs, GetFlags(pData, nSize, eCodec));
+    }
+
+    /** Indexes the next nSize bytes of the recording as one frame */
+    void Append(uint64_t nSize, int64_t nPtsUs, uint32_t nFlags)
+    {
+        uint8_t aRecord[SEEK_INDEX_RECORD_SIZE];
+        PutLe(aRecord, nOffset, 8);
+        PutLe(aRecord + 8, (uint64_t)nPtsUs, 8);
+        PutLe(aRecord + 16, nSize, 4);
+        PutLe(aRecord + 20, nFlags, 4);
+        fpOut.write(reinterpret_cast<const char *>(aRecord), sizeof(aRecord));
+        nOffset += nSize;
+        nEntries++;
+        // whatever a crash loses of the index lies after the last key frame
+        if (nFlags & SEEK_INDEX_KEY_FRAME)
+        {
+            fpOut.flush();
+        }
+    }
+
+    void Close()
+    {
+        fpOut.close();
+    }
+
+    uint64_t GetEntryCount() const { return nEntries; }
+
+    static uint32_t GetFlags(const uint8_t *pData, size_t nSize, NalCodec eCodec)
+    {
+        NalPacketInfo info;
+        DescribePacket(pData, nSize, eCodec, &info);
+        return (info.bKeyFrame ? SEEK_INDEX_KEY_FRAME : 0) | (info.bParameterSets ? SEEK_INDEX_PARAMETER_SETS : 0);
+    }
+
+private:
+    NalCodec eCodec;
+    std::ofstream fpOut;
+    uint64_t nOffset = 0, nEntries = 0;
+};
+
+/**
+*  @brief Random access to a raw recording through its seek index. A lookup reads only the
+*  records of a binary search and of the walk back to the preceding key frame, and an
+*  extraction reads only the bytes of the range, so pulling a clip costs I/O in proportion to
+*  the clip, not to the recording.
+*  The search takes the pts to increase in stream order, as they do without B frames; with B
+*  frames a range may start or end off by the reorder depth but stays decodable.
+*/
+class RecordingReader
+{
+public:
+    RecordingReader(const std::string &strPath, const std::string &strIndexPath = std::string())
+    {
+        std::string strIndex = strIndexPath.empty() ? GetSeekIndexPath(strPath) : strIndexPath;
+        fpIn.open(strPath, std::ios::in | std::ios::binary);
+        if (!fpIn)
+        {
+            throw std::invalid_argument("Unable to open recording: " + strPath);
+        }
+        fpIndex.open(strIndex, std::ios::in | std::ios::binary);
+        if (!fpIndex)
+        {
+            throw std::invalid_argument("Unable to open index file: " + strIndex);
+        }
+        uint8_t aHeader[SEEK_INDEX_HEADER_SIZE];
+        if (!fpIndex.read(reinterpret_cast<char *>(aHeader), sizeof(aHeader)) || memcmp(aHeader, SEEK_INDEX_MAGIC, 4)
+            || GetLe(aHeader + 4, 2) != SEEK_INDEX_VERSION || GetLe(aHeader + 6, 2) < SEEK_INDEX_RECORD_SIZE)
+        {
+            throw std::invalid_argument("Not a seek index: " + strIndex);
+        }
+        nRecordSize = (uint32_t)GetLe(aHeader + 6, 2);
+        eCodec = aHeader[8] == NAL_CODEC_HEVC ? NAL_CODEC_HEVC : NAL_CODEC_H264;
+
+        fpIn.seekg(0, std::ios::end);
+        nRecordingSize = (uint64_t)fpIn.tellg();
+        fpIndex.seekg(0, std::ios::end);
+        nEntries = ((uint64_t)fpIndex.tellg() - SEEK_INDEX_HEADER_SIZE) / nRecordSize;
+        // the index of a recording that was not flushed completely can run past its end
+        while (nEntries)
+        {
+            SeekIndexEntry entry = GetEntry(nEntries - 1);
+            if (entry.nOffset + entry.nSize <= nRecordingSize)
+            {
+                break;
+            }
+            nEntries--;
+        }
+    }
+
+    uint64_t GetFrameCount() const { return nEntries; }
+    NalCodec GetCodec() const { return eCodec; }
+
+    SeekIndexEntry GetEntry(uint64_t i)
+    {
+        uint8_t aRecord[SEEK_INDEX_RECORD_SIZE];
+        fpIndex.clear();
+        fpIndex.seekg(SEEK_INDEX_HEADER_SIZE + i * nRecordSize);
+        if (!fpIndex.read(reinterpret_cast<char *>(aRecord), sizeof(aRecord)))
+        {
+            throw std::runtime_error("Unable to read the seek index");
+        }
+        SeekIndexEntry entry;
+        entry.nOffset = GetLe(aRecord, 8);
+        entry.nPtsUs = (int64_t)GetLe(aRecord + 8, 8);
+        entry.nSize = (uint32_t)GetLe(aRecord + 16, 4);
+        entry.nFlags = (uint32_t)GetLe(aRecord + 20, 4);
+        return entry;
+    }
+
+    /** First frame with a pts at or after nTimeUs; GetFrameCount() if there is none */
+    uint64_t FindFrame(int64_t nTimeUs)
+    {
+        uint64_t iLow = 0, iHigh = nEntries;
+        while (iLow < iHigh)
+        {
+            uint64_t iMid = iLow + (iHigh - iLow) / 2;
+            if (GetEntry(iMid).nPtsUs < nTimeUs)
+            {
+                iLow = iMid + 1;
+            }
+            else
+            {
+                iHigh = iMid;
+            }
+        }
+        return iLow;
+    }
+
+    /** Last key frame at or before frame i; 0 if the recording has none before it */
+    uint64_t FindKeyFrame(uint64_t i)
+    {
+        i = (std::min)(i, nEntries ? nEntries - 1 : 0);
+        while (i > 0 && !GetEntry(i).IsKeyFrame())
+        {
+            i--;
+        }
+        return i;
+    }
+
+    /**
+    *  @brief Frames [*piBegin, *piEnd) that show [nStartUs, nEndUs): from the key frame at or
+    *  before nStartUs to the last frame before nEndUs. False if the range starts after the last
+    *  frame or ends before the first.
+    */
+    bool FindRange(int64_t nStartUs, int64_t nEndUs, uint64_t *piBegin, uint64_t *piEnd)
+    {
+        uint64_t iStart = FindFrame(nStartUs);
+        if (iStart == nEntries)
+        {
+            return false;
+        }
+        // the frame on screen at nStartUs is the last one that began at or before it
+        if (iStart > 0 && GetEntry(iStart).nPtsUs > nStartUs)
+        {
+            iStart--;
+        }
+        *piBegin = FindKeyFrame(iStart);
+        *piEnd = FindFrame(nEndUs);
+        return *piEnd > *piBegin;
+    }
+
+    bool ReadFrame(uint64_t i, std::vector<uint8_t> &vData, SeekIndexEntry *pEntry = NULL)
+    {
+        if (i >= nEntries)
+        {
+            return false;
+        }
+        SeekIndexEntry entry = GetEntry(i);
+        vData.resize(entry.nSize);
+        fpIn.clear();
+        fpIn.seekg(entry.nOffset);
+        if (!fpIn.read(reinterpret_cast<char *>(vData.data()), entry.nSize))
+        {
+            return false;
+        }
+        if (pEntry)
+        {
+            *pEntry = entry;
+        }
+        return true;
+    }
+
+    /**
+    *  @brief The SPS/PPS (and VPS) of the recording, from the first frame that carries them,
+    *  with 4-byte start codes. Empty if no frame does.
+    */
+    void GetSequenceParams(std::vector<uint8_t> &vSeqParams)
+    {
+        vSeqParams.clear();
+        std::vector<uint8_t> vFrame;
+        std::vector<NalUnit> vNal;
+        for (uint64_t i = 0; i < nEntries; i++)
+        {
+            if (!(GetEntry(i).nFlags & SEEK_INDEX_PARAMETER_SETS) || !ReadFrame(i, vFrame))
+            {
+                continue;
+            }
+            SplitAnnexB(vFrame.data(), vFrame.size(), vNal);
+            for (const NalUnit &nal : vNal)
+            {
+                bool bParams = eCodec == NAL_CODEC_HEVC
+                    ? GetHevcNalType(nal) >= HEVC_NAL_VPS && GetHevcNalType(nal) <= HEVC_NAL_PPS
+                    : GetH264NalType(nal) == H264_NAL_SPS || GetH264NalType(nal) == H264_NAL_PPS;
+                if (bParams)
+                {
+                    static const uint8_t aStartCode[4] = { 0, 0, 0, 1 };
+                    vSeqParams.insert(vSeqParams.end(), aStartCode, aStartCode + 4);
+                    vSeqParams.insert(vSeqParams.end(), nal.pData, nal.pData + nal.nSize);
+                }
+            }
+            return;
+        }
+    }
+
+    /**
+    *  @brief Copies frames [iBegin, iEnd), which lie back to back in the recording, to out as a
+    *  stream that decodes on its own: the sequence parameters go in front unless the first frame
+    *  carries them. Returns the number of bytes written.
+    */
+    uint64_t ExtractFrames(uint64_t iBegin, uint64_t iEnd, std::ostream &out)
+    {
+        iEnd = (std::min)(iEnd, nEntries);
+        if (iBegin >= iEnd)
+        {
+            return 0;
+        }
+        uint64_t nWritten = 0;
+        SeekIndexEntry first = GetEntry(iBegin), last = GetEntry(iEnd - 1);
+        if (!(first.nFlags & SEEK_INDEX_PARAMETER_SETS))
+        {
+            std::vector<uint8_t> vSeqParams;
+            GetSequenceParams(vSeqParams);
+            out.write(reinterpret_cast<const char *>(vSeqParams.data()), vSeqParams.size());
+            nWritten += vSeqParams.size();
+        }
+
+        std::vector<char> vBuf(1 << 20);
+        uint64_t nLeft = last.nOffset + last.nSize - first.nOffset;
+        fpIn.clear();
+        fpIn.seekg(first.nOffset);
+        while (nLeft)
+        {
+            size_t nChunk = (size_t)(std::min)(nLeft, (uint64_t)vBuf.size());
+            if (!fpIn.read(vBuf.data(), nChunk) || !out.write(vBuf.data(), nChunk))
+            {
+                throw std::runtime_error("Unable to copy the range of the recording");
+            }
+            nLeft -= nChunk;
+            nWritten += nChunk;
+        }
+        return nWritten;
+    }
+
+    /** ExtractFrames() of FindRange(nStartUs, nEndUs); 0 if the range holds no frame */
+    uint64_t ExtractRange(int64_t nStartUs, int64_t nEndUs, std::ostream &out)
+    {
+        uint64_t iBegin, iEnd;
+        if (!FindRange(nStartUs, nEndUs, &iBegin, &iEnd))
+        {
+            return 0;
+        }
+        return ExtractFrames(iBegin, iEnd, out);
+    }
+
+private:
+    std::ifstream fpIn, fpIndex;
+    NalCodec eCodec = NAL_CODEC_H264;
+    uint32_t nRecordSize = SEEK_INDEX_RECORD_SIZE;
+    uint64_t nEntries = 0, nRecordingSize = 0;
+};
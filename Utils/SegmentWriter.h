@@ -0,0 +1,315 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <thread>
+#include <future>
+#include <functional>
+#include <atomic>
+#include <stdexcept>
+#include <ctype.h>
+#include "Logger.h"
+#include "Mp4Writer.h"
+#include "NalScanner.h"
+#include "SeekIndex.h"
+#include "../Queue.h"
+
+struct SegmentOptions
+{
+    /** Roll over at the first key frame after this many seconds; 0 disables the time limit */
+    int nDurationSec = 0;
+    /** Roll over at the first key frame after this many bytes; 0 disables the size limit */
+    uint64_t nMaxBytes = 0;
+    /** Settings of the MP4 segments; unused for raw .h264 segments */
+    Mp4WriterOptions mp4Options;
+    /** Write a seek index (<segment>.idx) next to each raw segment */
+    bool bIndex = true;
+    /** Called on the finalization thread with the path of every completed segment */
+    std::function<void(const std::string &)> funcSegmentClosed;
+};
+
+/**
+*  @brief One output file of a segmented recording, either MP4 or raw Annex-B. A raw file gets
+*  a seek index unless bIndex is false. eCodec is the codec of the raw stream and of its index.
+*/
+class SegmentFile
+{
+public:
+    SegmentFile(const std::string &strPath, int nWidth, int nHeight, const std::vector<uint8_t> &vSeqParams, const Mp4WriterOptions &mp4Options, bool bIndex = true,
+        NalCodec eCodec = NAL_CODEC_H264)
+        : strPath(strPath), vSeqParams(vSeqParams), eCodec(eCodec)
+    {
+        if (IsMp4Path(strPath))
+        {
+            pMp4Writer.reset(new Mp4Writer(strPath, nWidth, nHeight, vSeqParams, mp4Options));
+            return;
+        }
+        fpOut.open(strPath, std::ios::out | std::ios::binary);
+        if (!fpOut)
+        {
+            throw std::invalid_argument("Unable to open output file: " + strPath);
+        }
+        if (bIndex)
+        {
+            pIndex.reset(new SeekIndexWriter(GetSeekIndexPath(strPath), eCodec));
+        }
+    }
+
+    void WritePacket(const std::vector<uint8_t> &vPacket, int64_t nTimestampUs)
+    {
+        if (pMp4Writer)
+        {
+            pMp4Writer->WritePacket(vPacket, nTimestampUs);
+        }
+        else
+        {
+            uint32_t nFlags = SeekIndexWriter::GetFlags(vPacket.data(), vPacket.size(), eCodec);
+            size_t nPrefix = 0;
+            // a segment cut at an IDR that came without SPS/PPS would not be decodable on its own
+            if (nBytes == 0 && !(nFlags & SEEK_INDEX_PARAMETER_SETS) && !vSeqParams.empty())
+            {
+                fpOut.write(reinterpret_cast<const char *>(vSeqParams.data()), vSeqParams.size());
+                nPrefix = vSeqParams.size();
+                nFlags |= SEEK_INDEX_PARAMETER_SETS;
+            }
+            fpOut.write(reinterpret_cast<const char *>(vPacket.data()), vPacket.size());
+            if (pIndex)
+            {
+                pIndex->Append(nPrefix + vPacket.size(), nTimestampUs, nFlags);
+            }
+            nBytes += nPrefix;
+        }
+        nBytes += vPacket.size();
+    }
+
+    void Close()
+    {
+        if (pMp4Writer)
+        {
+            pMp4Writer->Close();
+        }
+        else
+        {
+            fpOut.close();
+            if (pIndex)
+            {
+                pIndex->Close();
+            }
+        }
+    }
+
+    const std::string &GetPath() const { return strPath; }
+    uint64_t GetBytes() const { return nBytes; }
+
+    static bool IsMp4Path(const std::string &strPath)
+    {
+        if (strPath.size() <= 4)
+        {
+            return false;
+        }
+        std::string strExt = strPath.substr(strPath.size() - 4);
+        for (char &c : strExt)
+        {
+            c = (char)tolower((unsigned char)c);
+        }
+        return strExt == ".mp4";
+    }
+
+private:
+    std::string strPath;
+    std::vector<uint8_t> vSeqParams;
+    NalCodec eCodec;
+    std::unique_ptr<Mp4Writer> pMp4Writer;
+    std::ofstream fpOut;
+    std::unique_ptr<SeekIndexWriter> pIndex;
+    uint64_t nBytes = 0;
+};
+
+/**
+*  @brief Splits a recording into numbered files (name_0000.mp4, name_0001.mp4, ...)
+*  that each start with a key frame.
+*  Once a segment is over its duration or size budget, IsRolloverDue() tells the
+*  caller to force an IDR and the next key frame packet goes into the next file.
+*  That file is opened ahead of time and the finished one is closed (moov
+*  written, file flushed) on a background thread, so the encoding thread only
+*  swaps pointers at the boundary. A segment that fails to close is logged and
+*  the recording goes on with the next one.
+*/
+class SegmentWriter
+{
+public:
+    SegmentWriter(const std::string &strPath, int nWidth, int nHeight, const std::vector<uint8_t> &vSeqParams, const SegmentOptions &options,
+        NalCodec eCodec = NAL_CODEC_H264)
+        : nWidth(nWidth), nHeight(nHeight), vSeqParams(vSeqParams), options(options), eCodec(eCodec)
+    {
+        size_t iDot = strPath.find_last_of('.');
+        size_t iSlash = strPath.find_last_of("/\\");
+        if (iDot == std::string::npos || (iSlash != std::string::npos && iDot < iSlash))
+        {
+            iDot = strPath.size();
+        }
+        strStem = strPath.substr(0, iDot);
+        strExtension = strPath.substr(iDot);
+
+        pCurrent.reset(OpenSegment(0));
+        thWorker = std::thread(&SegmentWriter::Run, this);
+        PrepareNext();
+    }
+
+    ~SegmentWriter()
+    {
+        try
+        {
+            Close();
+        }
+        catch (...)
+        {
+        }
+    }
+
+    /**
+    *  @brief True once the current segment is over budget; the caller should
+    *  then request an IDR (NV_ENC_PIC_FLAG_FORCEIDR) for the next frame.
+    *  May be called from another thread than WritePacket().
+    */
+    bool IsRolloverDue() const
+    {
+        return bRolloverDue;
+    }
+
+    void WritePacket(const std::vector<uint8_t> &vPacket, int64_t nTimestampUs, bool bKeyFrame)
+    {
+        if (bKeyFrame && bRolloverDue)
+        {
+            Rollover();
+        }
+        if (!bHasFrames)
+        {
+            nSegmentStartUs = nTimestampUs;
+            bHasFrames = true;
+        }
+        nLastTimestampUs = nTimestampUs;
+        pCurrent->WritePacket(vPacket, nTimestampUs);
+        bRolloverDue = (options.nDurationSec > 0 && nLastTimestampUs - nSegmentStartUs >= (int64_t)options.nDurationSec * 1000000)
+            || (options.nMaxBytes > 0 && pCurrent->GetBytes() >= options.nMaxBytes);
+    }
+
+    /**
+    *  @brief Closes the current segment, waits for all background work and deletes the unused pre-opened file.
+    */
+    void Close()
+    {
+        if (!pCurrent)
+        {
+            return;
+        }
+        SegmentFile *pLast = pCurrent.release();
+        qJob.push([this, pLast]() { Finalize(pLast); });
+        std::unique_ptr<SegmentFile> pUnused;
+        try
+        {
+            pUnused = futureNext.get();
+        }
+        catch (...)
+        {
+        }
+        qJob.push(std::function<void()>());
+        thWorker.join();
+        if (pUnused)
+        {
+            pUnused->Close();
+            remove(pUnused->GetPath().c_str());
+            remove(GetSeekIndexPath(pUnused->GetPath()).c_str());
+        }
+    }
+
+    int GetSegmentIndex() const { return iSegment; }
+
+private:
+    SegmentFile *OpenSegment(int i)
+    {
+        char szIndex[16];
+        sprintf(szIndex, "_%04d", i);
+        return new SegmentFile(strStem + szIndex + strExtension, nWidth, nHeight, vSeqParams, options.mp4Options, options.bIndex, eCodec);
+    }
+
+    void PrepareNext()
+    {
+        std::shared_ptr<std::promise<std::unique_ptr<SegmentFile>>> pPromise(new std::promise<std::unique_ptr<SegmentFile>>());
+        futureNext = pPromise->get_future();
+        int iNext = iSegment + 1;
+        qJob.push([this, pPromise, iNext]() {
+            try
+            {
+                pPromise->set_value(std::unique_ptr<SegmentFile>(OpenSegment(iNext)));
+            }
+            catch (...)
+            {
+                pPromise->set_exception(std::current_exception());
+            }
+        });
+    }
+
+    void Rollover()
+    {
+        // normally ready long before the boundary; get() only blocks if opening is slower than a whole segment
+        std::unique_ptr<SegmentFile> pNext = futureNext.get();
+        SegmentFile *pDone = pCurrent.release();
+        pCurrent = std::move(pNext);
+        iSegment++;
+        bHasFrames = false;
+        bRolloverDue = false;
+        qJob.push([this, pDone]() { Finalize(pDone); });
+        PrepareNext();
+    }
+
+    void Finalize(SegmentFile *pSegment)
+    {
+        std::unique_ptr<SegmentFile> p(pSegment);
+        try
+        {
+            p->Close();
+            if (options.funcSegmentClosed)
+            {
+                options.funcSegmentClosed(p->GetPath());
+            }
+        }
+        catch (const std::exception &ex)
+        {
+            LOG(ERROR) << "Finalizing segment " << p->GetPath() << " failed: " << ex.what();
+        }
+    }
+
+    void Run()
+    {
+        while (true)
+        {
+            std::function<void()> job = qJob.pop();
+            if (!job)
+            {
+                break;
+            }
+            job();
+        }
+    }
+
+    int nWidth, nHeight;
+    std::vector<uint8_t> vSeqParams;
+    SegmentOptions options;
+    NalCodec eCodec;
+    std::string strStem, strExtension;
+
+    std::unique_ptr<SegmentFile> pCurrent;
+    std::future<std::unique_ptr<SegmentFile>> futureNext;
+    int iSegment = 0;
+    bool bHasFrames = false;
+    std::atomic<bool> bRolloverDue{false};
+    int64_t nSegmentStartUs = 0, nLastTimestampUs = 0;
+
+    Queue<std::function<void()>> qJob;
+    std::thread thWorker;
+};
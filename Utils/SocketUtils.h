@@ -0,0 +1,53 @@
+#pragma once
+
+#include "Logger.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/socket.h>
+#endif
+
+/**
+* Helpers for the sockets of the local servers (metrics, control, replay trigger) and the RTP
+* sender; SOCKET and INVALID_SOCKET come from Logger.h.
+*/
+
+inline int CloseSocket(SOCKET s) {
+#ifdef _WIN32
+    return closesocket(s);
+#else
+    return close(s);
+#endif
+}
+
+/**
+* @brief send() that reports a connection closed by the peer as an error instead of raising
+* SIGPIPE, which would end the process: MSG_NOSIGNAL on Linux, SO_NOSIGPIPE on macOS.
+* Windows has no SIGPIPE.
+*/
+inline int SendNoSignal(SOCKET s, const char *pData, int nSize) {
+#if defined(MSG_NOSIGNAL)
+    return (int)send(s, pData, nSize, MSG_NOSIGNAL);
+#else
+#if defined(SO_NOSIGPIPE)
+    int nOn = 1;
+    setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, &nOn, sizeof(nOn));
+#endif
+    return (int)send(s, pData, nSize, 0);
+#endif
+}
+
+/**
+* @brief Sends all of pData; false if the connection fails first.
+*/
+inline bool SendAll(SOCKET s, const char *pData, size_t nSize) {
+    size_t nSent = 0;
+    while (nSent < nSize) {
+        int n = SendNoSignal(s, pData + nSent, (int)(nSize - nSent));
+        if (n <= 0) {
+            return false;
+        }
+        nSent += n;
+    }
+    return true;
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/**
+*  @brief Splits a startup into consecutive named phases: every Mark() ends the phase
+*  that started at the previous mark (or at construction / Restart()). Thread safe, so
+*  the phase that ends on another thread (e.g. "first frame") can be marked there.
+*  Work that runs in parallel with the marked phases is timed with a Scope instead;
+*  the total is then the end of whichever phase finished last.
+*/
+class StartupTimer {
+public:
+    struct Phase {
+        std::string strName;
+        double dStartMs, dEndMs;
+    };
+
+    /**
+    *  @brief Times a phase from its construction to its destruction, on any thread and
+    *  independently of Mark().
+    */
+    class Scope {
+    public:
+        Scope(StartupTimer &timer, const char *szPhase) : timer(timer), strName(szPhase), dStartMs(timer.GetElapsedMs()) {}
+        ~Scope() {
+            timer.Add(strName, dStartMs);
+        }
+    private:
+        StartupTimer &timer;
+        std::string strName;
+        double dStartMs;
+    };
+
+    StartupTimer() {
+        Restart();
+    }
+
+    void Restart() {
+        std::lock_guard<std::mutex> lock(mtx);
+        tStart = tLast = std::chrono::steady_clock::now();
+        vPhase.clear();
+    }
+
+    void Mark(const char *szPhase) {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto tNow = std::chrono::steady_clock::now();
+        vPhase.push_back(Phase{szPhase, ToMs(tLast), ToMs(tNow)});
+        tLast = tNow;
+    }
+
+    /** Adds a phase that started at dStartMs and ends now */
+    void Add(const std::string &strName, double dStartMs) {
+        std::lock_guard<std::mutex> lock(mtx);
+        vPhase.push_back(Phase{strName, dStartMs, ToMs(std::chrono::steady_clock::now())});
+    }
+
+    double GetElapsedMs() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return ToMs(std::chrono::steady_clock::now());
+    }
+
+    std::vector<Phase> GetPhases() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return vPhase;
+    }
+
+    /** Time from the start to the end of the last phase */
+    double GetTotalMs() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return GetEndMs();
+    }
+
+    /** e.g. "device 21.4 ms, encode api 15.2 ms (parallel), encoder 88.0 ms, total 109.4 ms" */
+    std::string ToString() {
+        std::lock_guard<std::mutex> lock(mtx);
+        std::ostringstream oss;
+        oss.setf(std::ios::fixed);
+        oss.precision(1);
+        for (size_t i = 0; i < vPhase.size(); i++) {
+            oss << vPhase[i].strName << " " << vPhase[i].dEndMs - vPhase[i].dStartMs << " ms" << (IsParallel(i) ? " (parallel)" : "") << ", ";
+        }
+        oss << "total " << GetEndMs() << " ms";
+        return oss.str();
+    }
+
+    /** e.g. {"device":21.4,"encoder":88.0,"total":109.4} */
+    std::string ToJson() {
+        std::lock_guard<std::mutex> lock(mtx);
+        std::ostringstream oss;
+        oss << "{";
+        for (const Phase &phase : vPhase) {
+            oss << "\"" << phase.strName << "\":" << phase.dEndMs - phase.dStartMs << ",";
+        }
+        oss << "\"total\":" << GetEndMs() << "}";
+        return oss.str();
+    }
+
+private:
+    double GetEndMs() const {
+        double dEndMs = 0;
+        for (const Phase &phase : vPhase) {
+            dEndMs = phase.dEndMs > dEndMs ? phase.dEndMs : dEndMs;
+        }
+        return dEndMs;
+    }
+
+    /** True if phase i overlaps any other phase */
+    bool IsParallel(size_t i) const {
+        for (size_t j = 0; j < vPhase.size(); j++) {
+            if (j != i && vPhase[j].dStartMs < vPhase[i].dEndMs && vPhase[i].dStartMs < vPhase[j].dEndMs) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    double ToMs(std::chrono::steady_clock::time_point t) const {
+        return std::chrono::duration<double, std::milli>(t - tStart).count();
+    }
+
+    std::mutex mtx;
+    std::chrono::steady_clock::time_point tStart, tLast;
+    std::vector<Phase> vPhase;
+};